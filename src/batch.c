@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <glob.h>
+#include <time.h>
+#include "image.h"
+#include "args.h"
+#include "batch.h"
+#include "instrument.h"
+
+#define MAX_BATCH_OPS 32
+
+static const struct{
+    const char *name;
+    batch_kind kind;
+} op_names[] = {
+    {"grayscale", BATCH_GRAYSCALE},
+    {"resize", BATCH_RESIZE},
+    {"nn", BATCH_NN_RESIZE},
+    {"area", BATCH_AREA_RESIZE},
+    {"lanczos", BATCH_LANCZOS_RESIZE},
+    {"blur", BATCH_BLUR},
+    {"sobel", BATCH_SOBEL},
+    {"colorize_sobel", BATCH_COLORIZE_SOBEL},
+    {"clamp", BATCH_CLAMP},
+};
+
+static int parse_op(const char *step, int len, batch_op *op)
+{
+    /**
+     * Parses one step of a chain, name[:argument].
+     * 
+     * @returns 1 if the step was understood, 0 otherwise
+     * 
+     */
+
+    char buff[64];
+    if (len <= 0 || len >= (int)sizeof(buff)) return 0;
+    memcpy(buff, step, len);
+    buff[len] = 0;
+
+    char *arg = strchr(buff, ':');
+    if (arg) *arg++ = 0;
+
+    memset(op, 0, sizeof(*op));
+    int n = sizeof(op_names) / sizeof(op_names[0]);
+    int i = 0;
+    while (i < n && strcmp(buff, op_names[i].name)) i ++;
+    if (i == n) return 0;
+    op->kind = op_names[i].kind;
+
+    switch (op->kind)
+    {
+        case BATCH_RESIZE:
+        case BATCH_NN_RESIZE:
+        case BATCH_AREA_RESIZE:
+        case BATCH_LANCZOS_RESIZE:
+            return arg && 2 == sscanf(arg, "%dx%d", &op->w, &op->h) && op->w > 0 && op->h > 0;
+        case BATCH_BLUR:
+            return arg && 1 == sscanf(arg, "%f", &op->sigma) && op->sigma > 0;
+        default:
+            return arg == 0;
+    }
+}
+
+int parse_batch_ops(const char *chain, batch_op *ops, int max)
+{
+    /**
+     * Parses a comma separated chain of operations.
+     * 
+     * @param chain e.g. "grayscale,resize:256x256,blur:2"
+     * @param[out] ops the parsed operations
+     * @param max room in ops
+     * 
+     * @returns the number of operations, or -1 if the chain is malformed
+     * 
+     */
+
+    int n = 0;
+    const char *step = chain;
+    while (*step)
+    {
+        const char *end = strchr(step, ',');
+        int len = end ? end - step : (int)strlen(step);
+        if (n == max || !parse_op(step, len, ops + n))
+        {
+            fprintf(stderr, "Bad batch operation \"%.*s\"\n", len, step);
+            return -1;
+        }
+        n ++;
+        if (!end) break;
+        step = end + 1;
+    }
+    return n;
+}
+
+static image apply_op(image im, const batch_op *op)
+{
+    /**
+     * Applies one operation, freeing im unless the result is im itself.
+     * 
+     */
+
+    image out = im;
+    switch (op->kind)
+    {
+        case BATCH_GRAYSCALE:
+            if (im.c == 3) out = rgb_to_grayscale(im);
+            break;
+        case BATCH_RESIZE:
+            out = bilinear_resize(im, op->w, op->h);
+            break;
+        case BATCH_NN_RESIZE:
+            out = nn_resize(im, op->w, op->h);
+            break;
+        case BATCH_AREA_RESIZE:
+            out = area_resize(im, op->w, op->h);
+            break;
+        case BATCH_LANCZOS_RESIZE:
+            out = lanczos_resize(im, op->w, op->h);
+            break;
+        case BATCH_BLUR:
+        {
+            image f = make_gaussian_filter(op->sigma);
+            out = convolve_image(im, f, 1);
+            free_image(f);
+            break;
+        }
+        case BATCH_SOBEL:
+        {
+            image theta = make_image_uninit(im.w, im.h, 1);
+            out = make_image_uninit(im.w, im.h, 1);
+            sobel_image_into(out, theta, im, 0);
+            feature_normalize(out);
+            free_image(theta);
+            break;
+        }
+        case BATCH_COLORIZE_SOBEL:
+            out = colorize_sobel(im);
+            break;
+        case BATCH_CLAMP:
+            clamp_image(im);
+            break;
+    }
+    if (out.data != im.data) free_image(im);
+    return out;
+}
+
+image apply_batch_ops(image im, const batch_op *ops, int n)
+{
+    /**
+     * Runs a chain of operations on an image.
+     * 
+     * @param im the source image, which is consumed: it is freed, or
+     * returned if every operation worked in place
+     * @param ops, n the chain
+     * 
+     * @returns the processed image
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    for (int i = 0; i < n; i ++) im = apply_op(im, ops + i);
+    return im;
+}
+
+// ---- Bounded queues between the stages ----
+
+typedef struct{
+    int index;
+    image im;
+} batch_item;
+
+typedef struct{
+    batch_item *items;
+    int cap, head, count;
+    int producers;              // threads that may still push
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} batch_queue;
+
+static void queue_init(batch_queue *q, int cap, int producers)
+{
+    q->items = calloc(cap, sizeof(batch_item));
+    q->cap = cap;
+    q->head = q->count = 0;
+    q->producers = producers;
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->not_empty, 0);
+    pthread_cond_init(&q->not_full, 0);
+}
+
+static void queue_destroy(batch_queue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+}
+
+static void queue_push(batch_queue *q, batch_item item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap) pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % q->cap] = item;
+    q->count ++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int queue_pop(batch_queue *q, batch_item *item)
+{
+    /**
+     * Takes the oldest item, waiting for one if need be.
+     * 
+     * @returns 0 once the queue is empty and every producer is done
+     * 
+     */
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && q->producers > 0) pthread_cond_wait(&q->not_empty, &q->lock);
+    int got = q->count > 0;
+    if (got)
+    {
+        *item = q->items[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count --;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return got;
+}
+
+static void queue_producer_done(batch_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    if (-- q->producers == 0) pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// ---- Pipeline stages ----
+
+typedef struct{
+    char **inputs;
+    int n_inputs;
+    const batch_op *ops;
+    int n_ops;
+    batch_config cfg;
+    char **names;               // output file of each input
+    int next;                   // next input to decode
+    int failed;
+    batch_queue decoded;
+    batch_queue processed;
+} batch_state;
+
+static void *decode_stage(void *ctx)
+{
+    batch_state *b = ctx;
+    int i;
+    while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->n_inputs)
+    {
+        batch_item item = {i, try_load_image(b->inputs[i])};
+        if (!item.im.data)
+        {
+            __atomic_add_fetch(&b->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        queue_push(&b->decoded, item);
+    }
+    queue_producer_done(&b->decoded);
+    return 0;
+}
+
+static void *process_stage(void *ctx)
+{
+    batch_state *b = ctx;
+    batch_item item;
+    while (queue_pop(&b->decoded, &item))
+    {
+        item.im = apply_batch_ops(item.im, b->ops, b->n_ops);
+        queue_push(&b->processed, item);
+    }
+    queue_producer_done(&b->processed);
+    return 0;
+}
+
+static char *output_name(const char *dir, const char *input)
+{
+    /**
+     * Builds dir/<input file name without extension>, as save_image_options
+     * adds the extension.
+     * 
+     */
+
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    const char *dot = strrchr(base, '.');
+    int len = dot && dot != base ? dot - base : (int)strlen(base);
+
+    char *name = malloc(strlen(dir) + len + 2);
+    sprintf(name, "%s/%.*s", dir, len, base);
+    return name;
+}
+
+typedef struct{
+    const char *name;
+    const char *input;
+} named_input;
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(((const named_input *)a)->name, ((const named_input *)b)->name);
+}
+
+static char **output_names(char **inputs, int n, const char *dir)
+{
+    /**
+     * Builds the output name of every input, before anything is written.
+     * 
+     * @returns the names, or 0 (with a message on stderr) if two inputs,
+     * such as a/x.jpg and b/x.png, would be written to the same file
+     * 
+     */
+
+    char **names = malloc(n * sizeof(char *));
+    named_input *sorted = malloc(n * sizeof(named_input));
+    for (int i = 0; i < n; i ++)
+    {
+        names[i] = output_name(dir, inputs[i]);
+        sorted[i].name = names[i];
+        sorted[i].input = inputs[i];
+    }
+    qsort(sorted, n, sizeof(named_input), compare_names);
+
+    int clash = 0;
+    for (int i = 1; i < n && !clash; i ++) if (!strcmp(sorted[i - 1].name, sorted[i].name)) clash = i;
+    if (clash)
+    {
+        fprintf(stderr, "%s and %s would both be written to %s\n",
+                sorted[clash - 1].input, sorted[clash].input, sorted[clash].name);
+        for (int i = 0; i < n; i ++) free(names[i]);
+        free(names);
+        names = 0;
+    }
+    free(sorted);
+    return names;
+}
+
+static void *encode_stage(void *ctx)
+{
+    batch_state *b = ctx;
+    batch_item item;
+    while (queue_pop(&b->processed, &item))
+    {
+        if (!save_image_options(item.im, b->names[item.index], b->cfg.save))
+        {
+            __atomic_add_fetch(&b->failed, 1, __ATOMIC_RELAXED);
+        }
+        free_image(item.im);
+    }
+    return 0;
+}
+
+int run_batch(char **inputs, int n_inputs, const batch_op *ops, int n_ops, batch_config cfg)
+{
+    /**
+     * Decodes, processes and encodes a list of images as a pipeline.
+     * 
+     * A quarter of the workers decode and a quarter encode, at least one
+     * each, and the rest run the chain. Each stage hands images to the next
+     * through a bounded queue, so decoding stalls rather than running ahead
+     * of a slower processing stage. Outputs are written as they finish, not
+     * in input order.
+     * 
+     * @param inputs, n_inputs the files to process
+     * @param ops, n_ops the chain to apply to each
+     * @param cfg output directory, format and pipeline sizes
+     * 
+     * @returns the number of inputs that could not be read or written,
+     * or -1, with nothing written, if two inputs would have the same
+     * output file
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    char **names = output_names(inputs, n_inputs, cfg.out_dir);
+    if (!names) return -1;
+
+    int workers = cfg.workers > 0 ? cfg.workers : get_num_threads();
+    int n_decode = workers / 4 > 0 ? workers / 4 : 1;
+    int n_encode = workers / 4 > 0 ? workers / 4 : 1;
+    int n_process = workers - n_decode - n_encode > 0 ? workers - n_decode - n_encode : 1;
+    int cap = cfg.queue_size > 0 ? cfg.queue_size : 2 * n_process;
+
+    batch_state b = {inputs, n_inputs, ops, n_ops, cfg, names, 0, 0};
+    queue_init(&b.decoded, cap, n_decode);
+    queue_init(&b.processed, cap, n_process);
+
+    int n_threads = n_decode + n_process + n_encode;
+    pthread_t *threads = calloc(n_threads, sizeof(pthread_t));
+    int t = 0;
+    for (int i = 0; i < n_decode; i ++) pthread_create(threads + t ++, 0, decode_stage, &b);
+    for (int i = 0; i < n_process; i ++) pthread_create(threads + t ++, 0, process_stage, &b);
+    for (int i = 0; i < n_encode; i ++) pthread_create(threads + t ++, 0, encode_stage, &b);
+    for (int i = 0; i < n_threads; i ++) pthread_join(threads[i], 0);
+
+    free(threads);
+    queue_destroy(&b.decoded);
+    queue_destroy(&b.processed);
+    for (int i = 0; i < n_inputs; i ++) free(names[i]);
+    free(names);
+    return b.failed;
+}
+
+static int expand_inputs(int argc, char **argv, glob_t *g)
+{
+    /**
+     * Collects the input files left in argv, expanding any glob patterns
+     * the shell did not (e.g. because they were quoted).
+     * 
+     */
+
+    int flags = 0;
+    for (int i = 0; i < argc; i ++)
+    {
+        if (!argv[i]) continue;
+        int r = glob(argv[i], flags | GLOB_NOCHECK, 0, g);
+        if (r && r != GLOB_NOMATCH) return 0;
+        flags = GLOB_APPEND;
+    }
+    return flags != 0;
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int batch_main(int argc, char **argv)
+{
+    /**
+     * uwimg batch [-ops chain] [-o dir] [-png] [-q quality] [-z level]
+     *             [-j workers] inputs...
+     * 
+     * Inputs are files or glob patterns. Outputs keep their input's file
+     * name, with a .jpg or .png extension, in dir (default "."); nothing
+     * is written if two inputs have the same name.
+     * 
+     */
+
+    char *chain = find_char_arg(argc, argv, "-ops", "");
+    char *dir = find_char_arg(argc, argv, "-o", ".");
+    int png = find_arg(argc, argv, "-png");
+    batch_config cfg;
+    cfg.out_dir = dir;
+    cfg.save = default_save_options(png ? FORMAT_PNG : FORMAT_JPG);
+    cfg.save.quality = find_int_arg(argc, argv, "-q", cfg.save.quality);
+    cfg.save.compression = find_int_arg(argc, argv, "-z", cfg.save.compression);
+    cfg.workers = find_int_arg(argc, argv, "-j", 0);
+    cfg.queue_size = 0;
+
+    batch_op ops[MAX_BATCH_OPS];
+    int n_ops = parse_batch_ops(chain, ops, MAX_BATCH_OPS);
+    if (n_ops < 0) return 1;
+
+    // argv[0] and argv[1] are the program and "batch"
+    glob_t g;
+    memset(&g, 0, sizeof(g));
+    if (argc < 3 || !expand_inputs(argc - 2, argv + 2, &g))
+    {
+        fprintf(stderr, "usage: %s batch [-ops chain] [-o dir] [-png] [-q quality] "
+                "[-z level] [-j workers] inputs...\n", argv[0]);
+        globfree(&g);
+        return 1;
+    }
+
+    double start = now_seconds();
+    int failed = run_batch(g.gl_pathv, g.gl_pathc, ops, n_ops, cfg);
+    if (failed < 0)
+    {
+        globfree(&g);
+        return 1;
+    }
+    fprintf(stderr, "%d images, %d failed, %.3f s\n", (int)g.gl_pathc, failed, now_seconds() - start);
+    globfree(&g);
+    return failed != 0;
+}
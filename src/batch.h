@@ -0,0 +1,54 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "image.h"
+
+// Batch processing of many image files with one chain of operations.
+//
+// A chain is written as comma separated steps, for example
+//     grayscale,resize:256x256,blur:2,sobel
+// and is applied to every input in order. run_batch overlaps the three
+// stages of each image, decode, process and encode, on separate threads
+// joined by bounded queues, so a slow disk or codec does not leave the
+// processing threads idle and at most a few decoded images are in flight.
+
+typedef enum{
+    BATCH_GRAYSCALE,
+    BATCH_RESIZE,
+    BATCH_NN_RESIZE,
+    BATCH_AREA_RESIZE,
+    BATCH_LANCZOS_RESIZE,
+    BATCH_BLUR,
+    BATCH_SOBEL,
+    BATCH_COLORIZE_SOBEL,
+    BATCH_CLAMP
+} batch_kind;
+
+typedef struct{
+    batch_kind kind;
+    int w, h;       // resize target
+    float sigma;    // blur radius
+} batch_op;
+
+typedef struct{
+    const char *out_dir;    // outputs go to out_dir/<input basename>.<ext>
+    save_options save;
+    int workers;            // threads across all stages, 0 for the default
+    int queue_size;         // images waiting between two stages, 0 for 2 per stage thread
+} batch_config;
+
+// Parses a chain into at most max ops and returns how many, or -1 (with a
+// message on stderr) if a step is not understood.
+int parse_batch_ops(const char *chain, batch_op *ops, int max);
+
+// Runs the chain on one image, consuming it, and returns the result.
+image apply_batch_ops(image im, const batch_op *ops, int n);
+
+// Processes every input and returns the number that failed, or -1 (with a
+// message on stderr) if two inputs would be written to the same file.
+int run_batch(char **inputs, int n_inputs, const batch_op *ops, int n_ops, batch_config cfg);
+
+// Entry point of `uwimg batch`.
+int batch_main(int argc, char **argv);
+
+#endif
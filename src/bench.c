@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "image.h"
+#include "args.h"
+#include "color_simd.h"
+#include "bench.h"
+
+typedef struct{
+    image im;           // random input
+    image out;          // output of the kernel, or a copy of im for in place kernels
+    qimage q;
+    hwc_image hwc;
+    resize_plan *plan;
+    op_graph *graph;
+} bench_input;
+
+typedef struct{
+    const char *name;
+    int in_c;           // 0 for any channel count, else only this one
+    int out_c;          // channels of out, 0 for the same as the input
+    int out_div;        // out is the input's size divided by this, 0 for no out
+    int max_size;       // skip larger images, 0 for no limit
+    void (*setup)(bench_input *b);
+    void (*run)(bench_input *b);
+    void (*reset)(bench_input *b);  // restores what an in place run changed, untimed
+} bench_case;
+
+static image box_7, sharpen, highpass, emboss_5, gauss_2, gauss_2_1d, gauss_4;
+
+static void discard(image im)
+{
+    free_image(im);
+}
+
+// In place kernels run on a fresh copy of the input every time
+static void reset_out(bench_input *b) { copy_image_into(b->out, b->im); }
+
+static void b_copy(bench_input *b) { copy_image_into(b->out, b->im); }
+static void b_grayscale(bench_input *b) { rgb_to_grayscale_into(b->out, b->im); }
+static void b_rgb_to_hsv(bench_input *b) { rgb_to_hsv(b->out); }
+static void b_hsv_to_rgb(bench_input *b) { hsv_to_rgb(b->out); }
+static void b_shift(bench_input *b) { shift_image(b->out, 0, .01); }
+static void b_scale(bench_input *b) { scale_image(b->out, 0, 1); }
+static void b_threshold(bench_input *b) { threshold_image(b->out, .5); }
+static void b_clamp(bench_input *b) { clamp_image(b->out); }
+static void b_add(bench_input *b) { add_image_into(b->out, b->im, b->im); }
+static void b_sub(bench_input *b) { sub_image_into(b->out, b->im, b->im); }
+static void b_feature_normalize(bench_input *b) { feature_normalize(b->out); }
+
+// shift, shift, clamp and grayscale, one step at a time and fused
+static void b_point_chain(bench_input *b)
+{
+    image rgb = {b->out.w, b->out.h, 3, b->out.data};
+    image gray = {b->out.w, b->out.h, 1, b->out.data + 3*b->out.w*b->out.h};
+    copy_image_into(rgb, b->im);
+    shift_image(rgb, 0, .1);
+    shift_image(rgb, 2, -.1);
+    clamp_image(rgb);
+    rgb_to_grayscale_into(gray, rgb);
+}
+
+static void point_graph(bench_input *b)
+{
+    b->graph = make_op_graph(b->im);
+    op_graph_shift(b->graph, 0, .1);
+    op_graph_shift(b->graph, 2, -.1);
+    op_graph_clamp(b->graph);
+    op_graph_grayscale(b->graph);
+}
+
+static void b_op_graph(bench_input *b)
+{
+    image gray = {b->out.w, b->out.h, 1, b->out.data + 3*b->out.w*b->out.h};
+    eval_op_graph_into(gray, b->graph);
+}
+
+static void b_nn_resize(bench_input *b) { nn_resize_into(b->out, b->im); }
+static void b_bilinear_resize(bench_input *b) { bilinear_resize_into(b->out, b->im); }
+static void b_area_resize(bench_input *b) { discard(area_resize(b->im, b->im.w/2, b->im.h/2)); }
+static void b_lanczos_resize(bench_input *b) { discard(lanczos_resize(b->im, b->im.w/2, b->im.h/2)); }
+static void b_pyramid_resize(bench_input *b) { discard(pyramid_resize(b->im, b->im.w/4, b->im.h/4)); }
+static void b_resize_with_plan(bench_input *b) { resize_with_plan_into(b->out, b->im, b->plan); }
+
+static void b_resize_view(bench_input *b)
+{
+    // The centre of the image, resized without copying it out first
+    image_view crop = view_region(view_image(b->im), b->im.w / 8, b->im.h / 8, b->im.w * 3 / 4, b->im.h * 3 / 4);
+    bilinear_resize_view_into(b->out, crop);
+}
+
+static void half_plan(bench_input *b)
+{
+    b->plan = make_resize_plan(b->im.w, b->im.h, b->im.w/2, b->im.h/2, RESIZE_BILINEAR);
+}
+
+static void b_convolve(bench_input *b) { convolve_image_into(b->out, b->im, box_7, 1); }
+static void b_convolve_3x3(bench_input *b) { convolve_image_into(b->out, b->im, sharpen, 1); }
+static void b_convolve_3x3_sum(bench_input *b) { convolve_image_into(b->out, b->im, highpass, 0); }
+static void b_convolve_5x5(bench_input *b) { convolve_image_into(b->out, b->im, emboss_5, 1); }
+static void b_convolve_separable(bench_input *b) { convolve_image_separable_into(b->out, b->im, gauss_2_1d, gauss_2_1d, 1); }
+static void b_box_blur(bench_input *b) { box_blur_into(b->out, b->im, 31); }
+static void b_integral_image(bench_input *b) { free_integral_image(make_integral_image(b->im, 1)); }
+static void b_gaussian_blur(bench_input *b) { gaussian_blur_into(b->out, b->im, 2); }
+static void b_gaussian_blur_iir(bench_input *b) { gaussian_blur_iir_into(b->out, b->im, 2); }
+static void b_gaussian_blur_wide(bench_input *b) { gaussian_blur_into(b->out, b->im, 5); }
+static void b_gaussian_blur_iir_wide(bench_input *b) { gaussian_blur_iir_into(b->out, b->im, 5); }
+static void b_gaussian_downsample(bench_input *b) { gaussian_downsample_into(b->out, b->im); }
+static void b_convolve_fft(bench_input *b) { convolve_image_fft_into(b->out, b->im, gauss_4, 1); }
+
+static void b_stream_convolve(bench_input *b)
+{
+    image_source src = image_source_from_image(b->im);
+    image_sink dst = image_sink_to_image(b->out);
+    stream_convolve(src, dst, gauss_2, 1, 0);
+    close_image_source(src);
+    close_image_sink(dst);
+}
+
+static void sobel_planes(bench_input *b, int flags)
+{
+    int n = b->out.w*b->out.h;
+    image mag = {b->out.w, b->out.h, 1, b->out.data};
+    image theta = {b->out.w, b->out.h, 1, b->out.data + n};
+    sobel_image_into(mag, theta, b->im, flags);
+}
+
+static void b_sobel(bench_input *b) { sobel_planes(b, 0); }
+static void b_sobel_fast(bench_input *b) { sobel_planes(b, SOBEL_FAST_ATAN2 | SOBEL_L1); }
+static void b_colorize_sobel(bench_input *b) { colorize_sobel_into(b->out, b->im); }
+
+static void encode(image im, image_format format)
+{
+    int size = 0;
+    free(encode_image(im, default_save_options(format), &size));
+}
+
+static void b_encode_jpg(bench_input *b) { encode(b->im, FORMAT_JPG); }
+static void b_encode_png(bench_input *b) { encode(b->im, FORMAT_PNG); }
+
+static void to_qimage(bench_input *b)
+{
+    b->q = image_to_qimage(b->im, QIMAGE_U8);
+}
+
+static void b_qimage_grayscale(bench_input *b) { free_qimage(qimage_rgb_to_grayscale(b->q)); }
+static void b_qimage_bilinear_resize(bench_input *b) { free_qimage(qimage_bilinear_resize(b->q, b->q.w/2, b->q.h/2)); }
+static void b_qimage_box_blur(bench_input *b) { free_qimage(qimage_box_blur(b->q, 7)); }
+
+static void to_hwc(bench_input *b)
+{
+    // The input interleaved, and out's buffer reused as an interleaved output
+    b->hwc = image_to_hwc(b->im);
+}
+
+static hwc_image hwc_out(bench_input *b)
+{
+    hwc_image out = {b->out.w, b->out.h, b->out.c, b->out.data};
+    return out;
+}
+
+static void keep_hwc(bench_input *b)
+{
+    // out keeps the interleaved pixels for reset_hwc
+    to_hwc(b);
+    memcpy(b->out.data, b->hwc.data, (size_t)b->hwc.w * b->hwc.h * b->hwc.c * sizeof(float));
+}
+
+static void reset_hwc(bench_input *b)
+{
+    memcpy(b->hwc.data, b->out.data, (size_t)b->hwc.w * b->hwc.h * b->hwc.c * sizeof(float));
+}
+
+static void b_hwc_grayscale(bench_input *b) { hwc_rgb_to_grayscale_into(hwc_out(b), b->hwc); }
+static void b_hwc_rgb_to_hsv(bench_input *b) { hwc_rgb_to_hsv(b->hwc); }
+static void b_hwc_resize_with_plan(bench_input *b) { hwc_resize_with_plan_into(hwc_out(b), b->hwc, b->plan); }
+static void b_hwc_convolve(bench_input *b) { hwc_convolve_image_into(hwc_out(b), b->hwc, sharpen, 1); }
+
+static void to_hwc_half_plan(bench_input *b)
+{
+    to_hwc(b);
+    half_plan(b);
+}
+
+static const bench_case cases[] = {
+    {"copy_image", 0, 0, 1, 0, 0, b_copy},
+    {"rgb_to_grayscale", 3, 1, 1, 0, 0, b_grayscale},
+    {"rgb_to_hsv", 3, 0, 1, 0, 0, b_rgb_to_hsv, reset_out},
+    {"hsv_to_rgb", 3, 0, 1, 0, 0, b_hsv_to_rgb, reset_out},
+    {"shift_image", 0, 0, 1, 0, 0, b_shift, reset_out},
+    {"scale_image", 0, 0, 1, 0, 0, b_scale, reset_out},
+    {"clamp_image", 0, 0, 1, 0, 0, b_clamp, reset_out},
+    {"threshold_image", 0, 0, 1, 0, 0, b_threshold, reset_out},
+    {"add_image", 0, 0, 1, 0, 0, b_add},
+    {"sub_image", 0, 0, 1, 0, 0, b_sub},
+    {"feature_normalize", 0, 0, 1, 0, 0, b_feature_normalize, reset_out},
+    {"point_chain", 3, 4, 1, 0, 0, b_point_chain},
+    {"op_graph", 3, 4, 1, 0, point_graph, b_op_graph},
+    {"nn_resize", 0, 0, 2, 0, 0, b_nn_resize},
+    {"bilinear_resize", 0, 0, 2, 0, 0, b_bilinear_resize},
+    {"resize_with_plan", 0, 0, 2, 0, half_plan, b_resize_with_plan},
+    {"bilinear_resize_view", 0, 0, 2, 0, 0, b_resize_view},
+    {"area_resize", 0, 0, 0, 0, 0, b_area_resize},
+    {"lanczos_resize", 0, 0, 0, 0, 0, b_lanczos_resize},
+    {"pyramid_resize", 0, 0, 0, 0, 0, b_pyramid_resize},
+    {"convolve_image", 0, 0, 1, 0, 0, b_convolve},
+    {"convolve_image_3x3", 0, 0, 1, 0, 0, b_convolve_3x3},
+    {"convolve_image_3x3_sum", 0, 1, 1, 0, 0, b_convolve_3x3_sum},
+    {"convolve_image_5x5", 0, 0, 1, 0, 0, b_convolve_5x5},
+    {"convolve_image_separable", 0, 0, 1, 0, 0, b_convolve_separable},
+    {"box_blur", 0, 0, 1, 0, 0, b_box_blur},
+    {"make_integral_image", 0, 0, 0, 0, 0, b_integral_image},
+    {"gaussian_blur_2", 0, 0, 1, 0, 0, b_gaussian_blur},
+    {"gaussian_blur_iir_2", 0, 0, 1, 0, 0, b_gaussian_blur_iir},
+    {"gaussian_blur_5", 0, 0, 1, 0, 0, b_gaussian_blur_wide},
+    {"gaussian_blur_iir_5", 0, 0, 1, 0, 0, b_gaussian_blur_iir_wide},
+    {"gaussian_downsample", 0, 0, 2, 0, 0, b_gaussian_downsample},
+    {"convolve_image_fft", 0, 0, 1, 1024, 0, b_convolve_fft},
+    {"stream_convolve", 0, 0, 1, 0, 0, b_stream_convolve},
+    {"sobel_image", 0, 2, 1, 0, 0, b_sobel},
+    {"sobel_image_fast", 0, 2, 1, 0, 0, b_sobel_fast},
+    {"colorize_sobel", 0, 3, 1, 0, 0, b_colorize_sobel},
+    {"encode_jpg", 3, 0, 0, 0, 0, b_encode_jpg},
+    {"encode_png", 3, 0, 0, 4096, 0, b_encode_png},
+    {"hwc_rgb_to_grayscale", 3, 1, 1, 0, to_hwc, b_hwc_grayscale},
+    {"hwc_rgb_to_hsv", 3, 0, 1, 0, keep_hwc, b_hwc_rgb_to_hsv, reset_hwc},
+    {"hwc_resize_with_plan", 0, 0, 2, 0, to_hwc_half_plan, b_hwc_resize_with_plan},
+    {"hwc_convolve_image_3x3", 0, 0, 1, 0, to_hwc, b_hwc_convolve},
+    {"qimage_rgb_to_grayscale", 3, 0, 0, 0, to_qimage, b_qimage_grayscale},
+    {"qimage_bilinear_resize", 0, 0, 0, 0, to_qimage, b_qimage_bilinear_resize},
+    {"qimage_box_blur", 0, 0, 0, 0, to_qimage, b_qimage_box_blur},
+};
+
+#define N_CASES ((int)(sizeof(cases)/sizeof(cases[0])))
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int runs_case(const bench_case *bc, bench_config cfg, int size, int c)
+{
+    if (cfg.filter && !strstr(bc->name, cfg.filter)) return 0;
+    if (bc->in_c && bc->in_c != c) return 0;
+    return !bc->max_size || size <= bc->max_size;
+}
+
+static bench_result time_case(const bench_case *bc, bench_input *b, bench_config cfg)
+{
+    /**
+     * Times one case on one input.
+     * 
+     * At least three runs are timed, whatever the budget, so the median
+     * and percentile mean something even for the slowest kernels. A case
+     * with a reset hook has it called before every run, outside the timing.
+     * 
+     */
+
+    for (int i = 0; i < cfg.warmup; i ++)
+    {
+        if (bc->reset) bc->reset(b);
+        bc->run(b);
+    }
+
+    int reps = cfg.reps > 3 ? cfg.reps : 3;
+    double *t = calloc(reps, sizeof(double));
+    double start = now_seconds();
+    int n = 0;
+    while (n < reps && (n < 3 || now_seconds() - start < cfg.budget))
+    {
+        if (bc->reset) bc->reset(b);
+        double t0 = now_seconds();
+        bc->run(b);
+        t[n ++] = (now_seconds() - t0) * 1000;
+    }
+    qsort(t, n, sizeof(double), compare_doubles);
+
+    bench_result r;
+    r.name = bc->name;
+    r.w = b->im.w;
+    r.h = b->im.h;
+    r.c = b->im.c;
+    r.reps = n;
+    r.median_ms = n % 2 ? t[n/2] : (t[n/2 - 1] + t[n/2]) / 2;
+    r.p95_ms = t[(int)(.95 * (n - 1) + .5)];
+    r.min_ms = t[0];
+    r.mean_ms = 0;
+    for (int i = 0; i < n; i ++) r.mean_ms += t[i] / n;
+    r.mpix_per_s = r.median_ms > 0 ? (double)r.w * r.h / (r.median_ms * 1000) : 0;
+    free(t);
+    return r;
+}
+
+static void setup_case(const bench_case *bc, bench_input *b)
+{
+    image im = b->im;
+    memset(&b->out, 0, sizeof(image));
+    if (bc->out_div)
+    {
+        int c = bc->out_c ? bc->out_c : im.c;
+        b->out = make_image(im.w / bc->out_div, im.h / bc->out_div, c);
+        if (bc->out_div == 1 && c == im.c) copy_image_into(b->out, im);
+    }
+    if (bc->setup) bc->setup(b);
+}
+
+static void teardown_case(bench_input *b)
+{
+    free_image(b->out);
+    free_qimage(b->q);
+    free_hwc_image(b->hwc);
+    if (b->plan) free_resize_plan(b->plan);
+    free_op_graph(b->graph);
+    memset(&b->out, 0, sizeof(image));
+    memset(&b->q, 0, sizeof(qimage));
+    memset(&b->hwc, 0, sizeof(hwc_image));
+    b->plan = 0;
+    b->graph = 0;
+}
+
+static image random_image(int w, int h, int c)
+{
+    image im = make_image(w, h, c);
+    srand(w * 31 + c);
+    for (int i = 0; i < w*h*c; i ++) im.data[i] = rand() / (float)RAND_MAX;
+    return im;
+}
+
+int max_bench_results(bench_config cfg)
+{
+    return N_CASES * cfg.n_sizes * cfg.n_channels;
+}
+
+int run_benchmarks(bench_config cfg, bench_result *results, int max)
+{
+    /**
+     * Runs every selected case on each size and channel count of cfg.
+     * 
+     * @param cfg what to run and for how long
+     * @param results where to store the results, in the order they ran
+     * @param max room in results
+     * 
+     * @returns the number of results stored
+     * 
+     */
+
+    box_7 = make_box_filter(7);
+    sharpen = make_sharpen_filter();
+    highpass = make_highpass_filter();
+    emboss_5 = make_image(5, 5, 1);
+    for (int i = 0; i < 25; i ++) emboss_5.data[i] = (i % 5 + i / 5 - 4) / 8.0f;
+    gauss_2 = make_gaussian_filter(2);
+    gauss_2_1d = make_gaussian_filter_1d(2);
+    gauss_4 = make_gaussian_filter(4);
+
+    int n = 0;
+    for (int s = 0; s < cfg.n_sizes; s ++)
+    {
+        for (int k = 0; k < cfg.n_channels; k ++)
+        {
+            int size = cfg.sizes[s], c = cfg.channels[k];
+            int any = 0;
+            for (int i = 0; i < N_CASES; i ++) any |= runs_case(&cases[i], cfg, size, c);
+            if (!any) continue;
+
+            bench_input b;
+            memset(&b, 0, sizeof(b));
+            b.im = random_image(size, size, c);
+            for (int i = 0; i < N_CASES && n < max; i ++)
+            {
+                if (!runs_case(&cases[i], cfg, size, c)) continue;
+                setup_case(&cases[i], &b);
+                results[n] = time_case(&cases[i], &b, cfg);
+                teardown_case(&b);
+
+                bench_result r = results[n ++];
+                fprintf(stderr, "%-26s %5dx%-5d c=%d  median %9.3f ms  p95 %9.3f ms  %8.1f MPix/s\n",
+                        r.name, r.w, r.h, r.c, r.median_ms, r.p95_ms, r.mpix_per_s);
+            }
+            free_image(b.im);
+        }
+    }
+
+    free_image(box_7);
+    free_image(sharpen);
+    free_image(highpass);
+    free_image(emboss_5);
+    free_image(gauss_2);
+    free_image(gauss_2_1d);
+    free_image(gauss_4);
+    return n;
+}
+
+void write_bench_json(FILE *f, const bench_result *results, int n)
+{
+    /**
+     * Writes results with enough about the build to tell runs apart.
+     * 
+     */
+
+    fprintf(f, "{\n  \"simd\": \"%s\",\n  \"threads\": %d,\n  \"results\": [", get_color_kernels()->name, get_num_threads());
+    for (int i = 0; i < n; i ++)
+    {
+        const bench_result *r = results + i;
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"w\": %d, \"h\": %d, \"c\": %d, \"reps\": %d, "
+                "\"median_ms\": %.4f, \"p95_ms\": %.4f, \"min_ms\": %.4f, \"mean_ms\": %.4f, "
+                "\"mpix_per_s\": %.2f}", i ? "," : "", r->name, r->w, r->h, r->c, r->reps,
+                r->median_ms, r->p95_ms, r->min_ms, r->mean_ms, r->mpix_per_s);
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+static int parse_int_list(const char *s, int *out, int max)
+{
+    int n = 0;
+    while (*s && n < max)
+    {
+        char *end;
+        long v = strtol(s, &end, 10);
+        if (end == s || v <= 0) return -1;
+        if (*end && *end != ',') return -1;
+        out[n ++] = v;
+        s = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+int bench_main(int argc, char **argv)
+{
+    /**
+     * uwimg bench [-f filter] [-sizes 256,1024,...] [-c 1,3] [-warmup n]
+     *             [-reps n] [-budget seconds] [-j threads] [-o file.json]
+     * 
+     * Progress goes to stderr as each case finishes; the JSON goes to the
+     * -o file, or to stdout without one.
+     * 
+     */
+
+    int sizes[32], channels[8];
+    bench_config cfg;
+    cfg.filter = find_char_arg(argc, argv, "-f", 0);
+    cfg.n_sizes = parse_int_list(find_char_arg(argc, argv, "-sizes", "256,512,1024,2048,4096,8192"), sizes, 32);
+    cfg.n_channels = parse_int_list(find_char_arg(argc, argv, "-c", "1,3"), channels, 8);
+    cfg.sizes = sizes;
+    cfg.channels = channels;
+    cfg.warmup = find_int_arg(argc, argv, "-warmup", 1);
+    cfg.reps = find_int_arg(argc, argv, "-reps", 15);
+    cfg.budget = find_float_arg(argc, argv, "-budget", 2);
+    set_num_threads(find_int_arg(argc, argv, "-j", 0));
+    char *out = find_char_arg(argc, argv, "-o", 0);
+    if (cfg.n_sizes <= 0 || cfg.n_channels <= 0)
+    {
+        fprintf(stderr, "usage: %s bench [-f filter] [-sizes 256,1024,...] [-c 1,3] [-warmup n] "
+                "[-reps n] [-budget seconds] [-j threads] [-o file.json]\n", argv[0]);
+        return 1;
+    }
+
+    int max = max_bench_results(cfg);
+    bench_result *results = calloc(max, sizeof(bench_result));
+    int n = run_benchmarks(cfg, results, max);
+
+    FILE *f = out ? fopen(out, "w") : stdout;
+    if (!f)
+    {
+        fprintf(stderr, "Cannot write %s\n", out);
+        free(results);
+        return 1;
+    }
+    write_bench_json(f, results, n);
+    if (out) fclose(f);
+    free(results);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+
+// Micro-benchmarks of the image kernels.
+//
+// Every case runs one public function on random images of each requested
+// size and channel count: a few untimed warmup runs, then timed runs until
+// either the repetition count or the time budget is used up. Outputs are
+// allocated once per size where the function has an _into form, so the
+// numbers measure the kernel rather than malloc. Results are medians and
+// 95th percentiles in milliseconds plus megapixels of input per second,
+// written as JSON so two builds can be compared.
+
+typedef struct{
+    const char *filter;     // only cases whose name contains this, 0 for all
+    const int *sizes;       // square image sizes
+    int n_sizes;
+    const int *channels;
+    int n_channels;
+    int warmup;
+    int reps;               // at most this many timed runs...
+    double budget;          // ...and no more than about this many seconds
+} bench_config;
+
+typedef struct{
+    const char *name;
+    int w, h, c;
+    int reps;
+    double median_ms, p95_ms, min_ms, mean_ms;
+    double mpix_per_s;
+} bench_result;
+
+// How many results run_benchmarks can produce for cfg at most.
+int max_bench_results(bench_config cfg);
+
+// Runs the selected cases and returns how many results were stored. The
+// cases share their filters, so only one run may be in flight at a time.
+int run_benchmarks(bench_config cfg, bench_result *results, int max);
+
+void write_bench_json(FILE *f, const bench_result *results, int n);
+
+// Entry point of `uwimg bench`.
+int bench_main(int argc, char **argv);
+
+#endif
@@ -0,0 +1,600 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "color_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COLOR_SIMD_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define COLOR_SIMD_NEON
+#endif
+
+// All of the vector kernels below follow the scalar kernels in
+// process_image.c operation for operation. The per-pixel branches there
+// become masks: every candidate result is computed for every lane and the
+// right one is blended in, so there is no data dependent control flow.
+//
+// For HSV to RGB we use the closed form of the six hue sectors,
+//     f(n) = V - C * max(0, min(k, 4 - k, 1)),  k = (n + 6H) mod 6
+// with n = 5, 3, 1 for red, green and blue; it agrees with the sector
+// table at every boundary. Hues outside [0, 1] give V - C in every channel,
+// as in the scalar kernel.
+//
+// Byte deinterleaving gathers 8 pixels at a time with byte shuffles, one
+// for each channel, then widens to 32 bits, converts and multiplies by
+// 1/255 like deinterleave_bytes_scalar in load_image.c. Interleaving runs
+// the other way on 16 pixels: clamp, v * 255 + 0.5 truncated (the scalar
+// rounding), saturating packs down to bytes, and three byte shuffles per
+// 16 output bytes to lay out the triples.
+
+#ifdef COLOR_SIMD_X86
+
+// ---- Byte shuffles shared by the AVX2 and SSE kernels ----
+
+__attribute__((target("sse4.1")))
+static inline void gather8_sse(const unsigned char *src, int stride, __m128i *r, __m128i *g, __m128i *b)
+{
+    /**
+     * Splits 8 interleaved pixels into the low 8 bytes of r, g and b.
+     * 
+     */
+    
+    if (stride == 4)
+    {
+        // Group each 4 pixel load by channel, then pair up the two loads
+        __m128i m = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), m);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + 16)), m);
+        __m128i lo = _mm_unpacklo_epi32(p0, p1);
+        *r = lo;
+        *g = _mm_srli_si128(lo, 8);
+        *b = _mm_unpackhi_epi32(p0, p1);
+        return;
+    }
+    
+    // 24 bytes: pixels 0-5 come from the first load, 5-7 from the second
+    __m128i lo = _mm_loadu_si128((const __m128i *)src);
+    __m128i hi = _mm_loadl_epi64((const __m128i *)(src + 16));
+    *r = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                      _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, -1, -1, -1, -1, -1, -1, -1, -1)));
+    *g = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                      _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, -1, -1, -1, -1, -1, -1, -1, -1)));
+    *b = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                      _mm_shuffle_epi8(hi, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+}
+
+__attribute__((target("sse4.1")))
+static inline void scatter16_sse(__m128i r, __m128i g, __m128i b, unsigned char *dst)
+{
+    /**
+     * Writes 16 pixels of channel bytes as 48 bytes of RGB triples.
+     * 
+     */
+    
+    __m128i o0 = _mm_or_si128(_mm_shuffle_epi8(r, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+                 _mm_or_si128(_mm_shuffle_epi8(g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1)),
+                              _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1))));
+    __m128i o1 = _mm_or_si128(_mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+                 _mm_or_si128(_mm_shuffle_epi8(g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10)),
+                              _mm_shuffle_epi8(b, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1))));
+    __m128i o2 = _mm_or_si128(_mm_shuffle_epi8(r, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+                 _mm_or_si128(_mm_shuffle_epi8(g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1)),
+                              _mm_shuffle_epi8(b, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15))));
+    _mm_storeu_si128((__m128i *)dst, o0);
+    _mm_storeu_si128((__m128i *)(dst + 16), o1);
+    _mm_storeu_si128((__m128i *)(dst + 32), o2);
+}
+
+// ---- AVX2, 16 pixels per iteration ----
+
+__attribute__((target("avx2")))
+static inline void gray8_avx2(const float *r, const float *g, const float *b, float *gray)
+{
+    __m256 y = _mm256_mul_ps(_mm256_loadu_ps(r), _mm256_set1_ps(0.299f));
+    y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_loadu_ps(g), _mm256_set1_ps(0.587f)));
+    y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_loadu_ps(b), _mm256_set1_ps(0.114f)));
+    _mm256_storeu_ps(gray, y);
+}
+
+__attribute__((target("avx2")))
+static void rgb_to_grayscale_avx2(const float *r, const float *g, const float *b, float *gray, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        gray8_avx2(r + i, g + i, b + i, gray + i);
+        gray8_avx2(r + i + 8, g + i + 8, b + i + 8, gray + i + 8);
+    }
+    rgb_to_grayscale_scalar(r + i, g + i, b + i, gray + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline void hsv8_avx2(float *r, float *g, float *b)
+{
+    __m256 red = _mm256_loadu_ps(r);
+    __m256 green = _mm256_loadu_ps(g);
+    __m256 blue = _mm256_loadu_ps(b);
+    __m256 zero = _mm256_setzero_ps();
+    
+    __m256 value = _mm256_max_ps(red, _mm256_max_ps(green, blue));
+    __m256 min = _mm256_min_ps(red, _mm256_min_ps(green, blue));
+    __m256 diff = _mm256_sub_ps(value, min);
+    
+    __m256 saturation = _mm256_and_ps(_mm256_cmp_ps(value, zero, _CMP_GT_OQ), 
+                                      _mm256_div_ps(diff, value));
+    
+    __m256 hr = _mm256_div_ps(_mm256_sub_ps(green, blue), diff);
+    __m256 hg = _mm256_add_ps(_mm256_div_ps(_mm256_sub_ps(blue, red), diff), _mm256_set1_ps(2));
+    __m256 hb = _mm256_add_ps(_mm256_div_ps(_mm256_sub_ps(red, green), diff), _mm256_set1_ps(4));
+    
+    __m256 hue = _mm256_blendv_ps(hb, hg, _mm256_cmp_ps(value, green, _CMP_EQ_OQ));
+    hue = _mm256_blendv_ps(hue, hr, _mm256_cmp_ps(value, red, _CMP_EQ_OQ));
+    hue = _mm256_div_ps(hue, _mm256_set1_ps(6));
+    hue = _mm256_add_ps(hue, _mm256_and_ps(_mm256_cmp_ps(hue, zero, _CMP_LT_OQ), _mm256_set1_ps(1)));
+    hue = _mm256_and_ps(_mm256_cmp_ps(diff, zero, _CMP_NEQ_OQ), hue);
+    
+    _mm256_storeu_ps(r, hue);
+    _mm256_storeu_ps(g, saturation);
+    _mm256_storeu_ps(b, value);
+}
+
+__attribute__((target("avx2")))
+static void rgb_to_hsv_avx2(float *r, float *g, float *b, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        hsv8_avx2(r + i, g + i, b + i);
+        hsv8_avx2(r + i + 8, g + i + 8, b + i + 8);
+    }
+    rgb_to_hsv_scalar(r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 sector_avx2(__m256 h6, __m256 chroma, __m256 value, float n)
+{
+    __m256 six = _mm256_set1_ps(6);
+    __m256 k = _mm256_add_ps(h6, _mm256_set1_ps(n));
+    k = _mm256_sub_ps(k, _mm256_and_ps(_mm256_cmp_ps(k, six, _CMP_GE_OQ), six));
+    __m256 t = _mm256_min_ps(k, _mm256_sub_ps(_mm256_set1_ps(4), k));
+    t = _mm256_max_ps(_mm256_setzero_ps(), _mm256_min_ps(t, _mm256_set1_ps(1)));
+    return _mm256_sub_ps(value, _mm256_mul_ps(chroma, t));
+}
+
+__attribute__((target("avx2")))
+static inline void rgb8_avx2(float *h, float *s, float *v)
+{
+    __m256 value = _mm256_loadu_ps(v);
+    __m256 chroma = _mm256_mul_ps(value, _mm256_loadu_ps(s));
+    __m256 h6 = _mm256_mul_ps(_mm256_loadu_ps(h), _mm256_set1_ps(6));
+    __m256 diff = _mm256_sub_ps(value, chroma);
+    __m256 valid = _mm256_and_ps(_mm256_cmp_ps(h6, _mm256_setzero_ps(), _CMP_GE_OQ), 
+                                 _mm256_cmp_ps(h6, _mm256_set1_ps(6), _CMP_LE_OQ));
+    
+    _mm256_storeu_ps(h, _mm256_blendv_ps(diff, sector_avx2(h6, chroma, value, 5), valid));
+    _mm256_storeu_ps(s, _mm256_blendv_ps(diff, sector_avx2(h6, chroma, value, 3), valid));
+    _mm256_storeu_ps(v, _mm256_blendv_ps(diff, sector_avx2(h6, chroma, value, 1), valid));
+}
+
+__attribute__((target("avx2")))
+static void hsv_to_rgb_avx2(float *h, float *s, float *v, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        rgb8_avx2(h + i, s + i, v + i);
+        rgb8_avx2(h + i + 8, s + i + 8, v + i + 8);
+    }
+    hsv_to_rgb_scalar(h + i, s + i, v + i, n - i);
+}
+
+// ---- SSE4.1, 8 pixels per iteration ----
+
+__attribute__((target("sse4.1")))
+static inline void gray4_sse(const float *r, const float *g, const float *b, float *gray)
+{
+    __m128 y = _mm_mul_ps(_mm_loadu_ps(r), _mm_set1_ps(0.299f));
+    y = _mm_add_ps(y, _mm_mul_ps(_mm_loadu_ps(g), _mm_set1_ps(0.587f)));
+    y = _mm_add_ps(y, _mm_mul_ps(_mm_loadu_ps(b), _mm_set1_ps(0.114f)));
+    _mm_storeu_ps(gray, y);
+}
+
+__attribute__((target("sse4.1")))
+static void rgb_to_grayscale_sse(const float *r, const float *g, const float *b, float *gray, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        gray4_sse(r + i, g + i, b + i, gray + i);
+        gray4_sse(r + i + 4, g + i + 4, b + i + 4, gray + i + 4);
+    }
+    rgb_to_grayscale_scalar(r + i, g + i, b + i, gray + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static inline void hsv4_sse(float *r, float *g, float *b)
+{
+    __m128 red = _mm_loadu_ps(r);
+    __m128 green = _mm_loadu_ps(g);
+    __m128 blue = _mm_loadu_ps(b);
+    __m128 zero = _mm_setzero_ps();
+    
+    __m128 value = _mm_max_ps(red, _mm_max_ps(green, blue));
+    __m128 min = _mm_min_ps(red, _mm_min_ps(green, blue));
+    __m128 diff = _mm_sub_ps(value, min);
+    
+    __m128 saturation = _mm_and_ps(_mm_cmpgt_ps(value, zero), _mm_div_ps(diff, value));
+    
+    __m128 hr = _mm_div_ps(_mm_sub_ps(green, blue), diff);
+    __m128 hg = _mm_add_ps(_mm_div_ps(_mm_sub_ps(blue, red), diff), _mm_set1_ps(2));
+    __m128 hb = _mm_add_ps(_mm_div_ps(_mm_sub_ps(red, green), diff), _mm_set1_ps(4));
+    
+    __m128 hue = _mm_blendv_ps(hb, hg, _mm_cmpeq_ps(value, green));
+    hue = _mm_blendv_ps(hue, hr, _mm_cmpeq_ps(value, red));
+    hue = _mm_div_ps(hue, _mm_set1_ps(6));
+    hue = _mm_add_ps(hue, _mm_and_ps(_mm_cmplt_ps(hue, zero), _mm_set1_ps(1)));
+    hue = _mm_and_ps(_mm_cmpneq_ps(diff, zero), hue);
+    
+    _mm_storeu_ps(r, hue);
+    _mm_storeu_ps(g, saturation);
+    _mm_storeu_ps(b, value);
+}
+
+__attribute__((target("sse4.1")))
+static void rgb_to_hsv_sse(float *r, float *g, float *b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        hsv4_sse(r + i, g + i, b + i);
+        hsv4_sse(r + i + 4, g + i + 4, b + i + 4);
+    }
+    rgb_to_hsv_scalar(r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128 sector_sse(__m128 h6, __m128 chroma, __m128 value, float n)
+{
+    __m128 six = _mm_set1_ps(6);
+    __m128 k = _mm_add_ps(h6, _mm_set1_ps(n));
+    k = _mm_sub_ps(k, _mm_and_ps(_mm_cmpge_ps(k, six), six));
+    __m128 t = _mm_min_ps(k, _mm_sub_ps(_mm_set1_ps(4), k));
+    t = _mm_max_ps(_mm_setzero_ps(), _mm_min_ps(t, _mm_set1_ps(1)));
+    return _mm_sub_ps(value, _mm_mul_ps(chroma, t));
+}
+
+__attribute__((target("sse4.1")))
+static inline void rgb4_sse(float *h, float *s, float *v)
+{
+    __m128 value = _mm_loadu_ps(v);
+    __m128 chroma = _mm_mul_ps(value, _mm_loadu_ps(s));
+    __m128 h6 = _mm_mul_ps(_mm_loadu_ps(h), _mm_set1_ps(6));
+    __m128 diff = _mm_sub_ps(value, chroma);
+    __m128 valid = _mm_and_ps(_mm_cmpge_ps(h6, _mm_setzero_ps()), _mm_cmple_ps(h6, _mm_set1_ps(6)));
+    
+    _mm_storeu_ps(h, _mm_blendv_ps(diff, sector_sse(h6, chroma, value, 5), valid));
+    _mm_storeu_ps(s, _mm_blendv_ps(diff, sector_sse(h6, chroma, value, 3), valid));
+    _mm_storeu_ps(v, _mm_blendv_ps(diff, sector_sse(h6, chroma, value, 1), valid));
+}
+
+__attribute__((target("sse4.1")))
+static void hsv_to_rgb_sse(float *h, float *s, float *v, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        rgb4_sse(h + i, s + i, v + i);
+        rgb4_sse(h + i + 4, s + i + 4, v + i + 4);
+    }
+    hsv_to_rgb_scalar(h + i, s + i, v + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline void store8_avx2(__m128i bytes, float *dst)
+{
+    __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+    _mm256_storeu_ps(dst, _mm256_mul_ps(v, _mm256_set1_ps(1.0f / 255)));
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_bytes_avx2(const unsigned char *src, int stride, float *r, float *g, float *b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i rb, gb, bb;
+        gather8_sse(src + i * stride, stride, &rb, &gb, &bb);
+        store8_avx2(rb, r + i);
+        store8_avx2(gb, g + i);
+        store8_avx2(bb, b + i);
+    }
+    deinterleave_bytes_scalar(src + i * stride, stride, r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i quantize8_avx2(const float *src)
+{
+    __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src), _mm256_setzero_ps()), _mm256_set1_ps(1));
+    return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(255)), _mm256_set1_ps(0.5f)));
+}
+
+__attribute__((target("avx2")))
+static inline __m128i quantize16_avx2(const float *src)
+{
+    // The 256 bit packs work per lane, so put the quarters back in order
+    __m256i w = _mm256_packus_epi32(quantize8_avx2(src), quantize8_avx2(src + 8));
+    w = _mm256_permute4x64_epi64(w, 0xD8);
+    return _mm_packus_epi16(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+}
+
+__attribute__((target("avx2")))
+static void interleave_bytes_avx2(const float *r, const float *g, const float *b, unsigned char *dst, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        scatter16_sse(quantize16_avx2(r + i), quantize16_avx2(g + i), quantize16_avx2(b + i), dst + i * 3);
+    }
+    interleave_bytes_scalar(r + i, g + i, b + i, dst + i * 3, n - i);
+}
+
+static const color_kernels avx2_kernels = {
+    "avx2", rgb_to_grayscale_avx2, rgb_to_hsv_avx2, hsv_to_rgb_avx2, deinterleave_bytes_avx2,
+    interleave_bytes_avx2
+};
+
+__attribute__((target("sse4.1")))
+static inline void store8_sse(__m128i bytes, float *dst)
+{
+    __m128 k = _mm_set1_ps(1.0f / 255);
+    __m128 v0 = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(bytes));
+    __m128 v1 = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(bytes, 4)));
+    _mm_storeu_ps(dst, _mm_mul_ps(v0, k));
+    _mm_storeu_ps(dst + 4, _mm_mul_ps(v1, k));
+}
+
+__attribute__((target("sse4.1")))
+static void deinterleave_bytes_sse(const unsigned char *src, int stride, float *r, float *g, float *b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m128i rb, gb, bb;
+        gather8_sse(src + i * stride, stride, &rb, &gb, &bb);
+        store8_sse(rb, r + i);
+        store8_sse(gb, g + i);
+        store8_sse(bb, b + i);
+    }
+    deinterleave_bytes_scalar(src + i * stride, stride, r + i, g + i, b + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i quantize4_sse(const float *src)
+{
+    __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src), _mm_setzero_ps()), _mm_set1_ps(1));
+    return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(255)), _mm_set1_ps(0.5f)));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i quantize16_sse(const float *src)
+{
+    __m128i lo = _mm_packus_epi32(quantize4_sse(src), quantize4_sse(src + 4));
+    __m128i hi = _mm_packus_epi32(quantize4_sse(src + 8), quantize4_sse(src + 12));
+    return _mm_packus_epi16(lo, hi);
+}
+
+__attribute__((target("sse4.1")))
+static void interleave_bytes_sse(const float *r, const float *g, const float *b, unsigned char *dst, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        scatter16_sse(quantize16_sse(r + i), quantize16_sse(g + i), quantize16_sse(b + i), dst + i * 3);
+    }
+    interleave_bytes_scalar(r + i, g + i, b + i, dst + i * 3, n - i);
+}
+
+static const color_kernels sse_kernels = {
+    "sse4.1", rgb_to_grayscale_sse, rgb_to_hsv_sse, hsv_to_rgb_sse, deinterleave_bytes_sse,
+    interleave_bytes_sse
+};
+
+#endif
+
+#ifdef COLOR_SIMD_NEON
+
+// ---- NEON, 8 pixels per iteration ----
+
+static inline void gray4_neon(const float *r, const float *g, const float *b, float *gray)
+{
+    float32x4_t y = vmulq_n_f32(vld1q_f32(r), 0.299f);
+    y = vaddq_f32(y, vmulq_n_f32(vld1q_f32(g), 0.587f));
+    y = vaddq_f32(y, vmulq_n_f32(vld1q_f32(b), 0.114f));
+    vst1q_f32(gray, y);
+}
+
+static void rgb_to_grayscale_neon(const float *r, const float *g, const float *b, float *gray, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        gray4_neon(r + i, g + i, b + i, gray + i);
+        gray4_neon(r + i + 4, g + i + 4, b + i + 4, gray + i + 4);
+    }
+    rgb_to_grayscale_scalar(r + i, g + i, b + i, gray + i, n - i);
+}
+
+static inline float32x4_t mask_neon(uint32x4_t mask, float32x4_t v)
+{
+    return vreinterpretq_f32_u32(vandq_u32(mask, vreinterpretq_u32_f32(v)));
+}
+
+static inline void hsv4_neon(float *r, float *g, float *b)
+{
+    float32x4_t red = vld1q_f32(r);
+    float32x4_t green = vld1q_f32(g);
+    float32x4_t blue = vld1q_f32(b);
+    float32x4_t zero = vdupq_n_f32(0);
+    
+    float32x4_t value = vmaxq_f32(red, vmaxq_f32(green, blue));
+    float32x4_t min = vminq_f32(red, vminq_f32(green, blue));
+    float32x4_t diff = vsubq_f32(value, min);
+    
+    float32x4_t saturation = mask_neon(vcgtq_f32(value, zero), vdivq_f32(diff, value));
+    
+    float32x4_t hr = vdivq_f32(vsubq_f32(green, blue), diff);
+    float32x4_t hg = vaddq_f32(vdivq_f32(vsubq_f32(blue, red), diff), vdupq_n_f32(2));
+    float32x4_t hb = vaddq_f32(vdivq_f32(vsubq_f32(red, green), diff), vdupq_n_f32(4));
+    
+    float32x4_t hue = vbslq_f32(vceqq_f32(value, green), hg, hb);
+    hue = vbslq_f32(vceqq_f32(value, red), hr, hue);
+    hue = vdivq_f32(hue, vdupq_n_f32(6));
+    hue = vaddq_f32(hue, mask_neon(vcltq_f32(hue, zero), vdupq_n_f32(1)));
+    hue = mask_neon(vmvnq_u32(vceqq_f32(diff, zero)), hue);
+    
+    vst1q_f32(r, hue);
+    vst1q_f32(g, saturation);
+    vst1q_f32(b, value);
+}
+
+static void rgb_to_hsv_neon(float *r, float *g, float *b, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        hsv4_neon(r + i, g + i, b + i);
+        hsv4_neon(r + i + 4, g + i + 4, b + i + 4);
+    }
+    rgb_to_hsv_scalar(r + i, g + i, b + i, n - i);
+}
+
+static inline float32x4_t sector_neon(float32x4_t h6, float32x4_t chroma, float32x4_t value, float n)
+{
+    float32x4_t six = vdupq_n_f32(6);
+    float32x4_t k = vaddq_f32(h6, vdupq_n_f32(n));
+    k = vsubq_f32(k, mask_neon(vcgeq_f32(k, six), six));
+    float32x4_t t = vminq_f32(k, vsubq_f32(vdupq_n_f32(4), k));
+    t = vmaxq_f32(vdupq_n_f32(0), vminq_f32(t, vdupq_n_f32(1)));
+    return vsubq_f32(value, vmulq_f32(chroma, t));
+}
+
+static inline void rgb4_neon(float *h, float *s, float *v)
+{
+    float32x4_t value = vld1q_f32(v);
+    float32x4_t chroma = vmulq_f32(value, vld1q_f32(s));
+    float32x4_t h6 = vmulq_n_f32(vld1q_f32(h), 6);
+    float32x4_t diff = vsubq_f32(value, chroma);
+    uint32x4_t valid = vandq_u32(vcgeq_f32(h6, vdupq_n_f32(0)), vcleq_f32(h6, vdupq_n_f32(6)));
+    
+    vst1q_f32(h, vbslq_f32(valid, sector_neon(h6, chroma, value, 5), diff));
+    vst1q_f32(s, vbslq_f32(valid, sector_neon(h6, chroma, value, 3), diff));
+    vst1q_f32(v, vbslq_f32(valid, sector_neon(h6, chroma, value, 1), diff));
+}
+
+static void hsv_to_rgb_neon(float *h, float *s, float *v, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        rgb4_neon(h + i, s + i, v + i);
+        rgb4_neon(h + i + 4, s + i + 4, v + i + 4);
+    }
+    hsv_to_rgb_scalar(h + i, s + i, v + i, n - i);
+}
+
+static inline void store16_neon(uint8x16_t bytes, float *dst)
+{
+    float32x4_t k = vdupq_n_f32(1.0f / 255);
+    uint16x8_t lo = vmovl_u8(vget_low_u8(bytes));
+    uint16x8_t hi = vmovl_u8(vget_high_u8(bytes));
+    vst1q_f32(dst, vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), k));
+    vst1q_f32(dst + 4, vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), k));
+    vst1q_f32(dst + 8, vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), k));
+    vst1q_f32(dst + 12, vmulq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), k));
+}
+
+static void deinterleave_bytes_neon(const unsigned char *src, int stride, float *r, float *g, float *b, int n)
+{
+    // The structure loads deinterleave 16 pixels by themselves
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t c0, c1, c2;
+        if (stride == 4)
+        {
+            uint8x16x4_t px = vld4q_u8(src + i * 4);
+            c0 = px.val[0]; c1 = px.val[1]; c2 = px.val[2];
+        }
+        else
+        {
+            uint8x16x3_t px = vld3q_u8(src + i * 3);
+            c0 = px.val[0]; c1 = px.val[1]; c2 = px.val[2];
+        }
+        store16_neon(c0, r + i);
+        store16_neon(c1, g + i);
+        store16_neon(c2, b + i);
+    }
+    deinterleave_bytes_scalar(src + i * stride, stride, r + i, g + i, b + i, n - i);
+}
+
+static inline uint8x16_t quantize16_neon(const float *src)
+{
+    uint16x4_t q[4];
+    for (int j = 0; j < 4; j ++)
+    {
+        float32x4_t v = vminq_f32(vmaxq_f32(vld1q_f32(src + 4 * j), vdupq_n_f32(0)), vdupq_n_f32(1));
+        q[j] = vmovn_u32(vcvtq_u32_f32(vmlaq_f32(vdupq_n_f32(0.5f), v, vdupq_n_f32(255))));
+    }
+    return vcombine_u8(vmovn_u16(vcombine_u16(q[0], q[1])), vmovn_u16(vcombine_u16(q[2], q[3])));
+}
+
+static void interleave_bytes_neon(const float *r, const float *g, const float *b, unsigned char *dst, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16x3_t px;
+        px.val[0] = quantize16_neon(r + i);
+        px.val[1] = quantize16_neon(g + i);
+        px.val[2] = quantize16_neon(b + i);
+        vst3q_u8(dst + i * 3, px);
+    }
+    interleave_bytes_scalar(r + i, g + i, b + i, dst + i * 3, n - i);
+}
+
+static const color_kernels neon_kernels = {
+    "neon", rgb_to_grayscale_neon, rgb_to_hsv_neon, hsv_to_rgb_neon, deinterleave_bytes_neon,
+    interleave_bytes_neon
+};
+
+#endif
+
+static const color_kernels scalar_kernels = {
+    "scalar", rgb_to_grayscale_scalar, rgb_to_hsv_scalar, hsv_to_rgb_scalar, deinterleave_bytes_scalar,
+    interleave_bytes_scalar
+};
+
+static const color_kernels *selected_kernels = &scalar_kernels;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void select_color_kernels()
+{
+    const char *env = getenv("UWIMG_SIMD");
+    if (env && 0 == strcmp(env, "0")) return;
+    
+#ifdef COLOR_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) selected_kernels = &avx2_kernels;
+    else if (__builtin_cpu_supports("sse4.1")) selected_kernels = &sse_kernels;
+#elif defined(COLOR_SIMD_NEON)
+    selected_kernels = &neon_kernels;
+#endif
+}
+
+const color_kernels *get_color_kernels()
+{
+    pthread_once(&select_once, select_color_kernels);
+    return selected_kernels;
+}
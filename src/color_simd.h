@@ -0,0 +1,36 @@
+#ifndef COLOR_SIMD_H
+#define COLOR_SIMD_H
+
+// Color space conversion kernels over planar channel data.
+//
+// Each kernel works on n pixels of three separate channel planes; the HSV
+// kernels convert in place. The scalar kernels in process_image.c are the
+// reference implementation, and the vectorized kernels in color_simd.c are
+// picked at runtime from the features of the CPU we are running on.
+//
+// deinterleave_bytes turns n pixels of 8 bit interleaved data with 3 or 4
+// bytes per pixel into three float planes scaled to [0, 1]; a fourth byte
+// (alpha) is skipped without being converted. interleave_bytes is the
+// way back for saving: three planes are clamped to [0, 1], rounded to
+// 8 bits and packed as RGB triples.
+
+typedef struct{
+    const char *name;
+    void (*rgb_to_grayscale)(const float *r, const float *g, const float *b, float *gray, int n);
+    void (*rgb_to_hsv)(float *r, float *g, float *b, int n);
+    void (*hsv_to_rgb)(float *h, float *s, float *v, int n);
+    void (*deinterleave_bytes)(const unsigned char *src, int stride, float *r, float *g, float *b, int n);
+    void (*interleave_bytes)(const float *r, const float *g, const float *b, unsigned char *dst, int n);
+} color_kernels;
+
+// Kernels for this CPU, selected once on first use. Setting the environment
+// variable UWIMG_SIMD=0 forces the scalar reference kernels.
+const color_kernels *get_color_kernels();
+
+void rgb_to_grayscale_scalar(const float *r, const float *g, const float *b, float *gray, int n);
+void rgb_to_hsv_scalar(float *r, float *g, float *b, int n);
+void hsv_to_rgb_scalar(float *h, float *s, float *v, int n);
+void deinterleave_bytes_scalar(const unsigned char *src, int stride, float *r, float *g, float *b, int n);
+void interleave_bytes_scalar(const float *r, const float *g, const float *b, unsigned char *dst, int n);
+
+#endif
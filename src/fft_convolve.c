@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+#include "pixel_access.h"
+#include "parallel.h"
+#include "image_pool.h"
+#include "instrument.h"
+
+// Frequency domain convolution.
+//
+// For a filter of fw x fh taps, direct convolution costs fw * fh multiply
+// adds per pixel, while going through the FFT costs O(log N) per pixel
+// whatever the filter size. convolve_image switches over to this path for
+// large filters that are not separable.
+//
+// To keep convolve_image's clamped borders, each channel is first padded
+// by the filter radius with its border pixels repeated, into a power of two
+// grid big enough that the circular convolution never wraps onto a pixel
+// we keep. Two channels filtered with the same kernel share one complex
+// transform, one in the real part and one in the imaginary part; since the
+// kernel is real, the two results come back separated the same way.
+
+// Spectra of recently used kernels, keyed on the kernel contents and the
+// transform size, so filtering many images with the same kernel only
+// transforms it once.
+#define FFT_CACHE_SIZE 4
+
+typedef struct{
+    int fw, fh;
+    int px, py;
+    float *taps;
+    float *spectrum;
+    int refs;
+    unsigned long long used;
+} spectrum_entry;
+
+static spectrum_entry *cache[FFT_CACHE_SIZE];
+static unsigned long long cache_clock = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int next_pow2(int n)
+{
+    int p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+static image make_twiddles(int n)
+{
+    // cos and sin of -2 pi k / n for k < n / 2, computed in double
+    image t = scratch_image(n, 1, 1);
+    for (int k = 0; k < n / 2; k ++)
+    {
+        double a = -2 * M_PI * k / n;
+        t.data[2 * k] = cos(a);
+        t.data[2 * k + 1] = sin(a);
+    }
+    return t;
+}
+
+static void fft1d(float *z, int n, const float *twiddles, int inverse)
+{
+    /**
+     * In place iterative radix-2 FFT of n interleaved complex values.
+     * 
+     * The inverse transform is not scaled by 1 / n.
+     * 
+     */
+    
+    for (int i = 1, j = 0; i < n; i ++)
+    {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j |= bit;
+        if (i < j)
+        {
+            float re = z[2 * i], im = z[2 * i + 1];
+            z[2 * i] = z[2 * j];
+            z[2 * i + 1] = z[2 * j + 1];
+            z[2 * j] = re;
+            z[2 * j + 1] = im;
+        }
+    }
+    
+    float sign = inverse ? -1 : 1;
+    for (int len = 2; len <= n; len <<= 1)
+    {
+        int half = len / 2, step = n / len;
+        for (int i = 0; i < n; i += len)
+        {
+            for (int k = 0; k < half; k ++)
+            {
+                float wr = twiddles[2 * k * step], wi = sign * twiddles[2 * k * step + 1];
+                float *a = z + 2 * (i + k), *b = z + 2 * (i + k + half);
+                float br = b[0] * wr - b[1] * wi;
+                float bi = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - br;
+                b[1] = a[1] - bi;
+                a[0] += br;
+                a[1] += bi;
+            }
+        }
+    }
+}
+
+typedef struct{
+    float *grid;
+    int px, py;
+    const float *twiddles;
+    int inverse;
+} fft_args;
+
+static void fft_rows_band(void *ctx, int r0, int r1)
+{
+    fft_args *a = ctx;
+    for (int y = r0; y < r1; y ++) fft1d(a->grid + (size_t)2 * y * a->px, a->px, a->twiddles, a->inverse);
+}
+
+static void fft_cols_band(void *ctx, int c0, int c1)
+{
+    fft_args *a = ctx;
+    image col_buffer = scratch_image(2 * a->py, 1, 1);
+    float *col = col_buffer.data;
+    for (int x = c0; x < c1; x ++)
+    {
+        for (int y = 0; y < a->py; y ++)
+        {
+            size_t i = 2 * (x + (size_t)y * a->px);
+            col[2 * y] = a->grid[i];
+            col[2 * y + 1] = a->grid[i + 1];
+        }
+        fft1d(col, a->py, a->twiddles, a->inverse);
+        for (int y = 0; y < a->py; y ++)
+        {
+            size_t i = 2 * (x + (size_t)y * a->px);
+            a->grid[i] = col[2 * y];
+            a->grid[i + 1] = col[2 * y + 1];
+        }
+    }
+    release_scratch_image(col_buffer);
+}
+
+static void fft2d(float *grid, int px, int py, int inverse)
+{
+    image tx = make_twiddles(px);
+    image ty = make_twiddles(py);
+    fft_args rows = {grid, px, py, tx.data, inverse};
+    fft_args cols = {grid, px, py, ty.data, inverse};
+    parallel_for(py, row_grain(px * 8), fft_rows_band, &rows);
+    parallel_for(px, row_grain(py * 8), fft_cols_band, &cols);
+    release_scratch_image(ty);
+    release_scratch_image(tx);
+}
+
+static float *kernel_spectrum(const float *taps, int fw, int fh, int px, int py)
+{
+    /**
+     * Transforms a kernel for correlation on a px x py grid.
+     * 
+     * Tap (i, j) is stored at (-i, -j) modulo the grid size, which turns the
+     * circular convolution into the correlation convolve_image computes.
+     * 
+     */
+    
+    float *grid = calloc((size_t)2 * px * py, sizeof(float));
+    for (int j = 0; j < fh; j ++)
+    {
+        for (int i = 0; i < fw; i ++)
+        {
+            int x = (px - i) % px, y = (py - j) % py;
+            grid[2 * (x + (size_t)y * px)] = taps[i + j * fw];
+        }
+    }
+    fft2d(grid, px, py, 0);
+    return grid;
+}
+
+static spectrum_entry *acquire_spectrum(const float *taps, int fw, int fh, int px, int py)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < FFT_CACHE_SIZE; i ++)
+    {
+        spectrum_entry *e = cache[i];
+        if (e && e->fw == fw && e->fh == fh && e->px == px && e->py == py &&
+            0 == memcmp(e->taps, taps, fw * fh * sizeof(float)))
+        {
+            e->refs ++;
+            e->used = ++cache_clock;
+            pthread_mutex_unlock(&cache_lock);
+            return e;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    
+    spectrum_entry *e = calloc(1, sizeof(spectrum_entry));
+    e->fw = fw;
+    e->fh = fh;
+    e->px = px;
+    e->py = py;
+    e->taps = malloc(fw * fh * sizeof(float));
+    memcpy(e->taps, taps, fw * fh * sizeof(float));
+    e->spectrum = kernel_spectrum(taps, fw, fh, px, py);
+    e->refs = 2; // one for the caller, one for the cache
+    
+    // Replace the least recently used slot
+    pthread_mutex_lock(&cache_lock);
+    int victim = 0;
+    for (int i = 0; i < FFT_CACHE_SIZE; i ++)
+    {
+        if (!cache[i]) { victim = i; break; }
+        if (cache[i]->used < cache[victim]->used) victim = i;
+    }
+    spectrum_entry *old = cache[victim];
+    e->used = ++cache_clock;
+    cache[victim] = e;
+    int release = old && --old->refs == 0;
+    pthread_mutex_unlock(&cache_lock);
+    
+    if (release)
+    {
+        free(old->taps);
+        free(old->spectrum);
+        free(old);
+    }
+    return e;
+}
+
+static void release_spectrum(spectrum_entry *e)
+{
+    pthread_mutex_lock(&cache_lock);
+    int release = --e->refs == 0;
+    pthread_mutex_unlock(&cache_lock);
+    if (release)
+    {
+        free(e->taps);
+        free(e->spectrum);
+        free(e);
+    }
+}
+
+void free_fft_cache()
+{
+    /**
+     * Drops every cached kernel spectrum.
+     * 
+     */
+    
+    for (int i = 0; i < FFT_CACHE_SIZE; i ++)
+    {
+        pthread_mutex_lock(&cache_lock);
+        spectrum_entry *e = cache[i];
+        cache[i] = 0;
+        pthread_mutex_unlock(&cache_lock);
+        if (e) release_spectrum(e);
+    }
+}
+
+static void pad_plane(const float *src, int w, int h, int left, int top,
+                      float *grid, int px, int py, int part)
+{
+    // Writes the clamped, shifted plane into the real (part 0) or
+    // imaginary (part 1) half of every grid element
+    for (int y = 0; y < py; y ++)
+    {
+        const float *row = src + clamp_index(y - top, h) * w;
+        float *dst = grid + (size_t)2 * y * px + part;
+        for (int x = 0; x < px; x ++) dst[2 * x] = row[clamp_index(x - left, w)];
+    }
+}
+
+static void multiply_spectrum(float *grid, const float *k, size_t n)
+{
+    for (size_t i = 0; i < n; i ++)
+    {
+        float re = grid[2 * i], im = grid[2 * i + 1];
+        grid[2 * i] = re * k[2 * i] - im * k[2 * i + 1];
+        grid[2 * i + 1] = re * k[2 * i + 1] + im * k[2 * i];
+    }
+}
+
+static void unpad_plane(const float *grid, int px, int w, int h, float scale,
+                        float *dst, int part)
+{
+    for (int y = 0; y < h; y ++)
+    {
+        const float *row = grid + (size_t)2 * y * px + part;
+        for (int x = 0; x < w; x ++) dst[x + y * w] = row[2 * x] * scale;
+    }
+}
+
+image convolve_image_fft(image im, image filter, int preserve)
+{
+    /**
+     * Convolves an image with a filter in the frequency domain.
+     * 
+     * The result matches convolve_image, borders and both `preserve` modes
+     * included, up to floating point error. The cost per pixel grows with
+     * the log of the image size rather than with the filter size, so this
+     * is the fast way to apply large, non-separable filters. Kernel spectra
+     * are cached, so reusing a filter skips its transform.
+     * 
+     * @param im the image to convolve
+     * @param filter the filter to convolve with, 1 or im.c channels
+     * @param preserve whether to keep the channels of im separate
+     * 
+     * @returns convolved image with im.c channels if preserve, 1 otherwise
+     * 
+     */
+    
+    image out = make_image_uninit(im.w, im.h, preserve ? im.c : 1);
+    convolve_image_fft_into(out, im, filter, preserve);
+    return out;
+}
+
+void convolve_image_fft_into(image out, image im, image filter, int preserve)
+{
+    /**
+     * Same as convolve_image_fft, writing into a caller's image.
+     * 
+     * @param[out] out im.w x im.h image with im.c channels if preserve, 1
+     * otherwise; it must not overlap im
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    assert(filter.c == 1 || filter.c == im.c);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve ? im.c : 1));
+    
+    int w = im.w, h = im.h, plane = w * h;
+    int fw = filter.w, fh = filter.h;
+    int px = next_pow2(w + fw - 1), py = next_pow2(h + fh - 1);
+    // Grids of 2^30 points and more are in reach: sizes go through size_t
+    size_t n = (size_t)px * py;
+    float scale = 1.0f / n;
+    
+    image grid_buffer = scratch_image(2 * px, py, 1);
+    float *grid = grid_buffer.data;
+    
+    if (filter.c == 1)
+    {
+        spectrum_entry *k = acquire_spectrum(filter.data, fw, fh, px, py);
+        image sum = {0};
+        int channels = im.c;
+        const float *src = im.data;
+        
+        if (!preserve && im.c > 1)
+        {
+            // As in the spatial path, sum the channels first
+            sum = scratch_image(w, h, 1);
+            memcpy(sum.data, im.data, plane * sizeof(float));
+            for (int c = 1; c < im.c; c ++)
+            {
+                for (int i = 0; i < plane; i ++) sum.data[i] += im.data[i + c * plane];
+            }
+            channels = 1;
+            src = sum.data;
+        }
+        
+        for (int c = 0; c < channels; c += 2)
+        {
+            int pair = c + 1 < channels;
+            memset(grid, 0, 2 * n * sizeof(float));
+            pad_plane(src + c * plane, w, h, fw / 2, fh / 2, grid, px, py, 0);
+            if (pair) pad_plane(src + (c + 1) * plane, w, h, fw / 2, fh / 2, grid, px, py, 1);
+            
+            fft2d(grid, px, py, 0);
+            multiply_spectrum(grid, k->spectrum, n);
+            fft2d(grid, px, py, 1);
+            
+            unpad_plane(grid, px, w, h, scale, out.data + c * plane, 0);
+            if (pair) unpad_plane(grid, px, w, h, scale, out.data + (c + 1) * plane, 1);
+        }
+        
+        if (sum.data) release_scratch_image(sum);
+        release_spectrum(k);
+    }
+    else
+    {
+        // Every channel has its own kernel: transform channels one at a
+        // time, and when summing add up the products before inverting
+        image acc = {0};
+        if (!preserve)
+        {
+            acc = scratch_image(2 * px, py, 1);
+            memset(acc.data, 0, 2 * n * sizeof(float));
+        }
+        
+        for (int c = 0; c < im.c; c ++)
+        {
+            spectrum_entry *k = acquire_spectrum(filter.data + c * fw * fh, fw, fh, px, py);
+            memset(grid, 0, 2 * n * sizeof(float));
+            pad_plane(im.data + c * plane, w, h, fw / 2, fh / 2, grid, px, py, 0);
+            fft2d(grid, px, py, 0);
+            multiply_spectrum(grid, k->spectrum, n);
+            release_spectrum(k);
+            
+            if (preserve)
+            {
+                fft2d(grid, px, py, 1);
+                unpad_plane(grid, px, w, h, scale, out.data + c * plane, 0);
+            }
+            else
+            {
+                for (size_t i = 0; i < 2 * n; i ++) acc.data[i] += grid[i];
+            }
+        }
+        
+        if (!preserve)
+        {
+            fft2d(acc.data, px, py, 1);
+            unpad_plane(acc.data, px, w, h, scale, out.data, 0);
+            release_scratch_image(acc);
+        }
+    }
+    
+    release_scratch_image(grid_buffer);
+}
@@ -4,92 +4,1108 @@
 #include <math.h>
 #include <assert.h>
 #include "image.h"
+#include "pixel_access.h"
+#include "parallel.h"
+#include "image_pool.h"
+#include "instrument.h"
 #define TWOPI 6.2831853
 
+// Relative tolerance used when testing whether a 2D kernel is rank-1
+#define SEPARABLE_EPS 1e-5f
+
+// Non-separable filters with at least this many taps are convolved in the
+// frequency domain, where the cost no longer grows with the filter size
+#define FFT_MIN_TAPS 144
+
 void l1_normalize(image im)
 {
-    // TODO
+    /**
+     * Normalizes an image so that all of its values sum to one.
+     * 
+     * Filters are normalized this way so that convolving with them keeps
+     * the overall brightness of the image unchanged.
+     * 
+     * @param[out] im the image to normalize
+     * 
+     */
+    
+    int n = im.w * im.h * im.c;
+    float sum = 0;
+    for (int i = 0; i < n; i ++) sum += im.data[i];
+    if (sum == 0) return;
+    for (int i = 0; i < n; i ++) im.data[i] /= sum;
 }
 
 image make_box_filter(int w)
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Makes a square box filter of the given width.
+     * 
+     * Every element of the box filter has the same weight, 1 / (w * w),
+     * so convolving with it averages the w x w neighbourhood of a pixel.
+     * 
+     * @param w width (and height) of the filter
+     * 
+     * @returns w x w x 1 box filter
+     * 
+     */
+    
+    image filter = make_image(w, w, 1);
+    for (int i = 0; i < w * w; i ++) filter.data[i] = 1;
+    l1_normalize(filter);
+    return filter;
+}
+
+image make_box_filter_1d(int w)
+{
+    /**
+     * Makes a one dimensional box filter of the given width.
+     * 
+     * Convolving with this filter horizontally and then vertically is the
+     * same as convolving with `make_box_filter(w)`, at O(2w) instead of
+     * O(w * w) cost per pixel.
+     * 
+     * @param w width of the filter
+     * 
+     * @returns w x 1 x 1 box filter
+     * 
+     */
+    
+    image filter = make_image(w, 1, 1);
+    for (int i = 0; i < w; i ++) filter.data[i] = 1;
+    l1_normalize(filter);
+    return filter;
+}
+
+typedef struct{
+    const float *src;
+    float *dst;
+    int w, h;
+    const float *k;
+    int kn;
+} pass_args;
+
+static void convolve_rows(void *ctx, int y0, int y1)
+{
+    /**
+     * Correlates rows [y0, y1) of a single channel plane with a 1D kernel.
+     * 
+     * Each row is first copied into a scratch row with its border pixels
+     * repeated, so the inner loop can read neighbours without any bounds
+     * checks.
+     * 
+     * @param ctx pass_args with the source and destination planes
+     * 
+     */
+    
+    pass_args *a = ctx;
+    int w = a->w, kn = a->kn;
+    int left = kn / 2;
+    int right = kn - 1 - left;
+    image pad_row_buffer = scratch_image(w + kn, 1, 1);
+    float *pad = pad_row_buffer.data;
+    
+    for (int y = y0; y < y1; y ++)
+    {
+        const float *row = a->src + y * w;
+        float *out = a->dst + y * w;
+        
+        pad_row(row, w, left, right, pad);
+        
+        for (int x = 0; x < w; x ++) out[x] = 0;
+        for (int i = 0; i < kn; i ++)
+        {
+            float tap = a->k[i];
+            const float *p = pad + i;
+            for (int x = 0; x < w; x ++) out[x] += tap * p[x];
+        }
+    }
+    release_scratch_image(pad_row_buffer);
+}
+
+static void convolve_cols(void *ctx, int y0, int y1)
+{
+    /**
+     * Correlates the columns of a single channel plane with a 1D kernel,
+     * producing output rows [y0, y1).
+     * 
+     * Rows are accumulated whole, so memory is still walked row by row and
+     * the border handling happens once per row rather than once per pixel.
+     * 
+     * @param ctx pass_args with the source and destination planes
+     * 
+     */
+    
+    pass_args *a = ctx;
+    int w = a->w, kn = a->kn;
+    int left = kn / 2;
+    
+    for (int y = y0; y < y1; y ++)
+    {
+        float *out = a->dst + y * w;
+        for (int x = 0; x < w; x ++) out[x] = 0;
+        
+        for (int i = 0; i < kn; i ++)
+        {
+            float tap = a->k[i];
+            const float *row = a->src + clamp_index(y + i - left, a->h) * w;
+            for (int x = 0; x < w; x ++) out[x] += tap * row[x];
+        }
+    }
+}
+
+typedef struct{
+    image im;
+    float *sum;
+} sum_args;
+
+static void sum_channels(void *ctx, int i0, int i1)
+{
+    sum_args *a = ctx;
+    int plane = a->im.w * a->im.h;
+    for (int i = i0; i < i1; i ++) a->sum[i] = 0;
+    for (int c = 0; c < a->im.c; c ++)
+    {
+        const float *src = a->im.data + c * plane;
+        for (int i = i0; i < i1; i ++) a->sum[i] += src[i];
+    }
+}
+
+static void convolve_separable(image out, image im, const float *kx, int nx,
+                               const float *ky, int ny, int preserve)
+{
+    /**
+     * Runs a separable convolution as a horizontal and a vertical pass.
+     * 
+     * When `preserve` is off the channels are summed before filtering.
+     * Convolution is linear and the borders are clamped the same way in
+     * every channel, so this gives the same result as filtering each
+     * channel and summing afterwards, with a third of the work.
+     * 
+     */
+    
+    int plane = im.w * im.h;
+    int channels = preserve ? im.c : 1;
+    image tmp = scratch_image(im.w, im.h, 1);
+    image sum = {0};
+    
+    if (!preserve && im.c > 1)
+    {
+        sum = scratch_image(im.w, im.h, 1);
+        sum_args s = {im, sum.data};
+        parallel_for(plane, PIXEL_GRAIN, sum_channels, &s);
+    }
+    
+    for (int c = 0; c < channels; c ++)
+    {
+        const float *src = sum.data ? sum.data : im.data + c * plane;
+        pass_args rows = {src, tmp.data, im.w, im.h, kx, nx};
+        pass_args cols = {tmp.data, out.data + c * plane, im.w, im.h, ky, ny};
+        parallel_for(im.h, row_grain(im.w), convolve_rows, &rows);
+        parallel_for(im.h, row_grain(im.w), convolve_cols, &cols);
+    }
+    
+    if (sum.data) release_scratch_image(sum);
+    release_scratch_image(tmp);
+}
+
+static int is_box_filter(image filter)
+{
+    // A square single channel filter of equal taps summing to one, as
+    // make_box_filter makes, which box_blur runs at any width for the same cost
+    if (filter.c != 1 || filter.w != filter.h || filter.w < 2) return 0;
+    int n = filter.w * filter.h;
+    for (int i = 1; i < n; i ++) if (filter.data[i] != filter.data[0]) return 0;
+    return fabsf(filter.data[0] * n - 1) < SEPARABLE_EPS;
+}
+
+static int factor_separable(image filter, float *kx, float *ky)
+{
+    /**
+     * Tries to factor a single channel 2D kernel into two 1D kernels.
+     * 
+     * A kernel is separable when it is the outer product of a column and a
+     * row vector, i.e. every row is a multiple of every other row. We take
+     * the row and column through the largest element as the factors and
+     * then check that their product reproduces the whole kernel.
+     * 
+     * @param filter w x h x 1 kernel
+     * @param[out] kx horizontal factor, filter.w floats
+     * @param[out] ky vertical factor, filter.h floats
+     * 
+     * @returns 1 if the kernel is separable, 0 otherwise
+     * 
+     */
+    
+    int fw = filter.w, fh = filter.h;
+    int px = 0, py = 0;
+    float pivot = 0;
+    
+    for (int y = 0; y < fh; y ++)
+    {
+        for (int x = 0; x < fw; x ++)
+        {
+            float v = fabsf(filter.data[x + y * fw]);
+            if (v > pivot)
+            {
+                pivot = v;
+                px = x;
+                py = y;
+            }
+        }
+    }
+    if (pivot == 0) return 0;
+    
+    float p = filter.data[px + py * fw];
+    for (int x = 0; x < fw; x ++) kx[x] = filter.data[x + py * fw] / p;
+    for (int y = 0; y < fh; y ++) ky[y] = filter.data[px + y * fw];
+    
+    float tolerance = SEPARABLE_EPS * pivot;
+    for (int y = 0; y < fh; y ++)
+    {
+        for (int x = 0; x < fw; x ++)
+        {
+            if (fabsf(filter.data[x + y * fw] - kx[x] * ky[y]) > tolerance) return 0;
+        }
+    }
+    return 1;
+}
+
+image convolve_image_separable(image im, image fx, image fy, int preserve)
+{
+    /**
+     * Convolves an image with a separable filter given as two 1D filters.
+     * 
+     * The result is the same as convolving with the 2D filter fx * fy, but
+     * each pixel costs O(fx + fy) operations instead of O(fx * fy).
+     * 
+     * @param im the image to convolve
+     * @param fx horizontal filter (its w * h elements are used in order)
+     * @param fy vertical filter (its w * h elements are used in order)
+     * @param preserve whether to keep the channels of im separate
+     * 
+     * @returns convolved image with im.c channels if preserve, 1 otherwise
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    image out = make_image_uninit(im.w, im.h, preserve ? im.c : 1);
+    convolve_image_separable_into(out, im, fx, fy, preserve);
+    return out;
+}
+
+void convolve_image_separable_into(image out, image im, image fx, image fy, int preserve)
+{
+    /**
+     * Same as convolve_image_separable, writing into a caller's image.
+     * 
+     * @param[out] out im.w x im.h image with im.c channels if preserve, 1
+     * otherwise; it must not overlap im
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    assert(fx.c == 1 && fy.c == 1);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve ? im.c : 1));
+    convolve_separable(out, im, fx.data, fx.w * fx.h, fy.data, fy.w * fy.h, preserve);
+}
+
+typedef struct{
+    image im;
+    image filter;
+    image out;
+    int preserve;
+} convolve_args;
+
+static void convolve_band(void *ctx, int y0, int y1)
+{
+    /**
+     * Direct 2D convolution of output rows [y0, y1), for any filter.
+     * 
+     */
+    
+    convolve_args *a = ctx;
+    image im = a->im, filter = a->filter;
+    int fw = filter.w, fh = filter.h;
+    int plane = im.w * im.h;
+    
+    for (int c = 0; c < im.c; c ++)
+    {
+        const float *src = im.data + c * plane;
+        const float *f = filter.data + (filter.c == 1 ? 0 : c) * fw * fh;
+        float *dst = a->out.data + (a->preserve ? c : 0) * plane;
+        
+        for (int y = y0; y < y1; y ++)
+        {
+            for (int x = 0; x < im.w; x ++)
+            {
+                float sum = 0;
+                for (int j = 0; j < fh; j ++)
+                {
+                    const float *row = src + clamp_index(y + j - fh / 2, im.h) * im.w;
+                    for (int i = 0; i < fw; i ++)
+                    {
+                        sum += f[i + j * fw] * row[clamp_index(x + i - fw / 2, im.w)];
+                    }
+                }
+                dst[x + y * im.w] += sum;
+            }
+        }
+    }
+}
+
+// 3x3 and 5x5 filters.
+//
+// Most filter calls are for small kernels, where the direct loop above
+// spends more time on its loop counters and clamped reads than on the
+// multiply adds. Here the kernel size is a compile time constant, so the
+// taps are unrolled into straight line code and the loop over x, which
+// does no clamping, is left for the compiler to vectorize; it is built
+// once for the baseline ISA and once for AVX2 with FMA, picked at run time.
+// Only the r = K/2 pixels at each end of a row read clamped neighbours, in
+// a separate loop, and rows above and below the image are clamped once
+// per output row.
+
+typedef struct{
+    image_view im;
+    image filter;
+    image out;
+    image summed;       // im with its channels summed, when !preserve and the filter has one channel
+    int preserve;
+} small_args;
+
+static inline __attribute__((always_inline))
+void small_border(const float **rows, const float *f, float *dst, int w, int add, int x0, int x1, const int K)
+{
+    for (int x = x0; x < x1; x ++)
+    {
+        float sum = 0;
+        for (int j = 0; j < K; j ++)
+        {
+            for (int i = 0; i < K; i ++) sum += f[j * K + i] * rows[j][clamp_index(x + i - K / 2, w)];
+        }
+        dst[x] = add ? dst[x] + sum : sum;
+    }
+}
+
+static inline __attribute__((always_inline))
+void small_row(const float **rows, const float *f, float *dst, int w, int add, const int K)
+{
+    const int r = K / 2;
+    int x0 = r < w ? r : w, x1 = w - r > x0 ? w - r : x0;
+    float t[K * K];
+    for (int i = 0; i < K * K; i ++) t[i] = f[i];
+    
+    small_border(rows, t, dst, w, add, 0, x0, K);
+    for (int x = x0; x < x1; x ++)
+    {
+        float sum = 0;
+        for (int j = 0; j < K; j ++)
+        {
+            for (int i = 0; i < K; i ++) sum += t[j * K + i] * rows[j][x + i - r];
+        }
+        dst[x] = add ? dst[x] + sum : sum;
+    }
+    small_border(rows, t, dst, w, add, x1, w, K);
+}
+
+static void small_row_3(const float **rows, const float *f, float *dst, int w, int add)
+{
+    small_row(rows, f, dst, w, add, 3);
+}
+
+static void small_row_5(const float **rows, const float *f, float *dst, int w, int add)
+{
+    small_row(rows, f, dst, w, add, 5);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma")))
+static void small_row_3_avx2(const float **rows, const float *f, float *dst, int w, int add)
+{
+    small_row(rows, f, dst, w, add, 3);
+}
+
+__attribute__((target("avx2,fma")))
+static void small_row_5_avx2(const float **rows, const float *f, float *dst, int w, int add)
+{
+    small_row(rows, f, dst, w, add, 5);
+}
+#endif
+
+typedef void (*small_row_fn)(const float **rows, const float *f, float *dst, int w, int add);
+
+static small_row_fn small_row_kernel(int k)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return k == 3 ? small_row_3_avx2 : small_row_5_avx2;
+#endif
+    return k == 3 ? small_row_3 : small_row_5;
+}
+
+static void small_band(void *ctx, int y0, int y1)
+{
+    small_args *a = ctx;
+    image_view src = a->summed.data ? view_image(a->summed) : a->im;
+    int k = a->filter.w, w = src.w, h = src.h;
+    small_row_fn row_fn = small_row_kernel(k);
+    const float *rows[5];
+    
+    for (int c = 0; c < src.c; c ++)
+    {
+        const float *f = a->filter.data + (a->filter.c == 1 ? 0 : c) * k * k;
+        int add = !a->preserve && c > 0;
+        for (int y = y0; y < y1; y ++)
+        {
+            for (int j = 0; j < k; j ++) rows[j] = view_row(src, clamp_index(y + j - k / 2, h), c);
+            row_fn(rows, f, image_row(a->out, y, a->preserve ? c : 0), w, add);
+        }
+    }
+}
+
+static void sum_channels_band(void *ctx, int y0, int y1)
+{
+    small_args *a = ctx;
+    int w = a->im.w;
+    for (int y = y0; y < y1; y ++)
+    {
+        float *dst = image_row(a->summed, y, 0);
+        memcpy(dst, view_row(a->im, y, 0), w * sizeof(float));
+        for (int c = 1; c < a->im.c; c ++)
+        {
+            const float *src = view_row(a->im, y, c);
+            for (int x = 0; x < w; x ++) dst[x] += src[x];
+        }
+    }
+}
+
+static void convolve_small(image out, image_view im, image filter, int preserve)
+{
+    /**
+     * Convolves with a 3x3 or 5x5 filter.
+     * 
+     * Without preserve, a single channel filter is run once on the sum of
+     * the channels instead of once per channel, which is the same by
+     * linearity.
+     * 
+     */
+    
+    small_args a = {im, filter, out, {0, 0, 0, 0}, preserve};
+    if (!preserve && filter.c == 1 && im.c > 1)
+    {
+        a.summed = scratch_image(im.w, im.h, 1);
+        parallel_for(im.h, row_grain(im.w * im.c), sum_channels_band, &a);
+    }
+    int work = im.w * filter.w * filter.h * (a.summed.data ? 1 : im.c);
+    parallel_for(im.h, row_grain(work), small_band, &a);
+    if (a.summed.data) release_scratch_image(a.summed);
 }
 
 image convolve_image(image im, image filter, int preserve)
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Convolves an image with a filter.
+     * 
+     * The filter is centered on every pixel, multiplied element-wise with
+     * the neighbourhood under it and summed. Pixels outside the image take
+     * the value of the closest border pixel. A filter either has a single
+     * channel, which is applied to every channel of the image, or as many
+     * channels as the image. If `preserve` is set the result has the same
+     * number of channels as the image, otherwise the channels are summed.
+     * 
+     * 3x3 and 5x5 filters have unrolled, vectorized kernels of their own.
+     * Box filters are run with running sums, at a cost per pixel that does
+     * not depend on their size. Other single channel filters that are the
+     * outer product of two vectors, such as gaussian filters, are detected
+     * and run as two 1D passes, so their cost per pixel is O(w + h) rather
+     * than O(w * h).
+     * Other filters of 12 x 12 taps or more go through the FFT instead.
+     * 
+     * @param im the image to convolve
+     * @param filter the filter to convolve with
+     * @param preserve whether to keep the channels of im separate
+     * 
+     * @returns convolved image with im.c channels if preserve, 1 otherwise
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    image out = make_image_uninit(im.w, im.h, preserve ? im.c : 1);
+    convolve_image_into(out, im, filter, preserve);
+    return out;
+}
+
+void convolve_image_into(image out, image im, image filter, int preserve)
+{
+    /**
+     * Same as convolve_image, writing into a caller's image.
+     * 
+     * Together with the per-thread scratch buffers used for intermediates,
+     * repeated calls with same sized images do not allocate.
+     * 
+     * @param[out] out im.w x im.h image with im.c channels if preserve, 1
+     * otherwise; it must not overlap im
+     * @param im the image to convolve
+     * @param filter the filter to convolve with
+     * @param preserve whether to keep the channels of im separate
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    assert(filter.c == 1 || filter.c == im.c);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve ? im.c : 1));
+    
+    if (filter.w == filter.h && (filter.w == 3 || filter.w == 5))
+    {
+        convolve_small(out, view_image(im), filter, preserve);
+        return;
+    }
+    
+    if (preserve && is_box_filter(filter))
+    {
+        box_blur_into(out, im, filter.w);
+        return;
+    }
+    
+    if (filter.c == 1 && filter.w > 1 && filter.h > 1)
+    {
+        image kx = scratch_image(filter.w, 1, 1);
+        image ky = scratch_image(filter.h, 1, 1);
+        int separable = factor_separable(filter, kx.data, ky.data);
+        if (separable) convolve_separable(out, im, kx.data, filter.w, ky.data, filter.h, preserve);
+        release_scratch_image(ky);
+        release_scratch_image(kx);
+        if (separable) return;
+    }
+    
+    if (filter.w * filter.h >= FFT_MIN_TAPS)
+    {
+        convolve_image_fft_into(out, im, filter, preserve);
+        return;
+    }
+    
+    memset(out.data, 0, out.w * out.h * out.c * sizeof(float));
+    convolve_args a = {im, filter, out, preserve};
+    parallel_for(im.h, row_grain(im.w * filter.w * filter.h), convolve_band, &a);
+}
+
+image convolve_view(image_view v, image filter, int preserve)
+{
+    image out = make_image_uninit(v.w, v.h, preserve ? v.c : 1);
+    convolve_view_into(out, v, filter, preserve);
+    return out;
+}
+
+void convolve_view_into(image out, image_view v, image filter, int preserve)
+{
+    /**
+     * Same as convolve_image_into, reading the pixels of a view.
+     * 
+     * Borders are clamped to the view's own edges, so the result is that of
+     * convolve_image on a copy of the view. 3x3 and 5x5 filters read the
+     * view in place; other filters run on a per-thread scratch copy of it,
+     * unless the view covers whole planes of its buffer.
+     * 
+     * @param[out] out v.w x v.h image with v.c channels if preserve, 1
+     * otherwise; it must not overlap v
+     * @param v the view to convolve
+     * @param filter the filter to convolve with
+     * @param preserve whether to keep the channels of v separate
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    assert(filter.c == 1 || filter.c == v.c);
+    assert(out.w == v.w && out.h == v.h && out.c == (preserve ? v.c : 1));
+    
+    if (view_is_image(v))
+    {
+        convolve_image_into(out, view_as_image(v), filter, preserve);
+        return;
+    }
+    
+    if (filter.w == filter.h && (filter.w == 3 || filter.w == 5))
+    {
+        convolve_small(out, v, filter, preserve);
+        return;
+    }
+    
+    image copy = scratch_image(v.w, v.h, v.c);
+    copy_view_into(copy, v);
+    convolve_image_into(out, copy, filter, preserve);
+    release_scratch_image(copy);
 }
 
 image make_highpass_filter()
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Makes the 3x3 highpass filter, which keeps edges and removes flat
+     * areas.
+     * 
+     * @returns 3 x 3 x 1 filter
+     * 
+     */
+    
+    static const float highpass[9] = { 0, -1,  0,
+                                      -1,  4, -1,
+                                       0, -1,  0};
+    image filter = make_image(3, 3, 1);
+    memcpy(filter.data, highpass, sizeof(highpass));
+    return filter;
 }
 
 image make_sharpen_filter()
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Makes the 3x3 sharpen filter, the identity plus the highpass filter.
+     * 
+     * @returns 3 x 3 x 1 filter
+     * 
+     */
+    
+    static const float sharpen[9] = { 0, -1,  0,
+                                     -1,  5, -1,
+                                      0, -1,  0};
+    image filter = make_image(3, 3, 1);
+    memcpy(filter.data, sharpen, sizeof(sharpen));
+    return filter;
 }
 
 image make_emboss_filter()
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Makes the 3x3 emboss filter, a diagonal gradient on top of the image.
+     * 
+     * @returns 3 x 3 x 1 filter
+     * 
+     */
+    
+    static const float emboss[9] = {-2, -1,  0,
+                                    -1,  1,  1,
+                                     0,  1,  2};
+    image filter = make_image(3, 3, 1);
+    memcpy(filter.data, emboss, sizeof(emboss));
+    return filter;
 }
 
 // Question 2.2.1: Which of these filters should we use preserve when we run our convolution and which ones should we not? Why?
-// Answer: TODO
+// Answer: Sharpen and emboss should preserve, since their output is still a
+// color image: sharpen adds detail to the image and emboss adds a gradient
+// to it. Highpass should not; it only finds edges, and summing the channels
+// gives one map of where the edges are in any channel.
 
 // Question 2.2.2: Do we have to do any post-processing for the above filters? Which ones and why?
-// Answer: TODO
+// Answer: All three can go below 0 or above 1, highpass and sharpen around
+// every edge and emboss along all diagonal gradients, so their results
+// have to be clamped (or normalized) before they can be saved or shown.
+
+static int gaussian_filter_width(float sigma)
+{
+    // The filter covers three standard deviations each way, rounded up to odd
+    int w = ceilf(sigma * 6);
+    return w % 2 ? w : w + 1;
+}
 
 image make_gaussian_filter(float sigma)
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Makes a normalized 2D gaussian filter with the given standard deviation.
+     * 
+     * The filter is 6 sigma wide (the next odd integer), which holds nearly
+     * all of the gaussian's mass, and its elements are
+     * G(x, y) = 1 / (2 pi sigma^2) * exp(-(x^2 + y^2) / (2 sigma^2))
+     * measured from the center, then normalized to sum to one.
+     * 
+     * @param sigma standard deviation of the gaussian
+     * 
+     * @returns w x w x 1 gaussian filter
+     * 
+     */
+    
+    int w = gaussian_filter_width(sigma);
+    image filter = make_image(w, w, 1);
+    
+    for (int y = 0; y < w; y ++)
+    {
+        for (int x = 0; x < w; x ++)
+        {
+            float dx = x - w / 2;
+            float dy = y - w / 2;
+            filter.data[x + y * w] = 1 / (TWOPI * sigma * sigma) * expf(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
+    }
+    l1_normalize(filter);
+    return filter;
+}
+
+image make_gaussian_filter_1d(float sigma)
+{
+    /**
+     * Makes a normalized 1D gaussian filter with the given standard deviation.
+     * 
+     * This is the same width as `make_gaussian_filter(sigma)`, and the outer
+     * product of this filter with itself is that 2D filter.
+     * 
+     * @param sigma standard deviation of the gaussian
+     * 
+     * @returns w x 1 x 1 gaussian filter
+     * 
+     */
+    
+    int w = gaussian_filter_width(sigma);
+    image filter = make_image(w, 1, 1);
+    
+    for (int x = 0; x < w; x ++)
+    {
+        float dx = x - w / 2;
+        filter.data[x] = expf(-(dx * dx) / (2 * sigma * sigma));
+    }
+    l1_normalize(filter);
+    return filter;
 }
 
 image add_image(image a, image b)
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Adds two images of the same size pixel by pixel.
+     * 
+     * @param a, b the images to add
+     * 
+     * @returns a + b
+     * 
+     */
+    
+    image out = make_image_uninit(a.w, a.h, a.c);
+    add_image_into(out, a, b);
+    return out;
+}
+
+void add_image_into(image out, image a, image b)
+{
+    /**
+     * Same as add_image, writing into a caller's image.
+     * 
+     * @param[out] out image the size of a; it may be a or b itself
+     * 
+     */
+    
+    assert(a.w == b.w && a.h == b.h && a.c == b.c);
+    assert(out.w == a.w && out.h == a.h && out.c == a.c);
+    int n = a.w * a.h * a.c;
+    for (int i = 0; i < n; i ++) out.data[i] = a.data[i] + b.data[i];
+}
+
+void add_image_inplace(image a, image b)
+{
+    /**
+     * Adds b to a pixel by pixel, a += b.
+     * 
+     */
+    
+    add_image_into(a, a, b);
 }
 
 image sub_image(image a, image b)
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Subtracts two images of the same size pixel by pixel.
+     * 
+     * @param a, b the images to subtract
+     * 
+     * @returns a - b
+     * 
+     */
+    
+    image out = make_image_uninit(a.w, a.h, a.c);
+    sub_image_into(out, a, b);
+    return out;
+}
+
+void sub_image_into(image out, image a, image b)
+{
+    /**
+     * Same as sub_image, writing into a caller's image.
+     * 
+     * @param[out] out image the size of a; it may be a or b itself
+     * 
+     */
+    
+    assert(a.w == b.w && a.h == b.h && a.c == b.c);
+    assert(out.w == a.w && out.h == a.h && out.c == a.c);
+    int n = a.w * a.h * a.c;
+    for (int i = 0; i < n; i ++) out.data[i] = a.data[i] - b.data[i];
+}
+
+void sub_image_inplace(image a, image b)
+{
+    /**
+     * Subtracts b from a pixel by pixel, a -= b.
+     * 
+     */
+    
+    sub_image_into(a, a, b);
 }
 
 image make_gx_filter()
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Makes the 3x3 sobel filter for the horizontal gradient.
+     * 
+     * @returns 3 x 3 x 1 filter
+     * 
+     */
+    
+    static const float gx[9] = {-1, 0, 1,
+                                -2, 0, 2,
+                                -1, 0, 1};
+    image filter = make_image(3, 3, 1);
+    memcpy(filter.data, gx, sizeof(gx));
+    return filter;
 }
 
 image make_gy_filter()
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Makes the 3x3 sobel filter for the vertical gradient.
+     * 
+     * @returns 3 x 3 x 1 filter
+     * 
+     */
+    
+    static const float gy[9] = {-1, -2, -1,
+                                 0,  0,  0,
+                                 1,  2,  1};
+    image filter = make_image(3, 3, 1);
+    memcpy(filter.data, gy, sizeof(gy));
+    return filter;
+}
+
+void threshold_image(image im, float thresh)
+{
+    /**
+     * Binarizes an image, for example an edge magnitude map.
+     * 
+     * Pixels above the threshold become 1 and all others 0, in every
+     * channel.
+     * 
+     * @param[out] im the image to threshold
+     * @param thresh the threshold
+     * 
+     */
+    
+    int n = im.w * im.h * im.c;
+    for (int i = 0; i < n; i ++) im.data[i] = im.data[i] > thresh ? 1 : 0;
 }
 
 void feature_normalize(image im)
 {
-    // TODO
+    /**
+     * Rescales an image linearly so that its values span [0, 1].
+     * 
+     * If every value is the same there is no range to stretch, and the
+     * image is set to zero instead.
+     * 
+     * @param[out] im the image to normalize
+     * 
+     */
+    
+    int n = im.w * im.h * im.c;
+    if (n == 0) return;
+    
+    float min = im.data[0], max = im.data[0];
+    for (int i = 0; i < n; i ++)
+    {
+        min = im.data[i] < min ? im.data[i] : min;
+        max = im.data[i] > max ? im.data[i] : max;
+    }
+    
+    float range = max - min;
+    for (int i = 0; i < n; i ++) im.data[i] = range > 0 ? (im.data[i] - min) / range : 0;
+}
+
+static inline float fast_atan2(float y, float x)
+{
+    /**
+     * atan2 from an odd minimax polynomial for atan on [0, 1], folded out
+     * to the full circle by octant; the error is below 1e-5 radians.
+     * 
+     */
+    
+    float ax = fabsf(x), ay = fabsf(y);
+    float hi = ax > ay ? ax : ay;
+    float lo = ax > ay ? ay : ax;
+    if (hi == 0) return 0;
+    
+    float t = lo / hi;
+    float t2 = t * t;
+    float r = ((-0.0464964749f * t2 + 0.15931422f) * t2 - 0.327622764f) * t2 * t + t;
+    
+    if (ay > ax) r = (float)M_PI_2 - r;
+    if (x < 0) r = (float)M_PI - r;
+    return y < 0 ? -r : r;
+}
+
+typedef struct{
+    const float *src;
+    int w, h;
+    int flags;
+    float *mag;
+    float *theta;
+} sobel_args;
+
+static void sobel_band(void *ctx, int y0, int y1)
+{
+    /**
+     * Fused 3x3 sobel over rows [y0, y1): both gradients are formed from
+     * the three neighbouring rows and turned into magnitude and direction
+     * in registers, so gx and gy never reach memory.
+     * 
+     */
+    
+    sobel_args *a = ctx;
+    int w = a->w;
+    int l1 = a->flags & SOBEL_L1;
+    int fast = a->flags & SOBEL_FAST_ATAN2;
+    
+    for (int y = y0; y < y1; y ++)
+    {
+        const float *up = a->src + clamp_index(y - 1, a->h) * w;
+        const float *mid = a->src + y * w;
+        const float *dn = a->src + clamp_index(y + 1, a->h) * w;
+        float *mag = a->mag + y * w;
+        float *theta = a->theta + y * w;
+        
+        for (int x = 0; x < w; x ++)
+        {
+            int xl = x > 0 ? x - 1 : 0;
+            int xr = x < w - 1 ? x + 1 : w - 1;
+            
+            float gx = (up[xr] - up[xl]) + 2 * (mid[xr] - mid[xl]) + (dn[xr] - dn[xl]);
+            float gy = (dn[xl] + 2 * dn[x] + dn[xr]) - (up[xl] + 2 * up[x] + up[xr]);
+            
+            mag[x] = l1 ? fabsf(gx) + fabsf(gy) : sqrtf(gx * gx + gy * gy);
+            theta[x] = fast ? fast_atan2(gy, gx) : atan2f(gy, gx);
+        }
+    }
+}
+
+void sobel_image_into(image mag, image theta, image im, int flags)
+{
+    /**
+     * Computes sobel gradient magnitude and direction into caller's images.
+     * 
+     * Convolution is linear, so the channels are summed first and a single
+     * plane goes through one fused pass, the same result as convolving each
+     * channel with make_gx_filter and make_gy_filter and summing.
+     * 
+     * @param[out] mag im.w x im.h x 1 gradient magnitude
+     * @param[out] theta im.w x im.h x 1 gradient direction in (-pi, pi]
+     * @param im the source image
+     * @param flags SOBEL_L1 for |gx| + |gy| instead of the euclidean
+     * magnitude, SOBEL_FAST_ATAN2 for a polynomial direction
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    assert(mag.w == im.w && mag.h == im.h && mag.c == 1);
+    assert(theta.w == im.w && theta.h == im.h && theta.c == 1);
+    
+    image sum = {0};
+    const float *src = im.data;
+    if (im.c > 1)
+    {
+        sum = scratch_image(im.w, im.h, 1);
+        sum_args s = {im, sum.data};
+        parallel_for(im.w * im.h, PIXEL_GRAIN, sum_channels, &s);
+        src = sum.data;
+    }
+    
+    sobel_args a = {src, im.w, im.h, flags, mag.data, theta.data};
+    parallel_for(im.h, row_grain(im.w * 9), sobel_band, &a);
+    
+    if (sum.data) release_scratch_image(sum);
+}
+
+image *sobel_image_flags(image im, int flags)
+{
+    /**
+     * Same as sobel_image, with the SOBEL_* options of sobel_image_into.
+     * 
+     */
+    
+    image *res = calloc(2, sizeof(image));
+    res[0] = make_image_uninit(im.w, im.h, 1);
+    res[1] = make_image_uninit(im.w, im.h, 1);
+    sobel_image_into(res[0], res[1], im, flags);
+    return res;
 }
 
 image *sobel_image(image im)
 {
-    // TODO
-    return calloc(2, sizeof(image));
+    /**
+     * Computes the gradient magnitude and direction of an image.
+     * 
+     * The image is convolved with the horizontal and vertical sobel filters,
+     * summing over channels, and at every pixel the gradient (gx, gy) gives
+     * magnitude sqrt(gx^2 + gy^2) and direction atan2(gy, gx).
+     * 
+     * @param im the source image
+     * 
+     * @returns array of two single channel images, magnitude then direction;
+     * the caller frees both images and the array
+     * 
+     */
+    
+    return sobel_image_flags(im, 0);
 }
 
 image colorize_sobel(image im)
 {
-    // TODO
-    return make_image(1,1,1);
+    /**
+     * Visualizes the gradients of an image as a color image.
+     * 
+     * The gradient direction becomes the hue and the gradient magnitude
+     * both the saturation and the value, each normalized to [0, 1], so
+     * strong edges are bright and edges of different orientation get
+     * different colors.
+     * 
+     * @param im the source image
+     * 
+     * @returns im.w x im.h x 3 RGB image
+     * 
+     */
+    
+    image out = make_image_uninit(im.w, im.h, 3);
+    colorize_sobel_into(out, im);
+    return out;
+}
+
+void colorize_sobel_into(image out, image im)
+{
+    /**
+     * Same as colorize_sobel, writing into a caller's image.
+     * 
+     * @param[out] out im.w x im.h x 3 image; it must not overlap im
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    assert(out.w == im.w && out.h == im.h && out.c == 3);
+    
+    // Hue, saturation and value planes of out hold theta, mag and mag
+    image theta = {im.w, im.h, 1, out.data};
+    image mag = {im.w, im.h, 1, out.data + im.w * im.h};
+    sobel_image_into(mag, theta, im, 0);
+    feature_normalize(mag);
+    feature_normalize(theta);
+    
+    memcpy(out.data + 2 * im.w * im.h, mag.data, im.w * im.h * sizeof(float));
+    hsv_to_rgb(out);
 }
@@ -0,0 +1,593 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include "image.h"
+#include "batch.h"
+
+// Frame pipelines for live video.
+//
+// Each stage runs on a thread of its own and reads its input from a ring
+// of `depth` preallocated frames, which the stage before it (or
+// push_frame, for the first stage) fills; the last stage fills the output
+// ring that latest_frame reads. A ring slot goes free -> filling -> ready
+// -> busy (being read) -> free, so a producer and a consumer never touch
+// the same frame and nothing is allocated once frames are flowing.
+//
+// Nothing ever waits for a slower consumer: when a producer finds no free
+// slot it takes the oldest ready frame instead, dropping it. Every ring
+// then holds at most depth frames, so the time from push_frame to output
+// is bounded by the stage times (and depth) instead of growing without
+// limit when frames come in faster than the slowest stage can take them.
+//
+// One lock guards every ring; it is only held to move slots between
+// states, never while a stage runs or a frame is copied.
+//
+// latest_frame calls take a second lock for their whole length, so the
+// output ring only ever has one reader, and it gets one slot more than
+// depth: the newest output stays ready while a reader copies an older one
+// and the last stage fills the next.
+
+typedef enum{
+    SLOT_FREE,
+    SLOT_FILLING,
+    SLOT_READY,
+    SLOT_BUSY
+} slot_state;
+
+typedef struct{
+    image im;
+    slot_state state;
+    long long frame;
+    double pushed;      // when the frame was pushed
+    double ready;       // when it became ready in this ring
+} frame_slot;
+
+typedef struct{
+    frame_slot *slots;
+    int depth;
+} frame_ring;
+
+typedef struct{
+    frame_stage_fn fn;
+    void *ctx;
+    void (*free_ctx)(void *ctx);
+    frame_ring out;
+    pthread_t thread;
+    pthread_cond_t input_ready;
+
+    long long frames, dropped;
+    double busy, max_busy, wait;
+} frame_stage;
+
+struct frame_pipeline{
+    int depth;
+    frame_ring input;
+    frame_stage *stages;
+    int n_stages, cap;
+    int started, stopping;
+    long long next_frame, latest_read, latest_output;
+
+    long long outputs;
+    double latency, max_latency;
+
+    pthread_mutex_t lock;
+    pthread_cond_t progress;    // a frame left a ring or was dropped
+    pthread_mutex_t read_lock;  // held by latest_frame
+};
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void make_ring(frame_ring *r, int depth, int w, int h, int c)
+{
+    // Room for one more slot, in case this ring ends up as the output
+    r->depth = depth;
+    r->slots = calloc(depth + 1, sizeof(frame_slot));
+    for (int i = 0; i < depth; i ++) r->slots[i].im = make_image_uninit(w, h, c);
+}
+
+static void grow_ring(frame_ring *r)
+{
+    image im = r->slots[0].im;
+    r->slots[r->depth ++].im = make_image_uninit(im.w, im.h, im.c);
+}
+
+static void free_ring(frame_ring *r)
+{
+    for (int i = 0; i < r->depth; i ++) free_image(r->slots[i].im);
+    free(r->slots);
+}
+
+static frame_ring *ring_into(frame_pipeline *p, int stage)
+{
+    // The ring stage reads from
+    return stage == 0 ? &p->input : &p->stages[stage - 1].out;
+}
+
+static frame_slot *find_slot(frame_ring *r, slot_state state, int oldest)
+{
+    frame_slot *best = 0;
+    for (int i = 0; i < r->depth; i ++)
+    {
+        frame_slot *s = r->slots + i;
+        if (s->state != state) continue;
+        if (!best || (oldest ? s->frame < best->frame : s->frame > best->frame)) best = s;
+    }
+    return best;
+}
+
+static frame_slot *acquire_slot(frame_pipeline *p, frame_ring *r, frame_stage *consumer)
+{
+    /**
+     * Takes a slot to fill, dropping the oldest ready frame if none is free.
+     * 
+     * The caller holds the lock. One producer and one consumer per ring and
+     * a depth of at least 2 mean there is always a free or a ready slot.
+     * 
+     */
+
+    frame_slot *s = find_slot(r, SLOT_FREE, 1);
+    if (!s)
+    {
+        s = find_slot(r, SLOT_READY, 1);
+        assert(s);
+        if (consumer) consumer->dropped ++;
+        pthread_cond_broadcast(&p->progress);
+    }
+    s->state = SLOT_FILLING;
+    return s;
+}
+
+static void publish_slot(frame_pipeline *p, frame_slot *s, int stage)
+{
+    // Marks a filled slot ready for the given stage, or as output past the last one
+    s->state = SLOT_READY;
+    s->ready = now_seconds();
+    if (stage < p->n_stages)
+    {
+        pthread_cond_signal(&p->stages[stage].input_ready);
+        return;
+    }
+
+    double latency = s->ready - s->pushed;
+    p->latest_output = s->frame;
+    p->outputs ++;
+    p->latency += latency;
+    if (latency > p->max_latency) p->max_latency = latency;
+
+    // Older outputs nobody read are superseded, not dropped
+    frame_ring *r = ring_into(p, stage);
+    for (int i = 0; i < r->depth; i ++)
+    {
+        frame_slot *o = r->slots + i;
+        if (o != s && o->state == SLOT_READY) o->state = SLOT_FREE;
+    }
+    pthread_cond_broadcast(&p->progress);
+}
+
+typedef struct{
+    frame_pipeline *p;
+    int index;
+} stage_thread_args;
+
+static void *run_stage(void *ctx)
+{
+    stage_thread_args a = *(stage_thread_args *)ctx;
+    free(ctx);
+    frame_pipeline *p = a.p;
+    frame_stage *st = p->stages + a.index;
+    frame_ring *in = ring_into(p, a.index);
+
+    pthread_mutex_lock(&p->lock);
+    while (1)
+    {
+        frame_slot *src = 0;
+        while (!p->stopping && !(src = find_slot(in, SLOT_READY, 1))) pthread_cond_wait(&st->input_ready, &p->lock);
+        if (p->stopping) break;
+        src->state = SLOT_BUSY;
+        frame_slot *dst = acquire_slot(p, &st->out, a.index + 1 < p->n_stages ? st + 1 : 0);
+        pthread_mutex_unlock(&p->lock);
+
+        double start = now_seconds();
+        st->fn(dst->im, src->im, st->ctx);
+        double busy = now_seconds() - start;
+
+        pthread_mutex_lock(&p->lock);
+        st->frames ++;
+        st->busy += busy;
+        st->wait += start - src->ready;
+        if (busy > st->max_busy) st->max_busy = busy;
+        dst->frame = src->frame;
+        dst->pushed = src->pushed;
+        src->state = SLOT_FREE;
+        publish_slot(p, dst, a.index + 1);
+        pthread_cond_broadcast(&p->progress);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+frame_pipeline *make_frame_pipeline(int w, int h, int c, int depth)
+{
+    /**
+     * Makes an empty pipeline for frames of one size.
+     * 
+     * Add stages with add_frame_stage or add_frame_ops, then push frames;
+     * the stage threads start with the first push_frame.
+     * 
+     * @param w, h, c the size of the frames that will be pushed
+     * @param depth frames in each ring between two stages, at least 2;
+     * more smooths out uneven stage times at the cost of latency
+     * 
+     * @returns the pipeline; free it with free_frame_pipeline
+     * 
+     */
+
+    assert(depth >= 2);
+    frame_pipeline *p = calloc(1, sizeof(frame_pipeline));
+    p->depth = depth;
+    p->latest_read = -1;
+    p->latest_output = -1;
+    make_ring(&p->input, depth, w, h, c);
+    pthread_mutex_init(&p->lock, 0);
+    pthread_cond_init(&p->progress, 0);
+    pthread_mutex_init(&p->read_lock, 0);
+    return p;
+}
+
+static image output_shape(frame_pipeline *p)
+{
+    frame_ring *r = ring_into(p, p->n_stages);
+    return r->slots[0].im;
+}
+
+void frame_pipeline_output_size(frame_pipeline *p, int *w, int *h, int *c)
+{
+    // The size of the frames latest_frame returns
+    image im = output_shape(p);
+    *w = im.w;
+    *h = im.h;
+    *c = im.c;
+}
+
+static int add_stage(frame_pipeline *p, int w, int h, int c, frame_stage_fn fn, void *ctx, void (*free_ctx)(void *))
+{
+    assert(!p->started);
+    if (p->n_stages == p->cap)
+    {
+        p->cap = p->cap ? 2 * p->cap : 8;
+        p->stages = realloc(p->stages, p->cap * sizeof(frame_stage));
+    }
+    frame_stage *st = p->stages + p->n_stages;
+    memset(st, 0, sizeof(*st));
+    st->fn = fn;
+    st->ctx = ctx;
+    st->free_ctx = free_ctx;
+    make_ring(&st->out, p->depth, w, h, c);
+    pthread_cond_init(&st->input_ready, 0);
+    return p->n_stages ++;
+}
+
+int add_frame_stage(frame_pipeline *p, int w, int h, int c, frame_stage_fn fn, void *ctx)
+{
+    /**
+     * Appends a stage that calls fn(out, in, ctx) on every frame.
+     * 
+     * in is the previous stage's output (or the pushed frame) and out a
+     * preallocated w x h x c frame, which fn fills, typically with one of
+     * the _into functions. fn runs on the stage's own thread, one frame
+     * at a time, and must not keep either image.
+     * 
+     * @param w, h, c the size of the stage's output
+     * @param ctx passed to fn; it stays the caller's
+     * 
+     * @returns the index of the stage
+     * 
+     */
+
+    return add_stage(p, w, h, c, fn, ctx, 0);
+}
+
+typedef struct{
+    batch_op op;
+    resize_plan *plan;
+    image theta;
+} op_stage;
+
+static void run_op(image out, image in, void *ctx)
+{
+    op_stage *s = ctx;
+    switch (s->op.kind)
+    {
+        case BATCH_GRAYSCALE:
+            rgb_to_grayscale_into(out, in);
+            break;
+        case BATCH_RESIZE:
+        case BATCH_NN_RESIZE:
+            resize_with_plan_into(out, in, s->plan);
+            break;
+        case BATCH_BLUR:
+            gaussian_blur_into(out, in, s->op.sigma);
+            break;
+        case BATCH_SOBEL:
+            sobel_image_into(out, s->theta, in, 0);
+            feature_normalize(out);
+            break;
+        case BATCH_COLORIZE_SOBEL:
+            colorize_sobel_into(out, in);
+            break;
+        case BATCH_CLAMP:
+            copy_image_into(out, in);
+            clamp_image(out);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+static void free_op_stage(void *ctx)
+{
+    op_stage *s = ctx;
+    free_resize_plan(s->plan);
+    free_image(s->theta);
+    free(s);
+}
+
+int add_frame_ops(frame_pipeline *p, const char *chain)
+{
+    /**
+     * Appends one stage per step of a `uwimg batch` chain.
+     * 
+     * Each step becomes the matching _into call, with any resize plan or
+     * scratch image it needs made here, once. grayscale is skipped on
+     * frames that do not have three channels, as in a batch.
+     * 
+     * @param chain e.g. "grayscale,resize:320x180,blur:2,sobel"
+     * 
+     * @returns the number of stages added, or -1 (with a message on
+     * stderr, and no stage added) if a step is not understood or has no
+     * _into form (area and lanczos)
+     * 
+     */
+
+    batch_op ops[32];
+    int n = parse_batch_ops(chain, ops, 32);
+    if (n < 0) return -1;
+    for (int i = 0; i < n; i ++)
+    {
+        if (ops[i].kind == BATCH_AREA_RESIZE || ops[i].kind == BATCH_LANCZOS_RESIZE)
+        {
+            fprintf(stderr, "Frame pipelines cannot run area or lanczos resizes\n");
+            return -1;
+        }
+    }
+
+    int added = 0;
+    for (int i = 0; i < n; i ++)
+    {
+        image in = output_shape(p);
+        int w = in.w, h = in.h, c = in.c;
+        if (ops[i].kind == BATCH_GRAYSCALE && c != 3) continue;
+
+        op_stage *s = calloc(1, sizeof(op_stage));
+        s->op = ops[i];
+        switch (ops[i].kind)
+        {
+            case BATCH_GRAYSCALE:
+            case BATCH_SOBEL:
+                c = 1;
+                break;
+            case BATCH_COLORIZE_SOBEL:
+                c = 3;
+                break;
+            case BATCH_RESIZE:
+            case BATCH_NN_RESIZE:
+                w = ops[i].w;
+                h = ops[i].h;
+                s->plan = make_resize_plan(in.w, in.h, w, h, ops[i].kind == BATCH_NN_RESIZE ? RESIZE_NN : RESIZE_BILINEAR);
+                break;
+            default:
+                break;
+        }
+        if (ops[i].kind == BATCH_SOBEL) s->theta = make_image_uninit(w, h, 1);
+        add_stage(p, w, h, c, run_op, s, free_op_stage);
+        added ++;
+    }
+    return added;
+}
+
+int frame_pipeline_stages(frame_pipeline *p)
+{
+    return p->n_stages;
+}
+
+static void start(frame_pipeline *p)
+{
+    p->started = 1;
+    grow_ring(ring_into(p, p->n_stages));
+    for (int i = 0; i < p->n_stages; i ++)
+    {
+        stage_thread_args *a = malloc(sizeof(stage_thread_args));
+        a->p = p;
+        a->index = i;
+        pthread_create(&p->stages[i].thread, 0, run_stage, a);
+    }
+}
+
+long long push_frame(frame_pipeline *p, image im)
+{
+    /**
+     * Hands a frame to the pipeline and returns without waiting for it.
+     * 
+     * The frame is copied into the input ring, so im can be reused at
+     * once. If the first stage has not kept up, the oldest frame still
+     * waiting for it is dropped to make room.
+     * 
+     * Frames must be pushed by one thread at a time; latest_frame may be
+     * called from any thread meanwhile.
+     * 
+     * @param im a frame of the size given to make_frame_pipeline
+     * 
+     * @returns the frame's number, counting from 0
+     * 
+     */
+
+    frame_slot *in = p->input.slots;
+    assert(im.w == in->im.w && im.h == in->im.h && im.c == in->im.c);
+
+    pthread_mutex_lock(&p->lock);
+    if (!p->started) start(p);
+    frame_slot *s = acquire_slot(p, &p->input, p->n_stages ? p->stages : 0);
+    long long frame = p->next_frame ++;
+    pthread_mutex_unlock(&p->lock);
+
+    double pushed = now_seconds();
+    copy_image_into(s->im, im);
+
+    pthread_mutex_lock(&p->lock);
+    s->frame = frame;
+    s->pushed = pushed;
+    publish_slot(p, s, 0);
+    pthread_mutex_unlock(&p->lock);
+    return frame;
+}
+
+long long latest_frame(frame_pipeline *p, image out)
+{
+    /**
+     * Copies the newest finished frame, without waiting for any.
+     * 
+     * Any thread may call this, but calls from several threads run one at
+     * a time, and each frame is only returned to one of them.
+     * 
+     * @param[out] out an image of frame_pipeline_output_size; it is left
+     * alone if there is no new frame
+     * 
+     * @returns the number of the frame copied, or -1 if no frame has
+     * come out since the last call
+     * 
+     */
+
+    frame_ring *r = ring_into(p, p->n_stages);
+    assert(out.w == r->slots[0].im.w && out.h == r->slots[0].im.h && out.c == r->slots[0].im.c);
+
+    pthread_mutex_lock(&p->read_lock);
+    pthread_mutex_lock(&p->lock);
+    frame_slot *s = find_slot(r, SLOT_READY, 0);
+    if (!s || s->frame <= p->latest_read)
+    {
+        pthread_mutex_unlock(&p->lock);
+        pthread_mutex_unlock(&p->read_lock);
+        return -1;
+    }
+    s->state = SLOT_BUSY;
+    long long frame = s->frame;
+    p->latest_read = frame;
+    pthread_mutex_unlock(&p->lock);
+
+    copy_image_into(out, s->im);
+
+    pthread_mutex_lock(&p->lock);
+    // Still the newest output, unless one came out while copying
+    s->state = frame == p->latest_output ? SLOT_READY : SLOT_FREE;
+    pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&p->read_lock);
+    return frame;
+}
+
+static int in_flight(frame_pipeline *p)
+{
+    for (int i = 0; i < p->n_stages; i ++)
+    {
+        frame_ring *r = ring_into(p, i);
+        for (int j = 0; j < r->depth; j ++) if (r->slots[j].state != SLOT_FREE) return 1;
+    }
+    return 0;
+}
+
+void flush_frame_pipeline(frame_pipeline *p)
+{
+    // Waits until every frame pushed so far has come out or been dropped
+    pthread_mutex_lock(&p->lock);
+    while (in_flight(p)) pthread_cond_wait(&p->progress, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int frame_pipeline_stats(frame_pipeline *p, int stage, frame_stats *s)
+{
+    /**
+     * Reports how a stage has been doing since the pipeline was made.
+     * 
+     * @param stage a stage index, or -1 for the whole pipeline: frames
+     * that came out, frames dropped at any stage, the time from
+     * push_frame to output in mean_ms and max_ms, and the stages' mean
+     * queueing times summed in wait_ms
+     * @param[out] s the counts and times
+     * 
+     * @returns 0 if there is no such stage
+     * 
+     */
+
+    if (stage < -1 || stage >= p->n_stages) return 0;
+    memset(s, 0, sizeof(*s));
+    pthread_mutex_lock(&p->lock);
+    if (stage == -1)
+    {
+        s->frames = p->outputs;
+        for (int i = 0; i < p->n_stages; i ++)
+        {
+            s->dropped += p->stages[i].dropped;
+            s->wait_ms += p->stages[i].frames ? p->stages[i].wait * 1000 / p->stages[i].frames : 0;
+        }
+        s->mean_ms = p->outputs ? p->latency * 1000 / p->outputs : 0;
+        s->max_ms = p->max_latency * 1000;
+    }
+    else
+    {
+        frame_stage *st = p->stages + stage;
+        s->frames = st->frames;
+        s->dropped = st->dropped;
+        s->mean_ms = st->frames ? st->busy * 1000 / st->frames : 0;
+        s->max_ms = st->max_busy * 1000;
+        s->wait_ms = st->frames ? st->wait * 1000 / st->frames : 0;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 1;
+}
+
+void free_frame_pipeline(frame_pipeline *p)
+{
+    /**
+     * Stops the stage threads and frees the pipeline. Frames still in the
+     * pipeline are dropped; call flush_frame_pipeline first to finish them.
+     * 
+     */
+
+    if (!p) return;
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    for (int i = 0; i < p->n_stages; i ++) pthread_cond_signal(&p->stages[i].input_ready);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < p->n_stages; i ++)
+    {
+        frame_stage *st = p->stages + i;
+        if (p->started) pthread_join(st->thread, 0);
+        if (st->free_ctx) st->free_ctx(st->ctx);
+        free_ring(&st->out);
+        pthread_cond_destroy(&st->input_ready);
+    }
+    free_ring(&p->input);
+    free(p->stages);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->progress);
+    pthread_mutex_destroy(&p->read_lock);
+    free(p);
+}
@@ -0,0 +1,588 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+
+#ifdef OPENCL
+
+// OpenCL backend.
+//
+// A gpu_image is a planar float buffer on the first GPU (or, failing that,
+// any OpenCL device) found, laid out exactly like image. Every call only
+// enqueues work on one in-order queue and returns: uploads, kernels and
+// downloads run in the order they were issued, so a chain of operations
+// stays on the device and the host only waits when it asks for a result,
+// with gpu_download or gpu_finish.
+//
+// The kernels follow the CPU ones: clamped borders for convolution and
+// sobel, the plan_axis pixel center mapping for the resizers and the
+// scalar color conversions of process_image.c.
+//
+// Without a device every gpu_image has mem 0, and every call given one
+// returns without doing anything, as in a build without OpenCL.
+
+#define CL_TARGET_OPENCL_VERSION 120
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+static const char *kernel_source =
+"int clamp_index(int i, int n) { return i < 0 ? 0 : (i >= n ? n - 1 : i); }\n"
+"\n"
+"__kernel void convolve(__global const float *im, __global float *out, __global const float *f,\n"
+"                       int w, int h, int c, int fw, int fh, int fc, int preserve)\n"
+"{\n"
+"    int x = get_global_id(0), y = get_global_id(1), z = get_global_id(2);\n"
+"    int z0 = preserve ? z : 0, z1 = preserve ? z + 1 : c;\n"
+"    float sum = 0;\n"
+"    for (int k = z0; k < z1; k ++)\n"
+"    {\n"
+"        __global const float *src = im + (size_t)k * w * h;\n"
+"        __global const float *taps = f + (fc == 1 ? 0 : (size_t)k * fw * fh);\n"
+"        for (int j = 0; j < fh; j ++)\n"
+"        {\n"
+"            __global const float *row = src + clamp_index(y + j - fh / 2, h) * w;\n"
+"            for (int i = 0; i < fw; i ++) sum += taps[j * fw + i] * row[clamp_index(x + i - fw / 2, w)];\n"
+"        }\n"
+"    }\n"
+"    out[((size_t)z * h + y) * w + x] = sum;\n"
+"}\n"
+"\n"
+"float source_coordinate(int i, int src, int dst)\n"
+"{\n"
+"    float ratio = (float)src / (float)dst;\n"
+"    return ratio * i + (-0.5f + 0.5f * ratio);\n"
+"}\n"
+"\n"
+"__kernel void nn_resize(__global const float *im, __global float *out, int w, int h, int ow, int oh)\n"
+"{\n"
+"    int x = get_global_id(0), y = get_global_id(1), z = get_global_id(2);\n"
+"    int sx = clamp_index((int)round(source_coordinate(x, w, ow)), w);\n"
+"    int sy = clamp_index((int)round(source_coordinate(y, h, oh)), h);\n"
+"    out[((size_t)z * oh + y) * ow + x] = im[((size_t)z * h + sy) * w + sx];\n"
+"}\n"
+"\n"
+"__kernel void bilinear_resize(__global const float *im, __global float *out, int w, int h, int ow, int oh)\n"
+"{\n"
+"    int x = get_global_id(0), y = get_global_id(1), z = get_global_id(2);\n"
+"    float sx = source_coordinate(x, w, ow), sy = source_coordinate(y, h, oh);\n"
+"    int left = (int)floor(sx), top = (int)floor(sy);\n"
+"    float dx = sx - left, dy = sy - top;\n"
+"    __global const float *src = im + (size_t)z * w * h;\n"
+"    __global const float *r0 = src + clamp_index(top, h) * w;\n"
+"    __global const float *r1 = src + clamp_index(top + 1, h) * w;\n"
+"    int x0 = clamp_index(left, w), x1 = clamp_index(left + 1, w);\n"
+"    float q1 = (1 - dy) * r0[x0] + dy * r1[x0];\n"
+"    float q2 = (1 - dy) * r0[x1] + dy * r1[x1];\n"
+"    out[((size_t)z * oh + y) * ow + x] = (1 - dx) * q1 + dx * q2;\n"
+"}\n"
+"\n"
+"__kernel void rgb_to_grayscale(__global const float *im, __global float *out, int n)\n"
+"{\n"
+"    int i = get_global_id(0);\n"
+"    out[i] = 0.299f * im[i] + 0.587f * im[n + i] + 0.114f * im[2 * n + i];\n"
+"}\n"
+"\n"
+"__kernel void rgb_to_hsv(__global float *im, int n)\n"
+"{\n"
+"    int i = get_global_id(0);\n"
+"    float r = im[i], g = im[n + i], b = im[2 * n + i];\n"
+"    float value = fmax(r, fmax(g, b));\n"
+"    float diff = value - fmin(r, fmin(g, b));\n"
+"    float saturation = value > 0 ? diff / value : 0;\n"
+"    float hue = 0;\n"
+"    if (diff != 0)\n"
+"    {\n"
+"        if (value == r) hue = (g - b) / diff;\n"
+"        else if (value == g) hue = (b - r) / diff + 2;\n"
+"        else hue = (r - g) / diff + 4;\n"
+"        hue = hue < 0 ? hue / 6 + 1 : hue / 6;\n"
+"    }\n"
+"    im[i] = hue;\n"
+"    im[n + i] = saturation;\n"
+"    im[2 * n + i] = value;\n"
+"}\n"
+"\n"
+"float sector(float h6, float chroma, float value, float k)\n"
+"{\n"
+"    k = h6 + k;\n"
+"    if (k >= 6) k -= 6;\n"
+"    return value - chroma * clamp(fmin(k, 4 - k), 0.0f, 1.0f);\n"
+"}\n"
+"\n"
+"__kernel void hsv_to_rgb(__global float *im, int n)\n"
+"{\n"
+"    int i = get_global_id(0);\n"
+"    float h6 = im[i] * 6, value = im[2 * n + i];\n"
+"    float chroma = value * im[n + i];\n"
+"    int valid = h6 >= 0 && h6 <= 6;\n"
+"    im[i] = valid ? sector(h6, chroma, value, 5) : value - chroma;\n"
+"    im[n + i] = valid ? sector(h6, chroma, value, 3) : value - chroma;\n"
+"    im[2 * n + i] = valid ? sector(h6, chroma, value, 1) : value - chroma;\n"
+"}\n"
+"\n"
+"float channel_sum(__global const float *im, int x, int y, int w, int h, int c)\n"
+"{\n"
+"    size_t i = (size_t)clamp_index(y, h) * w + clamp_index(x, w);\n"
+"    float sum = 0;\n"
+"    for (int z = 0; z < c; z ++) sum += im[(size_t)z * w * h + i];\n"
+"    return sum;\n"
+"}\n"
+"\n"
+"__kernel void sobel(__global const float *im, __global float *mag, __global float *theta,\n"
+"                    int w, int h, int c, int l1)\n"
+"{\n"
+"    int x = get_global_id(0), y = get_global_id(1);\n"
+"    float p[3][3];\n"
+"    for (int j = 0; j < 3; j ++)\n"
+"        for (int i = 0; i < 3; i ++) p[j][i] = channel_sum(im, x + i - 1, y + j - 1, w, h, c);\n"
+"    float gx = (p[0][2] - p[0][0]) + 2 * (p[1][2] - p[1][0]) + (p[2][2] - p[2][0]);\n"
+"    float gy = (p[2][0] + 2 * p[2][1] + p[2][2]) - (p[0][0] + 2 * p[0][1] + p[0][2]);\n"
+"    mag[y * w + x] = l1 ? fabs(gx) + fabs(gy) : sqrt(gx * gx + gy * gy);\n"
+"    theta[y * w + x] = atan2(gy, gx);\n"
+"}\n";
+
+typedef enum{
+    KERNEL_CONVOLVE,
+    KERNEL_NN_RESIZE,
+    KERNEL_BILINEAR_RESIZE,
+    KERNEL_GRAYSCALE,
+    KERNEL_RGB_TO_HSV,
+    KERNEL_HSV_TO_RGB,
+    KERNEL_SOBEL,
+    KERNEL_COUNT
+} kernel_id;
+
+static const char *kernel_names[KERNEL_COUNT] = {
+    "convolve", "nn_resize", "bilinear_resize", "rgb_to_grayscale", "rgb_to_hsv", "hsv_to_rgb", "sobel"
+};
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int available;
+static cl_context context;
+static cl_command_queue queue;
+static cl_program program;
+static cl_kernel kernels[KERNEL_COUNT];
+
+// Kernel arguments are state of the kernel object, so setting them and
+// enqueueing the kernel has to happen under one lock
+static pthread_mutex_t kernel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int check(cl_int err, const char *what)
+{
+    if (err == CL_SUCCESS) return 1;
+    fprintf(stderr, "uwimg: OpenCL %s failed with error %d\n", what, err);
+    return 0;
+}
+
+static cl_device_id pick_device()
+{
+    // The first GPU of any platform, or else the first device of any kind
+    cl_platform_id platforms[8];
+    cl_uint count = 0;
+    if (clGetPlatformIDs(8, platforms, &count) != CL_SUCCESS) return 0;
+    if (count > 8) count = 8;
+    cl_device_id device = 0;
+    for (cl_uint i = 0; i < count && !device; i ++)
+    {
+        clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, 0);
+    }
+    for (cl_uint i = 0; i < count && !device; i ++)
+    {
+        clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 1, &device, 0);
+    }
+    return device;
+}
+
+static void init_gpu()
+{
+    cl_device_id device = pick_device();
+    if (!device) return;
+
+    cl_int err;
+    context = clCreateContext(0, 1, &device, 0, 0, &err);
+    if (!check(err, "context creation")) return;
+    queue = clCreateCommandQueue(context, device, 0, &err);
+    if (!check(err, "queue creation")) return;
+    program = clCreateProgramWithSource(context, 1, &kernel_source, 0, &err);
+    if (!check(err, "program creation")) return;
+    err = clBuildProgram(program, 1, &device, "-cl-fast-relaxed-math", 0, 0);
+    if (err != CL_SUCCESS)
+    {
+        char log[4096] = "";
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(log) - 1, log, 0);
+        fprintf(stderr, "uwimg: OpenCL kernel build failed:\n%s\n", log);
+        return;
+    }
+    for (int i = 0; i < KERNEL_COUNT; i ++)
+    {
+        kernels[i] = clCreateKernel(program, kernel_names[i], &err);
+        if (!check(err, kernel_names[i])) return;
+    }
+    available = 1;
+}
+
+int gpu_available()
+{
+    /**
+     * Whether there is an OpenCL device to run on. The device is set up
+     * the first time this, or any other gpu_ function, is called.
+     * 
+     * @returns 1 if the gpu_ functions run on a device, 0 if they do nothing
+     * 
+     */
+
+    pthread_once(&init_once, init_gpu);
+    return available;
+}
+
+gpu_image make_gpu_image(int w, int h, int c)
+{
+    /**
+     * Allocates an image on the device, with undefined pixels.
+     * 
+     * @returns the image, whose mem is 0 if there is no device; free it
+     * with free_gpu_image
+     * 
+     */
+
+    gpu_image im = {w, h, c, 0};
+    if (!gpu_available()) return im;
+    cl_int err;
+    im.mem = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)w * h * c * sizeof(float), 0, &err);
+    if (!check(err, "allocation")) im.mem = 0;
+    return im;
+}
+
+void free_gpu_image(gpu_image im)
+{
+    // Pending work on the image still runs; the buffer goes once it is done
+    if (im.mem) clReleaseMemObject(im.mem);
+}
+
+void gpu_upload_into(gpu_image dst, image im)
+{
+    /**
+     * Queues a copy of an image to the device and returns at once.
+     * 
+     * @param[out] dst a device image the size of im
+     * @param im the image to copy, which must stay alive and unchanged
+     * until gpu_finish (or a blocking download) returns
+     * 
+     */
+
+    assert(dst.w == im.w && dst.h == im.h && dst.c == im.c);
+    if (!dst.mem) return;
+    size_t size = (size_t)im.w * im.h * im.c * sizeof(float);
+    check(clEnqueueWriteBuffer(queue, dst.mem, CL_FALSE, 0, size, im.data, 0, 0, 0), "upload");
+}
+
+gpu_image gpu_upload(image im)
+{
+    // Same as gpu_upload_into, allocating the device image
+    gpu_image dst = make_gpu_image(im.w, im.h, im.c);
+    if (dst.mem) gpu_upload_into(dst, im);
+    return dst;
+}
+
+void gpu_download_into(image out, gpu_image im)
+{
+    /**
+     * Queues a copy of a device image back to the host and returns at once.
+     * 
+     * @param[out] out an image the size of im, filled in once gpu_finish
+     * returns
+     * @param im the device image
+     * 
+     */
+
+    assert(out.w == im.w && out.h == im.h && out.c == im.c);
+    if (!im.mem) return;
+    size_t size = (size_t)im.w * im.h * im.c * sizeof(float);
+    check(clEnqueueReadBuffer(queue, im.mem, CL_FALSE, 0, size, out.data, 0, 0, 0), "download");
+}
+
+image gpu_download(gpu_image im)
+{
+    /**
+     * Copies a device image back to the host, waiting for it and for all
+     * the work queued before it.
+     * 
+     * @returns a new image, or an empty one if im has no device memory
+     * 
+     */
+
+    if (!im.mem)
+    {
+        image out = {0};
+        return out;
+    }
+    image out = make_image_uninit(im.w, im.h, im.c);
+    gpu_download_into(out, im);
+    gpu_finish();
+    return out;
+}
+
+void gpu_finish()
+{
+    // Waits until everything queued so far has run
+    if (gpu_available()) clFinish(queue);
+}
+
+static void run_kernel(kernel_id id, int dims, const size_t *global, int nargs, const size_t *sizes, const void **args)
+{
+    cl_kernel k = kernels[id];
+    pthread_mutex_lock(&kernel_lock);
+    for (int i = 0; i < nargs; i ++) clSetKernelArg(k, i, sizes[i], args[i]);
+    check(clEnqueueNDRangeKernel(queue, k, dims, 0, global, 0, 0, 0, 0), kernel_names[id]);
+    pthread_mutex_unlock(&kernel_lock);
+}
+
+#define MEM sizeof(cl_mem)
+#define INT sizeof(int)
+
+gpu_image gpu_convolve_image(gpu_image im, image filter, int preserve)
+{
+    // Same as convolve_image, on the device
+    gpu_image out = make_gpu_image(im.w, im.h, preserve ? im.c : 1);
+    if (out.mem) gpu_convolve_image_into(out, im, filter, preserve);
+    return out;
+}
+
+void gpu_convolve_image_into(gpu_image out, gpu_image im, image filter, int preserve)
+{
+    /**
+     * Same as convolve_image_into, on the device.
+     * 
+     * Every filter runs as a direct convolution, one work item per output
+     * pixel. The filter is copied to the device on every call.
+     * 
+     * @param[out] out im.w x im.h with im.c channels if preserve, 1
+     * otherwise; it must not be im
+     * 
+     */
+
+    assert(filter.c == 1 || filter.c == im.c);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve ? im.c : 1));
+    if (!out.mem || !im.mem) return;
+    assert(out.mem != im.mem);
+
+    cl_int err;
+    size_t taps = (size_t)filter.w * filter.h * filter.c * sizeof(float);
+    cl_mem f = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, taps, filter.data, &err);
+    if (!check(err, "filter upload")) return;
+
+    size_t global[3] = {im.w, im.h, out.c};
+    size_t sizes[] = {MEM, MEM, MEM, INT, INT, INT, INT, INT, INT, INT};
+    const void *args[] = {&im.mem, &out.mem, &f, &im.w, &im.h, &im.c, &filter.w, &filter.h, &filter.c, &preserve};
+    run_kernel(KERNEL_CONVOLVE, 3, global, 10, sizes, args);
+    clReleaseMemObject(f);
+}
+
+static void resize_into(kernel_id id, gpu_image dst, gpu_image im)
+{
+    assert(dst.c == im.c);
+    if (!dst.mem || !im.mem) return;
+    assert(dst.mem != im.mem);
+    size_t global[3] = {dst.w, dst.h, dst.c};
+    size_t sizes[] = {MEM, MEM, INT, INT, INT, INT};
+    const void *args[] = {&im.mem, &dst.mem, &im.w, &im.h, &dst.w, &dst.h};
+    run_kernel(id, 3, global, 6, sizes, args);
+}
+
+gpu_image gpu_nn_resize(gpu_image im, int w, int h)
+{
+    gpu_image out = make_gpu_image(w, h, im.c);
+    if (out.mem) gpu_nn_resize_into(out, im);
+    return out;
+}
+
+void gpu_nn_resize_into(gpu_image dst, gpu_image im)
+{
+    // Same as nn_resize_into, on the device
+    resize_into(KERNEL_NN_RESIZE, dst, im);
+}
+
+gpu_image gpu_bilinear_resize(gpu_image im, int w, int h)
+{
+    gpu_image out = make_gpu_image(w, h, im.c);
+    if (out.mem) gpu_bilinear_resize_into(out, im);
+    return out;
+}
+
+void gpu_bilinear_resize_into(gpu_image dst, gpu_image im)
+{
+    // Same as bilinear_resize_into, on the device
+    resize_into(KERNEL_BILINEAR_RESIZE, dst, im);
+}
+
+gpu_image gpu_rgb_to_grayscale(gpu_image im)
+{
+    gpu_image out = make_gpu_image(im.w, im.h, 1);
+    if (out.mem) gpu_rgb_to_grayscale_into(out, im);
+    return out;
+}
+
+void gpu_rgb_to_grayscale_into(gpu_image out, gpu_image im)
+{
+    // Same as rgb_to_grayscale_into, on the device
+    assert(im.c == 3);
+    assert(out.w == im.w && out.h == im.h && out.c == 1);
+    if (!out.mem || !im.mem) return;
+    int n = im.w * im.h;
+    size_t global[1] = {n};
+    size_t sizes[] = {MEM, MEM, INT};
+    const void *args[] = {&im.mem, &out.mem, &n};
+    run_kernel(KERNEL_GRAYSCALE, 1, global, 3, sizes, args);
+}
+
+static void color_in_place(kernel_id id, gpu_image im)
+{
+    assert(im.c == 3);
+    if (!im.mem) return;
+    int n = im.w * im.h;
+    size_t global[1] = {n};
+    size_t sizes[] = {MEM, INT};
+    const void *args[] = {&im.mem, &n};
+    run_kernel(id, 1, global, 2, sizes, args);
+}
+
+void gpu_rgb_to_hsv(gpu_image im)
+{
+    // Same as rgb_to_hsv, in place on the device
+    color_in_place(KERNEL_RGB_TO_HSV, im);
+}
+
+void gpu_hsv_to_rgb(gpu_image im)
+{
+    // Same as hsv_to_rgb, in place on the device
+    color_in_place(KERNEL_HSV_TO_RGB, im);
+}
+
+void gpu_sobel_image_into(gpu_image mag, gpu_image theta, gpu_image im, int flags)
+{
+    /**
+     * Same as sobel_image_into, on the device.
+     * 
+     * SOBEL_L1 is honoured; the direction always comes from the device's
+     * atan2, so SOBEL_FAST_ATAN2 makes no difference.
+     * 
+     */
+
+    assert(mag.w == im.w && mag.h == im.h && mag.c == 1);
+    assert(theta.w == im.w && theta.h == im.h && theta.c == 1);
+    if (!mag.mem || !theta.mem || !im.mem) return;
+    int l1 = (flags & SOBEL_L1) != 0;
+    size_t global[2] = {im.w, im.h};
+    size_t sizes[] = {MEM, MEM, MEM, INT, INT, INT, INT};
+    const void *args[] = {&im.mem, &mag.mem, &theta.mem, &im.w, &im.h, &im.c, &l1};
+    run_kernel(KERNEL_SOBEL, 2, global, 7, sizes, args);
+}
+
+#else
+
+// Built without OpenCL: there is never a device, device images have no
+// memory and every operation on them does nothing.
+
+static void print_missing()
+{
+    fprintf(stderr, "uwimg was built without OpenCL, rebuild with make OPENCL=1\n");
+}
+
+static void report_missing()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, print_missing);
+}
+
+int gpu_available()
+{
+    return 0;
+}
+
+gpu_image make_gpu_image(int w, int h, int c)
+{
+    report_missing();
+    gpu_image im = {w, h, c, 0};
+    return im;
+}
+
+void free_gpu_image(gpu_image im)
+{
+}
+
+gpu_image gpu_upload(image im)
+{
+    return make_gpu_image(im.w, im.h, im.c);
+}
+
+void gpu_upload_into(gpu_image dst, image im)
+{
+}
+
+image gpu_download(gpu_image im)
+{
+    image out = {0};
+    return out;
+}
+
+void gpu_download_into(image out, gpu_image im)
+{
+}
+
+void gpu_finish()
+{
+}
+
+gpu_image gpu_convolve_image(gpu_image im, image filter, int preserve)
+{
+    return make_gpu_image(im.w, im.h, preserve ? im.c : 1);
+}
+
+void gpu_convolve_image_into(gpu_image out, gpu_image im, image filter, int preserve)
+{
+}
+
+gpu_image gpu_nn_resize(gpu_image im, int w, int h)
+{
+    return make_gpu_image(w, h, im.c);
+}
+
+void gpu_nn_resize_into(gpu_image dst, gpu_image im)
+{
+}
+
+gpu_image gpu_bilinear_resize(gpu_image im, int w, int h)
+{
+    return make_gpu_image(w, h, im.c);
+}
+
+void gpu_bilinear_resize_into(gpu_image dst, gpu_image im)
+{
+}
+
+gpu_image gpu_rgb_to_grayscale(gpu_image im)
+{
+    return make_gpu_image(im.w, im.h, 1);
+}
+
+void gpu_rgb_to_grayscale_into(gpu_image out, gpu_image im)
+{
+}
+
+void gpu_rgb_to_hsv(gpu_image im)
+{
+}
+
+void gpu_hsv_to_rgb(gpu_image im)
+{
+}
+
+void gpu_sobel_image_into(gpu_image mag, gpu_image theta, gpu_image im, int flags)
+{
+}
+
+#endif
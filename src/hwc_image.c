@@ -0,0 +1,447 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "pixel_access.h"
+#include "color_simd.h"
+#include "parallel.h"
+#include "image_pool.h"
+#include "instrument.h"
+
+// Interleaved (HWC) images.
+//
+// An hwc_image keeps the channels of each pixel next to each other, the
+// way files, cameras and most other libraries lay them out, so a pipeline
+// that starts and ends with interleaved data can skip both transposes.
+// The kernels here read and write one stream per image instead of one per
+// channel:
+//
+// - the color conversions walk the pixels in tiles of TILE, splitting each
+//   tile into three rows that stay in cache and running the same color
+//   kernels as the planar functions on them;
+// - resizing runs a resize_plan with all channels of a pixel at once;
+// - convolution pads each source row once and runs every tap along the
+//   whole interleaved row, channels included.
+//
+// Each one gives the same result as its planar counterpart.
+//
+// The pixels live in a w*c x h x 1 image, so they get the same alignment
+// and memory accounting as any other image.
+
+#define TILE 1024
+
+static inline float *hwc_row(hwc_image im, int y)
+{
+    return im.data + (size_t)y * im.w * im.c;
+}
+
+hwc_image make_hwc_image(int w, int h, int c)
+{
+    /**
+     * Makes an interleaved image with unspecified contents.
+     * 
+     * @param w, h, c the size of the image
+     * 
+     * @returns the image; pixel (x, y) channel k is data[(y*w + x)*c + k];
+     * free it with free_hwc_image
+     * 
+     */
+
+    hwc_image im = {w, h, c, make_image_uninit(w * c, h, 1).data};
+    return im;
+}
+
+void free_hwc_image(hwc_image im)
+{
+    image store = {im.w * im.c, im.h, 1, im.data};
+    free_image(store);
+}
+
+typedef struct{
+    image planar;
+    hwc_image hwc;
+} layout_args;
+
+static void to_hwc_band(void *ctx, int i0, int i1)
+{
+    layout_args *a = ctx;
+    int c = a->hwc.c, plane = image_plane_size(a->planar);
+    for (int k = 0; k < c; k ++)
+    {
+        const float *src = a->planar.data + (size_t)k * plane;
+        float *dst = a->hwc.data + k;
+        for (int i = i0; i < i1; i ++) dst[(size_t)i * c] = src[i];
+    }
+}
+
+static void to_planar_band(void *ctx, int i0, int i1)
+{
+    layout_args *a = ctx;
+    int c = a->hwc.c, plane = image_plane_size(a->planar);
+    for (int k = 0; k < c; k ++)
+    {
+        const float *src = a->hwc.data + k;
+        float *dst = a->planar.data + (size_t)k * plane;
+        for (int i = i0; i < i1; i ++) dst[i] = src[(size_t)i * c];
+    }
+}
+
+hwc_image image_to_hwc(image im)
+{
+    // Interleaves a planar image
+    INSTRUMENT_FUNCTION();
+    hwc_image out = make_hwc_image(im.w, im.h, im.c);
+    layout_args a = {im, out};
+    parallel_for(image_plane_size(im), PIXEL_GRAIN, to_hwc_band, &a);
+    return out;
+}
+
+image hwc_to_image(hwc_image im)
+{
+    // And back to planar
+    INSTRUMENT_FUNCTION();
+    image out = make_image_uninit(im.w, im.h, im.c);
+    layout_args a = {out, im};
+    parallel_for(image_plane_size(out), PIXEL_GRAIN, to_planar_band, &a);
+    return out;
+}
+
+// ---- Color ----
+
+typedef struct{
+    hwc_image im;
+    hwc_image out;
+    int to_hsv;
+} hwc_color_args;
+
+// The loops over interleaved pixels only vectorize well with AVX2's
+// shuffles, so each comes in a baseline and an AVX2 build of the same
+// code, picked when a kernel starts like convolve_image's small filters.
+
+static inline __attribute__((always_inline))
+void gray_body(const float *restrict p, float *restrict gray, int n)
+{
+    for (int i = 0; i < n; i ++) gray[i] = p[3 * i] * 0.299f + p[3 * i + 1] * 0.587f + p[3 * i + 2] * 0.114f;
+}
+
+static inline __attribute__((always_inline))
+void split_body(const float *restrict p, float *restrict r, float *restrict g, float *restrict b, int n)
+{
+    for (int i = 0; i < n; i ++)
+    {
+        r[i] = p[3 * i];
+        g[i] = p[3 * i + 1];
+        b[i] = p[3 * i + 2];
+    }
+}
+
+static inline __attribute__((always_inline))
+void merge_body(const float *restrict r, const float *restrict g, const float *restrict b, float *restrict p, int n)
+{
+    for (int i = 0; i < n; i ++)
+    {
+        p[3 * i] = r[i];
+        p[3 * i + 1] = g[i];
+        p[3 * i + 2] = b[i];
+    }
+}
+
+static inline __attribute__((always_inline))
+void tap_body(float *restrict acc, const float *restrict p, float v, int n)
+{
+    for (int t = 0; t < n; t ++) acc[t] += v * p[t];
+}
+
+typedef struct{
+    void (*gray)(const float *p, float *gray, int n);
+    void (*split)(const float *p, float *r, float *g, float *b, int n);
+    void (*merge)(const float *r, const float *g, const float *b, float *p, int n);
+    void (*tap)(float *acc, const float *p, float v, int n);    // acc += v * p
+} hwc_kernels;
+
+#define DEFINE_HWC_KERNELS(SUFFIX, TARGET) \
+TARGET static void gray##SUFFIX(const float *p, float *gray, int n) { gray_body(p, gray, n); } \
+TARGET static void split##SUFFIX(const float *p, float *r, float *g, float *b, int n) { split_body(p, r, g, b, n); } \
+TARGET static void merge##SUFFIX(const float *r, const float *g, const float *b, float *p, int n) { merge_body(r, g, b, p, n); } \
+TARGET static void tap##SUFFIX(float *acc, const float *p, float v, int n) { tap_body(acc, p, v, n); } \
+static const hwc_kernels kernels##SUFFIX = {gray##SUFFIX, split##SUFFIX, merge##SUFFIX, tap##SUFFIX};
+
+DEFINE_HWC_KERNELS(_base, )
+#if defined(__x86_64__) || defined(__i386__)
+DEFINE_HWC_KERNELS(_avx2, __attribute__((target("avx2,fma"))))
+#endif
+
+static const hwc_kernels *get_hwc_kernels()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return &kernels_avx2;
+#endif
+    return &kernels_base;
+}
+
+static void gray_band(void *ctx, int i0, int i1)
+{
+    hwc_color_args *a = ctx;
+    get_hwc_kernels()->gray(a->im.data + (size_t)i0 * 3, a->out.data + i0, i1 - i0);
+}
+
+static void hsv_band(void *ctx, int i0, int i1)
+{
+    hwc_color_args *a = ctx;
+    const color_kernels *k = get_color_kernels();
+    const hwc_kernels *layout = get_hwc_kernels();
+    image buffer = scratch_image(TILE, 3, 1);
+    float *r = buffer.data, *g = r + TILE, *b = g + TILE;
+    for (int t = i0; t < i1; t += TILE)
+    {
+        int n = i1 - t < TILE ? i1 - t : TILE;
+        float *p = a->im.data + (size_t)t * 3;
+        layout->split(p, r, g, b, n);
+        if (a->to_hsv) k->rgb_to_hsv(r, g, b, n);
+        else k->hsv_to_rgb(r, g, b, n);
+        layout->merge(r, g, b, p, n);
+    }
+    release_scratch_image(buffer);
+}
+
+hwc_image hwc_rgb_to_grayscale(hwc_image im)
+{
+    /**
+     * Interleaved version of rgb_to_grayscale.
+     * 
+     * @returns a one channel image
+     * 
+     */
+
+    hwc_image out = make_hwc_image(im.w, im.h, 1);
+    hwc_rgb_to_grayscale_into(out, im);
+    return out;
+}
+
+void hwc_rgb_to_grayscale_into(hwc_image out, hwc_image im)
+{
+    // Same as hwc_rgb_to_grayscale, into a one channel image the size of im
+    INSTRUMENT_FUNCTION();
+    assert(im.c == 3);
+    assert(out.w == im.w && out.h == im.h && out.c == 1);
+    hwc_color_args a = {im, out, 0};
+    parallel_for(im.w * im.h, PIXEL_GRAIN, gray_band, &a);
+}
+
+void hwc_rgb_to_hsv(hwc_image im)
+{
+    // Interleaved version of rgb_to_hsv, in place
+    INSTRUMENT_FUNCTION();
+    assert(im.c == 3);
+    hwc_color_args a = {im, im, 1};
+    parallel_for(im.w * im.h, PIXEL_GRAIN, hsv_band, &a);
+}
+
+void hwc_hsv_to_rgb(hwc_image im)
+{
+    // Interleaved version of hsv_to_rgb, in place
+    INSTRUMENT_FUNCTION();
+    assert(im.c == 3);
+    hwc_color_args a = {im, im, 0};
+    parallel_for(im.w * im.h, PIXEL_GRAIN, hsv_band, &a);
+}
+
+// ---- Resizing ----
+
+typedef struct{
+    hwc_image im;
+    hwc_image out;
+    const resize_plan *plan;
+} hwc_resize_args;
+
+static inline __attribute__((always_inline))
+void resize_row(const resize_plan *p, const float *top, const float *bottom, float dy, float *dst, int w, const int c)
+{
+    // One output row; c is a constant in the common cases so the channel
+    // loop unrolls
+    if (p->mode == RESIZE_NN)
+    {
+        for (int col = 0; col < w; col ++)
+        {
+            const float *src = top + (size_t)p->x0[col] * c;
+            for (int k = 0; k < c; k ++) dst[col * c + k] = src[k];
+        }
+        return;
+    }
+    for (int col = 0; col < w; col ++)
+    {
+        int l = p->x0[col] * c, r = p->x1[col] * c;
+        float fx = p->fx[col];
+        for (int k = 0; k < c; k ++)
+        {
+            float q1 = (1 - dy) * top[l + k] + dy * bottom[l + k];
+            float q2 = (1 - dy) * top[r + k] + dy * bottom[r + k];
+            dst[col * c + k] = (1 - fx) * q1 + fx * q2;
+        }
+    }
+}
+
+static void hwc_resize_band(void *ctx, int r0, int r1)
+{
+    hwc_resize_args *a = ctx;
+    const resize_plan *p = a->plan;
+    int c = a->im.c, w = a->out.w;
+    for (int row = r0; row < r1; row ++)
+    {
+        const float *top = hwc_row(a->im, p->y0[row]);
+        const float *bottom = hwc_row(a->im, p->y1[row]);
+        float dy = p->fy[row];
+        float *dst = hwc_row(a->out, row);
+        if (c == 3) resize_row(p, top, bottom, dy, dst, w, 3);
+        else if (c == 1) resize_row(p, top, bottom, dy, dst, w, 1);
+        else resize_row(p, top, bottom, dy, dst, w, c);
+    }
+}
+
+hwc_image hwc_resize_with_plan(hwc_image im, const resize_plan *plan)
+{
+    /**
+     * Interleaved version of resize_with_plan.
+     * 
+     * @param im the image to resize, plan->src_w x plan->src_h
+     * @param plan the resize plan
+     * 
+     * @returns resized image, plan->dst_w x plan->dst_h x im.c
+     * 
+     */
+
+    hwc_image out = make_hwc_image(plan->dst_w, plan->dst_h, im.c);
+    hwc_resize_with_plan_into(out, im, plan);
+    return out;
+}
+
+void hwc_resize_with_plan_into(hwc_image out, hwc_image im, const resize_plan *plan)
+{
+    /**
+     * Same as hwc_resize_with_plan, writing into a caller's image.
+     * 
+     * @param[out] out plan->dst_w x plan->dst_h x im.c image; it must not
+     * overlap im
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(im.w == plan->src_w && im.h == plan->src_h);
+    assert(out.w == plan->dst_w && out.h == plan->dst_h && out.c == im.c);
+    hwc_resize_args a = {im, out, plan};
+    parallel_for(out.h, row_grain(out.w * im.c), hwc_resize_band, &a);
+}
+
+static hwc_image hwc_resize(hwc_image im, int w, int h, resize_mode mode)
+{
+    resize_plan *plan = make_resize_plan(im.w, im.h, w, h, mode);
+    hwc_image out = hwc_resize_with_plan(im, plan);
+    free_resize_plan(plan);
+    return out;
+}
+
+hwc_image hwc_nn_resize(hwc_image im, int w, int h)
+{
+    return hwc_resize(im, w, h, RESIZE_NN);
+}
+
+hwc_image hwc_bilinear_resize(hwc_image im, int w, int h)
+{
+    return hwc_resize(im, w, h, RESIZE_BILINEAR);
+}
+
+// ---- Convolution ----
+
+typedef struct{
+    hwc_image im;
+    image filter;
+    hwc_image out;
+    int preserve;
+} hwc_convolve_args;
+
+static void hwc_convolve_band(void *ctx, int y0, int y1)
+{
+    hwc_convolve_args *a = ctx;
+    hwc_image im = a->im;
+    image f = a->filter;
+    int c = im.c, n = im.w * c;
+    int left = f.w / 2, right = f.w - 1 - left;
+    image buffer = scratch_image(n + (f.w - 1) * c, 2, 1);
+    float *acc = buffer.data, *padded = acc + buffer.w;
+    const hwc_kernels *k = get_hwc_kernels();
+
+    for (int y = y0; y < y1; y ++)
+    {
+        memset(acc, 0, n * sizeof(float));
+        for (int j = 0; j < f.h; j ++)
+        {
+            // The source row with its border pixels repeated, as convolve_image clamps
+            const float *src = hwc_row(im, clamp_index(y + j - f.h / 2, im.h));
+            for (int i = 0; i < left; i ++) memcpy(padded + i * c, src, c * sizeof(float));
+            memcpy(padded + left * c, src, n * sizeof(float));
+            for (int i = 0; i < right; i ++) memcpy(padded + n + (left + i) * c, src + n - c, c * sizeof(float));
+
+            for (int i = 0; i < f.w; i ++)
+            {
+                const float *p = padded + i * c;
+                if (f.c == 1)
+                {
+                    k->tap(acc, p, f.data[j * f.w + i], n);
+                    continue;
+                }
+                for (int x = 0; x < im.w; x ++)
+                {
+                    for (int z = 0; z < c; z ++) acc[x * c + z] += f.data[(z * f.h + j) * f.w + i] * p[x * c + z];
+                }
+            }
+        }
+
+        float *dst = hwc_row(a->out, y);
+        if (a->preserve) memcpy(dst, acc, n * sizeof(float));
+        else for (int x = 0; x < im.w; x ++)
+        {
+            float sum = 0;
+            for (int z = 0; z < c; z ++) sum += acc[x * c + z];
+            dst[x] = sum;
+        }
+    }
+    release_scratch_image(buffer);
+}
+
+hwc_image hwc_convolve_image(hwc_image im, image filter, int preserve)
+{
+    /**
+     * Interleaved version of convolve_image.
+     * 
+     * @param im the image to filter
+     * @param filter a planar filter with one channel, or one per channel
+     * of im
+     * @param preserve whether to keep every channel, or sum them into one
+     * 
+     * @returns the filtered image
+     * 
+     */
+
+    hwc_image out = make_hwc_image(im.w, im.h, preserve ? im.c : 1);
+    hwc_convolve_image_into(out, im, filter, preserve);
+    return out;
+}
+
+void hwc_convolve_image_into(hwc_image out, hwc_image im, image filter, int preserve)
+{
+    /**
+     * Same as hwc_convolve_image, writing into a caller's image.
+     * 
+     * @param[out] out im.w x im.h image with im.c channels if preserve, 1
+     * otherwise; it must not overlap im
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(filter.c == 1 || filter.c == im.c);
+    assert(out.w == im.w && out.h == im.h && out.c == (preserve ? im.c : 1));
+    hwc_convolve_args a = {im, filter, out, preserve};
+    parallel_for(im.h, row_grain(im.w * im.c * filter.w * filter.h), hwc_convolve_band, &a);
+}
@@ -12,44 +12,339 @@ typedef struct{
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
 image copy_image(image im);
+void copy_image_into(image dst, image im);
 image rgb_to_grayscale(image im);
+void rgb_to_grayscale_into(image dst, image im);
 image grayscale_to_rgb(image im, float r, float g, float b);
 void rgb_to_hsv(image im);
 void hsv_to_rgb(image im);
 void shift_image(image im, int c, float v);
 void scale_image(image im, int c, float v);
+void scale_image_channels(image im, const float *v);
 void clamp_image(image im);
 image get_channel(image im, int c);
 int same_image(image a, image b);
 image sub_image(image a, image b);
 image add_image(image a, image b);
+void sub_image_into(image dst, image a, image b);
+void add_image_into(image dst, image a, image b);
+void sub_image_inplace(image a, image b);
+void add_image_inplace(image a, image b);
 
 // Loading and saving
 image make_image(int w, int h, int c);
 image load_image(char *filename);
+void load_image_into(image dst, char *filename);
+image try_load_image(char *filename);
 void save_image(image im, const char *name);
 void save_png(image im, const char *name);
+typedef enum{
+    FORMAT_JPG,
+    FORMAT_PNG
+} image_format;
+typedef struct{
+    image_format format;
+    int quality;        // JPEG quality, 1 to 100
+    int compression;    // PNG deflate level, higher is smaller and slower
+} save_options;
+typedef void (*image_write_fn)(void *ctx, void *data, int size);
+save_options default_save_options(image_format format);
+int save_image_options(image im, const char *name, save_options opts);
+int encode_image_to_func(image im, save_options opts, image_write_fn write, void *ctx);
+unsigned char *encode_image(image im, save_options opts, int *size);
+image bytes_to_image(const unsigned char *data, int w, int h, int c);
+void bytes_to_image_into(image dst, const unsigned char *data, int c);
+void image_to_bytes(image im, unsigned char *dst);
+int save_image_raw(image im, const char *name);
+image load_image_raw(const char *filename);
 void free_image(image im);
 
+// Memory
+typedef struct image_arena image_arena;
+image make_image_uninit(int w, int h, int c);
+image_arena *make_image_arena();
+image arena_make_image(image_arena *a, int w, int h, int c);
+image arena_make_image_uninit(image_arena *a, int w, int h, int c);
+image arena_load_image(image_arena *a, char *filename);
+void arena_release_image(image_arena *a, image im);
+void arena_reset(image_arena *a);
+void free_image_arena(image_arena *a);
+
 // Resizing
 float nn_interpolate(image im, float x, float y, int c);
 image nn_resize(image im, int w, int h);
+void nn_resize_into(image dst, image im);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
+void bilinear_resize_into(image dst, image im);
+image area_resize(image im, int w, int h);
+image lanczos_resize(image im, int w, int h);
+image pyramid_resize(image im, int w, int h);
+
+typedef enum{
+    RESIZE_NN,
+    RESIZE_BILINEAR
+} resize_mode;
+
+typedef struct{
+    int src_w, src_h;
+    int dst_w, dst_h;
+    resize_mode mode;
+    int *x0, *x1;
+    float *fx;
+    int *y0, *y1;
+    float *fy;
+} resize_plan;
+
+resize_plan *make_resize_plan(int src_w, int src_h, int dst_w, int dst_h, resize_mode mode);
+image resize_with_plan(image im, const resize_plan *plan);
+void resize_with_plan_into(image dst, image im, const resize_plan *plan);
+void free_resize_plan(resize_plan *plan);
 
 // Filtering
 image convolve_image(image im, image filter, int preserve);
+void convolve_image_into(image dst, image im, image filter, int preserve);
+image convolve_image_separable(image im, image fx, image fy, int preserve);
+void convolve_image_separable_into(image dst, image im, image fx, image fy, int preserve);
+image convolve_image_fft(image im, image filter, int preserve);
+void convolve_image_fft_into(image dst, image im, image filter, int preserve);
+void free_fft_cache();
 image make_box_filter(int w);
+image make_box_filter_1d(int w);
 image make_highpass_filter();
 image make_sharpen_filter();
 image make_emboss_filter();
 image make_gaussian_filter(float sigma);
+image make_gaussian_filter_1d(float sigma);
+image cached_gaussian_filter(float sigma);
+image cached_gaussian_filter_1d(float sigma);
+void free_gaussian_cache();
+image gaussian_blur(image im, float sigma);
+void gaussian_blur_into(image out, image im, float sigma);
+image gaussian_blur_iir(image im, float sigma);
+void gaussian_blur_iir_into(image out, image im, float sigma);
 image make_gx_filter();
 image make_gy_filter();
 void feature_normalize(image im);
 void threshold_image(image im, float thresh);
+image box_blur(image im, int w);
+void box_blur_into(image out, image im, int w);
+typedef struct{
+    int w,h,c;
+    double *sum;        // (w+1) x (h+1) per channel
+    double *sum_sq;     // same for squared pixels, or 0
+} integral_image;
+integral_image make_integral_image(image im, int squares);
+void free_integral_image(integral_image ii);
+double integral_sum(integral_image ii, int x, int y, int w, int h, int c);
+double integral_mean(integral_image ii, int x, int y, int w, int h, int c);
+double integral_variance(integral_image ii, int x, int y, int w, int h, int c);
 image *sobel_image(image im);
+typedef enum{
+    SOBEL_FAST_ATAN2 = 1,
+    SOBEL_L1 = 2
+} sobel_flags;
+image *sobel_image_flags(image im, int flags);
+void sobel_image_into(image mag, image theta, image im, int flags);
 image colorize_sobel(image im);
+void colorize_sobel_into(image dst, image im);
+
+// Views
+typedef struct{
+    int w,h,c;
+    int stride;     // floats from one row to the next
+    int plane;      // floats from one channel to the next
+    float *data;    // pixel (x, y) channel k at data[k*plane + y*stride + x]
+} image_view;
+image_view view_image(image im);
+image_view view_region(image_view v, int x, int y, int w, int h);
+image_view view_channel(image_view v, int c);
+float get_view_pixel(image_view v, int x, int y, int c);
+void set_view_pixel(image_view v, int x, int y, int c, float val);
+image copy_view(image_view v);
+void copy_view_into(image dst, image_view v);
+void copy_image_to_view(image_view dst, image im);
+void shift_view(image_view v, int c, float val);
+void scale_view(image_view v, int c, float val);
+void clamp_view(image_view v);
+image rgb_to_grayscale_view(image_view v);
+void rgb_to_grayscale_view_into(image gray, image_view v);
+void rgb_to_hsv_view(image_view v);
+void hsv_to_rgb_view(image_view v);
+image nn_resize_view(image_view v, int w, int h);
+void nn_resize_view_into(image dst, image_view v);
+image bilinear_resize_view(image_view v, int w, int h);
+void bilinear_resize_view_into(image dst, image_view v);
+void resize_view_with_plan_into(image dst, image_view v, const resize_plan *plan);
+image convolve_view(image_view v, image filter, int preserve);
+void convolve_view_into(image out, image_view v, image filter, int preserve);
+
+// Pyramids
+typedef struct image_pyramid image_pyramid;
+image gaussian_downsample(image im);
+void gaussian_downsample_into(image out, image im);
+image_pyramid *make_image_pyramid(image im, int levels);
+int pyramid_levels(image_pyramid *p);
+image pyramid_gaussian(image_pyramid *p, int level);
+image pyramid_laplacian(image_pyramid *p, int level);
+void free_image_pyramid(image_pyramid *p);
+
+// Deferred point operations
+typedef struct op_graph op_graph;
+op_graph *make_op_graph(image im);
+void op_graph_shift(op_graph *g, int c, float v);
+void op_graph_scale(op_graph *g, int c, float v);
+void op_graph_clamp(op_graph *g);
+void op_graph_threshold(op_graph *g, float thresh);
+void op_graph_grayscale(op_graph *g);
+void op_graph_rgb_to_hsv(op_graph *g);
+void op_graph_hsv_to_rgb(op_graph *g);
+void op_graph_add(op_graph *g, image b);
+void op_graph_sub(op_graph *g, image b);
+int op_graph_channels(op_graph *g);
+image eval_op_graph(op_graph *g);
+void eval_op_graph_into(image out, op_graph *g);
+void free_op_graph(op_graph *g);
+
+// Streaming
+typedef struct{
+    int w,h,c;
+    int (*read_row)(void *ctx, int y, image row);   // row is w x 1 x c, y in increasing order
+    void (*close)(void *ctx);
+    void *ctx;
+} image_source;
+typedef struct{
+    int w,h,c;
+    int (*write_row)(void *ctx, int y, image row);
+    void (*close)(void *ctx);
+    void *ctx;
+} image_sink;
+image_source image_source_from_image(image im);
+image_sink image_sink_to_image(image im);
+image_source open_pnm_source(const char *filename);
+image_sink open_pnm_sink(const char *filename, int w, int h, int c);
+void close_image_source(image_source s);
+void close_image_sink(image_sink s);
+int stream_convolve(image_source src, image_sink dst, image filter, int preserve, int strip_rows);
+int stream_resize(image_source src, image_sink dst, resize_mode mode, int strip_rows);
+int stream_rgb_to_grayscale(image_source src, image_sink dst, int strip_rows);
+int stream_rgb_to_hsv(image_source src, image_sink dst, int strip_rows);
+int stream_hsv_to_rgb(image_source src, image_sink dst, int strip_rows);
+
+// Frame pipelines
+//
+// A chain of stages, each on its own thread, joined by rings of
+// preallocated frames. push_frame and latest_frame never wait for the
+// stages: when a stage falls behind, the oldest frame waiting for it is
+// dropped, which keeps the latency from push to output bounded.
+typedef struct frame_pipeline frame_pipeline;
+typedef void (*frame_stage_fn)(image out, image in, void *ctx);
+typedef struct{
+    long long frames;           // frames finished
+    long long dropped;          // frames dropped before they got to run
+    double mean_ms, max_ms;     // time spent running a frame
+    double wait_ms;             // mean time a frame waited for the stage
+} frame_stats;
+frame_pipeline *make_frame_pipeline(int w, int h, int c, int depth);
+int add_frame_stage(frame_pipeline *p, int w, int h, int c, frame_stage_fn fn, void *ctx);
+int add_frame_ops(frame_pipeline *p, const char *chain);
+int frame_pipeline_stages(frame_pipeline *p);
+void frame_pipeline_output_size(frame_pipeline *p, int *w, int *h, int *c);
+long long push_frame(frame_pipeline *p, image im);
+long long latest_frame(frame_pipeline *p, image out);
+void flush_frame_pipeline(frame_pipeline *p);
+int frame_pipeline_stats(frame_pipeline *p, int stage, frame_stats *s);
+void free_frame_pipeline(frame_pipeline *p);
+
+// Interleaved images
+typedef struct{
+    int w,h,c;
+    float *data;    // pixel (x, y) channel k at data[(y*w + x)*c + k]
+} hwc_image;
+hwc_image make_hwc_image(int w, int h, int c);
+void free_hwc_image(hwc_image im);
+hwc_image image_to_hwc(image im);
+image hwc_to_image(hwc_image im);
+hwc_image load_hwc_image(char *filename);
+int save_hwc_image(hwc_image im, const char *name, save_options opts);
+hwc_image hwc_rgb_to_grayscale(hwc_image im);
+void hwc_rgb_to_grayscale_into(hwc_image out, hwc_image im);
+void hwc_rgb_to_hsv(hwc_image im);
+void hwc_hsv_to_rgb(hwc_image im);
+hwc_image hwc_nn_resize(hwc_image im, int w, int h);
+hwc_image hwc_bilinear_resize(hwc_image im, int w, int h);
+hwc_image hwc_resize_with_plan(hwc_image im, const resize_plan *plan);
+void hwc_resize_with_plan_into(hwc_image out, hwc_image im, const resize_plan *plan);
+hwc_image hwc_convolve_image(hwc_image im, image filter, int preserve);
+void hwc_convolve_image_into(hwc_image out, hwc_image im, image filter, int preserve);
+
+// Fixed point images
+typedef enum{
+    QIMAGE_U8,
+    QIMAGE_U16
+} qimage_type;
+typedef struct{
+    int w,h,c;
+    qimage_type type;
+    void *data;     // planar like image, 1 or 2 bytes per sample
+} qimage;
+qimage make_qimage(int w, int h, int c, qimage_type type);
+void free_qimage(qimage im);
+qimage image_to_qimage(image im, qimage_type type);
+image qimage_to_image(qimage im);
+qimage load_qimage(char *filename, qimage_type type);
+qimage qimage_rgb_to_grayscale(qimage im);
+qimage qimage_nn_resize(qimage im, int w, int h);
+qimage qimage_bilinear_resize(qimage im, int w, int h);
+qimage qimage_resize_with_plan(qimage im, const resize_plan *plan);
+qimage qimage_box_blur(qimage im, int w);
+
+// GPU offload, with `make OPENCL=1`; without it, or without a device,
+// gpu_available returns 0, device images have mem 0 and the rest do nothing.
+// Every gpu_ call only queues work, in order, so chained calls stay on the
+// device; results are ready after gpu_finish or a gpu_download.
+typedef struct{
+    int w,h,c;
+    void *mem;      // planar like image, in device memory
+} gpu_image;
+int gpu_available();
+gpu_image make_gpu_image(int w, int h, int c);
+void free_gpu_image(gpu_image im);
+gpu_image gpu_upload(image im);
+void gpu_upload_into(gpu_image dst, image im);
+image gpu_download(gpu_image im);
+void gpu_download_into(image out, gpu_image im);
+void gpu_finish();
+gpu_image gpu_convolve_image(gpu_image im, image filter, int preserve);
+void gpu_convolve_image_into(gpu_image out, gpu_image im, image filter, int preserve);
+gpu_image gpu_nn_resize(gpu_image im, int w, int h);
+void gpu_nn_resize_into(gpu_image dst, gpu_image im);
+gpu_image gpu_bilinear_resize(gpu_image im, int w, int h);
+void gpu_bilinear_resize_into(gpu_image dst, gpu_image im);
+gpu_image gpu_rgb_to_grayscale(gpu_image im);
+void gpu_rgb_to_grayscale_into(gpu_image out, gpu_image im);
+void gpu_rgb_to_hsv(gpu_image im);
+void gpu_hsv_to_rgb(gpu_image im);
+void gpu_sobel_image_into(gpu_image mag, gpu_image theta, gpu_image im, int flags);
+
+// Instrumentation, with `make INSTRUMENT=1`; without it these do nothing
+int instrument_enabled();
+void instrument_reset();
+int instrument_counts(const char *name, long long *calls, double *seconds);
+void instrument_memory(long long *allocated, long long *freed, long long *live, long long *peak);
+void instrument_report(const char *filename);
+int instrument_trace_start(const char *filename);
+int instrument_trace_stop();
+
+// Threading
+//
+// Every function here may be called from several threads at once, as long
+// as no thread writes an image (or op_graph, plan or stream) that another
+// is using. Calls made while the kernel pool is busy with another caller's
+// work run on their own thread instead of waiting for it. The thread count
+// and the instrumentation counters are shared by the whole process.
+void set_num_threads(int n);
+int get_num_threads();
 
 #endif
 
@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+#include "image_pool.h"
+#include "instrument.h"
+
+// Image arenas.
+//
+// An arena keeps every buffer it has handed out. Released buffers go on a
+// free list for their size class (powers of two bytes, from 64 bytes up)
+// and are handed out again for any later request of that class, so a
+// pipeline that makes and drops the same sized temporaries every frame
+// only allocates on its first frame. All buffers are 64-byte aligned.
+
+#define SIZE_CLASSES 48
+#define MIN_CLASS 6
+#define SCRATCH_MAX_KEPT_CLASS 22   // scratch arenas free blocks of 8MB and up on release
+
+typedef struct{
+    float *data;
+    int size_class;
+} arena_block;
+
+struct image_arena{
+    pthread_mutex_t lock;
+    arena_block *live;
+    int live_count, live_cap;
+    float **free_list[SIZE_CLASSES];
+    int free_count[SIZE_CLASSES];
+    int free_cap[SIZE_CLASSES];
+    int max_kept_class;     // released blocks above this class are freed, 0 keeps all
+};
+
+static int size_class(size_t bytes)
+{
+    int k = MIN_CLASS;
+    while (k < SIZE_CLASSES - 1 && ((size_t)1 << k) < bytes) k ++;
+    return k;
+}
+
+static float *aligned_floats(size_t n)
+{
+    void *p = 0;
+    size_t bytes = n > 0 ? n * sizeof(float) : IMAGE_ALIGN;
+    if (posix_memalign(&p, IMAGE_ALIGN, bytes)) return 0;
+    return p;
+}
+
+image make_image_uninit(int w, int h, int c)
+{
+    /**
+     * Makes an image without clearing its contents.
+     * 
+     * Same as make_image, minus zeroing the buffer; for outputs that are
+     * about to be overwritten in full anyway. Free it with free_image.
+     * 
+     * @param w, h, c size of the image
+     * 
+     * @returns image with unspecified pixel values
+     * 
+     */
+    
+    image out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.data = aligned_floats((size_t)w * h * c);
+    if (out.data) INSTRUMENT_ALLOC((size_t)w * h * c * sizeof(float));
+    return out;
+}
+
+image_arena *make_image_arena()
+{
+    /**
+     * Makes an empty image arena.
+     * 
+     * Images made from an arena belong to it: give them back with
+     * arena_release_image (or all at once with arena_reset) and never call
+     * free_image on them. free_image_arena frees every buffer the arena
+     * ever handed out. An arena may be shared between threads.
+     * 
+     * @returns the arena, to be released with free_image_arena
+     * 
+     */
+    
+    image_arena *a = calloc(1, sizeof(image_arena));
+    pthread_mutex_init(&a->lock, 0);
+    return a;
+}
+
+static void push_free(image_arena *a, arena_block b)
+{
+    int k = b.size_class;
+    if (a->max_kept_class && k > a->max_kept_class)
+    {
+        free(b.data);
+        INSTRUMENT_FREE((size_t)1 << k);
+        return;
+    }
+    if (a->free_count[k] == a->free_cap[k])
+    {
+        a->free_cap[k] = a->free_cap[k] ? 2 * a->free_cap[k] : 4;
+        a->free_list[k] = realloc(a->free_list[k], a->free_cap[k] * sizeof(float *));
+    }
+    a->free_list[k][a->free_count[k] ++] = b.data;
+}
+
+image arena_make_image_uninit(image_arena *a, int w, int h, int c)
+{
+    /**
+     * Makes an image from an arena without clearing its contents.
+     * 
+     * @param a the arena
+     * @param w, h, c size of the image
+     * 
+     * @returns image with unspecified pixel values, owned by the arena
+     * 
+     */
+    
+    size_t n = (size_t)w * h * c;
+    arena_block b = {0, size_class(n * sizeof(float))};
+    
+    pthread_mutex_lock(&a->lock);
+    if (a->free_count[b.size_class]) b.data = a->free_list[b.size_class][-- a->free_count[b.size_class]];
+    pthread_mutex_unlock(&a->lock);
+    
+    if (!b.data)
+    {
+        b.data = aligned_floats(((size_t)1 << b.size_class) / sizeof(float));
+        INSTRUMENT_ALLOC((size_t)1 << b.size_class);
+    }
+    
+    pthread_mutex_lock(&a->lock);
+    if (a->live_count == a->live_cap)
+    {
+        a->live_cap = a->live_cap ? 2 * a->live_cap : 16;
+        a->live = realloc(a->live, a->live_cap * sizeof(arena_block));
+    }
+    a->live[a->live_count ++] = b;
+    pthread_mutex_unlock(&a->lock);
+    
+    image out;
+    out.w = w;
+    out.h = h;
+    out.c = c;
+    out.data = b.data;
+    return out;
+}
+
+image arena_make_image(image_arena *a, int w, int h, int c)
+{
+    /**
+     * Makes a zeroed image from an arena, like make_image.
+     * 
+     */
+    
+    image out = arena_make_image_uninit(a, w, h, c);
+    memset(out.data, 0, (size_t)w * h * c * sizeof(float));
+    return out;
+}
+
+void arena_release_image(image_arena *a, image im)
+{
+    /**
+     * Gives an image back to the arena it came from, for reuse.
+     * 
+     * @param a the arena the image was made from
+     * @param im the image; it must not be used afterwards
+     * 
+     */
+    
+    pthread_mutex_lock(&a->lock);
+    // Temporaries are usually released in reverse order, so look from the end
+    for (int i = a->live_count - 1; i >= 0; i --)
+    {
+        if (a->live[i].data == im.data)
+        {
+            push_free(a, a->live[i]);
+            a->live[i] = a->live[-- a->live_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+void arena_reset(image_arena *a)
+{
+    /**
+     * Gives every image made from the arena back to it at once.
+     * 
+     */
+    
+    pthread_mutex_lock(&a->lock);
+    for (int i = 0; i < a->live_count; i ++) push_free(a, a->live[i]);
+    a->live_count = 0;
+    pthread_mutex_unlock(&a->lock);
+}
+
+void free_image_arena(image_arena *a)
+{
+    /**
+     * Frees an arena and every buffer it handed out.
+     * 
+     */
+    
+    if (!a) return;
+    for (int i = 0; i < a->live_count; i ++)
+    {
+        free(a->live[i].data);
+        INSTRUMENT_FREE((size_t)1 << a->live[i].size_class);
+    }
+    for (int k = 0; k < SIZE_CLASSES; k ++)
+    {
+        for (int i = 0; i < a->free_count[k]; i ++) free(a->free_list[k][i]);
+        if (a->free_count[k]) INSTRUMENT_FREE(a->free_count[k] * ((size_t)1 << k));
+        free(a->free_list[k]);
+    }
+    free(a->live);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+}
+
+// Every thread gets its own scratch arena on first use, freed when the
+// thread exits. Scratch arenas do not keep blocks of 8MB and up once they
+// are released: one big temporary would otherwise stay allocated in every
+// pool worker for the life of the process.
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void free_scratch_arena(void *a)
+{
+    free_image_arena(a);
+}
+
+static void make_scratch_key()
+{
+    pthread_key_create(&scratch_key, free_scratch_arena);
+}
+
+static image_arena *thread_scratch_arena()
+{
+    pthread_once(&scratch_once, make_scratch_key);
+    image_arena *a = pthread_getspecific(scratch_key);
+    if (!a)
+    {
+        a = make_image_arena();
+        a->max_kept_class = SCRATCH_MAX_KEPT_CLASS;
+        pthread_setspecific(scratch_key, a);
+    }
+    return a;
+}
+
+image scratch_image(int w, int h, int c)
+{
+    return arena_make_image_uninit(thread_scratch_arena(), w, h, c);
+}
+
+void release_scratch_image(image im)
+{
+    arena_release_image(thread_scratch_arena(), im);
+}
@@ -0,0 +1,23 @@
+#ifndef IMAGE_POOL_H
+#define IMAGE_POOL_H
+
+// Internal scratch images for kernel temporaries.
+//
+// scratch_image hands out an uninitialized image from a per-thread arena
+// and release_scratch_image gives it back, so a kernel that needs the same
+// intermediate buffers call after call stops paying for fresh allocations.
+// Scratch images must be released on the thread that took them and never
+// passed to free_image or returned to the caller.
+
+#include "image.h"
+
+// Alignment of every image buffer we allocate, enough for AVX-512 loads
+#define IMAGE_ALIGN 64
+
+image scratch_image(int w, int h, int c);
+void release_scratch_image(image im);
+
+// Unmaps an image from load_image_raw; returns 0 if im is not mapped.
+int release_mapped_image(image im);
+
+#endif
@@ -0,0 +1,370 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "image.h"
+#include "instrument.h"
+
+#ifdef UWIMG_INSTRUMENT
+
+// Counters live in the instrumented functions' static sites, which link
+// themselves into a list the first time they are called. Call counts and
+// times are updated with atomics; only registration and trace events take
+// a lock.
+//
+// A trace is a list of complete ("X") events, one per instrumented call,
+// plus counter ("C") events for live image memory, kept in memory until
+// instrument_trace_stop writes them out in the Chrome trace event format
+// (chrome://tracing, Perfetto).
+//
+// Setting UWIMG_TRACE=file records a trace of the whole run, and
+// UWIMG_REPORT=file (or - for stderr) prints the report when the program
+// exits, so a job can be looked at without changing its code.
+
+#define MAX_TRACE_EVENTS (1 << 22)
+
+typedef struct{
+    const char *name;           // 0 for a memory counter event
+    unsigned long long start, dur;
+    long long live;
+    int tid;
+} trace_event;
+
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static instrument_site *sites;
+
+static long long allocated, freed, live, peak;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int tracing;
+static char *trace_file;
+static trace_event *events;
+static int event_count, event_cap, events_dropped;
+static unsigned long long trace_origin;
+
+static __thread int thread_id;
+static int thread_count;
+
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+static char *report_file;
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int current_thread()
+{
+    if (!thread_id) thread_id = __atomic_add_fetch(&thread_count, 1, __ATOMIC_RELAXED);
+    return thread_id;
+}
+
+static void report_at_exit()
+{
+    instrument_report(strcmp(report_file, "-") ? report_file : 0);
+}
+
+static void stop_trace_at_exit()
+{
+    instrument_trace_stop();
+}
+
+static void read_env()
+{
+    char *trace = getenv("UWIMG_TRACE");
+    if (trace && *trace && instrument_trace_start(trace)) atexit(stop_trace_at_exit);
+    char *report = getenv("UWIMG_REPORT");
+    if (report && *report)
+    {
+        report_file = strdup(report);
+        atexit(report_at_exit);
+    }
+}
+
+static void add_event(trace_event e)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (!tracing)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    if (event_count == event_cap)
+    {
+        if (event_cap == MAX_TRACE_EVENTS)
+        {
+            events_dropped ++;
+            pthread_mutex_unlock(&trace_lock);
+            return;
+        }
+        event_cap = event_cap ? 2 * event_cap : 4096;
+        events = realloc(events, event_cap * sizeof(trace_event));
+    }
+    events[event_count ++] = e;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+instrument_span instrument_begin(instrument_site *site)
+{
+    pthread_once(&env_once, read_env);
+    if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&sites_lock);
+        if (!site->registered)
+        {
+            site->next = sites;
+            sites = site;
+            __atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&sites_lock);
+    }
+    instrument_span span = {site, now_ns()};
+    return span;
+}
+
+void instrument_end(instrument_span *span)
+{
+    unsigned long long dur = now_ns() - span->start;
+    __atomic_add_fetch(&span->site->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&span->site->ns, dur, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+    {
+        trace_event e = {span->site->name, span->start, dur, 0, current_thread()};
+        add_event(e);
+    }
+}
+
+static void memory_event(long long now_live)
+{
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED)) return;
+    trace_event e = {0, now_ns(), 0, now_live, current_thread()};
+    add_event(e);
+}
+
+void instrument_alloc(size_t bytes)
+{
+    __atomic_add_fetch(&allocated, bytes, __ATOMIC_RELAXED);
+    long long now_live = __atomic_add_fetch(&live, bytes, __ATOMIC_RELAXED);
+    long long p = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while (now_live > p && !__atomic_compare_exchange_n(&peak, &p, now_live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    memory_event(now_live);
+}
+
+void instrument_free(size_t bytes)
+{
+    __atomic_add_fetch(&freed, bytes, __ATOMIC_RELAXED);
+    memory_event(__atomic_sub_fetch(&live, bytes, __ATOMIC_RELAXED));
+}
+
+int instrument_enabled()
+{
+    return 1;
+}
+
+void instrument_reset()
+{
+    /**
+     * Zeroes every counter and the peak, keeping the current live memory
+     * as the new starting point for the peak.
+     * 
+     */
+
+    pthread_mutex_lock(&sites_lock);
+    for (instrument_site *s = sites; s; s = s->next)
+    {
+        __atomic_store_n(&s->calls, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->ns, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&sites_lock);
+    __atomic_store_n(&allocated, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&freed, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&peak, __atomic_load_n(&live, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+int instrument_counts(const char *name, long long *calls, double *seconds)
+{
+    int found = 0;
+    *calls = 0;
+    *seconds = 0;
+    pthread_mutex_lock(&sites_lock);
+    for (instrument_site *s = sites; s; s = s->next)
+    {
+        if (strcmp(s->name, name)) continue;
+        *calls = __atomic_load_n(&s->calls, __ATOMIC_RELAXED);
+        *seconds = __atomic_load_n(&s->ns, __ATOMIC_RELAXED) * 1e-9;
+        found = 1;
+    }
+    pthread_mutex_unlock(&sites_lock);
+    return found;
+}
+
+void instrument_memory(long long *allocated_bytes, long long *freed_bytes, long long *live_bytes, long long *peak_bytes)
+{
+    *allocated_bytes = __atomic_load_n(&allocated, __ATOMIC_RELAXED);
+    *freed_bytes = __atomic_load_n(&freed, __ATOMIC_RELAXED);
+    *live_bytes = __atomic_load_n(&live, __ATOMIC_RELAXED);
+    *peak_bytes = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+}
+
+static int by_time(const void *a, const void *b)
+{
+    const instrument_site *x = *(instrument_site * const *)a, *y = *(instrument_site * const *)b;
+    return (x->ns < y->ns) - (x->ns > y->ns);
+}
+
+void instrument_report(const char *filename)
+{
+    /**
+     * Prints calls and time of every instrumented function that ran, the
+     * slowest first, followed by image memory.
+     * 
+     * @param filename where to write the report, 0 for stderr
+     * 
+     */
+
+    FILE *f = filename ? fopen(filename, "w") : stderr;
+    if (!f)
+    {
+        fprintf(stderr, "Cannot write report %s\n", filename);
+        return;
+    }
+
+    pthread_mutex_lock(&sites_lock);
+    int n = 0;
+    for (instrument_site *s = sites; s; s = s->next) n ++;
+    instrument_site **sorted = malloc((n + 1) * sizeof(instrument_site *));
+    n = 0;
+    for (instrument_site *s = sites; s; s = s->next) if (s->calls) sorted[n ++] = s;
+    qsort(sorted, n, sizeof(instrument_site *), by_time);
+
+    fprintf(f, "%-28s %10s %12s %12s\n", "function", "calls", "total ms", "mean us");
+    for (int i = 0; i < n; i ++)
+    {
+        instrument_site *s = sorted[i];
+        fprintf(f, "%-28s %10llu %12.3f %12.3f\n", s->name, s->calls, s->ns * 1e-6, s->ns * 1e-3 / s->calls);
+    }
+    pthread_mutex_unlock(&sites_lock);
+    free(sorted);
+
+    long long a, fr, l, p;
+    instrument_memory(&a, &fr, &l, &p);
+    fprintf(f, "image memory: %.1f MB allocated, %.1f MB freed, %.1f MB live, %.1f MB peak\n",
+            a / 1048576., fr / 1048576., l / 1048576., p / 1048576.);
+    if (filename) fclose(f);
+}
+
+int instrument_trace_start(const char *filename)
+{
+    /**
+     * Starts recording a Chrome trace, dropping any trace not yet stopped.
+     * 
+     * @param filename where instrument_trace_stop writes the trace
+     * 
+     * @returns 1
+     * 
+     */
+
+    pthread_mutex_lock(&trace_lock);
+    free(trace_file);
+    trace_file = strdup(filename);
+    event_count = 0;
+    events_dropped = 0;
+    trace_origin = now_ns();
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+    return 1;
+}
+
+int instrument_trace_stop()
+{
+    /**
+     * Stops recording and writes the trace.
+     * 
+     * @returns 1 if a trace was written, 0 if none was being recorded or
+     * the file could not be written
+     * 
+     */
+
+    pthread_mutex_lock(&trace_lock);
+    if (!tracing)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELAXED);
+
+    FILE *f = fopen(trace_file, "w");
+    if (f)
+    {
+        fprintf(f, "{\"traceEvents\": [");
+        for (int i = 0; i < event_count; i ++)
+        {
+            trace_event e = events[i];
+            double ts = (long long)(e.start - trace_origin) * 1e-3;
+            if (e.name)
+            {
+                fprintf(f, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                        i ? "," : "", e.name, e.tid, ts, e.dur * 1e-3);
+            }
+            else
+            {
+                fprintf(f, "%s\n{\"name\": \"image memory\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {\"MB\": %.3f}}",
+                        i ? "," : "", ts, e.live / 1048576.);
+            }
+        }
+        fprintf(f, "\n]}\n");
+        fclose(f);
+    }
+    else fprintf(stderr, "Cannot write trace %s\n", trace_file);
+    if (events_dropped) fprintf(stderr, "Trace %s is missing its last %d events\n", trace_file, events_dropped);
+
+    free(events);
+    events = 0;
+    event_count = event_cap = 0;
+    pthread_mutex_unlock(&trace_lock);
+    return f != 0;
+}
+
+#else
+
+int instrument_enabled()
+{
+    return 0;
+}
+
+void instrument_reset()
+{
+}
+
+int instrument_counts(const char *name, long long *calls, double *seconds)
+{
+    *calls = 0;
+    *seconds = 0;
+    return 0;
+}
+
+void instrument_memory(long long *allocated_bytes, long long *freed_bytes, long long *live_bytes, long long *peak_bytes)
+{
+    *allocated_bytes = *freed_bytes = *live_bytes = *peak_bytes = 0;
+}
+
+void instrument_report(const char *filename)
+{
+    fprintf(stderr, "uwimg was built without instrumentation, rebuild with make INSTRUMENT=1\n");
+}
+
+int instrument_trace_start(const char *filename)
+{
+    fprintf(stderr, "uwimg was built without instrumentation, rebuild with make INSTRUMENT=1\n");
+    return 0;
+}
+
+int instrument_trace_stop()
+{
+    return 0;
+}
+
+#endif
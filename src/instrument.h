@@ -0,0 +1,48 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stddef.h>
+
+// Instrumentation of the hot paths, compiled in with `make INSTRUMENT=1`.
+//
+// INSTRUMENT_FUNCTION() at the top of a function counts its calls and the
+// time spent in it, nested instrumented calls included, and adds a span to
+// the Chrome trace while one is being recorded. INSTRUMENT_ALLOC and
+// INSTRUMENT_FREE keep track of image memory. In a normal build all three
+// expand to nothing, so they cost nothing on the paths they sit on.
+
+#ifdef UWIMG_INSTRUMENT
+
+typedef struct instrument_site{
+    const char *name;
+    unsigned long long calls;
+    unsigned long long ns;
+    struct instrument_site *next;
+    int registered;
+} instrument_site;
+
+typedef struct{
+    instrument_site *site;
+    unsigned long long start;
+} instrument_span;
+
+instrument_span instrument_begin(instrument_site *site);
+void instrument_end(instrument_span *span);
+void instrument_alloc(size_t bytes);
+void instrument_free(size_t bytes);
+
+#define INSTRUMENT_FUNCTION() \
+    static instrument_site instrument_site_ = {__func__, 0, 0, 0, 0}; \
+    instrument_span instrument_span_ __attribute__((cleanup(instrument_end))) = instrument_begin(&instrument_site_)
+#define INSTRUMENT_ALLOC(bytes) instrument_alloc(bytes)
+#define INSTRUMENT_FREE(bytes) instrument_free(bytes)
+
+#else
+
+#define INSTRUMENT_FUNCTION() do{}while(0)
+#define INSTRUMENT_ALLOC(bytes) do{}while(0)
+#define INSTRUMENT_FREE(bytes) do{}while(0)
+
+#endif
+
+#endif
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "pixel_access.h"
+#include "parallel.h"
+#include "image_pool.h"
+#include "instrument.h"
+
+// Box filtering in constant time per pixel.
+//
+// box_blur slides a window along each row and then down each column,
+// adding the sample that enters and subtracting the one that leaves, so
+// every output costs a few additions whatever the width of the box. The
+// running sums are kept in double precision so that long rows do not
+// drift away from what convolving with make_box_filter would give.
+//
+// An integral image (summed-area table) holds, for every (x, y), the sum
+// of all pixels above and to the left of it. The sum over any rectangle
+// is then four lookups, which makes means and variances of arbitrary
+// regions O(1) after one pass over the image.
+
+typedef struct{
+    image im;
+    image out;
+    image sums;     // horizontal window sums of plane z
+    int z;
+    int k;
+} box_args;
+
+static void box_rows_band(void *ctx, int y0, int y1)
+{
+    // Sliding window along each row, borders clamped like convolve_image
+    box_args *a = ctx;
+    int w = a->im.w, k = a->k, left = k / 2;
+    for (int y = y0; y < y1; y ++)
+    {
+        const float *src = a->im.data + ((size_t)a->z * a->im.h + y) * w;
+        float *sums = a->sums.data + (size_t)y * w;
+        double s = 0;
+        for (int i = 0; i < k; i ++) s += src[clamp_index(i - left, w)];
+        for (int x = 0; x < w; x ++)
+        {
+            sums[x] = s;
+            s += src[clamp_index(x + k - left, w)];
+            s -= src[clamp_index(x - left, w)];
+        }
+    }
+}
+
+static void box_cols_band(void *ctx, int y0, int y1)
+{
+    // Same down each column, all columns of a row at a time
+    box_args *a = ctx;
+    int w = a->im.w, h = a->im.h, k = a->k, top = k / 2;
+    double scale = 1.0 / ((double)k * k);
+    double *acc = calloc(w, sizeof(double));
+    for (int j = 0; j < k; j ++)
+    {
+        const float *row = a->sums.data + (size_t)clamp_index(y0 + j - top, h) * w;
+        for (int x = 0; x < w; x ++) acc[x] += row[x];
+    }
+    for (int y = y0; y < y1; y ++)
+    {
+        float *out = a->out.data + ((size_t)a->z * h + y) * w;
+        for (int x = 0; x < w; x ++) out[x] = acc[x] * scale;
+        const float *in = a->sums.data + (size_t)clamp_index(y + k - top, h) * w;
+        const float *gone = a->sums.data + (size_t)clamp_index(y - top, h) * w;
+        for (int x = 0; x < w; x ++) acc[x] += (double)in[x] - gone[x];
+    }
+    free(acc);
+}
+
+image box_blur(image im, int w)
+{
+    /**
+     * Averages the w x w neighbourhood of every pixel.
+     * 
+     * Gives the same result as convolve_image(im, make_box_filter(w), 1),
+     * borders included, but the cost per pixel does not depend on w.
+     * 
+     * @param im the image to blur
+     * @param w the width of the box
+     * 
+     * @returns the blurred image
+     * 
+     */
+
+    image out = make_image_uninit(im.w, im.h, im.c);
+    box_blur_into(out, im, w);
+    return out;
+}
+
+void box_blur_into(image out, image im, int w)
+{
+    /**
+     * Same as box_blur, writing into a caller's image.
+     * 
+     * @param[out] out image the size of im; it must not overlap im
+     * @param im the image to blur
+     * @param w the width of the box
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(w > 0);
+    assert(out.w == im.w && out.h == im.h && out.c == im.c);
+    image sums = scratch_image(im.w, im.h, 1);
+    for (int z = 0; z < im.c; z ++)
+    {
+        box_args a = {im, out, sums, z, w};
+        parallel_for(im.h, row_grain(im.w), box_rows_band, &a);
+        parallel_for(im.h, row_grain(im.w * 2), box_cols_band, &a);
+    }
+    release_scratch_image(sums);
+}
+
+// ---- Integral images ----
+
+typedef struct{
+    image im;
+    double *table;      // sum or sum_sq
+    int z;
+    int squares;
+} integral_args;
+
+static void integral_rows_band(void *ctx, int y0, int y1)
+{
+    // Prefix sums along each row; row 0 and column 0 of the table stay zero
+    integral_args *a = ctx;
+    int w = a->im.w, tw = w + 1;
+    for (int y = y0; y < y1; y ++)
+    {
+        const float *src = a->im.data + ((size_t)a->z * a->im.h + y) * w;
+        double *t = a->table + (size_t)(y + 1) * tw;
+        double s = 0;
+        t[0] = 0;
+        if (a->squares) for (int x = 0; x < w; x ++) t[x + 1] = s += (double)src[x] * src[x];
+        else for (int x = 0; x < w; x ++) t[x + 1] = s += src[x];
+    }
+}
+
+static void integral_cols_band(void *ctx, int x0, int x1)
+{
+    // Then down each column, over a band of columns so rows are read in runs
+    integral_args *a = ctx;
+    int tw = a->im.w + 1;
+    for (int y = 2; y <= a->im.h; y ++)
+    {
+        double *t = a->table + (size_t)y * tw;
+        for (int x = x0; x < x1; x ++) t[x] += t[x - tw];
+    }
+}
+
+static void integral_table(integral_args *a, double *table, int squares)
+{
+    int tw = a->im.w + 1;
+    a->table = table;
+    a->squares = squares;
+    memset(table, 0, tw * sizeof(double));
+    parallel_for(a->im.h, row_grain(a->im.w), integral_rows_band, a);
+    parallel_for(tw, 64, integral_cols_band, a);
+}
+
+integral_image make_integral_image(image im, int squares)
+{
+    /**
+     * Makes the summed-area table of every channel of an image.
+     * 
+     * For each channel the table is (im.w + 1) x (im.h + 1), and entry
+     * (x, y) holds the sum of the pixels with coordinates below x and
+     * below y. Sums are kept in double precision.
+     * 
+     * @param im the image to sum
+     * @param squares whether to also keep a table of squared pixels, which
+     * integral_variance needs
+     * 
+     * @returns the integral image; free it with free_integral_image
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    integral_image ii;
+    ii.w = im.w;
+    ii.h = im.h;
+    ii.c = im.c;
+    size_t plane = (size_t)(im.w + 1) * (im.h + 1);
+    ii.sum = malloc(plane * im.c * sizeof(double));
+    ii.sum_sq = squares ? malloc(plane * im.c * sizeof(double)) : 0;
+
+    for (int z = 0; z < im.c; z ++)
+    {
+        integral_args a = {im, 0, z, 0};
+        integral_table(&a, ii.sum + z * plane, 0);
+        if (squares) integral_table(&a, ii.sum_sq + z * plane, 1);
+    }
+    return ii;
+}
+
+void free_integral_image(integral_image ii)
+{
+    free(ii.sum);
+    free(ii.sum_sq);
+}
+
+static int clip_region(integral_image ii, int *x0, int *y0, int *x1, int *y1)
+{
+    // Clips [x0, x1) x [y0, y1) to the image and returns its area
+    *x0 = *x0 < 0 ? 0 : (*x0 > ii.w ? ii.w : *x0);
+    *x1 = *x1 < *x0 ? *x0 : (*x1 > ii.w ? ii.w : *x1);
+    *y0 = *y0 < 0 ? 0 : (*y0 > ii.h ? ii.h : *y0);
+    *y1 = *y1 < *y0 ? *y0 : (*y1 > ii.h ? ii.h : *y1);
+    return (*x1 - *x0) * (*y1 - *y0);
+}
+
+static double table_sum(integral_image ii, const double *table, int x0, int y0, int x1, int y1, int c)
+{
+    int tw = ii.w + 1;
+    const double *t = table + (size_t)c * tw * (ii.h + 1);
+    return t[(size_t)y1*tw + x1] - t[(size_t)y0*tw + x1] - t[(size_t)y1*tw + x0] + t[(size_t)y0*tw + x0];
+}
+
+double integral_sum(integral_image ii, int x, int y, int w, int h, int c)
+{
+    /**
+     * Sums the w x h rectangle of channel c with its top left corner at
+     * (x, y), in constant time.
+     * 
+     * The parts of the rectangle outside the image are left out, so they
+     * count as zero.
+     * 
+     * @returns the sum of the pixels in the rectangle
+     * 
+     */
+
+    assert(c >= 0 && c < ii.c);
+    int x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+    if (!clip_region(ii, &x0, &y0, &x1, &y1)) return 0;
+    return table_sum(ii, ii.sum, x0, y0, x1, y1, c);
+}
+
+double integral_mean(integral_image ii, int x, int y, int w, int h, int c)
+{
+    /**
+     * Mean of the pixels of a rectangle that lie inside the image.
+     * 
+     * @returns the mean, or 0 if the rectangle misses the image
+     * 
+     */
+
+    assert(c >= 0 && c < ii.c);
+    int x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+    int n = clip_region(ii, &x0, &y0, &x1, &y1);
+    if (!n) return 0;
+    return table_sum(ii, ii.sum, x0, y0, x1, y1, c) / n;
+}
+
+double integral_variance(integral_image ii, int x, int y, int w, int h, int c)
+{
+    /**
+     * Variance of the pixels of a rectangle that lie inside the image, as
+     * E[p^2] - E[p]^2. The integral image must have been made with squares.
+     * 
+     * @returns the variance, or 0 if the rectangle misses the image
+     * 
+     */
+
+    assert(c >= 0 && c < ii.c);
+    assert(ii.sum_sq);
+    int x0 = x, y0 = y, x1 = x + w, y1 = y + h;
+    int n = clip_region(ii, &x0, &y0, &x1, &y1);
+    if (!n) return 0;
+    double mean = table_sum(ii, ii.sum, x0, y0, x1, y1, c) / n;
+    double var = table_sum(ii, ii.sum_sq, x0, y0, x1, y1, c) / n - mean * mean;
+    return var > 0 ? var : 0;
+}
@@ -1,8 +1,14 @@
 // You probably don't want to edit this file
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 
 #include "image.h"
+#include "color_simd.h"
+#include "parallel.h"
+#include "image_pool.h"
+#include "instrument.h"
 
 image make_empty_image(int w, int h, int c)
 {
@@ -16,8 +22,8 @@ image make_empty_image(int w, int h, int c)
 
 image make_image(int w, int h, int c)
 {
-    image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    image out = make_image_uninit(w,h,c);
+    memset(out.data, 0, (size_t)w*h*c*sizeof(float));
     return out;
 }
 
@@ -26,26 +32,182 @@ image make_image(int w, int h, int c)
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(image im, const char *name, int png)
+static inline unsigned char quantize_byte(float v)
+{
+    v = v > 0 ? v : 0;
+    v = v < 1 ? v : 1;
+    return (unsigned char)(v*255 + .5f);
+}
+
+void interleave_bytes_scalar(const float *r, const float *g, const float *b, unsigned char *dst, int n)
+{
+    // Reference for the color_kernels byte interleave
+    int i;
+    for(i = 0; i < n; ++i){
+        dst[i*3+0] = quantize_byte(r[i]);
+        dst[i*3+1] = quantize_byte(g[i]);
+        dst[i*3+2] = quantize_byte(b[i]);
+    }
+}
+
+typedef struct{
+    image im;
+    unsigned char *dst;
+} bytes_args;
+
+static void bytes_band(void *ctx, int i0, int i1)
 {
-    char buff[256];
-    unsigned char *data = calloc(im.w*im.h*im.c, sizeof(char));
+    bytes_args *a = ctx;
+    image im = a->im;
+    int plane = im.w*im.h;
+    unsigned char *dst = a->dst + i0*im.c;
+    if(im.c == 3){
+        get_color_kernels()->interleave_bytes(im.data + i0, im.data + plane + i0,
+            im.data + 2*plane + i0, dst, i1 - i0);
+        return;
+    }
     int i,k;
     for(k = 0; k < im.c; ++k){
-        for(i = 0; i < im.w*im.h; ++i){
-            data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
-        }
+        const float *src = im.data + k*plane;
+        for(i = i0; i < i1; ++i) dst[(i-i0)*im.c+k] = quantize_byte(src[i]);
     }
-    int success = 0;
-    if(png){
-        sprintf(buff, "%s.png", name);
-        success = stbi_write_png(buff, im.w, im.h, im.c, data, im.w*im.c);
+}
+
+// 
+// Convert a planar image to interleaved 8 bit pixels, clamping to [0, 1],
+// into w*h*c bytes at dst, e.g. a HWC array of another library
+//
+void image_to_bytes(image im, unsigned char *dst)
+{
+    bytes_args a = {im, dst};
+    parallel_for(im.w*im.h, PIXEL_GRAIN, bytes_band, &a);
+}
+
+static unsigned char *planar_to_bytes(image im)
+{
+    unsigned char *data = malloc((size_t)im.w*im.h*im.c);
+    image_to_bytes(im, data);
+    return data;
+}
+
+save_options default_save_options(image_format format)
+{
+    save_options opts;
+    opts.format = format;
+    opts.quality = 100;
+    opts.compression = 8;
+    return opts;
+}
+
+// stb keeps the PNG compression level in a (thread local) global, so PNG
+// writes set it first; JPEG writes take their quality as an argument.
+static int write_stb(image im, const unsigned char *data, save_options opts,
+                     const char *filename, stbi_write_func *func, void *ctx)
+{
+    assert(im.c >= 1 && im.c <= 4);
+    int success;
+    if(opts.format == FORMAT_PNG){
+        stbi_write_png_compression_level = opts.compression;
+        if(filename) success = stbi_write_png(filename, im.w, im.h, im.c, data, im.w*im.c);
+        else success = stbi_write_png_to_func(func, ctx, im.w, im.h, im.c, data, im.w*im.c);
     } else {
-        sprintf(buff, "%s.jpg", name);
-        success = stbi_write_jpg(buff, im.w, im.h, im.c, data, 100);
+        if(filename) success = stbi_write_jpg(filename, im.w, im.h, im.c, data, opts.quality);
+        else success = stbi_write_jpg_to_func(func, ctx, im.w, im.h, im.c, data, opts.quality);
     }
+    return success;
+}
+
+// 
+// Save an image to name.png or name.jpg as opts.format says. Safe to call
+// from several threads at once. Returns 1 on success, 0 on failure.
+//
+int save_image_options(image im, const char *name, save_options opts)
+{
+    INSTRUMENT_FUNCTION();
+    const char *ext = opts.format == FORMAT_PNG ? ".png" : ".jpg";
+    char *buff = malloc(strlen(name) + strlen(ext) + 1);
+    sprintf(buff, "%s%s", name, ext);
+
+    unsigned char *data = planar_to_bytes(im);
+    int success = write_stb(im, data, opts, buff, 0, 0);
+    free(data);
+    if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+    free(buff);
+    return success;
+}
+
+// 
+// Save an interleaved image like save_image_options; its pixels are
+// already in the order the encoders want and only need rounding to bytes.
+//
+int save_hwc_image(hwc_image im, const char *name, save_options opts)
+{
+    INSTRUMENT_FUNCTION();
+    const char *ext = opts.format == FORMAT_PNG ? ".png" : ".jpg";
+    char *buff = malloc(strlen(name) + strlen(ext) + 1);
+    sprintf(buff, "%s%s", name, ext);
+
+    // Interleaved floats quantize like one wide single channel image
+    image flat = {im.w*im.c, im.h, 1, im.data};
+    unsigned char *data = malloc((size_t)im.w*im.h*im.c);
+    image_to_bytes(flat, data);
+    image shape = {im.w, im.h, im.c, 0};
+    int success = write_stb(shape, data, opts, buff, 0, 0);
     free(data);
     if(!success) fprintf(stderr, "Failed to write image %s\n", buff);
+    free(buff);
+    return success;
+}
+
+// 
+// Encode an image without touching the disk, handing the encoded bytes to
+// write(ctx, data, size) as stb produces them; e.g. straight to a socket.
+// Returns 1 on success, 0 on failure.
+//
+int encode_image_to_func(image im, save_options opts, image_write_fn write, void *ctx)
+{
+    INSTRUMENT_FUNCTION();
+    unsigned char *data = planar_to_bytes(im);
+    int success = write_stb(im, data, opts, 0, write, ctx);
+    free(data);
+    return success;
+}
+
+typedef struct{
+    unsigned char *data;
+    int size, cap;
+} byte_buffer;
+
+static void append_bytes(void *ctx, void *data, int size)
+{
+    byte_buffer *b = ctx;
+    if(b->size + size > b->cap){
+        b->cap = 2*b->cap > b->size + size ? 2*b->cap : b->size + size;
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+// 
+// Encode an image into a malloc'd buffer, its length in *size. The caller
+// frees the buffer. Returns 0 on failure.
+//
+unsigned char *encode_image(image im, save_options opts, int *size)
+{
+    byte_buffer b = {0, 0, 0};
+    if(!encode_image_to_func(im, opts, append_bytes, &b)){
+        free(b.data);
+        *size = 0;
+        return 0;
+    }
+    *size = b.size;
+    return b.data;
+}
+
+void save_image_stb(image im, const char *name, int png)
+{
+    save_image_options(im, name, default_save_options(png ? FORMAT_PNG : FORMAT_JPG));
 }
 
 void save_png(image im, const char *name)
@@ -58,6 +220,116 @@ void save_image(image im, const char *name)
     save_image_stb(im, name, 0);
 }
 
+void deinterleave_bytes_scalar(const unsigned char *src, int stride, float *r, float *g, float *b, int n)
+{
+    // Reference for the color_kernels byte deinterleave
+    const float k = 1.0f/255;
+    int i;
+    for(i = 0; i < n; ++i){
+        r[i] = src[i*stride+0]*k;
+        g[i] = src[i*stride+1]*k;
+        b[i] = src[i*stride+2]*k;
+    }
+}
+
+typedef struct{
+    const unsigned char *src;
+    int c;
+    image im;
+} planar_args;
+
+static void planar_band(void *ctx, int i0, int i1)
+{
+    planar_args *a = ctx;
+    image im = a->im;
+    int n = i1 - i0;
+    int plane = im.w*im.h;
+    const unsigned char *src = a->src + i0*a->c;
+    if(im.c == 3){
+        get_color_kernels()->deinterleave_bytes(src, a->c,
+            im.data + i0, im.data + plane + i0, im.data + 2*plane + i0, n);
+        return;
+    }
+    const float k = 1.0f/255;
+    int i,ch;
+    for(ch = 0; ch < im.c; ++ch){
+        float *dst = im.data + ch*plane + i0;
+        for(i = 0; i < n; ++i) dst[i] = src[i*a->c+ch]*k;
+    }
+}
+
+// 
+// Convert interleaved 8 bit pixels with c channels to a planar image,
+// dropping the alpha byte of 4 channel data as we go
+//
+static void bytes_to_planar(image im, const unsigned char *data, int c)
+{
+    planar_args a = {data, c, im};
+    parallel_for(im.w*im.h, PIXEL_GRAIN, planar_band, &a);
+}
+
+static void hwc_band(void *ctx, int i0, int i1)
+{
+    planar_args *a = ctx;
+    int c = a->im.c;
+    const unsigned char *src = a->src + i0*a->c;
+    float *dst = a->im.data + i0*c;
+    const float k = 1.0f/255;
+    int i,ch;
+    if(a->c == c){
+        for(i = 0; i < (i1 - i0)*c; ++i) dst[i] = src[i]*k;
+        return;
+    }
+    for(i = 0; i < i1 - i0; ++i){
+        for(ch = 0; ch < c; ++ch) dst[i*c+ch] = src[i*a->c+ch]*k;
+    }
+}
+
+// 
+// Same as bytes_to_planar, keeping the pixels interleaved
+//
+static void bytes_to_hwc(hwc_image im, const unsigned char *data, int c)
+{
+    planar_args a = {data, c, {im.w, im.h, im.c, im.data}};
+    parallel_for(im.w*im.h, PIXEL_GRAIN, hwc_band, &a);
+}
+
+// 
+// The way back from interleaved 8 bit pixels that did not come from a
+// file; c = 4 drops alpha as load_image does
+//
+image bytes_to_image(const unsigned char *data, int w, int h, int c)
+{
+    image im = make_image_uninit(w, h, c == 4 ? 3 : c);
+    bytes_to_planar(im, data, c);
+    return im;
+}
+
+void bytes_to_image_into(image dst, const unsigned char *data, int c)
+{
+    assert(dst.c == (c == 4 ? 3 : c));
+    bytes_to_planar(dst, data, c);
+}
+
+static unsigned char *try_decode_stb(char *filename, int channels, int *w, int *h, int *c)
+{
+    unsigned char *data = stbi_load(filename, w, h, c, channels);
+    if (!data) {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
+            filename, stbi_failure_reason());
+        return 0;
+    }
+    if (channels) *c = channels;
+    return data;
+}
+
+static unsigned char *decode_stb(char *filename, int channels, int *w, int *h, int *c)
+{
+    unsigned char *data = try_decode_stb(filename, channels, w, h, c);
+    if (!data) exit(0);
+    return data;
+}
+
 // 
 // Load an image using stb
 // channels = [0..4]
@@ -65,27 +337,30 @@ void save_image(image im, const char *name)
 //
 image load_image_stb(char *filename, int channels)
 {
+    INSTRUMENT_FUNCTION();
     int w, h, c;
-    unsigned char *data = stbi_load(filename, &w, &h, &c, channels);
-    if (!data) {
-        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n",
-            filename, stbi_failure_reason());
-        exit(0);
-    }
-    if (channels) c = channels;
-    int i,j,k;
-    image im = make_image(w, h, c);
-    for(k = 0; k < c; ++k){
-        for(j = 0; j < h; ++j){
-            for(i = 0; i < w; ++i){
-                int dst_index = i + w*j + w*h*k;
-                int src_index = k + c*i + c*w*j;
-                im.data[dst_index] = (float)data[src_index]/255.;
-            }
-        }
-    }
+    unsigned char *data = decode_stb(filename, channels, &w, &h, &c);
     //We don't like alpha channels, #YOLO
-    if(im.c == 4) im.c = 3;
+    image im = make_image_uninit(w, h, c == 4 ? 3 : c);
+    bytes_to_planar(im, data, c);
+    free(data);
+    return im;
+}
+
+// 
+// Load an image file straight into interleaved floats, with no transpose;
+// as with load_image an alpha channel is dropped. A file that cannot be
+// read gives an image with no data.
+//
+hwc_image load_hwc_image(char *filename)
+{
+    INSTRUMENT_FUNCTION();
+    int w, h, c;
+    unsigned char *data = try_decode_stb(filename, 0, &w, &h, &c);
+    hwc_image im = {0, 0, 0, 0};
+    if (!data) return im;
+    im = make_hwc_image(w, h, c == 4 ? 3 : c);
+    bytes_to_hwc(im, data, c);
     free(data);
     return im;
 }
@@ -96,7 +371,55 @@ image load_image(char *filename)
     return out;
 }
 
+// 
+// Like load_image, but a file that cannot be read gives an image with no
+// data instead of ending the program
+//
+image try_load_image(char *filename)
+{
+    INSTRUMENT_FUNCTION();
+    int w, h, c;
+    unsigned char *data = try_decode_stb(filename, 0, &w, &h, &c);
+    if (!data) return make_empty_image(0, 0, 0);
+    image im = make_image_uninit(w, h, c == 4 ? 3 : c);
+    bytes_to_planar(im, data, c);
+    free(data);
+    return im;
+}
+
+// 
+// Load an image into a buffer we already have, e.g. the same frame buffer
+// for every image of a sequence. dst must be the size of the image on disk
+// (with alpha dropped).
+//
+void load_image_into(image dst, char *filename)
+{
+    INSTRUMENT_FUNCTION();
+    int w, h, c;
+    unsigned char *data = decode_stb(filename, 0, &w, &h, &c);
+    assert(dst.w == w && dst.h == h && dst.c == (c == 4 ? 3 : c));
+    bytes_to_planar(dst, data, c);
+    free(data);
+}
+
+// 
+// Load an image into a buffer taken from an arena, to be given back with
+// arena_release_image
+//
+image arena_load_image(image_arena *a, char *filename)
+{
+    INSTRUMENT_FUNCTION();
+    int w, h, c;
+    unsigned char *data = decode_stb(filename, 0, &w, &h, &c);
+    image im = arena_make_image_uninit(a, w, h, c == 4 ? 3 : c);
+    bytes_to_planar(im, data, c);
+    free(data);
+    return im;
+}
+
 void free_image(image im)
 {
+    if (release_mapped_image(im)) return;
+    if (im.data) INSTRUMENT_FREE((size_t)im.w*im.h*im.c*sizeof(float));
     free(im.data);
 }
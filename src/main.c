@@ -3,22 +3,28 @@
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "batch.h"
+#include "bench.h"
 
 int main(int argc, char **argv)
 {
-    char *in = find_char_arg(argc, argv, "-i", "data/dog.jpg");
-    char *out = find_char_arg(argc, argv, "-o", "out");
     //float scale = find_float_arg(argc, argv, "-s", 1);
     if(argc < 2){
-        printf("usage: %s [test | grayscale]\n", argv[0]);  
+        printf("usage: %s [test | grayscale | batch | bench]\n", argv[0]);  
     } else if (0 == strcmp(argv[1], "test")){
         run_tests();
     } else if (0 == strcmp(argv[1], "grayscale")){
+        char *in = find_char_arg(argc, argv, "-i", "data/dog.jpg");
+        char *out = find_char_arg(argc, argv, "-o", "out");
         image im = load_image(in);
         image g = rgb_to_grayscale(im);
         save_image(g, out);
         free_image(im);
         free_image(g);
+    } else if (0 == strcmp(argv[1], "batch")){
+        return batch_main(argc, argv);
+    } else if (0 == strcmp(argv[1], "bench")){
+        return bench_main(argc, argv);
     }
     return 0;
 }
@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "pixel_access.h"
+#include "color_simd.h"
+#include "parallel.h"
+#include "image_pool.h"
+#include "instrument.h"
+
+// Deferred point operations.
+//
+// Chaining shift_image, scale_image, clamp_image and rgb_to_grayscale walks
+// the whole image once per step, so the chain runs at memory speed however
+// little each step computes. An op_graph records the steps instead and
+// runs them all in one pass: the image is cut into tiles of TILE pixels,
+// each tile's channels are copied into a small buffer that stays in cache,
+// every step runs on the buffer, and the result is written out once.
+//
+// Every recorded operation works on each pixel independently, so any chain
+// of them fuses into a single pass. Consecutive shifts and scales of the
+// same channel are folded into one multiply add as they are recorded.
+
+#define TILE 1024
+
+typedef enum{
+    NODE_AFFINE,        // x * mul + add on one channel
+    NODE_CLAMP,
+    NODE_GRAYSCALE,
+    NODE_RGB_TO_HSV,
+    NODE_HSV_TO_RGB,
+    NODE_THRESHOLD,
+    NODE_ADD,
+    NODE_SUB
+} node_kind;
+
+typedef struct{
+    node_kind kind;
+    int c;
+    float mul, add;     // affine coefficients, add is also the threshold
+    image other;        // second operand of NODE_ADD and NODE_SUB
+} op_node;
+
+struct op_graph{
+    image input;
+    int c;              // channels after the last node
+    op_node *nodes;
+    int count, cap;
+};
+
+op_graph *make_op_graph(image im)
+{
+    /**
+     * Starts recording operations on an image.
+     * 
+     * Nothing is computed, and im is not read, until the graph is
+     * evaluated; im must stay alive (and unchanged, unless that is the
+     * intent) until then.
+     * 
+     * @param im the input of the graph
+     * 
+     * @returns the empty graph; free it with free_op_graph
+     * 
+     */
+
+    op_graph *g = calloc(1, sizeof(op_graph));
+    g->input = im;
+    g->c = im.c;
+    return g;
+}
+
+void free_op_graph(op_graph *g)
+{
+    if (!g) return;
+    free(g->nodes);
+    free(g);
+}
+
+int op_graph_channels(op_graph *g)
+{
+    return g->c;
+}
+
+static op_node *last_node(op_graph *g)
+{
+    return g->count ? g->nodes + g->count - 1 : 0;
+}
+
+static void add_node(op_graph *g, op_node n)
+{
+    if (g->count == g->cap)
+    {
+        g->cap = g->cap ? 2 * g->cap : 8;
+        g->nodes = realloc(g->nodes, g->cap * sizeof(op_node));
+    }
+    g->nodes[g->count ++] = n;
+}
+
+static void add_affine(op_graph *g, int c, float mul, float add)
+{
+    // Out of range channels are ignored, like shift_image does
+    if (c < 0 || c >= g->c) return;
+    op_node *last = last_node(g);
+    if (last && last->kind == NODE_AFFINE && last->c == c)
+    {
+        last->mul *= mul;
+        last->add = last->add * mul + add;
+        return;
+    }
+    op_node n = {NODE_AFFINE, c, mul, add};
+    add_node(g, n);
+}
+
+void op_graph_shift(op_graph *g, int c, float v)
+{
+    // Records shift_image(im, c, v)
+    add_affine(g, c, 1, v);
+}
+
+void op_graph_scale(op_graph *g, int c, float v)
+{
+    // Records scale_image(im, c, v)
+    add_affine(g, c, v, 0);
+}
+
+void op_graph_clamp(op_graph *g)
+{
+    // Records clamp_image(im); a second clamp in a row does nothing
+    op_node *last = last_node(g);
+    if (last && last->kind == NODE_CLAMP) return;
+    op_node n = {NODE_CLAMP};
+    add_node(g, n);
+}
+
+void op_graph_threshold(op_graph *g, float thresh)
+{
+    // Records threshold_image(im, thresh)
+    op_node n = {NODE_THRESHOLD, 0, 0, thresh};
+    add_node(g, n);
+}
+
+void op_graph_grayscale(op_graph *g)
+{
+    // Records rgb_to_grayscale(im), which leaves one channel
+    assert(g->c == 3);
+    op_node n = {NODE_GRAYSCALE};
+    add_node(g, n);
+    g->c = 1;
+}
+
+void op_graph_rgb_to_hsv(op_graph *g)
+{
+    assert(g->c == 3);
+    op_node n = {NODE_RGB_TO_HSV};
+    add_node(g, n);
+}
+
+void op_graph_hsv_to_rgb(op_graph *g)
+{
+    assert(g->c == 3);
+    op_node n = {NODE_HSV_TO_RGB};
+    add_node(g, n);
+}
+
+void op_graph_add(op_graph *g, image b)
+{
+    // Records add_image with b, which must match the image at this point
+    assert(b.w == g->input.w && b.h == g->input.h && b.c == g->c);
+    op_node n = {NODE_ADD, 0, 0, 0, b};
+    add_node(g, n);
+}
+
+void op_graph_sub(op_graph *g, image b)
+{
+    assert(b.w == g->input.w && b.h == g->input.h && b.c == g->c);
+    op_node n = {NODE_SUB, 0, 0, 0, b};
+    add_node(g, n);
+}
+
+typedef struct{
+    op_graph *g;
+    image out;
+} eval_args;
+
+static void run_nodes(op_graph *g, float **rows, float *spare, int i0, int n)
+{
+    /**
+     * Runs every node on one tile of n pixels starting at pixel i0.
+     * 
+     * @param rows the tile's channel rows, updated as channels come and go
+     * @param spare a free row, for nodes that cannot work in place
+     * 
+     */
+
+    const color_kernels *k = get_color_kernels();
+    int plane = image_plane_size(g->input);
+    int c = g->input.c;
+    for (int j = 0; j < g->count; j ++)
+    {
+        op_node *node = g->nodes + j;
+        switch (node->kind)
+        {
+            case NODE_AFFINE:
+            {
+                float *p = rows[node->c], mul = node->mul, add = node->add;
+                for (int i = 0; i < n; i ++) p[i] = p[i] * mul + add;
+                break;
+            }
+            case NODE_CLAMP:
+                for (int z = 0; z < c; z ++)
+                {
+                    float *p = rows[z];
+                    for (int i = 0; i < n; i ++)
+                    {
+                        float v = p[i] > 1 ? 1 : p[i];
+                        p[i] = v < 0 ? 0 : v;
+                    }
+                }
+                break;
+            case NODE_THRESHOLD:
+                for (int z = 0; z < c; z ++)
+                {
+                    float *p = rows[z], t = node->add;
+                    for (int i = 0; i < n; i ++) p[i] = p[i] > t ? 1 : 0;
+                }
+                break;
+            case NODE_GRAYSCALE:
+            {
+                k->rgb_to_grayscale(rows[0], rows[1], rows[2], spare, n);
+                float *r = rows[0];
+                rows[0] = spare;
+                spare = r;
+                c = 1;
+                break;
+            }
+            case NODE_RGB_TO_HSV:
+                k->rgb_to_hsv(rows[0], rows[1], rows[2], n);
+                break;
+            case NODE_HSV_TO_RGB:
+                k->hsv_to_rgb(rows[0], rows[1], rows[2], n);
+                break;
+            case NODE_ADD:
+            case NODE_SUB:
+                for (int z = 0; z < c; z ++)
+                {
+                    float *p = rows[z];
+                    const float *b = node->other.data + (size_t)z * plane + i0;
+                    if (node->kind == NODE_ADD) for (int i = 0; i < n; i ++) p[i] += b[i];
+                    else for (int i = 0; i < n; i ++) p[i] -= b[i];
+                }
+                break;
+        }
+    }
+}
+
+static void eval_band(void *ctx, int i0, int i1)
+{
+    eval_args *a = ctx;
+    image in = a->g->input;
+    int plane = image_plane_size(in);
+    image buffer = scratch_image(TILE, 1, in.c + 1);
+    float *rows[in.c];
+
+    for (int t = i0; t < i1; t += TILE)
+    {
+        int n = i1 - t < TILE ? i1 - t : TILE;
+        for (int z = 0; z < in.c; z ++)
+        {
+            rows[z] = buffer.data + z * TILE;
+            memcpy(rows[z], in.data + (size_t)z * plane + t, n * sizeof(float));
+        }
+        run_nodes(a->g, rows, buffer.data + in.c * TILE, t, n);
+        for (int z = 0; z < a->out.c; z ++)
+        {
+            memcpy(a->out.data + (size_t)z * plane + t, rows[z], n * sizeof(float));
+        }
+    }
+    release_scratch_image(buffer);
+}
+
+image eval_op_graph(op_graph *g)
+{
+    /**
+     * Runs the recorded operations in one pass over the image.
+     * 
+     * The result is the same as running the operations one after another
+     * on a copy of the input; the graph can be evaluated again, for
+     * example after the input's pixels have changed.
+     * 
+     * @param g the graph
+     * 
+     * @returns an image with op_graph_channels(g) channels
+     * 
+     */
+
+    image out = make_image_uninit(g->input.w, g->input.h, g->c);
+    eval_op_graph_into(out, g);
+    return out;
+}
+
+void eval_op_graph_into(image out, op_graph *g)
+{
+    /**
+     * Same as eval_op_graph, writing into a caller's image.
+     * 
+     * @param[out] out the size of the input with op_graph_channels(g)
+     * channels; it may be the input itself, to run the graph in place
+     * @param g the graph
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(out.w == g->input.w && out.h == g->input.h && out.c == g->c);
+    eval_args a = {g, out};
+    parallel_for(image_plane_size(g->input), PIXEL_GRAIN, eval_band, &a);
+}
@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "image.h"
+#include "parallel.h"
+
+#define MAX_THREADS 256
+
+static int requested_threads = 0;
+static int default_threads = 1;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void init_default_threads()
+{
+    char *env = getenv("UWIMG_NUM_THREADS");
+    int n = env ? atoi(env) : 0;
+    if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+    default_threads = n < 1 ? 1 : (n > MAX_THREADS ? MAX_THREADS : n);
+}
+
+void set_num_threads(int n)
+{
+    /**
+     * Sets how many threads the image kernels may use.
+     * 
+     * A value of zero (or less) goes back to the default, which is the
+     * UWIMG_NUM_THREADS environment variable if set, or else the number
+     * of online CPUs. One thread runs every kernel on the calling thread.
+     * 
+     * @param n number of threads, at most 256
+     * 
+     */
+    
+    if (n > MAX_THREADS) n = MAX_THREADS;
+    __atomic_store_n(&requested_threads, n > 0 ? n : 0, __ATOMIC_RELAXED);
+}
+
+int get_num_threads()
+{
+    /**
+     * Returns how many threads the image kernels will use.
+     * 
+     */
+    
+    int n = __atomic_load_n(&requested_threads, __ATOMIC_RELAXED);
+    if (n > 0) return n;
+    pthread_once(&default_once, init_default_threads);
+    return default_threads;
+}
+
+static int band_bounds(int n, int bands, int b)
+{
+    return (int)((long long)n * b / bands);
+}
+
+#ifdef _OPENMP
+
+#include <omp.h>
+
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx)
+{
+    int bands = get_num_threads();
+    if (grain < 1) grain = 1;
+    if (bands > n / grain) bands = n / grain;
+    if (bands <= 1 || omp_in_parallel())
+    {
+        if (n > 0) fn(ctx, 0, n);
+        return;
+    }
+    
+    #pragma omp parallel for num_threads(bands) schedule(static, 1)
+    for (int b = 0; b < bands; b ++)
+    {
+        fn(ctx, band_bounds(n, bands, b), band_bounds(n, bands, b + 1));
+    }
+}
+
+#else
+
+// A minimal fixed pool: the caller publishes a job under the lock and bumps
+// the generation, the workers and the caller then claim bands with an
+// atomic counter until none are left. Only one job runs at a time; a call
+// made while the pool is busy (from another thread, or from inside a band)
+// runs its whole range inline instead of waiting.
+//
+// A worker can wake up late, after the job it was woken for has finished.
+// Workers count themselves in and out of active under the lock, and a new
+// job is only published once none is left, so a straggler never claims a
+// band of the next job with the last job's counters.
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    pthread_mutex_t busy;
+    
+    pthread_t threads[MAX_THREADS];
+    int workers;
+    
+    unsigned generation;
+    parallel_fn fn;
+    void *ctx;
+    int n;
+    int bands;
+    int next;
+    int remaining;
+    int active;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER
+};
+
+static void run_bands()
+{
+    int b;
+    int finished = 0;
+    while ((b = __atomic_fetch_add(&pool.next, 1, __ATOMIC_ACQ_REL)) < pool.bands)
+    {
+        pool.fn(pool.ctx, band_bounds(pool.n, pool.bands, b), band_bounds(pool.n, pool.bands, b + 1));
+        finished ++;
+    }
+    if (finished && __atomic_sub_fetch(&pool.remaining, finished, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.done);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (;;)
+    {
+        while (pool.generation == seen) pthread_cond_wait(&pool.work, &pool.lock);
+        seen = pool.generation;
+        pool.active ++;
+        pthread_mutex_unlock(&pool.lock);
+        run_bands();
+        pthread_mutex_lock(&pool.lock);
+        if (-- pool.active == 0) pthread_cond_broadcast(&pool.done);
+    }
+    return 0;
+}
+
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx)
+{
+    int bands = get_num_threads();
+    if (grain < 1) grain = 1;
+    if (bands > n / grain) bands = n / grain;
+    if (bands <= 1 || pthread_mutex_trylock(&pool.busy))
+    {
+        if (n > 0) fn(ctx, 0, n);
+        return;
+    }
+    
+    pthread_mutex_lock(&pool.lock);
+    while (pool.active > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    while (pool.workers < bands - 1)
+    {
+        if (pthread_create(&pool.threads[pool.workers], 0, pool_worker, 0)) break;
+        pthread_detach(pool.threads[pool.workers]);
+        pool.workers ++;
+    }
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.n = n;
+    pool.bands = bands;
+    pool.remaining = bands;
+    __atomic_store_n(&pool.next, 0, __ATOMIC_RELEASE);
+    pool.generation ++;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    
+    run_bands();
+    
+    pthread_mutex_lock(&pool.lock);
+    while (__atomic_load_n(&pool.remaining, __ATOMIC_ACQUIRE) > 0) pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.busy);
+}
+
+#endif
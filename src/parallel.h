@@ -0,0 +1,30 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// Row-band parallelism for the image kernels.
+//
+// parallel_for splits the range [0, n) into contiguous bands and calls
+// fn(ctx, start, end) once per band, possibly from several threads at
+// once, returning when every band is done. Kernels pass rows (or pixels)
+// as the range and keep their arguments in a small struct behind ctx.
+//
+// With OPENMP=1 the bands run on an OpenMP team, otherwise on a small
+// pthread pool that is started on first use. The thread count comes from
+// set_num_threads(), or the UWIMG_NUM_THREADS environment variable, or
+// the number of online CPUs, in that order.
+
+typedef void (*parallel_fn)(void *ctx, int start, int end);
+
+void parallel_for(int n, int grain, parallel_fn fn, void *ctx);
+
+// Smallest band, in rows, worth handing to a thread for rows of width w.
+static inline int row_grain(int w)
+{
+    int grain = (1 << 14) / (w > 0 ? w : 1);
+    return grain > 0 ? grain : 1;
+}
+
+// Smallest band, in pixels, worth handing to a thread.
+#define PIXEL_GRAIN (1 << 14)
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef PIXEL_ACCESS_H
+#define PIXEL_ACCESS_H
+
+// Internal helpers for kernels that work directly on the planar image buffer.
+//
+// Images are stored channel by channel (CHW), each channel a w x h plane
+// laid out row by row. Kernels should walk a plane row-major, resolve any
+// clamping once per row (or once per column index) with these helpers and
+// then run a plain pointer loop that the compiler is free to vectorize.
+
+#include <string.h>
+#include "image.h"
+
+static inline int clamp_index(int i, int n)
+{
+    return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+static inline int image_plane_size(image im)
+{
+    return im.w * im.h;
+}
+
+static inline float *image_plane(image im, int c)
+{
+    return im.data + c * im.w * im.h;
+}
+
+static inline float *image_row(image im, int y, int c)
+{
+    return im.data + (c * im.h + y) * im.w;
+}
+
+static inline float *image_row_clamped(image im, int y, int c)
+{
+    return image_row(im, clamp_index(y, im.h), clamp_index(c, im.c));
+}
+
+static inline float *view_row(image_view v, int y, int c)
+{
+    return v.data + (size_t)c * v.plane + (size_t)y * v.stride;
+}
+
+static inline int view_is_image(image_view v)
+{
+    // Whether the view's pixels are laid out like an image of its size
+    return v.stride == v.w && (v.c == 1 || v.plane == v.w * v.h);
+}
+
+static inline image view_as_image(image_view v)
+{
+    // The image sharing a view's pixels; only valid if view_is_image(v)
+    image im = {v.w, v.h, v.c, v.data};
+    return im;
+}
+
+static inline void pad_row(const float *row, int w, int left, int right, float *dst)
+{
+    // Copies a row into dst with its border pixels repeated `left` times
+    // before and `right` times after, the same padding get_pixel implies.
+    for (int i = 0; i < left; i ++) dst[i] = row[0];
+    memcpy(dst + left, row, w * sizeof(float));
+    for (int i = 0; i < right; i ++) dst[left + w + i] = row[w - 1];
+}
+
+#endif
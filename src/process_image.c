@@ -4,6 +4,33 @@
 #include <stdlib.h>
 #include <math.h>
 #include "image.h"
+#include "pixel_access.h"
+#include "color_simd.h"
+#include "parallel.h"
+#include "instrument.h"
+
+typedef struct{
+    float *c0, *c1, *c2;
+    float *out;
+} color_args;
+
+static void grayscale_band(void *ctx, int i0, int i1)
+{
+    color_args *a = ctx;
+    get_color_kernels()->rgb_to_grayscale(a->c0 + i0, a->c1 + i0, a->c2 + i0, a->out + i0, i1 - i0);
+}
+
+static void rgb_to_hsv_band(void *ctx, int i0, int i1)
+{
+    color_args *a = ctx;
+    get_color_kernels()->rgb_to_hsv(a->c0 + i0, a->c1 + i0, a->c2 + i0, i1 - i0);
+}
+
+static void hsv_to_rgb_band(void *ctx, int i0, int i1)
+{
+    color_args *a = ctx;
+    get_color_kernels()->hsv_to_rgb(a->c0 + i0, a->c1 + i0, a->c2 + i0, i1 - i0);
+}
 
 float get_pixel(image im, int x, int y, int c)
 {
@@ -25,15 +52,7 @@ float get_pixel(image im, int x, int y, int c)
      * 
     */ 
     
-    x = x > im.w ? im.w - 1 : x;
-    y = y > im.h ? im.h - 1 : y;
-    c = c > im.c ? im.c - 1 : c;
-    
-    x = x < 0 ? 0: x;
-    y = y < 0 ? 0: y;
-    c = c < 0 ? 0: c;
-    
-    return im.data[x + y * im.w + im.w * im.h * c];
+    return image_row_clamped(im, y, c)[clamp_index(x, im.w)];
 }
 
 void set_pixel(image im, int x, int y, int c, float v)
@@ -53,9 +72,9 @@ void set_pixel(image im, int x, int y, int c, float v)
      * 
      */
     
-    if (x > im.w) return;
-    if (y > im.h) return;
-    if (c > im.c) return;
+    if (x >= im.w) return;
+    if (y >= im.h) return;
+    if (c >= im.c) return;
     
     if (x < 0) return;
     if (y < 0) return;
@@ -78,11 +97,25 @@ image copy_image(image im)
      * 
     */ 
     
-    image copy = make_image(im.w, im.h, im.c);
-    memcpy(copy.data, im.data, im.w * im.h * im.c * sizeof(float));
+    image copy = make_image_uninit(im.w, im.h, im.c);
+    copy_image_into(copy, im);
     return copy;
 }
 
+void copy_image_into(image dst, image im)
+{
+    /**
+     * Copies an image into another image of the same size.
+     * 
+     * @param[out] dst the destination image, the same size as im
+     * @param im the source image
+     * 
+     */
+    
+    assert(dst.w == im.w && dst.h == im.h && dst.c == im.c);
+    memcpy(dst.data, im.data, im.w * im.h * im.c * sizeof(float));
+}
+
 image rgb_to_grayscale(image im)
 {
     /**
@@ -104,21 +137,45 @@ image rgb_to_grayscale(image im)
      * 
     */ 
     
+    image gray = make_image_uninit(im.w, im.h, 1);
+    rgb_to_grayscale_into(gray, im);
+    return gray;
+}
+
+void rgb_to_grayscale_into(image gray, image im)
+{
+    /**
+     * Same as rgb_to_grayscale, writing into a caller's image.
+     * 
+     * @param[out] gray im.w x im.h x 1 destination image
+     * @param im the three channel source image
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
     assert(im.c == 3); // The source image must have three channels
-    image gray = make_image(im.w, im.h, 1);
+    assert(gray.w == im.w && gray.h == im.h && gray.c == 1);
+    
+    color_args a = {image_plane(im, 0), image_plane(im, 1), image_plane(im, 2), gray.data};
+    parallel_for(image_plane_size(im), PIXEL_GRAIN, grayscale_band, &a);
+}
+
+void rgb_to_grayscale_scalar(const float *red, const float *green, const float *blue,
+                             float *gray, int n)
+{
+    /**
+     * Reference luma kernel over n pixels of three channel planes.
+     * 
+     * The vectorized kernels in color_simd.c must match this one, and
+     * fall back to it for the tail of a plane.
+     * 
+     */
     
-    for (int i = 0; i < im.w; i ++) 
+    for (int i = 0; i < n; i ++) 
     {
-        for (int j = 0; j < im.h; j ++) 
-        {
-            float red   = get_pixel(im, i, j, 0);
-            float green = get_pixel(im, i, j, 1);
-            float blue  = get_pixel(im, i, j, 2);
-            
-            set_pixel(gray, i, j, 0, red * 0.299 + green * 0.587 + blue * 0.114);
-        }
+        gray[i] = red[i] * 0.299f + green[i] * 0.587f + blue[i] * 0.114f;
     }
-    return gray;
 }
 
 void shift_image(image im, int c, float v)
@@ -135,12 +192,57 @@ void shift_image(image im, int c, float v)
      * 
     */ 
     
-    for (int i = 0; i < im.w; i ++)
+    if (c < 0 || c >= im.c) return;
+    
+    float *plane = image_plane(im, c);
+    int n = image_plane_size(im);
+    
+    for (int i = 0; i < n; i ++) plane[i] += v;
+}
+
+void scale_image(image im, int c, float v)
+{
+    /**
+     * Scales all the pixels in a channel of the given image by some value v.
+     * 
+     * Like shift_image, only the plane of channel c is read and written,
+     * in one contiguous loop the compiler vectorizes. Scaling the
+     * saturation of an HSV image makes its colors more or less vivid.
+     * 
+     * @param[out] im the image to scale
+     * @param[in] c the channel to scale
+     * @param[in] v the value by which to scale
+     * 
+     */
+    
+    if (c < 0 || c >= im.c) return;
+    
+    float *plane = image_plane(im, c);
+    int n = image_plane_size(im);
+    
+    for (int i = 0; i < n; i ++) plane[i] *= v;
+}
+
+void scale_image_channels(image im, const float *v)
+{
+    /**
+     * Scales every channel of an image by its own value in one call.
+     * 
+     * The planes are walked one after the other, so the whole image is
+     * read and written once whatever the number of channels.
+     * 
+     * @param[out] im the image to scale
+     * @param[in] v im.c values, v[c] for channel c
+     * 
+     */
+    
+    int n = image_plane_size(im);
+    for (int c = 0; c < im.c; c ++)
     {
-        for (int j = 0; j < im.h; j ++)
-        {
-            set_pixel(im, i, j, c, get_pixel(im, i, j, c) + v);
-        }
+        float *plane = image_plane(im, c);
+        float s = v[c];
+        if (s == 1) continue;
+        for (int i = 0; i < n; i ++) plane[i] *= s;
     }
 }
 
@@ -158,16 +260,14 @@ void clamp_image(image im)
      * 
     */ 
     
-    for (int i = 0; i < im.w; i ++)
+    float *data = im.data;
+    int n = im.w * im.h * im.c;
+    
+    for (int i = 0; i < n; i ++)
     {
-        for (int j = 0; j < im.h; j ++)
-        { 
-            for (int c = 0; c < im.c; c ++)
-            {
-                if (get_pixel(im, i, j, c) > 1) set_pixel(im, i, j, c, 1);
-                if (get_pixel(im, i, j, c) < 0) set_pixel(im, i, j, c, 0);
-            }
-        }
+        float v = data[i];
+        v = v > 1 ? 1 : v;
+        data[i] = v < 0 ? 0 : v;
     }
 }
 
@@ -218,39 +318,50 @@ void rgb_to_hsv(image im)
      * 
      */
     
-    for (int w = 0; w < im.w; w ++)
+    INSTRUMENT_FUNCTION();
+
+    assert(im.c == 3); // The image must have three channels
+    color_args a = {image_plane(im, 0), image_plane(im, 1), image_plane(im, 2), 0};
+    parallel_for(image_plane_size(im), PIXEL_GRAIN, rgb_to_hsv_band, &a);
+}
+
+void rgb_to_hsv_scalar(float *r, float *g, float *b, int n)
+{
+    /**
+     * Reference RGB to HSV kernel, in place over n pixels of three planes.
+     * 
+     */
+    
+    for (int i = 0; i < n; i ++)
     {
-        for (int h = 0; h < im.h; h ++) 
-        {
-            float red = get_pixel(im, w, h, 0);
-            float green = get_pixel(im, w, h, 1);
-            float blue = get_pixel(im, w, h, 2);
-            
-            // the largest of the RGB components is the Value
-            float value = three_way_max(red, green, blue);
-            float min = three_way_min(red, green, blue);
-            
-            float diff = value - min;
+        float red = r[i];
+        float green = g[i];
+        float blue = b[i];
+        
+        // the largest of the RGB components is the Value
+        float value = three_way_max(red, green, blue);
+        float min = three_way_min(red, green, blue);
+        
+        float diff = value - min;
+        
+        float saturation = 0;
+        float hue = 0;
+        
+        // Saturation is the ratio between the difference and value
+        if (value > 0) saturation = diff / value;
+        
+        // if diff is zero, we will leave hue to be zero
+        if (diff != 0) {
+            if (value == red) hue = (green - blue) / diff;
+            else if (value == green) hue = (blue - red) / diff + 2;
+            else hue = (red - green) / diff + 4;
             
-            float saturation = 0;
-            float hue = 0;
-            
-            // Saturation is the ratio between the difference and value
-            if (value > 0) saturation = diff / value;
-            
-            // if diff is zero, we will leave hue to be zero
-            if (diff != 0) {
-                if (value == red) hue = (green - blue) / diff;
-                else if (value == green) hue = (blue - red) / diff + 2;
-                else hue = (red - green) / diff + 4;
-                
-                hue = hue < 0 ? hue / 6 + 1 : hue / 6;
-            }
-                        
-            set_pixel(im, w, h, 0, hue);
-            set_pixel(im, w, h, 1, saturation);
-            set_pixel(im, w, h, 2, value);
+            hue = hue < 0 ? hue / 6 + 1 : hue / 6;
         }
+                    
+        r[i] = hue;
+        g[i] = saturation;
+        b[i] = value;
     }
 }
 
@@ -269,76 +380,310 @@ void hsv_to_rgb(image im)
      * 
      */
     
-    for (int w = 0; w < im.w; w ++)
+    INSTRUMENT_FUNCTION();
+
+    assert(im.c == 3); // The image must have three channels
+    color_args a = {image_plane(im, 0), image_plane(im, 1), image_plane(im, 2), 0};
+    parallel_for(image_plane_size(im), PIXEL_GRAIN, hsv_to_rgb_band, &a);
+}
+
+void hsv_to_rgb_scalar(float *h, float *s, float *v, int n)
+{
+    /**
+     * Reference HSV to RGB kernel, in place over n pixels of three planes.
+     * 
+     */
+    
+    for (int i = 0; i < n; i ++)
     {
-        for (int h = 0; h < im.h; h ++)
+        float hue = h[i];
+        float saturation = s[i];
+        float value = v[i];
+        
+        float red = 0, green = 0, blue = 0;
+        
+        float chroma = value * saturation;
+        float _h = hue * 6.0;
+        
+        float X = chroma * (1 - fabs(fmod(_h, 2.0) - 1));
+        float diff = value - chroma;
+        
+        if (0 <= _h && _h <= 1.0) 
         {
-            float hue = get_pixel(im, w, h, 0);
-            float saturation = get_pixel(im, w, h, 1);
-            float value = get_pixel(im, w, h, 2);
-            
-            float red = 0, green = 0, blue = 0;
-            
-            float chroma = value * saturation;
-            float _h = hue * 6.0;
-            
-            float X = chroma * (1 - fabs(fmod(_h, 2.0) - 1));
-            float diff = value - chroma;
-            
-            if (0 <= _h && _h <= 1.0) 
-            {
-                red = chroma;
-                green = X;
-                blue = 0;
-            }
-            
-            else if (1.0 <= _h && _h <= 2.0)
-            {
-                red = X;
-                green = chroma;
-                blue = 0;
-            }
-            
-            else if (2.0 <= _h && _h <= 3.0)
-            {
-                red = 0;
-                green = chroma;
-                blue = X;
-            }
-            
-            else if (3.0 <= _h && _h <= 4.0)
-            {
-                red = 0;
-                green = X;
-                blue = chroma;
-            }
-            
-            else if (4.0 <= _h && _h <= 5.0) 
-            {
-                red = X;
-                green = 0;
-                blue = chroma;
-            }
-            
-            else if (5.0 <= _h && _h <=6.0)
-            {
-                red = chroma;
-                green = 0;
-                blue = X;
-            }
-            
-            else
+            red = chroma;
+            green = X;
+            blue = 0;
+        }
+        
+        else if (1.0 <= _h && _h <= 2.0)
+        {
+            red = X;
+            green = chroma;
+            blue = 0;
+        }
+        
+        else if (2.0 <= _h && _h <= 3.0)
+        {
+            red = 0;
+            green = chroma;
+            blue = X;
+        }
+        
+        else if (3.0 <= _h && _h <= 4.0)
+        {
+            red = 0;
+            green = X;
+            blue = chroma;
+        }
+        
+        else if (4.0 <= _h && _h <= 5.0) 
+        {
+            red = X;
+            green = 0;
+            blue = chroma;
+        }
+        
+        else if (5.0 <= _h && _h <=6.0)
+        {
+            red = chroma;
+            green = 0;
+            blue = X;
+        }
+        
+        else
+        {
+            red = green = blue = 0;
+        }
+        
+        red += diff;
+        green += diff;
+        blue += diff;
+        
+        h[i] = red;
+        s[i] = green;
+        v[i] = blue;
+    }
+}
+
+// ---- Views ----
+//
+// A view is a rectangle (or a single channel) of another buffer's pixels,
+// described by a row stride and a plane stride instead of being copied out.
+// The kernels below walk a view row by row, and hand whole views that are
+// laid out like an image straight to the image kernels.
+
+image_view view_image(image im)
+{
+    // The whole of an image, as a view
+    image_view v = {im.w, im.h, im.c, im.w, im.w * im.h, im.data};
+    return v;
+}
+
+image_view view_region(image_view v, int x, int y, int w, int h)
+{
+    /**
+     * Views a rectangle of a view, without copying it.
+     * 
+     * Writing through the view writes the pixels it points at; it is only
+     * valid as long as the buffer under it is.
+     * 
+     * @param v the view to look into, view_image(im) for an image
+     * @param x, y the top left corner of the rectangle in v
+     * @param w, h the size of the rectangle, which must lie inside v
+     * 
+     * @returns a w x h view with the channels of v
+     * 
+     */
+    
+    assert(w > 0 && h > 0 && x >= 0 && y >= 0 && x + w <= v.w && y + h <= v.h);
+    image_view r = v;
+    r.w = w;
+    r.h = h;
+    r.data = view_row(v, y, 0) + x;
+    return r;
+}
+
+image_view view_channel(image_view v, int c)
+{
+    // One channel of a view, as a single channel view
+    assert(c >= 0 && c < v.c);
+    image_view r = v;
+    r.c = 1;
+    r.data = view_row(v, 0, c);
+    return r;
+}
+
+float get_view_pixel(image_view v, int x, int y, int c)
+{
+    // Same as get_pixel, clamping to the view's own borders
+    return view_row(v, clamp_index(y, v.h), clamp_index(c, v.c))[clamp_index(x, v.w)];
+}
+
+void set_view_pixel(image_view v, int x, int y, int c, float val)
+{
+    // Same as set_pixel: coordinates outside the view are ignored
+    if (x < 0 || y < 0 || c < 0 || x >= v.w || y >= v.h || c >= v.c) return;
+    view_row(v, y, c)[x] = val;
+}
+
+image copy_view(image_view v)
+{
+    // The pixels of a view, copied into a new image
+    image copy = make_image_uninit(v.w, v.h, v.c);
+    copy_view_into(copy, v);
+    return copy;
+}
+
+void copy_view_into(image dst, image_view v)
+{
+    assert(dst.w == v.w && dst.h == v.h && dst.c == v.c);
+    for (int c = 0; c < v.c; c ++)
+    {
+        for (int y = 0; y < v.h; y ++) memcpy(image_row(dst, y, c), view_row(v, y, c), v.w * sizeof(float));
+    }
+}
+
+void copy_image_to_view(image_view dst, image im)
+{
+    // Pastes an image into the pixels a view points at
+    assert(dst.w == im.w && dst.h == im.h && dst.c == im.c);
+    for (int c = 0; c < im.c; c ++)
+    {
+        for (int y = 0; y < im.h; y ++) memcpy(view_row(dst, y, c), image_row(im, y, c), im.w * sizeof(float));
+    }
+}
+
+void shift_view(image_view v, int c, float val)
+{
+    // Same as shift_image, on the pixels of a view
+    if (c < 0 || c >= v.c) return;
+    for (int y = 0; y < v.h; y ++)
+    {
+        float *row = view_row(v, y, c);
+        for (int x = 0; x < v.w; x ++) row[x] += val;
+    }
+}
+
+void scale_view(image_view v, int c, float val)
+{
+    // Same as scale_image, on the pixels of a view
+    if (c < 0 || c >= v.c) return;
+    for (int y = 0; y < v.h; y ++)
+    {
+        float *row = view_row(v, y, c);
+        for (int x = 0; x < v.w; x ++) row[x] *= val;
+    }
+}
+
+void clamp_view(image_view v)
+{
+    // Same as clamp_image, on the pixels of a view
+    for (int c = 0; c < v.c; c ++)
+    {
+        for (int y = 0; y < v.h; y ++)
+        {
+            float *row = view_row(v, y, c);
+            for (int x = 0; x < v.w; x ++)
             {
-                red = green = blue = 0;
+                float p = row[x] > 1 ? 1 : row[x];
+                row[x] = p < 0 ? 0 : p;
             }
-            
-            red += diff;
-            green += diff;
-            blue += diff;
-            
-            set_pixel(im, w, h, 0, red);
-            set_pixel(im, w, h, 1, green);
-            set_pixel(im, w, h, 2, blue);
         }
     }
 }
+
+typedef struct{
+    image_view v;
+    image out;
+} view_color_args;
+
+static void grayscale_view_band(void *ctx, int y0, int y1)
+{
+    view_color_args *a = ctx;
+    const color_kernels *k = get_color_kernels();
+    for (int y = y0; y < y1; y ++)
+    {
+        k->rgb_to_grayscale(view_row(a->v, y, 0), view_row(a->v, y, 1), view_row(a->v, y, 2),
+                            image_row(a->out, y, 0), a->v.w);
+    }
+}
+
+static void rgb_to_hsv_view_band(void *ctx, int y0, int y1)
+{
+    view_color_args *a = ctx;
+    const color_kernels *k = get_color_kernels();
+    for (int y = y0; y < y1; y ++)
+    {
+        k->rgb_to_hsv(view_row(a->v, y, 0), view_row(a->v, y, 1), view_row(a->v, y, 2), a->v.w);
+    }
+}
+
+static void hsv_to_rgb_view_band(void *ctx, int y0, int y1)
+{
+    view_color_args *a = ctx;
+    const color_kernels *k = get_color_kernels();
+    for (int y = y0; y < y1; y ++)
+    {
+        k->hsv_to_rgb(view_row(a->v, y, 0), view_row(a->v, y, 1), view_row(a->v, y, 2), a->v.w);
+    }
+}
+
+image rgb_to_grayscale_view(image_view v)
+{
+    image gray = make_image_uninit(v.w, v.h, 1);
+    rgb_to_grayscale_view_into(gray, v);
+    return gray;
+}
+
+void rgb_to_grayscale_view_into(image gray, image_view v)
+{
+    /**
+     * Same as rgb_to_grayscale_into, reading the pixels of a view.
+     * 
+     * @param[out] gray v.w x v.h x 1 destination image
+     * @param v the three channel source view
+     * 
+     */
+    
+    INSTRUMENT_FUNCTION();
+
+    assert(v.c == 3);
+    assert(gray.w == v.w && gray.h == v.h && gray.c == 1);
+    if (view_is_image(v))
+    {
+        rgb_to_grayscale_into(gray, view_as_image(v));
+        return;
+    }
+    view_color_args a = {v, gray};
+    parallel_for(v.h, row_grain(v.w), grayscale_view_band, &a);
+}
+
+void rgb_to_hsv_view(image_view v)
+{
+    // Same as rgb_to_hsv, in place on the pixels of a view
+    INSTRUMENT_FUNCTION();
+
+    assert(v.c == 3);
+    if (view_is_image(v))
+    {
+        rgb_to_hsv(view_as_image(v));
+        return;
+    }
+    view_color_args a = {v};
+    parallel_for(v.h, row_grain(v.w), rgb_to_hsv_view_band, &a);
+}
+
+void hsv_to_rgb_view(image_view v)
+{
+    // Same as hsv_to_rgb, in place on the pixels of a view
+    INSTRUMENT_FUNCTION();
+
+    assert(v.c == 3);
+    if (view_is_image(v))
+    {
+        hsv_to_rgb(view_as_image(v));
+        return;
+    }
+    view_color_args a = {v};
+    parallel_for(v.h, row_grain(v.w), hsv_to_rgb_view_band, &a);
+}
@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include "image.h"
+#include "pixel_access.h"
+#include "parallel.h"
+#include "image_pool.h"
+#include "instrument.h"
+
+// Gaussian and Laplacian pyramids.
+//
+// gaussian_downsample blurs with the 5 tap binomial filter 1 4 6 4 1 / 16
+// in both directions and keeps every other pixel, but only ever computes
+// the pixels it keeps: each output row sums five source rows into a padded
+// row buffer, and the horizontal taps are then run at the even columns
+// only. That is 15 multiply adds per output pixel, where blurring the whole
+// image and then dropping three pixels in four costs 100.
+//
+// An image_pyramid holds the levels of one image, built the first time
+// they are asked for and kept until the pyramid is freed, so multi-scale
+// queries against the same image only pay for each level once. Gaussian
+// level i + 1 is gaussian_downsample of level i; Laplacian level i is
+// Gaussian level i minus level i + 1 resized back up with bilinear_resize,
+// and the last Laplacian level is the last Gaussian level itself.
+
+struct image_pyramid{
+    int levels;
+    image *gaussian;        // gaussian[0] is the caller's image
+    image *laplacian;       // the last level is gaussian[levels - 1]
+    pthread_mutex_t lock;
+};
+
+typedef struct{
+    image im;
+    image out;
+} downsample_args;
+
+static void downsample_band(void *ctx, int r0, int r1)
+{
+    downsample_args *a = ctx;
+    image im = a->im, out = a->out;
+    int w = im.w;
+    image buffer = scratch_image(w + 4, 1, 1);
+    float *t = buffer.data;
+
+    for (int z = 0; z < im.c; z ++)
+    {
+        for (int y = r0; y < r1; y ++)
+        {
+            const float *s0 = image_row_clamped(im, 2 * y - 2, z);
+            const float *s1 = image_row_clamped(im, 2 * y - 1, z);
+            const float *s2 = image_row_clamped(im, 2 * y, z);
+            const float *s3 = image_row_clamped(im, 2 * y + 1, z);
+            const float *s4 = image_row_clamped(im, 2 * y + 2, z);
+            float *v = t + 2;
+            for (int x = 0; x < w; x ++)
+            {
+                v[x] = (s0[x] + s4[x] + 4 * (s1[x] + s3[x]) + 6 * s2[x]) * (1.f / 16);
+            }
+            t[0] = t[1] = v[0];
+            v[w] = v[w + 1] = v[w - 1];
+
+            float *dst = image_row(out, y, z);
+            for (int x = 0; x < out.w; x ++)
+            {
+                const float *p = t + 2 * x;
+                dst[x] = (p[0] + p[4] + 4 * (p[1] + p[3]) + 6 * p[2]) * (1.f / 16);
+            }
+        }
+    }
+    release_scratch_image(buffer);
+}
+
+image gaussian_downsample(image im)
+{
+    /**
+     * Blurs an image with a 5 x 5 binomial filter and halves it.
+     * 
+     * Pixel (x, y) of the result is pixel (2x, 2y) of
+     * convolve_image(im, f, 1), where f is the outer product of
+     * 1 4 6 4 1 / 16 with itself, borders clamped the same way.
+     * 
+     * @param im the image to reduce
+     * 
+     * @returns a (im.w + 1) / 2 x (im.h + 1) / 2 image
+     * 
+     */
+
+    image out = make_image_uninit((im.w + 1) / 2, (im.h + 1) / 2, im.c);
+    gaussian_downsample_into(out, im);
+    return out;
+}
+
+void gaussian_downsample_into(image out, image im)
+{
+    /**
+     * Same as gaussian_downsample, writing into a caller's image.
+     * 
+     * @param[out] out a (im.w + 1) / 2 x (im.h + 1) / 2 image with the
+     * channels of im
+     * @param im the image to reduce
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(out.w == (im.w + 1) / 2 && out.h == (im.h + 1) / 2 && out.c == im.c);
+    downsample_args a = {im, out};
+    parallel_for(out.h, row_grain(im.w * 3 * im.c), downsample_band, &a);
+}
+
+image_pyramid *make_image_pyramid(image im, int levels)
+{
+    /**
+     * Makes a pyramid of an image, without building any of its levels.
+     * 
+     * Level 0 is im itself, which must stay alive and unchanged for as
+     * long as the pyramid is used. Each level after it is half the size of
+     * the one before, rounded up.
+     * 
+     * @param im the finest level
+     * @param levels how many levels, or 0 for as many as it takes to get
+     * one side down to a single pixel; larger counts are cut down to that
+     * 
+     * @returns the pyramid; free it with free_image_pyramid
+     * 
+     */
+
+    int max = 1;
+    for (int w = im.w, h = im.h; w > 1 && h > 1; w = (w + 1) / 2, h = (h + 1) / 2) max ++;
+    if (levels <= 0 || levels > max) levels = max;
+
+    image_pyramid *p = calloc(1, sizeof(image_pyramid));
+    p->levels = levels;
+    p->gaussian = calloc(levels, sizeof(image));
+    p->laplacian = calloc(levels, sizeof(image));
+    p->gaussian[0] = im;
+    pthread_mutex_init(&p->lock, 0);
+    return p;
+}
+
+void free_image_pyramid(image_pyramid *p)
+{
+    if (!p) return;
+    for (int i = 1; i < p->levels; i ++) free_image(p->gaussian[i]);
+    for (int i = 0; i < p->levels - 1; i ++) free_image(p->laplacian[i]);
+    pthread_mutex_destroy(&p->lock);
+    free(p->gaussian);
+    free(p->laplacian);
+    free(p);
+}
+
+int pyramid_levels(image_pyramid *p)
+{
+    return p->levels;
+}
+
+static image gaussian_level(image_pyramid *p, int level)
+{
+    // Builds the missing levels up to this one; the caller holds the lock
+    int i = level;
+    while (!p->gaussian[i].data) i --;
+    for (i ++; i <= level; i ++) p->gaussian[i] = gaussian_downsample(p->gaussian[i - 1]);
+    return p->gaussian[level];
+}
+
+image pyramid_gaussian(image_pyramid *p, int level)
+{
+    /**
+     * Returns a Gaussian level, building it on first use.
+     * 
+     * @param p the pyramid
+     * @param level from 0, the original image, to pyramid_levels(p) - 1
+     * 
+     * @returns the level, which belongs to the pyramid: do not free or
+     * change it
+     * 
+     */
+
+    assert(level >= 0 && level < p->levels);
+    pthread_mutex_lock(&p->lock);
+    image g = gaussian_level(p, level);
+    pthread_mutex_unlock(&p->lock);
+    return g;
+}
+
+image pyramid_laplacian(image_pyramid *p, int level)
+{
+    /**
+     * Returns a Laplacian level, building it (and the Gaussian levels it
+     * needs) on first use.
+     * 
+     * Adding bilinear_resize of Gaussian level + 1 back to the size of
+     * this level gives Gaussian level back; the last Laplacian level is
+     * the last Gaussian level.
+     * 
+     * @param p the pyramid
+     * @param level from 0 to pyramid_levels(p) - 1
+     * 
+     * @returns the level, which belongs to the pyramid: do not free or
+     * change it
+     * 
+     */
+
+    assert(level >= 0 && level < p->levels);
+    pthread_mutex_lock(&p->lock);
+    image l;
+    if (level == p->levels - 1) l = gaussian_level(p, level);
+    else
+    {
+        if (!p->laplacian[level].data)
+        {
+            image fine = gaussian_level(p, level);
+            image coarse = gaussian_level(p, level + 1);
+            image up = make_image_uninit(fine.w, fine.h, fine.c);
+            bilinear_resize_into(up, coarse);
+            sub_image_into(up, fine, up);
+            p->laplacian[level] = up;
+        }
+        l = p->laplacian[level];
+    }
+    pthread_mutex_unlock(&p->lock);
+    return l;
+}
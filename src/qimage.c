@@ -0,0 +1,438 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "image.h"
+#include "parallel.h"
+#include "instrument.h"
+#include "stb_image.h"
+
+// The fixed point kernels below are written once as macros over the
+// sample type and stamped out for uint8_t and uint16_t, so each inner loop
+// is a plain typed loop the compiler can vectorize. Samples are integers
+// in [0, max] with max = 255 or 65535 standing for 1.0; intermediate sums
+// are kept in 32 (or 64) bits and rounded once at the end.
+
+static inline int qimage_bytes(qimage_type type)
+{
+    return type == QIMAGE_U16 ? 2 : 1;
+}
+
+static inline int qimage_max(qimage_type type)
+{
+    return type == QIMAGE_U16 ? 65535 : 255;
+}
+
+static inline size_t qimage_plane_size(qimage im)
+{
+    return (size_t)im.w * im.h;
+}
+
+qimage make_qimage(int w, int h, int c, qimage_type type)
+{
+    /**
+     * Makes a zeroed fixed point image.
+     * 
+     * @param w, h, c the size of the image
+     * @param type QIMAGE_U8 or QIMAGE_U16 samples
+     * 
+     * @returns the image, freed with free_qimage
+     * 
+     */
+
+    qimage im;
+    im.w = w;
+    im.h = h;
+    im.c = c;
+    im.type = type;
+    im.data = calloc((size_t)w * h * c, qimage_bytes(type));
+    if (im.data) INSTRUMENT_ALLOC((size_t)w * h * c * qimage_bytes(type));
+    return im;
+}
+
+void free_qimage(qimage im)
+{
+    if (im.data) INSTRUMENT_FREE((size_t)im.w * im.h * im.c * qimage_bytes(im.type));
+    free(im.data);
+}
+
+// ---- Conversion to and from float images ----
+
+#define DEFINE_TO_FIXED(T) \
+static void to_fixed_##T(const float *src, T *dst, size_t n, float max) \
+{ \
+    for (size_t i = 0; i < n; i ++) \
+    { \
+        float v = src[i]; \
+        v = v > 0 ? v : 0; \
+        v = v < 1 ? v : 1; \
+        dst[i] = (T)(v * max + .5f); \
+    } \
+}
+
+#define DEFINE_TO_FLOAT(T) \
+static void to_float_##T(const T *src, float *dst, size_t n, float scale) \
+{ \
+    for (size_t i = 0; i < n; i ++) dst[i] = src[i] * scale; \
+}
+
+DEFINE_TO_FIXED(uint8_t)
+DEFINE_TO_FIXED(uint16_t)
+DEFINE_TO_FLOAT(uint8_t)
+DEFINE_TO_FLOAT(uint16_t)
+
+qimage image_to_qimage(image im, qimage_type type)
+{
+    /**
+     * Converts a float image to fixed point, clamping to [0, 1] and
+     * rounding to the nearest step.
+     * 
+     */
+
+    qimage q = make_qimage(im.w, im.h, im.c, type);
+    size_t n = qimage_plane_size(q) * q.c;
+    if (type == QIMAGE_U16) to_fixed_uint16_t(im.data, q.data, n, qimage_max(type));
+    else to_fixed_uint8_t(im.data, q.data, n, qimage_max(type));
+    return q;
+}
+
+image qimage_to_image(qimage q)
+{
+    /**
+     * Converts a fixed point image back to float, in [0, 1].
+     * 
+     */
+
+    image im = make_image_uninit(q.w, q.h, q.c);
+    size_t n = qimage_plane_size(q) * q.c;
+    float scale = 1.0f / qimage_max(q.type);
+    if (q.type == QIMAGE_U16) to_float_uint16_t(q.data, im.data, n, scale);
+    else to_float_uint8_t(q.data, im.data, n, scale);
+    return im;
+}
+
+#define DEFINE_DEINTERLEAVE(T) \
+static void deinterleave_##T(const T *src, int stride, T *dst, int c, size_t n) \
+{ \
+    for (int k = 0; k < c; k ++) \
+    { \
+        T *plane = dst + k * n; \
+        for (size_t i = 0; i < n; i ++) plane[i] = src[i * stride + k]; \
+    } \
+}
+
+DEFINE_DEINTERLEAVE(uint8_t)
+DEFINE_DEINTERLEAVE(uint16_t)
+
+qimage load_qimage(char *filename, qimage_type type)
+{
+    /**
+     * Loads an image file straight into fixed point, never going through
+     * float. As with load_image an alpha channel is dropped. 16 bit PNGs
+     * keep their full precision as QIMAGE_U16; 8 bit files are widened.
+     * 
+     * @returns the image, or one with no data if the file cannot be read
+     * 
+     */
+
+    int w, h, c;
+    void *data = type == QIMAGE_U16 ? (void *)stbi_load_16(filename, &w, &h, &c, 0)
+                                    : (void *)stbi_load(filename, &w, &h, &c, 0);
+    if (!data)
+    {
+        fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n", filename, stbi_failure_reason());
+        qimage empty = {0, 0, 0, type, 0};
+        return empty;
+    }
+
+    qimage q = make_qimage(w, h, c == 4 ? 3 : c, type);
+    if (type == QIMAGE_U16) deinterleave_uint16_t(data, c, q.data, q.c, qimage_plane_size(q));
+    else deinterleave_uint8_t(data, c, q.data, q.c, qimage_plane_size(q));
+    stbi_image_free(data);
+    return q;
+}
+
+// ---- Grayscale ----
+
+typedef struct{
+    qimage im;
+    qimage out;
+} qimage_args;
+
+// Luma weights 0.299, 0.587, 0.114 in 16 bit fixed point, summing to 1 << 16
+#define LUMA_R 19595u
+#define LUMA_G 38470u
+#define LUMA_B 7471u
+
+#define DEFINE_GRAY(T) \
+static void gray_##T(const T *r, const T *g, const T *b, T *out, int n) \
+{ \
+    for (int i = 0; i < n; i ++) \
+    { \
+        out[i] = (T)((LUMA_R * r[i] + LUMA_G * g[i] + LUMA_B * b[i] + (1u << 15)) >> 16); \
+    } \
+}
+
+DEFINE_GRAY(uint8_t)
+DEFINE_GRAY(uint16_t)
+
+static void gray_band(void *ctx, int i0, int i1)
+{
+    qimage_args *a = ctx;
+    size_t n = qimage_plane_size(a->im);
+    if (a->im.type == QIMAGE_U16)
+    {
+        const uint16_t *src = a->im.data;
+        gray_uint16_t(src + i0, src + n + i0, src + 2 * n + i0, (uint16_t *)a->out.data + i0, i1 - i0);
+    }
+    else
+    {
+        const uint8_t *src = a->im.data;
+        gray_uint8_t(src + i0, src + n + i0, src + 2 * n + i0, (uint8_t *)a->out.data + i0, i1 - i0);
+    }
+}
+
+qimage qimage_rgb_to_grayscale(qimage im)
+{
+    /**
+     * Fixed point version of rgb_to_grayscale.
+     * 
+     * @param im three channel image
+     * 
+     * @returns single channel image of the same type
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(im.c == 3);
+    qimage out = make_qimage(im.w, im.h, 1, im.type);
+    qimage_args a = {im, out};
+    parallel_for(im.w * im.h, PIXEL_GRAIN, gray_band, &a);
+    return out;
+}
+
+// ---- Resizing ----
+
+typedef struct{
+    qimage im;
+    qimage out;
+    const resize_plan *plan;
+    const uint32_t *wx;     // Q8 weights of x1 per output column
+} qresize_args;
+
+#define QWEIGHT_BITS 8
+#define QWEIGHT_ONE (1u << QWEIGHT_BITS)
+
+#define DEFINE_RESIZE_ROW(T) \
+static void resize_row_##T(const T *top, const T *bot, uint32_t wy, T *dst, int w, \
+                           const resize_plan *p, const uint32_t *wx) \
+{ \
+    const int *x0 = p->x0, *x1 = p->x1; \
+    if (p->mode == RESIZE_NN) \
+    { \
+        for (int col = 0; col < w; col ++) dst[col] = top[x0[col]]; \
+        return; \
+    } \
+    for (int col = 0; col < w; col ++) \
+    { \
+        uint32_t a = top[x0[col]] * (QWEIGHT_ONE - wx[col]) + top[x1[col]] * wx[col]; \
+        uint32_t b = bot[x0[col]] * (QWEIGHT_ONE - wx[col]) + bot[x1[col]] * wx[col]; \
+        dst[col] = (T)(((uint64_t)a * (QWEIGHT_ONE - wy) + (uint64_t)b * wy \
+                        + (1u << (2 * QWEIGHT_BITS - 1))) >> (2 * QWEIGHT_BITS)); \
+    } \
+}
+
+DEFINE_RESIZE_ROW(uint8_t)
+DEFINE_RESIZE_ROW(uint16_t)
+
+static inline uint32_t qweight(float f)
+{
+    return (uint32_t)(f * QWEIGHT_ONE + .5f);
+}
+
+static void qresize_band(void *ctx, int r0, int r1)
+{
+    qresize_args *a = ctx;
+    const resize_plan *p = a->plan;
+    qimage im = a->im, out = a->out;
+    size_t src_plane = qimage_plane_size(im), dst_plane = qimage_plane_size(out);
+
+    for (int z = 0; z < out.c; z ++)
+    {
+        for (int row = r0; row < r1; row ++)
+        {
+            size_t top = z * src_plane + (size_t)p->y0[row] * im.w;
+            size_t bot = z * src_plane + (size_t)p->y1[row] * im.w;
+            size_t dst = z * dst_plane + (size_t)row * out.w;
+            uint32_t wy = qweight(p->fy[row]);
+            if (im.type == QIMAGE_U16)
+            {
+                const uint16_t *src = im.data;
+                resize_row_uint16_t(src + top, src + bot, wy, (uint16_t *)out.data + dst, out.w, p, a->wx);
+            }
+            else
+            {
+                const uint8_t *src = im.data;
+                resize_row_uint8_t(src + top, src + bot, wy, (uint8_t *)out.data + dst, out.w, p, a->wx);
+            }
+        }
+    }
+}
+
+qimage qimage_resize_with_plan(qimage im, const resize_plan *plan)
+{
+    /**
+     * Fixed point version of resize_with_plan.
+     * 
+     * Bilinear weights are rounded to 8 bits, so results are within one
+     * step of the float resize.
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(im.w == plan->src_w && im.h == plan->src_h);
+    qimage out = make_qimage(plan->dst_w, plan->dst_h, im.c, im.type);
+
+    uint32_t *wx = malloc(plan->dst_w * sizeof(uint32_t));
+    for (int i = 0; i < plan->dst_w; i ++) wx[i] = qweight(plan->fx[i]);
+
+    qresize_args a = {im, out, plan, wx};
+    parallel_for(plan->dst_h, row_grain(plan->dst_w * im.c), qresize_band, &a);
+    free(wx);
+    return out;
+}
+
+qimage qimage_nn_resize(qimage im, int w, int h)
+{
+    INSTRUMENT_FUNCTION();
+    resize_plan *plan = make_resize_plan(im.w, im.h, w, h, RESIZE_NN);
+    qimage out = qimage_resize_with_plan(im, plan);
+    free_resize_plan(plan);
+    return out;
+}
+
+qimage qimage_bilinear_resize(qimage im, int w, int h)
+{
+    INSTRUMENT_FUNCTION();
+    resize_plan *plan = make_resize_plan(im.w, im.h, w, h, RESIZE_BILINEAR);
+    qimage out = qimage_resize_with_plan(im, plan);
+    free_resize_plan(plan);
+    return out;
+}
+
+// ---- Box blur ----
+
+typedef struct{
+    qimage im;
+    qimage out;
+    int z;
+    int k;
+    uint32_t *sums;     // horizontal window sums of plane z
+} qblur_args;
+
+static inline int qclamp(int i, int n)
+{
+    return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+#define DEFINE_BOX_ROWS(T) \
+static void box_rows_##T(const T *src, uint32_t *sums, int w, int k) \
+{ \
+    /* Sliding window along the row, borders clamped like convolve_image */ \
+    int left = k / 2; \
+    uint32_t s = 0; \
+    for (int i = 0; i < k; i ++) s += src[qclamp(i - left, w)]; \
+    for (int x = 0; x < w; x ++) \
+    { \
+        sums[x] = s; \
+        s += src[qclamp(x + k - left, w)]; \
+        s -= src[qclamp(x - left, w)]; \
+    } \
+}
+
+#define DEFINE_BOX_COLS(T) \
+static void box_cols_##T(const uint32_t *sums, T *dst, uint64_t *acc, int w, int h, \
+                         int y0, int y1, int k) \
+{ \
+    int top = k / 2; \
+    uint64_t n = (uint64_t)k * k; \
+    for (int x = 0; x < w; x ++) acc[x] = 0; \
+    for (int j = 0; j < k; j ++) \
+    { \
+        const uint32_t *row = sums + (size_t)qclamp(y0 + j - top, h) * w; \
+        for (int x = 0; x < w; x ++) acc[x] += row[x]; \
+    } \
+    for (int y = y0; y < y1; y ++) \
+    { \
+        T *out = dst + (size_t)y * w; \
+        for (int x = 0; x < w; x ++) out[x] = (T)((acc[x] + n / 2) / n); \
+        const uint32_t *in = sums + (size_t)qclamp(y + k - top, h) * w; \
+        const uint32_t *gone = sums + (size_t)qclamp(y - top, h) * w; \
+        for (int x = 0; x < w; x ++) acc[x] += in[x] - (uint64_t)gone[x]; \
+    } \
+}
+
+DEFINE_BOX_ROWS(uint8_t)
+DEFINE_BOX_ROWS(uint16_t)
+DEFINE_BOX_COLS(uint8_t)
+DEFINE_BOX_COLS(uint16_t)
+
+static void box_rows_band(void *ctx, int y0, int y1)
+{
+    qblur_args *a = ctx;
+    size_t plane = qimage_plane_size(a->im);
+    for (int y = y0; y < y1; y ++)
+    {
+        size_t off = a->z * plane + (size_t)y * a->im.w;
+        uint32_t *sums = a->sums + (size_t)y * a->im.w;
+        if (a->im.type == QIMAGE_U16) box_rows_uint16_t((const uint16_t *)a->im.data + off, sums, a->im.w, a->k);
+        else box_rows_uint8_t((const uint8_t *)a->im.data + off, sums, a->im.w, a->k);
+    }
+}
+
+static void box_cols_band(void *ctx, int y0, int y1)
+{
+    qblur_args *a = ctx;
+    int w = a->im.w, h = a->im.h;
+    size_t off = a->z * qimage_plane_size(a->im);
+    uint64_t *acc = malloc(w * sizeof(uint64_t));
+    if (a->im.type == QIMAGE_U16) box_cols_uint16_t(a->sums, (uint16_t *)a->out.data + off, acc, w, h, y0, y1, a->k);
+    else box_cols_uint8_t(a->sums, (uint8_t *)a->out.data + off, acc, w, h, y0, y1, a->k);
+    free(acc);
+}
+
+qimage qimage_box_blur(qimage im, int w)
+{
+    /**
+     * Fixed point version of convolving with make_box_filter(w).
+     * 
+     * Each channel takes a sliding window sum along the rows and then down
+     * the columns, so the cost per pixel does not depend on w, and the
+     * exact integer sum is rounded once at the end.
+     * 
+     * @param im the image to blur
+     * @param w the width of the box
+     * 
+     * @returns the blurred image, of the same type
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(w > 0);
+    qimage out = make_qimage(im.w, im.h, im.c, im.type);
+    uint32_t *sums = malloc(qimage_plane_size(im) * sizeof(uint32_t));
+
+    for (int z = 0; z < im.c; z ++)
+    {
+        qblur_args a = {im, out, z, w, sums};
+        parallel_for(im.h, row_grain(im.w), box_rows_band, &a);
+        parallel_for(im.h, row_grain(im.w * 2), box_cols_band, &a);
+    }
+
+    free(sums);
+    return out;
+}
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "image_pool.h"
+#include "instrument.h"
+
+// Raw float images.
+//
+// A raw file is a 64 byte header followed by the pixels exactly as they
+// sit in an image: planar float32, channel by channel, rows top to bottom,
+// in the byte order of the machine that wrote it. Loading maps the file
+// and points the image at the pixels, so nothing is decoded or copied.
+// The mapping is private: writing to the image never changes the file.
+//
+// Mapped images are freed with free_image like any other, which looks the
+// data pointer up in the table of mappings below and unmaps it.
+
+#define RAW_MAGIC "UWIMGRAW"
+#define RAW_VERSION 1
+#define RAW_BYTE_ORDER 0x01020304u
+#define RAW_HEADER_SIZE 64
+
+typedef struct{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    int32_t w, h, c;
+    char reserved[RAW_HEADER_SIZE - 28];
+} raw_header;
+
+_Static_assert(sizeof(raw_header) == RAW_HEADER_SIZE, "raw header must keep the pixels aligned");
+
+typedef struct{
+    float *data;
+    void *base;
+    size_t length;
+} raw_mapping;
+
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+static raw_mapping *mappings;
+static int mapping_count, mapping_cap;
+
+static void add_mapping(float *data, void *base, size_t length)
+{
+    pthread_mutex_lock(&mappings_lock);
+    if (mapping_count == mapping_cap)
+    {
+        mapping_cap = mapping_cap ? 2 * mapping_cap : 16;
+        mappings = realloc(mappings, mapping_cap * sizeof(raw_mapping));
+    }
+    raw_mapping m = {data, base, length};
+    mappings[mapping_count] = m;
+    __atomic_store_n(&mapping_count, mapping_count + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&mappings_lock);
+}
+
+int release_mapped_image(image im)
+{
+    /**
+     * Unmaps the file behind an image from load_image_raw.
+     * 
+     * @returns 1 if im was mapped (and is now unmapped), 0 otherwise
+     * 
+     */
+
+    // Most programs never map anything; don't take the lock for them
+    if (!im.data || __atomic_load_n(&mapping_count, __ATOMIC_ACQUIRE) == 0) return 0;
+
+    pthread_mutex_lock(&mappings_lock);
+    int found = 0;
+    for (int i = 0; i < mapping_count; i ++)
+    {
+        if (mappings[i].data != im.data) continue;
+        munmap(mappings[i].base, mappings[i].length);
+        mappings[i] = mappings[mapping_count - 1];
+        __atomic_store_n(&mapping_count, mapping_count - 1, __ATOMIC_RELEASE);
+        found = 1;
+        break;
+    }
+    pthread_mutex_unlock(&mappings_lock);
+    return found;
+}
+
+int save_image_raw(image im, const char *name)
+{
+    /**
+     * Saves an image losslessly to name.raw.
+     * 
+     * The file is written next to its final name and renamed into place,
+     * so a process that has the old file mapped keeps seeing the old data
+     * instead of a half written file.
+     * 
+     * @param im the image to save
+     * @param name the file name, without extension
+     * 
+     * @returns 1 on success, 0 on failure
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    char *final = malloc(strlen(name) + 5);
+    char *tmp = malloc(strlen(name) + 9);
+    sprintf(final, "%s.raw", name);
+    sprintf(tmp, "%s.raw.tmp", name);
+
+    raw_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RAW_MAGIC, sizeof(header.magic));
+    header.version = RAW_VERSION;
+    header.byte_order = RAW_BYTE_ORDER;
+    header.w = im.w;
+    header.h = im.h;
+    header.c = im.c;
+
+    size_t n = (size_t)im.w * im.h * im.c;
+    FILE *f = fopen(tmp, "wb");
+    int success = f && fwrite(&header, sizeof(header), 1, f) == 1
+                    && fwrite(im.data, sizeof(float), n, f) == n;
+    if (f && fclose(f)) success = 0;
+    if (success) success = 0 == rename(tmp, final);
+    if (!success)
+    {
+        fprintf(stderr, "Failed to write image %s\n", final);
+        remove(tmp);
+    }
+
+    free(final);
+    free(tmp);
+    return success;
+}
+
+image load_image_raw(const char *filename)
+{
+    /**
+     * Maps a raw image file as an image without copying it.
+     * 
+     * Pages are read from the file as they are first touched, so loading
+     * costs about the same whatever the size of the image, and the data is
+     * 64 byte aligned like every other image buffer. Free the image with
+     * free_image.
+     * 
+     * @param filename the file, including its extension
+     * 
+     * @returns the image, or one with no data if the file cannot be mapped
+     * or is not a raw image
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    image im = {0, 0, 0, 0};
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Cannot open raw image \"%s\"\n", filename);
+        return im;
+    }
+
+    struct stat st;
+    raw_header header;
+    int valid = 0 == fstat(fd, &st) && st.st_size >= RAW_HEADER_SIZE
+                && sizeof(header) == pread(fd, &header, sizeof(header), 0)
+                && 0 == memcmp(header.magic, RAW_MAGIC, sizeof(header.magic))
+                && header.version == RAW_VERSION && header.byte_order == RAW_BYTE_ORDER
+                && header.w >= 0 && header.h >= 0 && header.c >= 0;
+
+    size_t n = valid ? (size_t)header.w * header.h * header.c : 0;
+    size_t length = RAW_HEADER_SIZE + n * sizeof(float);
+    if (!valid || (size_t)st.st_size < length)
+    {
+        fprintf(stderr, "\"%s\" is not a raw image\n", filename);
+        close(fd);
+        return im;
+    }
+
+    void *base = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map raw image \"%s\"\n", filename);
+        return im;
+    }
+
+    im.w = header.w;
+    im.h = header.h;
+    im.c = header.c;
+    im.data = (float *)((char *)base + RAW_HEADER_SIZE);
+    add_mapping(im.data, base, length);
+    return im;
+}
@@ -862,8 +862,8 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
-// this is not threadsafe
-static const char *stbi__g_failure_reason;
+// thread local, so that a failure in one thread is not reported by another
+static __thread const char *stbi__g_failure_reason;
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -185,7 +185,8 @@ LICENSE
 
 #ifndef STB_IMAGE_WRITE_STATIC  // C++ forbids static forward declarations
 extern int stbi_write_tga_with_rle;
-extern int stbi_write_png_compression_level;
+// thread local, so that each thread's PNG writes use the level it set
+extern __thread int stbi_write_png_compression_level;
 extern int stbi_write_force_png_filter;
 #endif
 
@@ -262,11 +263,11 @@ STBIWDEF void stbi_flip_vertically_on_write(int flip_boolean);
 
 #ifdef STB_IMAGE_WRITE_STATIC
 static int stbi__flip_vertically_on_write=0;
-static int stbi_write_png_compression_level = 8;
+static __thread int stbi_write_png_compression_level = 8;
 static int stbi_write_tga_with_rle = 1;
 static int stbi_write_force_png_filter = -1;
 #else
-int stbi_write_png_compression_level = 8;
+__thread int stbi_write_png_compression_level = 8;
 int stbi__flip_vertically_on_write=0;
 int stbi_write_tga_with_rle = 1;
 int stbi_write_force_png_filter = -1;
@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#include "color_simd.h"
+#include "image_pool.h"
+#include "pixel_access.h"
+#include "instrument.h"
+
+// Strip execution for images that never exist in memory as a whole.
+//
+// Sources hand out rows one at a time in increasing order and sinks take
+// them the same way. Each kernel runs on a strip of output rows at a time.
+// The input rows a strip needs (its own rows plus the halo of the kernel,
+// clamped at the image borders exactly as the in-memory kernels clamp) are
+// gathered into a window that is an ordinary planar image, the in-memory
+// kernel is run on it, and the finished rows go to the sink. Rows a strip
+// shares with the one before are copied over from the previous window, so
+// every source row is read once and peak memory is a few strips.
+
+#define STRIP_FLOATS (1 << 20)
+
+static int default_strip_rows(int w, int c)
+{
+    int rows = STRIP_FLOATS / (w * c > 0 ? w * c : 1);
+    return rows > 8 ? rows : 8;
+}
+
+// ---- Row windows over a source ----
+
+typedef struct{
+    image_source *src;
+    image line;         // one row, w x 1 x c
+    int next;           // next row the source will give us
+    int ok;
+    image win[2];       // current and previous window, w x cap x c
+    int *rows[2];       // source row held by each window row
+    int n[2];           // rows in each window
+    int cur;
+} row_reader;
+
+static void init_reader(row_reader *r, image_source *src, int cap)
+{
+    r->src = src;
+    r->line = scratch_image(src->w, 1, src->c);
+    r->next = 0;
+    r->ok = 1;
+    for (int i = 0; i < 2; i ++)
+    {
+        r->win[i] = scratch_image(src->w, cap, src->c);
+        r->rows[i] = calloc(cap, sizeof(int));
+        r->n[i] = 0;
+    }
+    r->cur = 0;
+}
+
+static void free_reader(row_reader *r)
+{
+    for (int i = 1; i >= 0; i --)
+    {
+        free(r->rows[i]);
+        release_scratch_image(r->win[i]);
+    }
+    release_scratch_image(r->line);
+}
+
+static float *window_row(image win, int n, int i, int c)
+{
+    // Window rows are laid out as an n row planar image
+    return win.data + (size_t)c * win.w * n + (size_t)i * win.w;
+}
+
+static void copy_window_row(image dst, int dst_n, int i, const float *src, size_t src_plane)
+{
+    // src is channel 0 of a row whose channels are src_plane floats apart
+    for (int c = 0; c < dst.c; c ++)
+    {
+        memcpy(window_row(dst, dst_n, i, c), src + c * src_plane, dst.w * sizeof(float));
+    }
+}
+
+static int find_row(const int *rows, int n, int row)
+{
+    // Rows are requested in order, so a match is near the end if anywhere
+    for (int i = n - 1; i >= 0; i --)
+    {
+        if (rows[i] == row) return i;
+        if (rows[i] < row) break;
+    }
+    return -1;
+}
+
+static image gather_rows(row_reader *r, const int *rows, int n)
+{
+    /**
+     * Fills the next window with the given source rows, in order.
+     * 
+     * rows must be nondecreasing from one call to the next, except that a
+     * call may ask again for rows the previous call held.
+     * 
+     * @returns the window, a w x n x c planar image
+     * 
+     */
+
+    int cur = 1 - r->cur, prev = r->cur;
+    image win = r->win[cur];
+    image view = {win.w, n, win.c, win.data};
+    size_t plane = (size_t)win.w * r->n[prev];
+
+    for (int i = 0; i < n; i ++)
+    {
+        int row = rows[i];
+        r->rows[cur][i] = row;
+
+        int j = find_row(r->rows[cur], i, row);
+        if (j >= 0)
+        {
+            copy_window_row(view, n, i, window_row(win, n, j, 0), (size_t)win.w * n);
+            continue;
+        }
+
+        j = row < r->next ? find_row(r->rows[prev], r->n[prev], row) : -1;
+        if (j >= 0)
+        {
+            copy_window_row(view, n, i, window_row(r->win[prev], r->n[prev], j, 0), plane);
+            continue;
+        }
+
+        // Rows are read in order; the ones no strip needs are dropped
+        assert(row >= r->next);
+        while (r->ok && r->next <= row)
+        {
+            r->ok = r->src->read_row(r->src->ctx, r->next, r->line);
+            r->next ++;
+        }
+        copy_window_row(view, n, i, r->line.data, win.w);
+    }
+
+    r->n[cur] = n;
+    r->cur = cur;
+    return view;
+}
+
+static int write_rows(image_sink *dst, image strip, int first, int y0, int n, image line)
+{
+    // Sends rows [first, first + n) of a planar strip to the sink as rows
+    // [y0, y0 + n)
+    for (int i = 0; i < n; i ++)
+    {
+        for (int c = 0; c < strip.c; c ++)
+        {
+            memcpy(line.data + c * strip.w, window_row(strip, strip.h, first + i, c), strip.w * sizeof(float));
+        }
+        if (!dst->write_row(dst->ctx, y0 + i, line)) return 0;
+    }
+    return 1;
+}
+
+// ---- Kernels ----
+
+int stream_convolve(image_source src, image_sink dst, image filter, int preserve, int strip_rows)
+{
+    /**
+     * Streaming version of convolve_image.
+     * 
+     * Each strip of output rows reads the filter's halo above and below it,
+     * clamped to the image, so the output is the same as convolving the
+     * whole image at once.
+     * 
+     * @param src the image to convolve
+     * @param dst a sink of src.w x src.h with src.c channels if preserve,
+     * 1 otherwise
+     * @param filter the filter to convolve with
+     * @param preserve whether to keep the channels separate
+     * @param strip_rows output rows per strip, 0 for about 4MB per strip
+     * 
+     * @returns 1 on success, 0 if the source or sink failed
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(dst.w == src.w && dst.h == src.h && dst.c == (preserve ? src.c : 1));
+    int n = strip_rows > 0 ? strip_rows : default_strip_rows(src.w, src.c);
+    int top = filter.h / 2, halo = filter.h - 1;
+
+    row_reader r;
+    init_reader(&r, &src, n + halo);
+    int *rows = calloc(n + halo, sizeof(int));
+    image out = scratch_image(src.w, n + halo, dst.c);
+    image line = scratch_image(dst.w, 1, dst.c);
+    int ok = 1;
+
+    for (int y0 = 0; ok && y0 < src.h; y0 += n)
+    {
+        int m = y0 + n < src.h ? n : src.h - y0;
+        for (int i = 0; i < m + halo; i ++) rows[i] = clamp_index(y0 - top + i, src.h);
+
+        image win = gather_rows(&r, rows, m + halo);
+        image res = {out.w, m + halo, out.c, out.data};
+        convolve_image_into(res, win, filter, preserve);
+
+        // Window rows top .. top + m are the ones with their whole halo
+        ok = r.ok && write_rows(&dst, res, top, y0, m, line);
+    }
+
+    ok = ok && r.ok;
+    release_scratch_image(line);
+    release_scratch_image(out);
+    free(rows);
+    free_reader(&r);
+    return ok;
+}
+
+int stream_resize(image_source src, image_sink dst, resize_mode mode, int strip_rows)
+{
+    /**
+     * Streaming version of nn_resize and bilinear_resize, to the size of
+     * the sink.
+     * 
+     * Only the one or two source rows each output row interpolates from
+     * are kept; the rows in between are read and dropped, so shrinking a
+     * huge image needs no more memory than the output strips.
+     * 
+     * @param src the image to resize
+     * @param dst a sink of any size with src.c channels
+     * @param mode RESIZE_NN or RESIZE_BILINEAR
+     * @param strip_rows output rows per strip, 0 for about 4MB per strip
+     * 
+     * @returns 1 on success, 0 if the source or sink failed
+     * 
+     */
+
+    INSTRUMENT_FUNCTION();
+
+    assert(dst.c == src.c);
+    int n = strip_rows > 0 ? strip_rows : default_strip_rows(dst.w, dst.c);
+    resize_plan *plan = make_resize_plan(src.w, src.h, dst.w, dst.h, mode);
+
+    row_reader r;
+    init_reader(&r, &src, 2 * n);
+    int *rows = calloc(2 * n, sizeof(int));
+    int *y0 = calloc(n, sizeof(int));
+    int *y1 = calloc(n, sizeof(int));
+    image out = scratch_image(dst.w, n, dst.c);
+    image line = scratch_image(dst.w, 1, dst.c);
+    int ok = 1;
+
+    for (int j0 = 0; ok && j0 < dst.h; j0 += n)
+    {
+        int m = j0 + n < dst.h ? n : dst.h - j0;
+
+        // The distinct source rows of this strip, in order; both plan
+        // rows only ever move down, so each is either one of the last
+        // rows listed or a new one past them
+        int k = 0;
+        for (int j = 0; j < m; j ++)
+        {
+            int a = plan->y0[j0 + j], b = plan->y1[j0 + j];
+            y0[j] = find_row(rows, k, a);
+            if (y0[j] < 0) rows[y0[j] = k ++] = a;
+            y1[j] = find_row(rows, k, b);
+            if (y1[j] < 0) rows[y1[j] = k ++] = b;
+        }
+
+        image win = gather_rows(&r, rows, k);
+        resize_plan sub = *plan;
+        sub.src_h = k;
+        sub.dst_h = m;
+        sub.y0 = y0;
+        sub.y1 = y1;
+        sub.fy = plan->fy + j0;
+
+        image res = {out.w, m, out.c, out.data};
+        resize_with_plan_into(res, win, &sub);
+        ok = r.ok && write_rows(&dst, res, 0, j0, m, line);
+    }
+
+    ok = ok && r.ok;
+    release_scratch_image(line);
+    release_scratch_image(out);
+    free(y1);
+    free(y0);
+    free(rows);
+    free_reader(&r);
+    free_resize_plan(plan);
+    return ok;
+}
+
+typedef enum{
+    STREAM_GRAYSCALE,
+    STREAM_RGB_TO_HSV,
+    STREAM_HSV_TO_RGB
+} stream_color_op;
+
+static int stream_color(image_source src, image_sink dst, stream_color_op op, int strip_rows)
+{
+    // Pointwise conversions need no halo: each strip is its own rows
+    assert(src.c == 3 && dst.w == src.w && dst.h == src.h);
+    assert(dst.c == (op == STREAM_GRAYSCALE ? 1 : 3));
+    int n = strip_rows > 0 ? strip_rows : default_strip_rows(src.w, src.c);
+
+    row_reader r;
+    init_reader(&r, &src, n);
+    int *rows = calloc(n, sizeof(int));
+    image gray = scratch_image(src.w, n, 1);
+    image line = scratch_image(dst.w, 1, dst.c);
+    int ok = 1;
+
+    for (int y0 = 0; ok && y0 < src.h; y0 += n)
+    {
+        int m = y0 + n < src.h ? n : src.h - y0;
+        for (int i = 0; i < m; i ++) rows[i] = y0 + i;
+        image win = gather_rows(&r, rows, m);
+
+        image res = win;
+        if (op == STREAM_GRAYSCALE)
+        {
+            res = (image){gray.w, m, 1, gray.data};
+            rgb_to_grayscale_into(res, win);
+        }
+        else if (op == STREAM_RGB_TO_HSV) rgb_to_hsv(win);
+        else hsv_to_rgb(win);
+
+        ok = r.ok && write_rows(&dst, res, 0, y0, m, line);
+    }
+
+    ok = ok && r.ok;
+    release_scratch_image(line);
+    release_scratch_image(gray);
+    free(rows);
+    free_reader(&r);
+    return ok;
+}
+
+int stream_rgb_to_grayscale(image_source src, image_sink dst, int strip_rows)
+{
+    INSTRUMENT_FUNCTION();
+    return stream_color(src, dst, STREAM_GRAYSCALE, strip_rows);
+}
+
+int stream_rgb_to_hsv(image_source src, image_sink dst, int strip_rows)
+{
+    INSTRUMENT_FUNCTION();
+    return stream_color(src, dst, STREAM_RGB_TO_HSV, strip_rows);
+}
+
+int stream_hsv_to_rgb(image_source src, image_sink dst, int strip_rows)
+{
+    INSTRUMENT_FUNCTION();
+    return stream_color(src, dst, STREAM_HSV_TO_RGB, strip_rows);
+}
+
+// ---- Sources and sinks over images in memory ----
+
+static int read_image_row(void *ctx, int y, image row)
+{
+    image *im = ctx;
+    for (int c = 0; c < im->c; c ++)
+    {
+        memcpy(row.data + c * im->w, image_row(*im, y, c), im->w * sizeof(float));
+    }
+    return 1;
+}
+
+static int write_image_row(void *ctx, int y, image row)
+{
+    image *im = ctx;
+    for (int c = 0; c < im->c; c ++)
+    {
+        memcpy(image_row(*im, y, c), row.data + c * im->w, im->w * sizeof(float));
+    }
+    return 1;
+}
+
+image_source image_source_from_image(image im)
+{
+    /**
+     * Streams rows out of an image in memory, mostly for testing and for
+     * mixing streamed and in-memory stages.
+     * 
+     */
+
+    image *ctx = malloc(sizeof(image));
+    *ctx = im;
+    image_source s = {im.w, im.h, im.c, read_image_row, free, ctx};
+    return s;
+}
+
+image_sink image_sink_to_image(image im)
+{
+    image *ctx = malloc(sizeof(image));
+    *ctx = im;
+    image_sink s = {im.w, im.h, im.c, write_image_row, free, ctx};
+    return s;
+}
+
+// ---- Sources and sinks over binary PGM / PPM files ----
+
+typedef struct{
+    FILE *file;
+    int w, c;
+    int next;
+    unsigned char *bytes;
+} pnm_file;
+
+static int pnm_number(FILE *f, int *v)
+{
+    // Header fields are separated by whitespace and # comments
+    int ch = fgetc(f);
+    while (ch == '#' || ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+    {
+        if (ch == '#') while (ch != '\n' && ch != EOF) ch = fgetc(f);
+        ch = fgetc(f);
+    }
+    ungetc(ch, f);
+    return 1 == fscanf(f, "%d", v);
+}
+
+static void close_pnm(void *ctx)
+{
+    pnm_file *p = ctx;
+    if (p->file) fclose(p->file);
+    free(p->bytes);
+    free(p);
+}
+
+static int read_pnm_row(void *ctx, int y, image row)
+{
+    pnm_file *p = ctx;
+    assert(y == p->next);
+    p->next ++;
+    if (fread(p->bytes, p->c, p->w, p->file) != (size_t)p->w) return 0;
+
+    if (p->c == 3)
+    {
+        get_color_kernels()->deinterleave_bytes(p->bytes, 3, row.data, row.data + p->w, row.data + 2 * p->w, p->w);
+    }
+    else
+    {
+        for (int x = 0; x < p->w; x ++) row.data[x] = p->bytes[x] * (1.0f / 255);
+    }
+    return 1;
+}
+
+static int write_pnm_row(void *ctx, int y, image row)
+{
+    pnm_file *p = ctx;
+    assert(y == p->next);
+    p->next ++;
+
+    if (p->c == 3)
+    {
+        get_color_kernels()->interleave_bytes(row.data, row.data + p->w, row.data + 2 * p->w, p->bytes, p->w);
+    }
+    else
+    {
+        for (int x = 0; x < p->w; x ++)
+        {
+            float v = row.data[x];
+            v = v > 0 ? v : 0;
+            v = v < 1 ? v : 1;
+            p->bytes[x] = (unsigned char)(v * 255 + .5f);
+        }
+    }
+    return fwrite(p->bytes, p->c, p->w, p->file) == (size_t)p->w;
+}
+
+image_source open_pnm_source(const char *filename)
+{
+    /**
+     * Streams rows out of an 8 bit binary PGM (P5) or PPM (P6) file.
+     * 
+     * @returns the source, with w == 0 if the file cannot be read
+     * 
+     */
+
+    image_source s = {0};
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot open \"%s\"\n", filename);
+        return s;
+    }
+
+    char magic[3] = {0};
+    int w, h, max;
+    if (2 != fread(magic, 1, 2, f) || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')
+        || !pnm_number(f, &w) || !pnm_number(f, &h) || !pnm_number(f, &max) || max != 255)
+    {
+        fprintf(stderr, "\"%s\" is not an 8 bit binary PGM or PPM file\n", filename);
+        fclose(f);
+        return s;
+    }
+    fgetc(f);   // the single whitespace before the pixels
+
+    pnm_file *p = calloc(1, sizeof(pnm_file));
+    p->file = f;
+    p->w = w;
+    p->c = magic[1] == '6' ? 3 : 1;
+    p->bytes = malloc((size_t)w * p->c);
+
+    s.w = w;
+    s.h = h;
+    s.c = p->c;
+    s.read_row = read_pnm_row;
+    s.close = close_pnm;
+    s.ctx = p;
+    return s;
+}
+
+image_sink open_pnm_sink(const char *filename, int w, int h, int c)
+{
+    /**
+     * Streams rows into an 8 bit binary PGM (c == 1) or PPM (c == 3) file,
+     * clamping to [0, 1].
+     * 
+     * @returns the sink, with w == 0 if the file cannot be created
+     * 
+     */
+
+    assert(c == 1 || c == 3);
+    image_sink s = {0};
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        fprintf(stderr, "Cannot create \"%s\"\n", filename);
+        return s;
+    }
+    fprintf(f, "P%c\n%d %d\n255\n", c == 3 ? '6' : '5', w, h);
+
+    pnm_file *p = calloc(1, sizeof(pnm_file));
+    p->file = f;
+    p->w = w;
+    p->c = c;
+    p->bytes = malloc((size_t)w * c);
+
+    s.w = w;
+    s.h = h;
+    s.c = c;
+    s.write_row = write_pnm_row;
+    s.close = close_pnm;
+    s.ctx = p;
+    return s;
+}
+
+void close_image_source(image_source s)
+{
+    if (s.close) s.close(s.ctx);
+}
+
+void close_image_sink(image_sink s)
+{
+    if (s.close) s.close(s.ctx);
+}
@@ -2,9 +2,17 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "image.h"
 #include "test.h"
 #include "args.h"
+#include "color_simd.h"
+#include "image_pool.h"
+#include "stb_image.h"
+#include "batch.h"
+#include "bench.h"
 
 int tests_total = 0;
 int tests_fail = 0;
@@ -29,6 +37,201 @@ int same_image(image a, image b){
     return 1;
 }
 
+void test_arena()
+{
+    image_arena *a = make_image_arena();
+    image x = arena_make_image(a, 30, 20, 3);
+    image y = arena_make_image_uninit(a, 17, 5, 1);
+    TEST(((size_t)x.data % 64) == 0 && ((size_t)y.data % 64) == 0);
+    TEST(within_eps(x.data[30*20*3-1], 0));
+
+    // Released buffers are reused for requests of the same size class
+    float *old = x.data;
+    x.data[5] = 1;
+    arena_release_image(a, x);
+    image z = arena_make_image(a, 20, 30, 3);
+    TEST(z.data == old && within_eps(z.data[5], 0));
+
+    arena_reset(a);
+    image w = arena_make_image_uninit(a, 17, 5, 1);
+    TEST(w.data == y.data || w.data == z.data);
+    free_image_arena(a);
+
+    image u = make_image_uninit(7, 7, 7);
+    TEST(((size_t)u.data % 64) == 0);
+    free_image(u);
+}
+
+void test_load()
+{
+    // Alpha is dropped, and all three loaders agree
+    image im = load_image("data/dumbledore.png");
+    TEST(im.c == 3);
+    image into = make_image(im.w, im.h, im.c);
+    load_image_into(into, "data/dumbledore.png");
+    TEST(same_image(into, im));
+
+    image_arena *a = make_image_arena();
+    image pooled = arena_load_image(a, "data/dumbledore.png");
+    TEST(same_image(pooled, im));
+    arena_release_image(a, pooled);
+    free_image_arena(a);
+
+    free_image(im);
+    free_image(into);
+}
+
+void test_save()
+{
+    image im = load_image("data/dog.jpg");
+
+    // PNG round trips exactly, and encoding in memory gives the file's bytes
+    save_options opts = default_save_options(FORMAT_PNG);
+    opts.compression = 1;
+    TEST(save_image_options(im, "test_save_tmp", opts));
+    image back = load_image("test_save_tmp.png");
+    TEST(same_image(back, im));
+
+    int size = 0;
+    unsigned char *png = encode_image(im, opts, &size);
+    FILE *f = fopen("test_save_tmp.png", "rb");
+    fseek(f, 0, SEEK_END);
+    TEST(size == ftell(f));
+    unsigned char *file = malloc(size);
+    fseek(f, 0, SEEK_SET);
+    TEST(size == (int)fread(file, 1, size, f));
+    TEST(0 == memcmp(file, png, size));
+    fclose(f);
+    remove("test_save_tmp.png");
+
+    // JPEG quality trades size for error
+    save_options lo = default_save_options(FORMAT_JPG), hi = lo;
+    lo.quality = 10;
+    int lo_size = 0, hi_size = 0;
+    unsigned char *lo_jpg = encode_image(im, lo, &lo_size);
+    unsigned char *hi_jpg = encode_image(im, hi, &hi_size);
+    TEST(lo_jpg && hi_jpg && lo_size < hi_size);
+
+    free(png);
+    free(file);
+    free(lo_jpg);
+    free(hi_jpg);
+    free_image(im);
+    free_image(back);
+}
+
+void test_bytes()
+{
+    // Interleaved bytes in and out, as stb gives and takes them
+    int w, h, c;
+    unsigned char *png = stbi_load("data/dots.png", &w, &h, &c, 3);
+    image im = load_image("data/dots.png");
+    image from = bytes_to_image(png, w, h, 3);
+    TEST(same_image(from, im));
+
+    unsigned char *back = malloc(w*h*3);
+    image_to_bytes(from, back);
+    TEST(0 == memcmp(back, png, w*h*3));
+
+    // One channel and RGBA, alpha dropped
+    unsigned char rgba[8] = {255, 0, 51, 7, 0, 102, 255, 9};
+    image two = make_image(2, 1, 3);
+    bytes_to_image_into(two, rgba, 4);
+    TEST(within_eps(two.data[0], 1) && within_eps(two.data[3], .4) && within_eps(two.data[5], 1));
+    image gray = bytes_to_image(rgba, 4, 2, 1);
+    TEST(gray.c == 1 && within_eps(gray.data[7], 9/255.));
+
+    free(png);
+    free(back);
+    free_image(im);
+    free_image(from);
+    free_image(two);
+    free_image(gray);
+}
+
+void test_raw()
+{
+    image im = load_image("data/dog.jpg");
+    TEST(save_image_raw(im, "test_raw_tmp"));
+
+    // Loading maps the saved floats back bit for bit
+    image raw = load_image_raw("test_raw_tmp.raw");
+    TEST(raw.w == im.w && raw.h == im.h && raw.c == im.c);
+    TEST(0 == memcmp(raw.data, im.data, im.w*im.h*im.c*sizeof(float)));
+
+    // Writes stay in this process; the file is untouched
+    raw.data[0] = 5;
+    image again = load_image_raw("test_raw_tmp.raw");
+    TEST(again.data[0] == im.data[0]);
+    TEST(raw.data[0] == 5);
+    free_image(raw);
+    free_image(again);
+
+    // Anything else is refused without crashing
+    image bad = load_image_raw("data/dog.jpg");
+    TEST(!bad.data);
+    image missing = load_image_raw("test_raw_missing.raw");
+    TEST(!missing.data);
+
+    remove("test_raw_tmp.raw");
+    free_image(im);
+}
+
+void test_op_graph()
+{
+    image im = load_image("data/colorbar.png");
+    image other = load_image("data/colorbar.png");
+    shift_image(other, 1, .3);
+
+    // The shift, clamp, grayscale chain in one pass
+    op_graph *g = make_op_graph(im);
+    op_graph_shift(g, 0, .4);
+    op_graph_shift(g, 0, -.1);
+    op_graph_sub(g, other);
+    op_graph_clamp(g);
+    op_graph_grayscale(g);
+    TEST(op_graph_channels(g) == 1);
+    image fused = eval_op_graph(g);
+
+    image step = copy_image(im);
+    shift_image(step, 0, .4);
+    shift_image(step, 0, -.1);
+    sub_image_inplace(step, other);
+    clamp_image(step);
+    image gray = rgb_to_grayscale(step);
+    TEST(same_image(fused, gray));
+    free_op_graph(g);
+    free_image(fused);
+    free_image(gray);
+    free_image(step);
+
+    // A round trip through HSV with a saturation boost, run in place
+    image copy = copy_image(im);
+    g = make_op_graph(copy);
+    op_graph_rgb_to_hsv(g);
+    op_graph_scale(g, 1, 2);
+    op_graph_clamp(g);
+    op_graph_hsv_to_rgb(g);
+    op_graph_add(g, other);
+    op_graph_threshold(g, .5);
+    eval_op_graph_into(copy, g);
+
+    step = copy_image(im);
+    rgb_to_hsv(step);
+    float *s = step.data + step.w*step.h;
+    for (int i = 0; i < step.w*step.h; i ++) s[i] = s[i] * 2 > 1 ? 1 : s[i] * 2;
+    hsv_to_rgb(step);
+    add_image_inplace(step, other);
+    int ok = 1;
+    for (int i = 0; i < im.w*im.h*im.c; i ++) ok &= copy.data[i] == (step.data[i] > .5);
+    TEST(ok);
+    free_op_graph(g);
+    free_image(copy);
+    free_image(step);
+    free_image(other);
+    free_image(im);
+}
+
 void test_get_pixel(){
     image im = load_image("data/dots.png");
     // Test within image
@@ -41,6 +244,10 @@ void test_get_pixel(){
     TEST(within_eps(1, get_pixel(im, 7,8,0)));
     TEST(within_eps(0, get_pixel(im, 7,8,1)));
     TEST(within_eps(1, get_pixel(im, 7,8,2)));
+
+    // Test padding exactly one past the border
+    TEST(within_eps(get_pixel(im, 3,0,0), get_pixel(im, 4,0,0)));
+    TEST(within_eps(get_pixel(im, 1,1,1), get_pixel(im, 1,2,1)));
     free_image(im);
 }
 
@@ -96,6 +303,42 @@ void test_shift()
     free_image(c);
 }
 
+void test_scale()
+{
+    image im = load_image("data/dog.jpg");
+    image c = copy_image(im);
+    scale_image(c, 1, .5);
+    scale_image(c, 3, 2);
+    TEST(within_eps(c.data[0], im.data[0]));
+    TEST(within_eps(c.data[im.w*im.h + 13], im.data[im.w*im.h+13] * .5));
+    TEST(within_eps(c.data[2*im.w*im.h + 72], im.data[2*im.w*im.h+72]));
+
+    float v[3] = {2, 1, .25};
+    image all = copy_image(im);
+    scale_image_channels(all, v);
+    image each = copy_image(im);
+    for (int k = 0; k < 3; k ++) scale_image(each, k, v[k]);
+    TEST(same_image(all, each));
+
+    // The op graph records the same operations
+    op_graph *g = make_op_graph(im);
+    op_graph_scale(g, 1, .5);
+    op_graph_threshold(g, .3);
+    image fused = eval_op_graph(g);
+    threshold_image(c, .3);
+    TEST(same_image(fused, c));
+    int binary = 1;
+    for (int i = 0; i < c.w*c.h*c.c; i ++) binary &= c.data[i] == 0 || c.data[i] == 1;
+    TEST(binary);
+
+    free_op_graph(g);
+    free_image(fused);
+    free_image(all);
+    free_image(each);
+    free_image(im);
+    free_image(c);
+}
+
 void test_rgb_to_hsv()
 {
     image im = load_image("data/dog.jpg");
@@ -117,6 +360,68 @@ void test_hsv_to_rgb()
     free_image(c);
 }
 
+void test_color_kernels()
+{
+    // Odd sized so the vector kernels also run their scalar tails, and with
+    // grays, primaries and out of range hues to hit every mask.
+    image im = make_image(37, 11, 3);
+    int i, n = im.w*im.h;
+    srand(455);
+    for(i = 0; i < n*3; ++i) im.data[i] = rand()/(float)RAND_MAX;
+    for(i = 0; i < 3; ++i){
+        im.data[0 + i*n] = .5;
+        im.data[1 + i*n] = i == 1;
+        im.data[2 + i*n] = i == 2;
+    }
+    im.data[3] = -.1;
+    im.data[4] = 1.2;
+
+    const color_kernels *k = get_color_kernels();
+    image ref = copy_image(im);
+    image vec = copy_image(im);
+
+    image gray_ref = make_image(im.w, im.h, 1);
+    image gray_vec = make_image(im.w, im.h, 1);
+    rgb_to_grayscale_scalar(ref.data, ref.data + n, ref.data + 2*n, gray_ref.data, n);
+    k->rgb_to_grayscale(vec.data, vec.data + n, vec.data + 2*n, gray_vec.data, n);
+    TEST(same_image(gray_vec, gray_ref));
+
+    hsv_to_rgb_scalar(ref.data, ref.data + n, ref.data + 2*n, n);
+    k->hsv_to_rgb(vec.data, vec.data + n, vec.data + 2*n, n);
+    TEST(same_image(vec, ref));
+
+    rgb_to_hsv_scalar(ref.data, ref.data + n, ref.data + 2*n, n);
+    k->rgb_to_hsv(vec.data, vec.data + n, vec.data + 2*n, n);
+    TEST(same_image(vec, ref));
+
+    // Byte deinterleave, with and without an alpha byte to skip
+    unsigned char bytes[37*11*4];
+    for(i = 0; i < n*4; ++i) bytes[i] = rand() & 255;
+    int stride;
+    for(stride = 3; stride <= 4; ++stride){
+        deinterleave_bytes_scalar(bytes, stride, ref.data, ref.data + n, ref.data + 2*n, n);
+        k->deinterleave_bytes(bytes, stride, vec.data, vec.data + n, vec.data + 2*n, n);
+        TEST(same_image(vec, ref));
+        TEST(within_eps(vec.data[n+5], bytes[5*stride+1]/255.));
+    }
+
+    // And back, with out of range values clamped
+    unsigned char out_ref[37*11*3], out_vec[37*11*3];
+    im.data[7] = 3;
+    im.data[n+7] = -2;
+    interleave_bytes_scalar(im.data, im.data + n, im.data + 2*n, out_ref, n);
+    k->interleave_bytes(im.data, im.data + n, im.data + 2*n, out_vec, n);
+    TEST(0 == memcmp(out_ref, out_vec, sizeof(out_ref)));
+    TEST(out_vec[21] == 255 && out_vec[22] == 0);
+    TEST(out_vec[n*3-1] == (unsigned char)(im.data[3*n-1]*255 + .5f));
+
+    free_image(im);
+    free_image(ref);
+    free_image(vec);
+    free_image(gray_ref);
+    free_image(gray_vec);
+}
+
 void test_nn_resize()
 {
     image im = load_image("data/dogsmall.jpg");
@@ -155,6 +460,37 @@ void test_bl_resize()
     free_image(gt2);
 }
 
+void test_resize_plan()
+{
+    image im = load_image("data/dog.jpg");
+    image gray = rgb_to_grayscale(im);
+    resize_plan *plan = make_resize_plan(im.w, im.h, 301, 977, RESIZE_BILINEAR);
+
+    // One plan serves any image of the source size, whatever its channels
+    image a = resize_with_plan(im, plan);
+    image b = resize_with_plan(gray, plan);
+    image gt_a = bilinear_resize(im, 301, 977);
+    image gt_b = bilinear_resize(gray, 301, 977);
+    TEST(same_image(a, gt_a));
+    TEST(same_image(b, gt_b));
+    free_resize_plan(plan);
+
+    plan = make_resize_plan(im.w, im.h, 1000, 50, RESIZE_NN);
+    image c = resize_with_plan(im, plan);
+    image gt_c = nn_resize(im, 1000, 50);
+    TEST(same_image(c, gt_c));
+    free_resize_plan(plan);
+
+    free_image(im);
+    free_image(gray);
+    free_image(a);
+    free_image(b);
+    free_image(c);
+    free_image(gt_a);
+    free_image(gt_b);
+    free_image(gt_c);
+}
+
 void test_multiple_resize()
 {
     image im = load_image("data/dog.jpg");
@@ -173,6 +509,50 @@ void test_multiple_resize()
 }
 
 
+float image_mean(image im, int c)
+{
+    int i, n = im.w*im.h;
+    float sum = 0;
+    for(i = 0; i < n; ++i) sum += im.data[i + c*n];
+    return sum/n;
+}
+
+void test_downscale()
+{
+    image im = load_image("data/dog.jpg");
+
+    // Downscaling by exactly 2 averages each 2x2 block
+    image area = area_resize(im, im.w/2, im.h/2);
+    int x = 17, y = 5;
+    float avg = (get_pixel(im, 2*x, 2*y, 1) + get_pixel(im, 2*x+1, 2*y, 1) +
+                 get_pixel(im, 2*x, 2*y+1, 1) + get_pixel(im, 2*x+1, 2*y+1, 1))/4;
+    TEST(within_eps(get_pixel(area, x, y, 1), avg));
+
+    // Every resampler keeps the overall brightness
+    image thumb = pyramid_resize(im, 67, 41);
+    image lanczos = lanczos_resize(im, 67, 41);
+    TEST(thumb.w == 67 && thumb.h == 41 && thumb.c == 3);
+    TEST(fabsf(image_mean(thumb, 0) - image_mean(im, 0)) < .01);
+    TEST(fabsf(image_mean(lanczos, 2) - image_mean(im, 2)) < .01);
+
+    // Flat images stay flat, including at the borders
+    image flat = make_image(13, 7, 1);
+    int i;
+    for(i = 0; i < 13*7; ++i) flat.data[i] = .3;
+    image up = lanczos_resize(flat, 40, 3);
+    image down = area_resize(flat, 5, 4);
+    TEST(within_eps(get_pixel(up, 0, 0, 0), .3) && within_eps(get_pixel(up, 39, 2, 0), .3));
+    TEST(within_eps(get_pixel(down, 4, 3, 0), .3));
+
+    free_image(im);
+    free_image(area);
+    free_image(thumb);
+    free_image(lanczos);
+    free_image(flat);
+    free_image(up);
+    free_image(down);
+}
+
 void test_highpass_filter(){
     image im = load_image("data/dog.jpg");
     image f = make_highpass_filter();
@@ -260,6 +640,325 @@ void test_gaussian_blur(){
     free_image(gt);
 }
 
+static image naive_convolve(image im, image f, int preserve)
+{
+    image out = make_image(im.w, im.h, preserve ? im.c : 1);
+    for (int c = 0; c < im.c; c ++)
+    {
+        for (int y = 0; y < im.h; y ++)
+        {
+            for (int x = 0; x < im.w; x ++)
+            {
+                float sum = 0;
+                for (int j = 0; j < f.h; j ++)
+                {
+                    for (int i = 0; i < f.w; i ++)
+                    {
+                        sum += get_pixel(f, i, j, f.c == 1 ? 0 : c) * get_pixel(im, x + i - f.w/2, y + j - f.h/2, c);
+                    }
+                }
+                int oc = preserve ? c : 0;
+                set_pixel(out, x, y, oc, get_pixel(out, x, y, oc) + sum);
+            }
+        }
+    }
+    return out;
+}
+
+void test_small_convolution()
+{
+    // The unrolled 3x3 and 5x5 paths, with shared and per channel filters,
+    // against a plain loop; the 2 x 3 image is narrower than the filters
+    image ims[] = {load_image("data/dogsmall.jpg"), make_image(2, 3, 3)};
+    for (int i = 0; i < 2*3*3; i ++) ims[1].data[i] = i / 17.0f;
+    int sizes[] = {3, 5}, channels[] = {1, 3};
+    int ok = 1;
+    for (int n = 0; n < 2; n ++)
+    {
+        for (int s = 0; s < 2; s ++)
+        {
+            for (int k = 0; k < 2; k ++)
+            {
+                image f = make_image(sizes[s], sizes[s], channels[k]);
+                for (int i = 0; i < f.w*f.h*f.c; i ++) f.data[i] = ((i * 7) % 11 - 5) / 10.0f;
+                for (int preserve = 0; preserve < 2; preserve ++)
+                {
+                    image gt = naive_convolve(ims[n], f, preserve);
+                    image out = convolve_image(ims[n], f, preserve);
+                    ok &= same_image(out, gt);
+                    free_image(gt);
+                    free_image(out);
+                }
+                free_image(f);
+            }
+        }
+        free_image(ims[n]);
+    }
+    TEST(ok);
+}
+
+void test_pyramid()
+{
+    image dog = load_image("data/dogsmall.jpg");
+    image im = bilinear_resize(dog, 101, 77);
+    image f = make_image(5, 5, 1);
+    float taps[] = {1/16., 4/16., 6/16., 4/16., 1/16.};
+    for (int y = 0; y < 5; y ++) for (int x = 0; x < 5; x ++) f.data[y*5 + x] = taps[x]*taps[y];
+
+    // The fused kernel keeps the even pixels of a full binomial blur
+    image blurred = convolve_image(im, f, 1);
+    image half = gaussian_downsample(im);
+    TEST(half.w == 51 && half.h == 39 && half.c == 3);
+    image gt = make_image(half.w, half.h, half.c);
+    for (int z = 0; z < gt.c; z ++) for (int y = 0; y < gt.h; y ++) for (int x = 0; x < gt.w; x ++){
+        set_pixel(gt, x, y, z, get_pixel(blurred, 2*x, 2*y, z));
+    }
+    TEST(same_image(half, gt));
+
+    // 77 rows halve down to one in seven steps
+    image_pyramid *p = make_image_pyramid(im, 0);
+    TEST(pyramid_levels(p) == 8);
+    image g3 = pyramid_gaussian(p, 3);
+    TEST(g3.w == 13 && g3.h == 10);
+    TEST(pyramid_gaussian(p, 3).data == g3.data);
+    TEST(pyramid_gaussian(p, 0).data == im.data);
+    image quarter = gaussian_downsample(half);
+    image eighth = gaussian_downsample(quarter);
+    TEST(same_image(g3, eighth));
+
+    // Each Laplacian level adds back up to its Gaussian level
+    int ok = 1;
+    for (int i = 0; i < pyramid_levels(p) - 1; i ++){
+        image l = pyramid_laplacian(p, i);
+        image g = pyramid_gaussian(p, i);
+        image up = bilinear_resize(pyramid_gaussian(p, i + 1), g.w, g.h);
+        add_image_inplace(up, l);
+        ok &= same_image(up, g) && pyramid_laplacian(p, i).data == l.data;
+        free_image(up);
+    }
+    TEST(ok);
+    TEST(pyramid_laplacian(p, 7).data == pyramid_gaussian(p, 7).data);
+
+    // A pyramid with fewer levels stops early
+    image_pyramid *small = make_image_pyramid(im, 2);
+    TEST(pyramid_levels(small) == 2);
+    TEST(same_image(pyramid_laplacian(small, 1), half));
+
+    free_image_pyramid(p);
+    free_image_pyramid(small);
+    free_image(dog);
+    free_image(im);
+    free_image(f);
+    free_image(blurred);
+    free_image(half);
+    free_image(gt);
+    free_image(quarter);
+    free_image(eighth);
+}
+
+void test_gaussian_cache()
+{
+    // The cache hands back copies equal to a fresh kernel, before and
+    // after more sigmas than it holds have pushed the first one out
+    image f = make_gaussian_filter(3);
+    image f1 = make_gaussian_filter_1d(3);
+    int i;
+    for(i = 0; i < 2; ++i){
+        image c = cached_gaussian_filter(3);
+        image c1 = cached_gaussian_filter_1d(3);
+        TEST(same_image(c, f));
+        TEST(same_image(c1, f1));
+        free_image(c);
+        free_image(c1);
+        int s;
+        for(s = 1; s <= 12; ++s) free_image(cached_gaussian_filter_1d(s / 4.));
+    }
+    image c = cached_gaussian_filter_1d(2.5);
+    TEST(c.w == 15);
+    free_image(c);
+    free_gaussian_cache();
+    free_image(f);
+    free_image(f1);
+}
+
+void test_gaussian_iir()
+{
+    image im = load_image("data/dogsmall.jpg");
+
+    // Small sigmas are the FIR blur
+    image f = make_gaussian_filter(2);
+    image fir = convolve_image(im, f, 1);
+    image blur = gaussian_blur(im, 2);
+    TEST(same_image(blur, fir));
+    free_image(f);
+    free_image(fir);
+    free_image(blur);
+
+    // Large ones are close to it everywhere, borders included
+    image f1 = make_gaussian_filter_1d(8);
+    fir = convolve_image_separable(im, f1, f1, 1);
+    blur = gaussian_blur(im, 8);
+    float worst = 0, total = 0;
+    for (int i = 0; i < im.w*im.h*im.c; i ++){
+        float d = fabsf(blur.data[i] - fir.data[i]);
+        worst = d > worst ? d : worst;
+        total += d;
+    }
+    TEST(worst < .03);
+    TEST(total / (im.w*im.h*im.c) < .005);
+
+    // In place gives the same image
+    image copy = copy_image(im);
+    gaussian_blur_iir_into(copy, copy, 8);
+    TEST(same_image(copy, blur));
+
+    // A flat image stays flat, even at sigmas far wider than the image
+    image flat = make_image(7, 2, 1);
+    for (int i = 0; i < 14; i ++) flat.data[i] = .7;
+    image wide = gaussian_blur_iir(flat, 40);
+    TEST(same_image(wide, flat));
+
+    free_image(f1);
+    free_image(fir);
+    free_image(blur);
+    free_image(copy);
+    free_image(flat);
+    free_image(wide);
+    free_image(im);
+}
+
+void test_box_blur()
+{
+    image im = load_image("data/dogsmall.jpg");
+    int widths[] = {1, 4, 7, 31};
+    for (int i = 0; i < 4; i ++)
+    {
+        // Same as two passes of the 1D box, borders and even widths included
+        image f = make_box_filter_1d(widths[i]);
+        image gt = convolve_image_separable(im, f, f, 1);
+        image blur = box_blur(im, widths[i]);
+        TEST(same_image(blur, gt));
+        free_image(f);
+        free_image(gt);
+        free_image(blur);
+    }
+
+    // convolve_image hands box filters to box_blur
+    image box = make_box_filter(9);
+    image conv = convolve_image(im, box, 1);
+    image blur = box_blur(im, 9);
+    TEST(same_image(conv, blur));
+    free_image(box);
+    free_image(conv);
+    free_image(blur);
+
+    integral_image ii = make_integral_image(im, 1);
+    double sum = 0, sq = 0;
+    int x0 = 13, y0 = 7, w = 20, h = 11, c = 2, n = w*h;
+    for (int y = y0; y < y0 + h; y ++)
+    {
+        for (int x = x0; x < x0 + w; x ++)
+        {
+            float v = get_pixel(im, x, y, c);
+            sum += v;
+            sq += v*v;
+        }
+    }
+    TEST(within_eps(integral_sum(ii, x0, y0, w, h, c), sum));
+    TEST(within_eps(integral_mean(ii, x0, y0, w, h, c), sum / n));
+    TEST(within_eps(integral_variance(ii, x0, y0, w, h, c), sq / n - (sum / n) * (sum / n)));
+
+    // Rectangles are clipped to the image
+    float corner = get_pixel(im, im.w - 1, im.h - 1, 0);
+    TEST(within_eps(integral_sum(ii, im.w - 1, im.h - 1, 10, 10, 0), corner));
+    TEST(within_eps(integral_mean(ii, -5, -5, im.w + 10, im.h + 10, 0), integral_sum(ii, 0, 0, im.w, im.h, 0) / (im.w*im.h)));
+    TEST(integral_sum(ii, im.w, 0, 5, 5, 0) == 0);
+    TEST(integral_variance(ii, 3, 3, 1, 1, 1) == 0);
+    free_integral_image(ii);
+    free_image(im);
+}
+
+void test_separable_convolution(){
+    image im = load_image("data/dog.jpg");
+    image f = make_gaussian_filter(2);
+    image f1 = make_gaussian_filter_1d(2);
+
+    // A filter with a channel per image channel is never factored, so it
+    // serves as the unfactored reference.
+    image f3 = make_image(f.w, f.h, 3);
+    int i;
+    for(i = 0; i < 3; ++i) memcpy(f3.data + i*f.w*f.h, f.data, f.w*f.h*sizeof(float));
+
+    image ref = convolve_image(im, f3, 1);
+    image sep = convolve_image_separable(im, f1, f1, 1);
+    image detected = convolve_image(im, f, 1);
+    TEST(same_image(sep, ref));
+    TEST(same_image(detected, ref));
+
+    image ref_sum = convolve_image(im, f3, 0);
+    image sep_sum = convolve_image_separable(im, f1, f1, 0);
+    TEST(same_image(sep_sum, ref_sum));
+
+    image box = make_box_filter(7);
+    image box1 = make_box_filter_1d(7);
+    image box_blur = convolve_image(im, box, 1);
+    image box_sep = convolve_image_separable(im, box1, box1, 1);
+    TEST(same_image(box_sep, box_blur));
+
+    free_image(im);
+    free_image(f);
+    free_image(f1);
+    free_image(f3);
+    free_image(ref);
+    free_image(sep);
+    free_image(detected);
+    free_image(ref_sum);
+    free_image(sep_sum);
+    free_image(box);
+    free_image(box1);
+    free_image(box_blur);
+    free_image(box_sep);
+}
+
+void test_fft_convolution(){
+    image im = load_image("data/dogsmall.jpg");
+    int i;
+
+    // Small, asymmetric and not separable, so convolve_image runs it
+    // directly and any flip or shift in the FFT path would show up
+    image f = make_image(5, 4, 1);
+    image f3 = make_image(5, 4, 3);
+    srand(7);
+    for(i = 0; i < 5*4; ++i) f.data[i] = rand()/(float)RAND_MAX - .3;
+    for(i = 0; i < 5*4*3; ++i) f3.data[i] = rand()/(float)RAND_MAX - .5;
+
+    image ref = convolve_image(im, f, 1);
+    image fft = convolve_image_fft(im, f, 1);
+    TEST(same_image(fft, ref));
+    image ref_sum = convolve_image(im, f, 0);
+    image fft_sum = convolve_image_fft(im, f, 0);
+    TEST(same_image(fft_sum, ref_sum));
+    image ref3 = convolve_image(im, f3, 0);
+    image fft3 = convolve_image_fft(im, f3, 0);
+    TEST(same_image(fft3, ref3));
+
+    // Reusing the filter hits the spectrum cache
+    image again = convolve_image_fft(im, f, 1);
+    TEST(same_image(again, ref));
+    free_fft_cache();
+
+    free_image(im);
+    free_image(f);
+    free_image(f3);
+    free_image(ref);
+    free_image(fft);
+    free_image(ref_sum);
+    free_image(fft_sum);
+    free_image(ref3);
+    free_image(fft3);
+    free_image(again);
+}
+
 void test_hybrid_image(){
     image man = load_image("data/melisa.png");
     image woman = load_image("data/aria.png");
@@ -345,6 +1044,873 @@ void test_sobel(){
 
 
 
+void test_sobel_fused()
+{
+    image im = load_image("data/dog.jpg");
+    image fx = make_gx_filter();
+    image fy = make_gy_filter();
+    image gx = convolve_image(im, fx, 0);
+    image gy = convolve_image(im, fy, 0);
+    image *exact = sobel_image(im);
+    image *fast = sobel_image_flags(im, SOBEL_FAST_ATAN2 | SOBEL_L1);
+
+    // The fused pass agrees with the two convolutions it replaces
+    int i, bad_mag = 0, bad_theta = 0, bad_fast = 0;
+    for(i = 0; i < im.w*im.h; ++i){
+        float x = gx.data[i], y = gy.data[i];
+        if(!within_eps(exact[0].data[i], sqrtf(x*x + y*y))) ++bad_mag;
+        if(!within_eps(fast[0].data[i], fabsf(x) + fabsf(y))) ++bad_mag;
+        if(fabsf(x) + fabsf(y) < .01) continue;
+        // Directions either side of the branch cut at +-pi are equal
+        float d = fabsf(exact[1].data[i] - atan2f(y, x));
+        if(!within_eps(fminf(d, 2*M_PI - d), 0)) ++bad_theta;
+        d = fabsf(fast[1].data[i] - exact[1].data[i]);
+        if(!within_eps(fminf(d, 2*M_PI - d), 0)) ++bad_fast;
+    }
+    TEST(bad_mag == 0);
+    TEST(bad_theta == 0);
+    TEST(bad_fast == 0);
+
+    free_image(im);
+    free_image(fx);
+    free_image(fy);
+    free_image(gx);
+    free_image(gy);
+    for(i = 0; i < 2; ++i){
+        free_image(exact[i]);
+        free_image(fast[i]);
+    }
+    free(exact);
+    free(fast);
+}
+
+static int same_hwc(hwc_image a, image b)
+{
+    image planar = hwc_to_image(a);
+    int same = same_image(planar, b);
+    free_image(planar);
+    return same;
+}
+
+void test_views()
+{
+    image im = load_image("data/dog.jpg");
+    image_view whole = view_image(im);
+    image_view face = view_region(whole, 201, 37, 233, 171);
+    TEST(face.w == 233 && face.h == 171 && face.c == 3 && face.stride == im.w);
+    TEST(within_eps(get_view_pixel(face, 5, 7, 2), get_pixel(im, 206, 44, 2)));
+    TEST(within_eps(get_view_pixel(face, -3, 500, 1), get_pixel(im, 201, 207, 1)));
+
+    // Every view kernel gives what the image kernel gives on a copy
+    image crop = copy_view(face);
+    TEST(within_eps(crop.data[0], get_pixel(im, 201, 37, 0)));
+    TEST(within_eps(crop.data[crop.w*crop.h*3 - 1], get_pixel(im, 433, 207, 2)));
+
+    image a = bilinear_resize_view(face, 112, 112);
+    image b = bilinear_resize(crop, 112, 112);
+    TEST(same_image(a, b));
+    free_image(a);
+    free_image(b);
+
+    a = nn_resize_view(face, 500, 60);
+    b = nn_resize(crop, 500, 60);
+    TEST(same_image(a, b));
+    free_image(a);
+    free_image(b);
+
+    image filters[3] = {make_highpass_filter(), make_emboss_filter(), make_gaussian_filter(2)};
+    int i, p;
+    for(i = 0; i < 3; ++i){
+        for(p = 0; p < 2; ++p){
+            a = convolve_view(face, filters[i], p);
+            b = convolve_image(crop, filters[i], p);
+            TEST(same_image(a, b));
+            free_image(a);
+            free_image(b);
+        }
+        free_image(filters[i]);
+    }
+
+    a = rgb_to_grayscale_view(face);
+    b = rgb_to_grayscale(crop);
+    TEST(same_image(a, b));
+    free_image(a);
+    free_image(b);
+
+    image_view green = view_channel(face, 1);
+    TEST(green.c == 1 && within_eps(get_view_pixel(green, 3, 4, 0), get_pixel(crop, 3, 4, 1)));
+    image box = make_box_filter(3);
+    image g = copy_view(green);
+    a = convolve_view(green, box, 1);
+    b = convolve_image(g, box, 1);
+    TEST(same_image(a, b));
+    free_image(a);
+    free_image(b);
+    free_image(g);
+    free_image(box);
+
+    // Writing through a view only touches the region
+    image edited = copy_image(im);
+    image_view region = view_region(view_image(edited), 201, 37, 233, 171);
+    rgb_to_hsv_view(region);
+    shift_view(region, 2, .5);
+    clamp_view(region);
+    b = copy_image(crop);
+    rgb_to_hsv(b);
+    shift_image(b, 2, .5);
+    clamp_image(b);
+    a = copy_view(region);
+    TEST(same_image(a, b));
+    TEST(within_eps(get_pixel(edited, 200, 37, 0), get_pixel(im, 200, 37, 0)));
+    TEST(within_eps(get_pixel(edited, 434, 100, 2), get_pixel(im, 434, 100, 2)));
+    TEST(within_eps(get_pixel(edited, 300, 208, 1), get_pixel(im, 300, 208, 1)));
+
+    hsv_to_rgb_view(region);
+    hsv_to_rgb(b);
+    free_image(a);
+    a = copy_view(region);
+    TEST(same_image(a, b));
+
+    copy_image_to_view(region, crop);
+    TEST(same_image(edited, im));
+    set_view_pixel(region, 0, 0, 0, 3);
+    set_view_pixel(region, 233, 0, 0, 3);
+    TEST(within_eps(get_pixel(edited, 201, 37, 0), 3) && within_eps(get_pixel(edited, 434, 37, 0), get_pixel(im, 434, 37, 0)));
+
+    free_image(a);
+    free_image(b);
+    free_image(edited);
+    free_image(crop);
+    free_image(im);
+}
+
+void test_gpu()
+{
+    // Device images without memory, as every one is when there is no
+    // device, are left alone by every call
+    image host = make_image(4, 3, 3);
+    image f = make_gaussian_filter(2);
+    gpu_image none = {4, 3, 3, 0};
+    gpu_image none1 = {4, 3, 1, 0};
+    gpu_upload_into(none, host);
+    gpu_download_into(host, none);
+    gpu_convolve_image_into(none, none, f, 1);
+    gpu_nn_resize_into(none, none);
+    gpu_bilinear_resize_into(none, none);
+    gpu_rgb_to_grayscale_into(none1, none);
+    gpu_rgb_to_hsv(none);
+    gpu_hsv_to_rgb(none);
+    gpu_sobel_image_into(none1, none1, none, 0);
+    gpu_finish();
+    image empty = gpu_download(none);
+    TEST(!empty.data && !empty.w && !empty.h && !empty.c);
+    free_gpu_image(none);
+    free_image(host);
+
+    // The rest only runs with make OPENCL=1 on a machine with an OpenCL device
+    if(!gpu_available()){
+        free_image(f);
+        return;
+    }
+    image im = load_image("data/dog.jpg");
+    image hp = make_highpass_filter();
+
+    gpu_image g = gpu_upload(im);
+    TEST(g.mem && g.w == im.w && g.h == im.h && g.c == im.c);
+    image back = gpu_download(g);
+    TEST(same_image(back, im));
+    free_image(back);
+
+    gpu_image gc = gpu_convolve_image(g, f, 1);
+    image conv = convolve_image(im, f, 1);
+    back = gpu_download(gc);
+    TEST(same_image(back, conv));
+    free_image(back);
+
+    gpu_image gh = gpu_convolve_image(g, hp, 0);
+    image high = convolve_image(im, hp, 0);
+    back = gpu_download(gh);
+    TEST(same_image(back, high));
+    free_image(back);
+
+    gpu_image gnn = gpu_nn_resize(g, 1001, 53);
+    image nn = nn_resize(im, 1001, 53);
+    back = gpu_download(gnn);
+    TEST(same_image(back, nn));
+    free_image(back);
+
+    gpu_image gbl = gpu_bilinear_resize(g, 301, 177);
+    image bl = bilinear_resize(im, 301, 177);
+    back = gpu_download(gbl);
+    TEST(same_image(back, bl));
+    free_image(back);
+
+    gpu_image ggray = gpu_rgb_to_grayscale(g);
+    image gray = rgb_to_grayscale(im);
+    back = gpu_download(ggray);
+    TEST(same_image(back, gray));
+    free_image(back);
+
+    gpu_image mag = make_gpu_image(im.w, im.h, 1);
+    gpu_image theta = make_gpu_image(im.w, im.h, 1);
+    gpu_sobel_image_into(mag, theta, g, 0);
+    image *sobel = sobel_image(im);
+    image m = gpu_download(mag);
+    image t = gpu_download(theta);
+    TEST(same_image(m, sobel[0]));
+    // Flat spots have no direction, and the sign of zero can put it at -pi or pi
+    int i, bad = 0;
+    for(i = 0; i < im.w*im.h; ++i){
+        if(sobel[0].data[i] > .01 && !within_eps(t.data[i], sobel[1].data[i])) ++bad;
+    }
+    TEST(bad == 0);
+    free_image(m);
+    free_image(t);
+
+    // A chain that only comes back to the host at the end, and async copies
+    image hsv = copy_image(im);
+    rgb_to_hsv(hsv);
+    gpu_image chain = gpu_upload(im);
+    gpu_rgb_to_hsv(chain);
+    image staged = make_image(im.w, im.h, im.c);
+    gpu_download_into(staged, chain);
+    gpu_hsv_to_rgb(chain);
+    gpu_image small = gpu_bilinear_resize(chain, 301, 177);
+    image out = make_image(301, 177, im.c);
+    gpu_download_into(out, small);
+    gpu_finish();
+    TEST(same_image(staged, hsv));
+    TEST(same_image(out, bl));
+
+    gpu_image gs[] = {g, gc, gh, gnn, gbl, ggray, mag, theta, chain, small};
+    for(i = 0; i < 10; ++i) free_gpu_image(gs[i]);
+    image ims[] = {im, f, hp, conv, high, nn, bl, gray, sobel[0], sobel[1], hsv, staged, out};
+    for(i = 0; i < 13; ++i) free_image(ims[i]);
+    free(sobel);
+}
+
+void test_hwc_image()
+{
+    image im = load_image("data/dogsmall.jpg");
+    hwc_image h = image_to_hwc(im);
+    TEST(h.w == im.w && h.h == im.h && h.c == 3);
+    TEST(h.data[(7*im.w + 5)*3 + 2] == get_pixel(im, 5, 7, 2));
+    TEST(same_hwc(h, im));
+
+    // Loading skips the planar image entirely but reads the same pixels
+    hwc_image loaded = load_hwc_image("data/dogsmall.jpg");
+    TEST(same_hwc(loaded, im));
+    free_hwc_image(loaded);
+    image dots = load_image("data/dots.png");
+    loaded = load_hwc_image("data/dots.png");
+    TEST(loaded.c == 3 && same_hwc(loaded, dots));
+    free_hwc_image(loaded);
+    free_image(dots);
+
+    // Every kernel matches its planar counterpart
+    image gray = rgb_to_grayscale(im);
+    hwc_image hgray = hwc_rgb_to_grayscale(h);
+    TEST(hgray.c == 1 && same_hwc(hgray, gray));
+
+    image hsv = copy_image(im);
+    rgb_to_hsv(hsv);
+    hwc_image hhsv = image_to_hwc(im);
+    hwc_rgb_to_hsv(hhsv);
+    TEST(same_hwc(hhsv, hsv));
+    hsv_to_rgb(hsv);
+    hwc_hsv_to_rgb(hhsv);
+    TEST(same_hwc(hhsv, hsv));
+
+    image nn = nn_resize(im, 301, 41);
+    hwc_image hnn = hwc_nn_resize(h, 301, 41);
+    TEST(same_hwc(hnn, nn));
+    image bl = bilinear_resize(im, 57, 203);
+    hwc_image hbl = hwc_bilinear_resize(h, 57, 203);
+    TEST(same_hwc(hbl, bl));
+
+    image f = make_gaussian_filter(2);
+    image blur = convolve_image(im, f, 1);
+    hwc_image hblur = hwc_convolve_image(h, f, 1);
+    TEST(same_hwc(hblur, blur));
+    image hp = make_highpass_filter();
+    image edges = convolve_image(im, hp, 0);
+    hwc_image hedges = hwc_convolve_image(h, hp, 0);
+    TEST(hedges.c == 1 && same_hwc(hedges, edges));
+    image per_channel = make_image(3, 5, 3);
+    for (int i = 0; i < 45; i ++) per_channel.data[i] = (i % 7 - 3) / 10.;
+    image mixed = convolve_image(im, per_channel, 1);
+    hwc_image hmixed = hwc_convolve_image(h, per_channel, 1);
+    TEST(same_hwc(hmixed, mixed));
+
+    // Saving writes the same bytes a planar save would
+    TEST(save_hwc_image(h, "test_hwc_tmp", default_save_options(FORMAT_PNG)));
+    image saved = load_image("test_hwc_tmp.png");
+    TEST(same_image(saved, im));
+    remove("test_hwc_tmp.png");
+
+    free_image(im);
+    free_image(gray);
+    free_image(hsv);
+    free_image(nn);
+    free_image(bl);
+    free_image(f);
+    free_image(blur);
+    free_image(hp);
+    free_image(edges);
+    free_image(per_channel);
+    free_image(mixed);
+    free_image(saved);
+    free_hwc_image(h);
+    free_hwc_image(hgray);
+    free_hwc_image(hhsv);
+    free_hwc_image(hnn);
+    free_hwc_image(hbl);
+    free_hwc_image(hblur);
+    free_hwc_image(hedges);
+    free_hwc_image(hmixed);
+}
+
+void test_qimage()
+{
+    image im = load_image("data/dog.jpg");
+    image f = make_box_filter(7);
+    qimage_type types[2] = {QIMAGE_U8, QIMAGE_U16};
+    int t;
+    for(t = 0; t < 2; ++t){
+        // Each fixed point kernel stays within a rounding step of float
+        qimage q = image_to_qimage(im, types[t]);
+        image back = qimage_to_image(q);
+        TEST(same_image(back, im));
+        free_image(back);
+
+        qimage qgray = qimage_rgb_to_grayscale(q);
+        image gray = rgb_to_grayscale(im);
+        back = qimage_to_image(qgray);
+        TEST(same_image(back, gray));
+        free_image(back);
+
+        qimage qbl = qimage_bilinear_resize(q, 301, 177);
+        image bl = bilinear_resize(im, 301, 177);
+        back = qimage_to_image(qbl);
+        TEST(same_image(back, bl));
+        free_image(back);
+
+        qimage qnn = qimage_nn_resize(q, 1001, 53);
+        image nn = nn_resize(im, 1001, 53);
+        back = qimage_to_image(qnn);
+        TEST(same_image(back, nn));
+        free_image(back);
+
+        qimage qbox = qimage_box_blur(q, 7);
+        image box = convolve_image(im, f, 1);
+        back = qimage_to_image(qbox);
+        TEST(same_image(back, box));
+        free_image(back);
+
+        qimage loaded = load_qimage("data/dog.jpg", types[t]);
+        back = qimage_to_image(loaded);
+        TEST(same_image(back, im));
+        free_image(back);
+
+        free_qimage(q);
+        free_qimage(qgray);
+        free_qimage(qbl);
+        free_qimage(qnn);
+        free_qimage(qbox);
+        free_qimage(loaded);
+        free_image(gray);
+        free_image(bl);
+        free_image(nn);
+        free_image(box);
+    }
+    free_image(im);
+    free_image(f);
+}
+
+void test_stream()
+{
+    image im = load_image("data/dogsmall.jpg");
+    image f = make_gaussian_filter(2);
+    image box = make_box_filter(3);
+    box.data[0] = 0; // not separable, takes the direct 2D path
+
+    // Strips much shorter than the filter halo still match in memory results
+    image out = make_image(im.w, im.h, im.c);
+    image gt = convolve_image(im, f, 1);
+    image_source src = image_source_from_image(im);
+    image_sink sink = image_sink_to_image(out);
+    TEST(stream_convolve(src, sink, f, 1, 5));
+    close_image_source(src);
+    close_image_sink(sink);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    image gray = make_image(im.w, im.h, 1);
+    gt = convolve_image(im, box, 0);
+    src = image_source_from_image(im);
+    sink = image_sink_to_image(gray);
+    TEST(stream_convolve(src, sink, box, 0, 0));
+    close_image_source(src);
+    close_image_sink(sink);
+    TEST(same_image(gray, gt));
+    free_image(gt);
+
+    gt = rgb_to_grayscale(im);
+    src = image_source_from_image(im);
+    sink = image_sink_to_image(gray);
+    TEST(stream_rgb_to_grayscale(src, sink, 16));
+    close_image_source(src);
+    close_image_sink(sink);
+    TEST(same_image(gray, gt));
+    free_image(gt);
+    gt = copy_image(im);
+    rgb_to_hsv(gt);
+    src = image_source_from_image(im);
+    sink = image_sink_to_image(out);
+    TEST(stream_rgb_to_hsv(src, sink, 9));
+    close_image_source(src);
+    close_image_sink(sink);
+    TEST(same_image(out, gt));
+    free_image(gt);
+
+    int sizes[3][2] = {{113, 47}, {500, 333}, {31, 200}};
+    int i, mode;
+    for(i = 0; i < 3; ++i){
+        for(mode = 0; mode < 2; ++mode){
+            image small = make_image(sizes[i][0], sizes[i][1], im.c);
+            gt = mode ? bilinear_resize(im, small.w, small.h) : nn_resize(im, small.w, small.h);
+            src = image_source_from_image(im);
+            sink = image_sink_to_image(small);
+            TEST(stream_resize(src, sink, mode, 7));
+            close_image_source(src);
+            close_image_sink(sink);
+            TEST(same_image(small, gt));
+            free_image(gt);
+            free_image(small);
+        }
+    }
+
+    // Through a file: the convolved image is written to it and read back
+    // in strips, so the grayscale pass never holds it whole
+    src = image_source_from_image(im);
+    sink = open_pnm_sink("test_stream_tmp.ppm", im.w, im.h, 3);
+    TEST(stream_convolve(src, sink, f, 1, 0));
+    close_image_source(src);
+    close_image_sink(sink);
+    src = open_pnm_source("test_stream_tmp.ppm");
+    image_sink gray_sink = image_sink_to_image(gray);
+    TEST(src.w == im.w && src.h == im.h && src.c == 3);
+    TEST(stream_rgb_to_grayscale(src, gray_sink, 0));
+    close_image_source(src);
+    close_image_sink(gray_sink);
+    gt = convolve_image(im, f, 1);
+    image gt_gray = rgb_to_grayscale(gt);
+    TEST(same_image(gray, gt_gray));
+    remove("test_stream_tmp.ppm");
+
+    free_image(gt);
+    free_image(gt_gray);
+    free_image(im);
+    free_image(f);
+    free_image(box);
+    free_image(out);
+    free_image(gray);
+}
+
+void test_into()
+{
+    image im = load_image("data/dog.jpg");
+    image f = make_gaussian_filter(2);
+    image dst = make_image(im.w, im.h, im.c);
+
+    // Outputs written into caller buffers match the allocating versions
+    image gt = convolve_image(im, f, 1);
+    convolve_image_into(dst, im, f, 1);
+    TEST(same_image(dst, gt));
+    free_image(gt);
+
+    gt = colorize_sobel(im);
+    colorize_sobel_into(dst, im);
+    TEST(same_image(dst, gt));
+    free_image(gt);
+
+    copy_image_into(dst, im);
+    TEST(same_image(dst, im));
+
+    image small = make_image(97, 203, im.c);
+    gt = bilinear_resize(im, 97, 203);
+    bilinear_resize_into(small, im);
+    TEST(same_image(small, gt));
+    free_image(gt);
+
+    resize_plan *plan = make_resize_plan(im.w, im.h, 97, 203, RESIZE_NN);
+    gt = nn_resize(im, 97, 203);
+    resize_with_plan_into(small, im, plan);
+    TEST(same_image(small, gt));
+    free_image(gt);
+    free_resize_plan(plan);
+
+    image gray = make_image(im.w, im.h, 1);
+    gt = rgb_to_grayscale(im);
+    rgb_to_grayscale_into(gray, im);
+    TEST(same_image(gray, gt));
+    free_image(gt);
+
+    // In place arithmetic round trips
+    image blur = convolve_image(im, f, 1);
+    gt = add_image(im, blur);
+    add_image_into(dst, im, blur);
+    TEST(same_image(dst, gt));
+    add_image_inplace(blur, im);
+    TEST(same_image(blur, gt));
+    sub_image_inplace(blur, im);
+    sub_image_into(dst, gt, im);
+    TEST(same_image(blur, dst));
+    free_image(gt);
+
+    free_image(im);
+    free_image(f);
+    free_image(dst);
+    free_image(small);
+    free_image(gray);
+    free_image(blur);
+}
+
+void test_threads()
+{
+    image im = load_image("data/dog.jpg");
+    image f = make_gaussian_filter(2);
+    image box = make_box_filter(3);
+    box.data[0] = 0; // not separable, takes the direct 2D path
+
+    int threads = get_num_threads();
+    image ref[6], par[6];
+    int i, t;
+    for(t = 0; t < 2; ++t){
+        image *out = t ? par : ref;
+        set_num_threads(t ? 4 : 1);
+        out[0] = convolve_image(im, f, 1);
+        out[1] = convolve_image(im, box, 0);
+        out[2] = bilinear_resize(im, 1001, 333);
+        out[3] = nn_resize(im, 97, 1203);
+        out[4] = copy_image(im);
+        rgb_to_hsv(out[4]);
+        image *sobel = sobel_image(im);
+        out[5] = sobel[0];
+        free_image(sobel[1]);
+        free(sobel);
+    }
+    set_num_threads(threads);
+
+    for(i = 0; i < 6; ++i){
+        TEST(same_image(par[i], ref[i]));
+        free_image(ref[i]);
+        free_image(par[i]);
+    }
+    free_image(im);
+    free_image(f);
+    free_image(box);
+}
+
+// Jobs for test_concurrency; each reads the shared input and returns a new
+// image, and t names the calling thread for jobs that need a file
+static image filter_gauss, filter_5x5, filter_box, filter_big;
+static resize_plan *shared_plan;
+
+static image job_load(image im, int t) { return load_image("data/dogsmall.jpg"); }
+static image job_gauss(image im, int t) { return convolve_image(im, filter_gauss, 1); }
+static image job_5x5(image im, int t) { return convolve_image(im, filter_5x5, 0); }
+static image job_box(image im, int t) { return convolve_image(im, filter_box, 1); }
+static image job_fft(image im, int t) { return convolve_image(im, filter_big, 1); }
+static image job_bilinear(image im, int t) { return bilinear_resize(im, 301, 97); }
+static image job_nn(image im, int t) { return nn_resize(im, 37, 411); }
+static image job_plan(image im, int t) { return resize_with_plan(im, shared_plan); }
+static image job_grayscale(image im, int t) { return rgb_to_grayscale(im); }
+
+static image job_hsv(image im, int t)
+{
+    image out = copy_image(im);
+    rgb_to_hsv(out);
+    shift_image(out, 1, .1);
+    clamp_image(out);
+    hsv_to_rgb(out);
+    return out;
+}
+
+static image job_sobel(image im, int t)
+{
+    image *sobel = sobel_image(im);
+    free_image(sobel[1]);
+    image out = sobel[0];
+    free(sobel);
+    return out;
+}
+
+static image job_op_graph(image im, int t)
+{
+    op_graph *g = make_op_graph(im);
+    op_graph_scale(g, 0, 1.5);
+    op_graph_clamp(g);
+    op_graph_grayscale(g);
+    image out = eval_op_graph(g);
+    free_op_graph(g);
+    return out;
+}
+
+static image job_qimage(image im, int t)
+{
+    qimage q = image_to_qimage(im, QIMAGE_U8);
+    qimage blurred = qimage_box_blur(q, 3);
+    image out = qimage_to_image(blurred);
+    free_qimage(q);
+    free_qimage(blurred);
+    return out;
+}
+
+static image job_png(image im, int t)
+{
+    // Threads write at different compression levels at once
+    save_options opts = default_save_options(FORMAT_PNG);
+    opts.compression = t % 2 ? 1 : 9;
+    int size, w, h, c;
+    unsigned char *png = encode_image(im, opts, &size);
+    unsigned char *data = stbi_load_from_memory(png, size, &w, &h, &c, 0);
+    image out = bytes_to_image(data, w, h, c);
+    free(png);
+    free(data);
+    return out;
+}
+
+static image job_raw(image im, int t)
+{
+    char name[64];
+    sprintf(name, "test_concurrency_tmp_%d", t);
+    save_image_raw(im, name);
+    strcat(name, ".raw");
+    image mapped = load_image_raw(name);
+    image out = copy_image(mapped);
+    free_image(mapped);
+    remove(name);
+    return out;
+}
+
+static image (*const concurrent_jobs[])(image, int) = {
+    job_load, job_gauss, job_5x5, job_box, job_fft, job_bilinear, job_nn,
+    job_plan, job_grayscale, job_hsv, job_sobel, job_op_graph, job_qimage,
+    job_png, job_raw
+};
+#define N_CONCURRENT_JOBS (int)(sizeof(concurrent_jobs) / sizeof(concurrent_jobs[0]))
+
+typedef struct{
+    image im;
+    image *ref;
+    int t;
+    int rounds;
+    int mismatches;
+} concurrency_args;
+
+static void *concurrency_thread(void *ctx)
+{
+    // Every thread runs every job, starting at a different one
+    concurrency_args *a = ctx;
+    for (int r = 0; r < a->rounds; r ++)
+    {
+        for (int j = 0; j < N_CONCURRENT_JOBS; j ++)
+        {
+            int k = (j + a->t + r) % N_CONCURRENT_JOBS;
+            image out = concurrent_jobs[k](a->im, a->t);
+            image ref = a->ref[k];
+            int same = out.w == ref.w && out.h == ref.h && out.c == ref.c;
+            for (int i = 0; same && i < ref.w*ref.h*ref.c; i ++) same = within_eps(out.data[i], ref.data[i]);
+            a->mismatches += !same;
+            free_image(out);
+        }
+    }
+    return 0;
+}
+
+static void *failing_decode_thread(void *ctx)
+{
+    unsigned char junk[16] = {0};
+    stbi_load_from_memory(junk, sizeof(junk), &(int){0}, &(int){0}, &(int){0}, 0);
+    return 0;
+}
+
+static void invert_stage(image out, image in, void *ctx)
+{
+    int i;
+    for(i = 0; i < in.w*in.h*in.c; ++i) out.data[i] = 1 - in.data[i];
+    *(int *)ctx += 1;
+}
+
+static void stamp_stage(image out, image in, void *ctx)
+{
+    // Marks a big frame with the number pushed in a 1x1 one, at both ends
+    out.data[0] = out.data[out.w*out.h*out.c - 1] = in.data[0];
+}
+
+typedef struct{
+    frame_pipeline *p;
+    int *done;
+    int *seen;
+    int frames, errors;
+} reader_args;
+
+static void *frame_reader_thread(void *ctx)
+{
+    reader_args *a = ctx;
+    int w, h, c;
+    frame_pipeline_output_size(a->p, &w, &h, &c);
+    image out = make_image(w, h, c);
+    long long last = -1;
+    while (!__atomic_load_n(a->done, __ATOMIC_ACQUIRE))
+    {
+        long long frame = latest_frame(a->p, out);
+        if (frame < 0) continue;
+        a->errors += frame <= last || out.data[0] != frame || out.data[w*h*c - 1] != frame;
+        a->errors += __atomic_fetch_add(a->seen + frame, 1, __ATOMIC_RELAXED) != 0;
+        a->frames ++;
+        last = frame;
+    }
+    free_image(out);
+    return 0;
+}
+
+static void slow_stage(image out, image in, void *ctx)
+{
+    struct timespec ts = {0, 5000000};
+    nanosleep(&ts, 0);
+    copy_image_into(out, in);
+}
+
+void test_frame_pipeline()
+{
+    image im = load_image("data/dog.jpg");
+
+    // A chain of ops gives what the same chain gives in a batch
+    frame_pipeline *p = make_frame_pipeline(im.w, im.h, im.c, 3);
+    TEST(add_frame_ops(p, "grayscale,resize:256x192,blur:2,clamp") == 4);
+    int w, h, c;
+    frame_pipeline_output_size(p, &w, &h, &c);
+    TEST(w == 256 && h == 192 && c == 1);
+    image out = make_image(w, h, c);
+    TEST(latest_frame(p, out) == -1);
+    TEST(push_frame(p, im) == 0);
+    flush_frame_pipeline(p);
+    TEST(latest_frame(p, out) == 0);
+    TEST(latest_frame(p, out) == -1);
+    batch_op ops[4];
+    parse_batch_ops("grayscale,resize:256x192,blur:2,clamp", ops, 4);
+    image ref = apply_batch_ops(copy_image(im), ops, 4);
+    TEST(same_image(out, ref));
+    frame_stats s;
+    TEST(frame_pipeline_stats(p, -1, &s) && s.frames == 1 && s.dropped == 0 && s.max_ms >= s.mean_ms);
+    TEST(frame_pipeline_stats(p, 3, &s) && s.frames == 1);
+    TEST(!frame_pipeline_stats(p, 4, &s));
+    free_frame_pipeline(p);
+    free_image(out);
+    free_image(ref);
+
+    TEST(add_frame_ops(p = make_frame_pipeline(8, 8, 3, 2), "area:4x4") == -1);
+    TEST(frame_pipeline_stages(p) == 0);
+    free_frame_pipeline(p);
+
+    // Pushing faster than a stage runs drops the oldest frames, never the newest
+    int calls = 0;
+    p = make_frame_pipeline(im.w, im.h, im.c, 2);
+    add_frame_stage(p, im.w, im.h, im.c, slow_stage, 0);
+    add_frame_stage(p, im.w, im.h, im.c, invert_stage, &calls);
+    int i;
+    for(i = 0; i < 40; ++i) push_frame(p, im);
+    flush_frame_pipeline(p);
+    out = make_image(im.w, im.h, im.c);
+    TEST(latest_frame(p, out) == 39);
+    TEST(within_eps(out.data[1000], 1 - im.data[1000]));
+    frame_stats slow, all;
+    frame_pipeline_stats(p, 0, &slow);
+    frame_pipeline_stats(p, -1, &all);
+    TEST(slow.dropped > 0 && slow.frames + slow.dropped == 40);
+    TEST(slow.mean_ms >= 5);
+    TEST(all.frames == calls && all.frames + all.dropped == 40);
+    free_frame_pipeline(p);
+    free_image(out);
+
+    // Two threads reading while frames come out each get whole frames,
+    // newer each time, and never one the other already got
+    struct timespec pause = {0, 200000};
+    image stamp = make_image(1, 1, 1);
+    int done = 0;
+    int seen[400] = {0};
+    p = make_frame_pipeline(1, 1, 1, 2);
+    add_frame_stage(p, 1024, 1024, 1, stamp_stage, 0);
+    reader_args readers[2] = {{p, &done, seen}, {p, &done, seen}};
+    pthread_t tid[2];
+    for(i = 0; i < 2; ++i) pthread_create(tid + i, 0, frame_reader_thread, readers + i);
+    for(i = 0; i < 400; ++i){
+        stamp.data[0] = i;
+        push_frame(p, stamp);
+        nanosleep(&pause, 0);
+    }
+    flush_frame_pipeline(p);
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+    for(i = 0; i < 2; ++i) pthread_join(tid[i], 0);
+    TEST(readers[0].errors == 0 && readers[1].errors == 0);
+    TEST(readers[0].frames + readers[1].frames > 0);
+    free_frame_pipeline(p);
+    free_image(stamp);
+    free_image(im);
+}
+
+void test_concurrency()
+{
+    image im = load_image("data/dogsmall.jpg");
+    filter_gauss = make_gaussian_filter(2);
+    filter_5x5 = make_image(5, 5, 1);
+    for (int i = 0; i < 25; i ++) filter_5x5.data[i] = (i % 5 + i / 5 - 4) / 8.0f;
+    filter_box = make_box_filter(7);
+    filter_big = make_image(13, 13, 1);
+    for (int i = 0; i < 13*13; i ++) filter_big.data[i] = (i % 7) / (7.*13*13);
+    shared_plan = make_resize_plan(im.w, im.h, 150, 120, RESIZE_BILINEAR);
+
+    // References from one thread, then the same calls from eight at once,
+    // with the kernels' own pool in play so callers contend for it
+    int threads = get_num_threads();
+    set_num_threads(1);
+    image ref[N_CONCURRENT_JOBS];
+    for (int k = 0; k < N_CONCURRENT_JOBS; k ++) ref[k] = concurrent_jobs[k](im, 0);
+    set_num_threads(4);
+
+    pthread_t tid[8];
+    concurrency_args args[8];
+    for (int t = 0; t < 8; t ++)
+    {
+        concurrency_args a = {im, ref, t, 3, 0};
+        args[t] = a;
+        pthread_create(tid + t, 0, concurrency_thread, args + t);
+    }
+    int mismatches = 0;
+    for (int t = 0; t < 8; t ++)
+    {
+        pthread_join(tid[t], 0);
+        mismatches += args[t].mismatches;
+    }
+    set_num_threads(threads);
+    TEST(mismatches == 0);
+
+    // A failed load reports its own reason, not another thread's
+    TEST(!stbi_load("data/missing.jpg", &(int){0}, &(int){0}, &(int){0}, 0));
+    pthread_create(tid, 0, failing_decode_thread, 0);
+    pthread_join(tid[0], 0);
+    TEST(strstr(stbi_failure_reason(), "fopen") != 0);
+
+    for (int k = 0; k < N_CONCURRENT_JOBS; k ++) free_image(ref[k]);
+    free_resize_plan(shared_plan);
+    free_image(filter_gauss);
+    free_image(filter_5x5);
+    free_image(filter_box);
+    free_image(filter_big);
+    free_image(im);
+}
+
 int do_test()
 {
     TEST('1' == '1');
@@ -352,27 +1918,165 @@ int do_test()
     return 0;
 }
 
+void test_batch()
+{
+    batch_op ops[8];
+    TEST(-1 == parse_batch_ops("grayscale,resize:10", ops, 8));
+    TEST(-1 == parse_batch_ops("blur:2,sharpen", ops, 8));
+    int n = parse_batch_ops("resize:40x30,blur:1,grayscale", ops, 8);
+    TEST(n == 3);
+    TEST(ops[0].kind == BATCH_RESIZE && ops[0].w == 40 && ops[0].h == 30);
+    TEST(ops[1].kind == BATCH_BLUR && within_eps(ops[1].sigma, 1));
+
+    // Outputs go to a directory of their own, so nothing is left behind
+    // and no stray file from an earlier run can pass for one
+    char dir[] = "/tmp/uwimg_test_batch_XXXXXX";
+    TEST(mkdtemp(dir) != 0);
+    char dogsmall[64], dots[64];
+    snprintf(dogsmall, sizeof(dogsmall), "%s/dogsmall.png", dir);
+    snprintf(dots, sizeof(dots), "%s/dots.png", dir);
+
+    // One missing input fails on its own, the others come out processed
+    char *inputs[] = {"data/dogsmall.jpg", "data/missing.jpg", "data/dots.png"};
+    batch_config cfg = {dir, default_save_options(FORMAT_PNG), 3, 1};
+    TEST(1 == run_batch(inputs, 3, ops, n, cfg));
+
+    image gt = apply_batch_ops(load_image("data/dogsmall.jpg"), ops, n);
+    image out = load_image(dogsmall);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    free_image(out);
+
+    gt = apply_batch_ops(load_image("data/dots.png"), ops, n);
+    out = load_image(dots);
+    TEST(same_image(out, gt));
+    free_image(gt);
+    free_image(out);
+
+    remove(dogsmall);
+    remove(dots);
+
+    // Inputs that would overwrite each other's output are turned down
+    // before anything is written
+    char *clashing[] = {"data/dogsmall.jpg", "data/dots.png", "./data/dots.png"};
+    TEST(-1 == run_batch(clashing, 3, ops, n, cfg));
+    FILE *written = fopen(dogsmall, "rb");
+    TEST(!written);
+    if(written) fclose(written);
+    remove(dogsmall);
+    TEST(rmdir(dir) == 0);
+}
+
+void test_bench()
+{
+    int sizes[] = {32}, channels[] = {3};
+    bench_config cfg = {"resize", sizes, 1, channels, 1, 0, 3, 0};
+    int max = max_bench_results(cfg);
+    bench_result *r = calloc(max, sizeof(bench_result));
+    int n = run_benchmarks(cfg, r, max);
+    TEST(n > 0 && n < max);
+    int sane = 1;
+    for (int i = 0; i < n; i ++)
+    {
+        sane &= strstr(r[i].name, "resize") != 0 && r[i].w == 32 && r[i].c == 3 && r[i].reps == 3;
+        sane &= r[i].min_ms <= r[i].median_ms && r[i].median_ms <= r[i].p95_ms;
+    }
+    TEST(sane);
+    free(r);
+}
+
+void test_instrument()
+{
+    long long calls, allocated, freed, live, peak;
+    double seconds;
+    if (!instrument_enabled())
+    {
+        TEST(!instrument_counts("convolve_image_into", &calls, &seconds) && calls == 0);
+        return;
+    }
+
+    instrument_reset();
+    TEST(instrument_trace_start("test_instrument_tmp.json"));
+    image im = load_image("data/dogsmall.jpg");
+    image f = make_box_filter(7);
+    for (int i = 0; i < 3; i ++) free_image(convolve_image(im, f, 1));
+    TEST(instrument_trace_stop());
+
+    TEST(instrument_counts("convolve_image_into", &calls, &seconds) && calls == 3 && seconds > 0);
+    TEST(instrument_counts("load_image_stb", &calls, &seconds) && calls == 1);
+    TEST(!instrument_counts("no_such_function", &calls, &seconds));
+
+    // Three outputs came and went, and at most one was live at a time
+    size_t bytes = (size_t)im.w*im.h*im.c*sizeof(float);
+    instrument_memory(&allocated, &freed, &live, &peak);
+    TEST(freed == 3*bytes);
+    TEST(peak - live == bytes);
+
+    // A big scratch temporary is freed on release, not kept by the thread
+    long long kept = live;
+    release_scratch_image(scratch_image(2048, 2048, 1));
+    instrument_memory(&allocated, &freed, &live, &peak);
+    TEST(live == kept);
+
+    FILE *trace = fopen("test_instrument_tmp.json", "r");
+    TEST(trace != 0);
+    if (trace) fclose(trace);
+    remove("test_instrument_tmp.json");
+    free_image(im);
+    free_image(f);
+}
+
 void run_tests()
 {
+    test_arena();
+    test_load();
+    test_save();
+    test_bytes();
+    test_raw();
+    test_op_graph();
     test_get_pixel();
     test_set_pixel();
     test_copy();
     test_shift();
+    test_scale();
     test_grayscale();
     test_rgb_to_hsv();
     test_hsv_to_rgb();
+    test_color_kernels();
     test_nn_resize();
     test_bl_resize();
     test_multiple_resize();
+    test_resize_plan();
+    test_downscale();
     test_gaussian_filter();
     test_sharpen_filter();
     test_emboss_filter();
     test_highpass_filter();
     test_convolution();
     test_gaussian_blur();
+    test_gaussian_cache();
+    test_gaussian_iir();
+    test_separable_convolution();
+    test_box_blur();
+    test_pyramid();
+    test_small_convolution();
+    test_fft_convolution();
     test_hybrid_image();
     test_frequency_image();
     test_sobel();
+    test_sobel_fused();
+    test_into();
+    test_stream();
+    test_qimage();
+    test_hwc_image();
+    test_views();
+    test_gpu();
+    test_threads();
+    test_concurrency();
+    test_frame_pipeline();
+    test_batch();
+    test_bench();
+    test_instrument();
     printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
 
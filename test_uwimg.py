@@ -0,0 +1,67 @@
+# Tests for the NumPy side of uwimg.py: python3 test_uwimg.py after make.
+# Every test is skipped when numpy is not installed.
+import unittest
+from uwimg import *
+
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
+@unittest.skipIf(np is None, "numpy is not installed")
+class NumpyTest(unittest.TestCase):
+    def test_image_to_numpy(self):
+        im = make_image(4, 3, 2)
+        arr = image_to_numpy(im)
+        self.assertEqual(arr.shape, (2, 3, 4))
+        self.assertEqual(arr.dtype, np.float32)
+        arr[1, 2, 3] = .5
+        self.assertEqual(get_pixel(im, 3, 2, 1), .5)
+        free_image(im)
+
+    def test_array_protocol(self):
+        im = make_image(4, 3, 2)
+        set_pixel(im, 1, 2, 0, .25)
+        view = np.asarray(im)
+        self.assertTrue(np.shares_memory(view, image_to_numpy(im)))
+        copied = np.array(im, copy=True)
+        self.assertFalse(np.shares_memory(copied, view))
+        self.assertEqual(copied[0, 2, 1], .25)
+        doubles = np.asarray(im, dtype=np.float64)
+        self.assertEqual(doubles.dtype, np.float64)
+        self.assertEqual(doubles[0, 2, 1], .25)
+        if int(np.__version__.split(".")[0]) >= 2:
+            with self.assertRaises(ValueError):
+                np.asarray(im, dtype=np.float64, copy=False)
+        free_image(im)
+
+    def test_image_from_numpy(self):
+        arr = np.arange(24, dtype=np.float32).reshape(2, 3, 4) / 24
+        im = image_from_numpy(arr)
+        self.assertEqual((im.w, im.h, im.c), (4, 3, 2))
+        self.assertEqual(get_pixel(im, 3, 2, 1), arr[1, 2, 3])
+        set_pixel(im, 0, 0, 0, 1)
+        self.assertEqual(arr[0, 0, 0], 1)
+
+        flat = image_from_numpy(np.zeros((3, 4), dtype=np.float32))
+        self.assertEqual((flat.w, flat.h, flat.c), (4, 3, 1))
+        with self.assertRaises(ValueError):
+            image_from_numpy(np.zeros((2, 3, 4)))
+        with self.assertRaises(ValueError):
+            image_from_numpy(arr[:, :, ::2])
+
+    def test_image_from_numpy_bytes(self):
+        arr = np.arange(48, dtype=np.uint8).reshape(3, 4, 4) * 5
+        im = image_from_numpy_bytes(arr)
+        self.assertEqual((im.w, im.h, im.c), (4, 3, 3))
+        self.assertAlmostEqual(get_pixel(im, 3, 2, 1), arr[2, 3, 1] / 255., places=6)
+        back = image_to_numpy_bytes(im)
+        self.assertTrue(np.array_equal(back, arr[:, :, :3]))
+        free_image(im)
+
+        gray = image_from_numpy_bytes(arr[:, :, 0])
+        self.assertEqual((gray.w, gray.h, gray.c), (4, 3, 1))
+        free_image(gray)
+
+if __name__ == "__main__":
+    unittest.main()
@@ -3,6 +3,9 @@ from ctypes import *
 import math
 import random
 
+# CDLL releases the GIL for the length of every call, and the library may be
+# called from several threads at once (see "Threading" in src/image.h), so a
+# thread pool running convolve_image or bilinear_resize scales like processes
 lib = CDLL(os.path.join(os.path.dirname(__file__), "libuwimg.so"), RTLD_GLOBAL)
 
 def c_array(ctype, values):
@@ -19,6 +22,17 @@ class IMAGE(Structure):
         return add_image(self, other)
     def __sub__(self, other):
         return sub_image(self, other)
+    def __array__(self, dtype=None, copy=None):
+        # np.asarray(im) is a view of the pixels, see image_to_numpy.
+        # copy=True always copies; copy=False (NumPy 2) refuses to when a
+        # dtype conversion would need one
+        import numpy as np
+        arr = image_to_numpy(self)
+        if dtype is not None and np.dtype(dtype) != arr.dtype:
+            if copy is False:
+                raise ValueError("converting an image to %s needs a copy" % np.dtype(dtype))
+            return arr.astype(dtype)
+        return np.array(arr, copy=True) if copy else arr
 
 add_image = lib.add_image
 add_image.argtypes = [IMAGE, IMAGE]
@@ -28,6 +42,22 @@ sub_image = lib.sub_image
 sub_image.argtypes = [IMAGE, IMAGE]
 sub_image.restype = IMAGE
 
+add_image_into = lib.add_image_into
+add_image_into.argtypes = [IMAGE, IMAGE, IMAGE]
+add_image_into.restype = None
+
+sub_image_into = lib.sub_image_into
+sub_image_into.argtypes = [IMAGE, IMAGE, IMAGE]
+sub_image_into.restype = None
+
+add_image_inplace = lib.add_image_inplace
+add_image_inplace.argtypes = [IMAGE, IMAGE]
+add_image_inplace.restype = None
+
+sub_image_inplace = lib.sub_image_inplace
+sub_image_inplace.argtypes = [IMAGE, IMAGE]
+sub_image_inplace.restype = None
+
 make_image = lib.make_image
 make_image.argtypes = [c_int, c_int, c_int]
 make_image.restype = IMAGE
@@ -35,6 +65,34 @@ make_image.restype = IMAGE
 free_image = lib.free_image
 free_image.argtypes = [IMAGE]
 
+make_image_uninit = lib.make_image_uninit
+make_image_uninit.argtypes = [c_int, c_int, c_int]
+make_image_uninit.restype = IMAGE
+
+make_image_arena = lib.make_image_arena
+make_image_arena.argtypes = []
+make_image_arena.restype = c_void_p
+
+arena_make_image = lib.arena_make_image
+arena_make_image.argtypes = [c_void_p, c_int, c_int, c_int]
+arena_make_image.restype = IMAGE
+
+arena_make_image_uninit = lib.arena_make_image_uninit
+arena_make_image_uninit.argtypes = [c_void_p, c_int, c_int, c_int]
+arena_make_image_uninit.restype = IMAGE
+
+arena_release_image = lib.arena_release_image
+arena_release_image.argtypes = [c_void_p, IMAGE]
+arena_release_image.restype = None
+
+arena_reset = lib.arena_reset
+arena_reset.argtypes = [c_void_p]
+arena_reset.restype = None
+
+free_image_arena = lib.free_image_arena
+free_image_arena.argtypes = [c_void_p]
+free_image_arena.restype = None
+
 get_pixel = lib.get_pixel
 get_pixel.argtypes = [IMAGE, c_int, c_int, c_int]
 get_pixel.restype = c_float
@@ -47,10 +105,18 @@ rgb_to_grayscale = lib.rgb_to_grayscale
 rgb_to_grayscale.argtypes = [IMAGE]
 rgb_to_grayscale.restype = IMAGE
 
+rgb_to_grayscale_into = lib.rgb_to_grayscale_into
+rgb_to_grayscale_into.argtypes = [IMAGE, IMAGE]
+rgb_to_grayscale_into.restype = None
+
 copy_image = lib.copy_image
 copy_image.argtypes = [IMAGE]
 copy_image.restype = IMAGE
 
+copy_image_into = lib.copy_image_into
+copy_image_into.argtypes = [IMAGE, IMAGE]
+copy_image_into.restype = None
+
 rgb_to_hsv = lib.rgb_to_hsv
 rgb_to_hsv.argtypes = [IMAGE]
 rgb_to_hsv.restype = None
@@ -71,6 +137,21 @@ shift_image = lib.shift_image
 shift_image.argtypes = [IMAGE, c_int, c_float]
 shift_image.restype = None
 
+scale_image = lib.scale_image
+scale_image.argtypes = [IMAGE, c_int, c_float]
+scale_image.restype = None
+
+scale_image_channels_lib = lib.scale_image_channels
+scale_image_channels_lib.argtypes = [IMAGE, POINTER(c_float)]
+scale_image_channels_lib.restype = None
+
+def scale_image_channels(im, v):
+    scale_image_channels_lib(im, (c_float * len(v))(*v))
+
+threshold_image = lib.threshold_image
+threshold_image.argtypes = [IMAGE, c_float]
+threshold_image.restype = None
+
 load_image_lib = lib.load_image
 load_image_lib.argtypes = [c_char_p]
 load_image_lib.restype = IMAGE
@@ -78,6 +159,27 @@ load_image_lib.restype = IMAGE
 def load_image(f):
     return load_image_lib(f.encode('ascii'))
 
+try_load_image_lib = lib.try_load_image
+try_load_image_lib.argtypes = [c_char_p]
+try_load_image_lib.restype = IMAGE
+
+def try_load_image(f):
+    return try_load_image_lib(f.encode('ascii'))
+
+load_image_into_lib = lib.load_image_into
+load_image_into_lib.argtypes = [IMAGE, c_char_p]
+load_image_into_lib.restype = None
+
+def load_image_into(im, f):
+    load_image_into_lib(im, f.encode('ascii'))
+
+arena_load_image_lib = lib.arena_load_image
+arena_load_image_lib.argtypes = [c_void_p, c_char_p]
+arena_load_image_lib.restype = IMAGE
+
+def arena_load_image(a, f):
+    return arena_load_image_lib(a, f.encode('ascii'))
+
 save_png_lib = lib.save_png
 save_png_lib.argtypes = [IMAGE, c_char_p]
 save_png_lib.restype = None
@@ -92,6 +194,250 @@ save_image_lib.restype = None
 def save_image(im, f):
     return save_image_lib(im, f.encode('ascii'))
 
+FORMAT_JPG = 0
+FORMAT_PNG = 1
+
+class SAVE_OPTIONS(Structure):
+    _fields_ = [("format", c_int),
+                ("quality", c_int),
+                ("compression", c_int)]
+
+default_save_options = lib.default_save_options
+default_save_options.argtypes = [c_int]
+default_save_options.restype = SAVE_OPTIONS
+
+save_image_options_lib = lib.save_image_options
+save_image_options_lib.argtypes = [IMAGE, c_char_p, SAVE_OPTIONS]
+save_image_options_lib.restype = c_int
+
+def save_image_options(im, f, opts):
+    return save_image_options_lib(im, f.encode('ascii'), opts)
+
+encode_image_lib = lib.encode_image
+encode_image_lib.argtypes = [IMAGE, SAVE_OPTIONS, POINTER(c_int)]
+encode_image_lib.restype = POINTER(c_ubyte)
+
+libc = CDLL(None)
+libc.free.argtypes = [c_void_p]
+
+def encode_image(im, opts):
+    size = c_int(0)
+    data = encode_image_lib(im, opts, byref(size))
+    if not data:
+        return None
+    encoded = string_at(data, size.value)
+    libc.free(data)
+    return encoded
+
+save_image_raw_lib = lib.save_image_raw
+save_image_raw_lib.argtypes = [IMAGE, c_char_p]
+save_image_raw_lib.restype = c_int
+
+def save_image_raw(im, f):
+    return save_image_raw_lib(im, f.encode('ascii'))
+
+load_image_raw_lib = lib.load_image_raw
+load_image_raw_lib.argtypes = [c_char_p]
+load_image_raw_lib.restype = IMAGE
+
+def load_image_raw(f):
+    return load_image_raw_lib(f.encode('ascii'))
+
+class INTEGRAL_IMAGE(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("sum", POINTER(c_double)),
+                ("sum_sq", POINTER(c_double))]
+
+box_blur = lib.box_blur
+box_blur.argtypes = [IMAGE, c_int]
+box_blur.restype = IMAGE
+
+make_integral_image = lib.make_integral_image
+make_integral_image.argtypes = [IMAGE, c_int]
+make_integral_image.restype = INTEGRAL_IMAGE
+
+free_integral_image = lib.free_integral_image
+free_integral_image.argtypes = [INTEGRAL_IMAGE]
+free_integral_image.restype = None
+
+integral_sum = lib.integral_sum
+integral_sum.argtypes = [INTEGRAL_IMAGE, c_int, c_int, c_int, c_int, c_int]
+integral_sum.restype = c_double
+
+integral_mean = lib.integral_mean
+integral_mean.argtypes = [INTEGRAL_IMAGE, c_int, c_int, c_int, c_int, c_int]
+integral_mean.restype = c_double
+
+integral_variance = lib.integral_variance
+integral_variance.argtypes = [INTEGRAL_IMAGE, c_int, c_int, c_int, c_int, c_int]
+integral_variance.restype = c_double
+
+make_op_graph = lib.make_op_graph
+make_op_graph.argtypes = [IMAGE]
+make_op_graph.restype = c_void_p
+
+op_graph_shift = lib.op_graph_shift
+op_graph_shift.argtypes = [c_void_p, c_int, c_float]
+op_graph_shift.restype = None
+
+op_graph_scale = lib.op_graph_scale
+op_graph_scale.argtypes = [c_void_p, c_int, c_float]
+op_graph_scale.restype = None
+
+op_graph_clamp = lib.op_graph_clamp
+op_graph_clamp.argtypes = [c_void_p]
+op_graph_clamp.restype = None
+
+op_graph_threshold = lib.op_graph_threshold
+op_graph_threshold.argtypes = [c_void_p, c_float]
+op_graph_threshold.restype = None
+
+op_graph_grayscale = lib.op_graph_grayscale
+op_graph_grayscale.argtypes = [c_void_p]
+op_graph_grayscale.restype = None
+
+op_graph_rgb_to_hsv = lib.op_graph_rgb_to_hsv
+op_graph_rgb_to_hsv.argtypes = [c_void_p]
+op_graph_rgb_to_hsv.restype = None
+
+op_graph_hsv_to_rgb = lib.op_graph_hsv_to_rgb
+op_graph_hsv_to_rgb.argtypes = [c_void_p]
+op_graph_hsv_to_rgb.restype = None
+
+op_graph_add = lib.op_graph_add
+op_graph_add.argtypes = [c_void_p, IMAGE]
+op_graph_add.restype = None
+
+op_graph_sub = lib.op_graph_sub
+op_graph_sub.argtypes = [c_void_p, IMAGE]
+op_graph_sub.restype = None
+
+op_graph_channels = lib.op_graph_channels
+op_graph_channels.argtypes = [c_void_p]
+op_graph_channels.restype = c_int
+
+eval_op_graph = lib.eval_op_graph
+eval_op_graph.argtypes = [c_void_p]
+eval_op_graph.restype = IMAGE
+
+eval_op_graph_into = lib.eval_op_graph_into
+eval_op_graph_into.argtypes = [IMAGE, c_void_p]
+eval_op_graph_into.restype = None
+
+free_op_graph = lib.free_op_graph
+free_op_graph.argtypes = [c_void_p]
+free_op_graph.restype = None
+
+class IMAGE_VIEW(Structure):
+    # Pixel (x, y) channel k at data[k*plane + y*stride + x]; a view points
+    # into another image's pixels, so keep that image alive and never
+    # free_image the view's data
+    _fields_ = [('w', c_int),
+                ('h', c_int),
+                ('c', c_int),
+                ('stride', c_int),
+                ('plane', c_int),
+                ('data', POINTER(c_float))]
+
+view_image = lib.view_image
+view_image.argtypes = [IMAGE]
+view_image.restype = IMAGE_VIEW
+
+view_region = lib.view_region
+view_region.argtypes = [IMAGE_VIEW, c_int, c_int, c_int, c_int]
+view_region.restype = IMAGE_VIEW
+
+view_channel = lib.view_channel
+view_channel.argtypes = [IMAGE_VIEW, c_int]
+view_channel.restype = IMAGE_VIEW
+
+get_view_pixel = lib.get_view_pixel
+get_view_pixel.argtypes = [IMAGE_VIEW, c_int, c_int, c_int]
+get_view_pixel.restype = c_float
+
+set_view_pixel = lib.set_view_pixel
+set_view_pixel.argtypes = [IMAGE_VIEW, c_int, c_int, c_int, c_float]
+set_view_pixel.restype = None
+
+copy_view = lib.copy_view
+copy_view.argtypes = [IMAGE_VIEW]
+copy_view.restype = IMAGE
+
+copy_image_to_view = lib.copy_image_to_view
+copy_image_to_view.argtypes = [IMAGE_VIEW, IMAGE]
+copy_image_to_view.restype = None
+
+shift_view = lib.shift_view
+shift_view.argtypes = [IMAGE_VIEW, c_int, c_float]
+shift_view.restype = None
+
+scale_view = lib.scale_view
+scale_view.argtypes = [IMAGE_VIEW, c_int, c_float]
+scale_view.restype = None
+
+clamp_view = lib.clamp_view
+clamp_view.argtypes = [IMAGE_VIEW]
+clamp_view.restype = None
+
+rgb_to_grayscale_view = lib.rgb_to_grayscale_view
+rgb_to_grayscale_view.argtypes = [IMAGE_VIEW]
+rgb_to_grayscale_view.restype = IMAGE
+
+rgb_to_hsv_view = lib.rgb_to_hsv_view
+rgb_to_hsv_view.argtypes = [IMAGE_VIEW]
+rgb_to_hsv_view.restype = None
+
+hsv_to_rgb_view = lib.hsv_to_rgb_view
+hsv_to_rgb_view.argtypes = [IMAGE_VIEW]
+hsv_to_rgb_view.restype = None
+
+nn_resize_view = lib.nn_resize_view
+nn_resize_view.argtypes = [IMAGE_VIEW, c_int, c_int]
+nn_resize_view.restype = IMAGE
+
+bilinear_resize_view = lib.bilinear_resize_view
+bilinear_resize_view.argtypes = [IMAGE_VIEW, c_int, c_int]
+bilinear_resize_view.restype = IMAGE
+
+resize_view_with_plan_into = lib.resize_view_with_plan_into
+resize_view_with_plan_into.argtypes = [IMAGE, IMAGE_VIEW, c_void_p]
+resize_view_with_plan_into.restype = None
+
+convolve_view = lib.convolve_view
+convolve_view.argtypes = [IMAGE_VIEW, IMAGE, c_int]
+convolve_view.restype = IMAGE
+
+gaussian_downsample = lib.gaussian_downsample
+gaussian_downsample.argtypes = [IMAGE]
+gaussian_downsample.restype = IMAGE
+
+gaussian_downsample_into = lib.gaussian_downsample_into
+gaussian_downsample_into.argtypes = [IMAGE, IMAGE]
+gaussian_downsample_into.restype = None
+
+make_image_pyramid = lib.make_image_pyramid
+make_image_pyramid.argtypes = [IMAGE, c_int]
+make_image_pyramid.restype = c_void_p
+
+pyramid_levels = lib.pyramid_levels
+pyramid_levels.argtypes = [c_void_p]
+pyramid_levels.restype = c_int
+
+# The levels belong to the pyramid; do not free_image them
+pyramid_gaussian = lib.pyramid_gaussian
+pyramid_gaussian.argtypes = [c_void_p, c_int]
+pyramid_gaussian.restype = IMAGE
+
+pyramid_laplacian = lib.pyramid_laplacian
+pyramid_laplacian.argtypes = [c_void_p, c_int]
+pyramid_laplacian.restype = IMAGE
+
+free_image_pyramid = lib.free_image_pyramid
+free_image_pyramid.argtypes = [c_void_p]
+free_image_pyramid.restype = None
+
 same_image = lib.same_image
 same_image.argtypes = [IMAGE, IMAGE]
 same_image.restype = c_int
@@ -100,10 +446,49 @@ nn_resize = lib.nn_resize
 nn_resize.argtypes = [IMAGE, c_int, c_int]
 nn_resize.restype = IMAGE
 
+nn_resize_into = lib.nn_resize_into
+nn_resize_into.argtypes = [IMAGE, IMAGE]
+nn_resize_into.restype = None
+
 bilinear_resize = lib.bilinear_resize
 bilinear_resize.argtypes = [IMAGE, c_int, c_int]
 bilinear_resize.restype = IMAGE
 
+bilinear_resize_into = lib.bilinear_resize_into
+bilinear_resize_into.argtypes = [IMAGE, IMAGE]
+bilinear_resize_into.restype = None
+
+area_resize = lib.area_resize
+area_resize.argtypes = [IMAGE, c_int, c_int]
+area_resize.restype = IMAGE
+
+lanczos_resize = lib.lanczos_resize
+lanczos_resize.argtypes = [IMAGE, c_int, c_int]
+lanczos_resize.restype = IMAGE
+
+pyramid_resize = lib.pyramid_resize
+pyramid_resize.argtypes = [IMAGE, c_int, c_int]
+pyramid_resize.restype = IMAGE
+
+RESIZE_NN = 0
+RESIZE_BILINEAR = 1
+
+make_resize_plan = lib.make_resize_plan
+make_resize_plan.argtypes = [c_int, c_int, c_int, c_int, c_int]
+make_resize_plan.restype = c_void_p
+
+resize_with_plan = lib.resize_with_plan
+resize_with_plan.argtypes = [IMAGE, c_void_p]
+resize_with_plan.restype = IMAGE
+
+resize_with_plan_into = lib.resize_with_plan_into
+resize_with_plan_into.argtypes = [IMAGE, IMAGE, c_void_p]
+resize_with_plan_into.restype = None
+
+free_resize_plan = lib.free_resize_plan
+free_resize_plan.argtypes = [c_void_p]
+free_resize_plan.restype = None
+
 make_sharpen_filter = lib.make_sharpen_filter
 make_sharpen_filter.argtypes = []
 make_sharpen_filter.restype = IMAGE
@@ -112,6 +497,10 @@ make_box_filter = lib.make_box_filter
 make_box_filter.argtypes = [c_int]
 make_box_filter.restype = IMAGE
 
+make_box_filter_1d = lib.make_box_filter_1d
+make_box_filter_1d.argtypes = [c_int]
+make_box_filter_1d.restype = IMAGE
+
 make_emboss_filter = lib.make_emboss_filter
 make_emboss_filter.argtypes = []
 make_emboss_filter.restype = IMAGE
@@ -132,18 +521,489 @@ sobel_image = lib.sobel_image
 sobel_image.argtypes = [IMAGE]
 sobel_image.restype = POINTER(IMAGE)
 
+SOBEL_FAST_ATAN2 = 1
+SOBEL_L1 = 2
+
+sobel_image_flags = lib.sobel_image_flags
+sobel_image_flags.argtypes = [IMAGE, c_int]
+sobel_image_flags.restype = POINTER(IMAGE)
+
+sobel_image_into = lib.sobel_image_into
+sobel_image_into.argtypes = [IMAGE, IMAGE, IMAGE, c_int]
+sobel_image_into.restype = None
+
 colorize_sobel = lib.colorize_sobel
 colorize_sobel.argtypes = [IMAGE]
 colorize_sobel.restype = IMAGE
 
+colorize_sobel_into = lib.colorize_sobel_into
+colorize_sobel_into.argtypes = [IMAGE, IMAGE]
+colorize_sobel_into.restype = None
+
 make_gaussian_filter = lib.make_gaussian_filter
 make_gaussian_filter.argtypes = [c_float]
 make_gaussian_filter.restype = IMAGE
 
+make_gaussian_filter_1d = lib.make_gaussian_filter_1d
+make_gaussian_filter_1d.argtypes = [c_float]
+make_gaussian_filter_1d.restype = IMAGE
+
+cached_gaussian_filter = lib.cached_gaussian_filter
+cached_gaussian_filter.argtypes = [c_float]
+cached_gaussian_filter.restype = IMAGE
+
+cached_gaussian_filter_1d = lib.cached_gaussian_filter_1d
+cached_gaussian_filter_1d.argtypes = [c_float]
+cached_gaussian_filter_1d.restype = IMAGE
+
+free_gaussian_cache = lib.free_gaussian_cache
+free_gaussian_cache.argtypes = []
+free_gaussian_cache.restype = None
+
+gaussian_blur = lib.gaussian_blur
+gaussian_blur.argtypes = [IMAGE, c_float]
+gaussian_blur.restype = IMAGE
+
+gaussian_blur_into = lib.gaussian_blur_into
+gaussian_blur_into.argtypes = [IMAGE, IMAGE, c_float]
+gaussian_blur_into.restype = None
+
+gaussian_blur_iir = lib.gaussian_blur_iir
+gaussian_blur_iir.argtypes = [IMAGE, c_float]
+gaussian_blur_iir.restype = IMAGE
+
+gaussian_blur_iir_into = lib.gaussian_blur_iir_into
+gaussian_blur_iir_into.argtypes = [IMAGE, IMAGE, c_float]
+gaussian_blur_iir_into.restype = None
+
 convolve_image = lib.convolve_image
 convolve_image.argtypes = [IMAGE, IMAGE, c_int]
 convolve_image.restype = IMAGE
 
+convolve_image_into = lib.convolve_image_into
+convolve_image_into.argtypes = [IMAGE, IMAGE, IMAGE, c_int]
+convolve_image_into.restype = None
+
+convolve_image_fft = lib.convolve_image_fft
+convolve_image_fft.argtypes = [IMAGE, IMAGE, c_int]
+convolve_image_fft.restype = IMAGE
+
+convolve_image_fft_into = lib.convolve_image_fft_into
+convolve_image_fft_into.argtypes = [IMAGE, IMAGE, IMAGE, c_int]
+convolve_image_fft_into.restype = None
+
+convolve_image_separable = lib.convolve_image_separable
+convolve_image_separable.argtypes = [IMAGE, IMAGE, IMAGE, c_int]
+convolve_image_separable.restype = IMAGE
+
+convolve_image_separable_into = lib.convolve_image_separable_into
+convolve_image_separable_into.argtypes = [IMAGE, IMAGE, IMAGE, IMAGE, c_int]
+convolve_image_separable_into.restype = None
+
+class IMAGE_SOURCE(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("read_row", c_void_p),
+                ("close", c_void_p),
+                ("ctx", c_void_p)]
+
+class IMAGE_SINK(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("write_row", c_void_p),
+                ("close", c_void_p),
+                ("ctx", c_void_p)]
+
+image_source_from_image = lib.image_source_from_image
+image_source_from_image.argtypes = [IMAGE]
+image_source_from_image.restype = IMAGE_SOURCE
+
+image_sink_to_image = lib.image_sink_to_image
+image_sink_to_image.argtypes = [IMAGE]
+image_sink_to_image.restype = IMAGE_SINK
+
+open_pnm_source_lib = lib.open_pnm_source
+open_pnm_source_lib.argtypes = [c_char_p]
+open_pnm_source_lib.restype = IMAGE_SOURCE
+
+def open_pnm_source(f):
+    return open_pnm_source_lib(f.encode('ascii'))
+
+open_pnm_sink_lib = lib.open_pnm_sink
+open_pnm_sink_lib.argtypes = [c_char_p, c_int, c_int, c_int]
+open_pnm_sink_lib.restype = IMAGE_SINK
+
+def open_pnm_sink(f, w, h, c):
+    return open_pnm_sink_lib(f.encode('ascii'), w, h, c)
+
+close_image_source = lib.close_image_source
+close_image_source.argtypes = [IMAGE_SOURCE]
+close_image_source.restype = None
+
+close_image_sink = lib.close_image_sink
+close_image_sink.argtypes = [IMAGE_SINK]
+close_image_sink.restype = None
+
+stream_convolve = lib.stream_convolve
+stream_convolve.argtypes = [IMAGE_SOURCE, IMAGE_SINK, IMAGE, c_int, c_int]
+stream_convolve.restype = c_int
+
+stream_resize = lib.stream_resize
+stream_resize.argtypes = [IMAGE_SOURCE, IMAGE_SINK, c_int, c_int]
+stream_resize.restype = c_int
+
+stream_rgb_to_grayscale = lib.stream_rgb_to_grayscale
+stream_rgb_to_grayscale.argtypes = [IMAGE_SOURCE, IMAGE_SINK, c_int]
+stream_rgb_to_grayscale.restype = c_int
+
+stream_rgb_to_hsv = lib.stream_rgb_to_hsv
+stream_rgb_to_hsv.argtypes = [IMAGE_SOURCE, IMAGE_SINK, c_int]
+stream_rgb_to_hsv.restype = c_int
+
+stream_hsv_to_rgb = lib.stream_hsv_to_rgb
+stream_hsv_to_rgb.argtypes = [IMAGE_SOURCE, IMAGE_SINK, c_int]
+stream_hsv_to_rgb.restype = c_int
+
+QIMAGE_U8 = 0
+QIMAGE_U16 = 1
+
+class QIMAGE(Structure):
+    _fields_ = [("w", c_int),
+                ("h", c_int),
+                ("c", c_int),
+                ("type", c_int),
+                ("data", c_void_p)]
+
+make_qimage = lib.make_qimage
+make_qimage.argtypes = [c_int, c_int, c_int, c_int]
+make_qimage.restype = QIMAGE
+
+free_qimage = lib.free_qimage
+free_qimage.argtypes = [QIMAGE]
+free_qimage.restype = None
+
+image_to_qimage = lib.image_to_qimage
+image_to_qimage.argtypes = [IMAGE, c_int]
+image_to_qimage.restype = QIMAGE
+
+qimage_to_image = lib.qimage_to_image
+qimage_to_image.argtypes = [QIMAGE]
+qimage_to_image.restype = IMAGE
+
+load_qimage_lib = lib.load_qimage
+load_qimage_lib.argtypes = [c_char_p, c_int]
+load_qimage_lib.restype = QIMAGE
+
+def load_qimage(f, t=QIMAGE_U8):
+    return load_qimage_lib(f.encode('ascii'), t)
+
+qimage_rgb_to_grayscale = lib.qimage_rgb_to_grayscale
+qimage_rgb_to_grayscale.argtypes = [QIMAGE]
+qimage_rgb_to_grayscale.restype = QIMAGE
+
+qimage_nn_resize = lib.qimage_nn_resize
+qimage_nn_resize.argtypes = [QIMAGE, c_int, c_int]
+qimage_nn_resize.restype = QIMAGE
+
+qimage_bilinear_resize = lib.qimage_bilinear_resize
+qimage_bilinear_resize.argtypes = [QIMAGE, c_int, c_int]
+qimage_bilinear_resize.restype = QIMAGE
+
+qimage_resize_with_plan = lib.qimage_resize_with_plan
+qimage_resize_with_plan.argtypes = [QIMAGE, c_void_p]
+qimage_resize_with_plan.restype = QIMAGE
+
+qimage_box_blur = lib.qimage_box_blur
+qimage_box_blur.argtypes = [QIMAGE, c_int]
+qimage_box_blur.restype = QIMAGE
+
+class FRAME_STATS(Structure):
+    _fields_ = [('frames', c_longlong),
+                ('dropped', c_longlong),
+                ('mean_ms', c_double),
+                ('max_ms', c_double),
+                ('wait_ms', c_double)]
+
+# A stage function, fn(out, in, ctx); keep the FRAME_STAGE_FN object alive
+# for as long as the pipeline, which calls it from its own thread
+FRAME_STAGE_FN = CFUNCTYPE(None, IMAGE, IMAGE, c_void_p)
+
+make_frame_pipeline = lib.make_frame_pipeline
+make_frame_pipeline.argtypes = [c_int, c_int, c_int, c_int]
+make_frame_pipeline.restype = c_void_p
+
+add_frame_stage = lib.add_frame_stage
+add_frame_stage.argtypes = [c_void_p, c_int, c_int, c_int, FRAME_STAGE_FN, c_void_p]
+add_frame_stage.restype = c_int
+
+add_frame_ops_lib = lib.add_frame_ops
+add_frame_ops_lib.argtypes = [c_void_p, c_char_p]
+add_frame_ops_lib.restype = c_int
+
+def add_frame_ops(p, chain):
+    return add_frame_ops_lib(p, chain.encode('ascii'))
+
+frame_pipeline_stages = lib.frame_pipeline_stages
+frame_pipeline_stages.argtypes = [c_void_p]
+frame_pipeline_stages.restype = c_int
+
+frame_pipeline_output_size = lib.frame_pipeline_output_size
+frame_pipeline_output_size.argtypes = [c_void_p, POINTER(c_int), POINTER(c_int), POINTER(c_int)]
+frame_pipeline_output_size.restype = None
+
+push_frame = lib.push_frame
+push_frame.argtypes = [c_void_p, IMAGE]
+push_frame.restype = c_longlong
+
+latest_frame = lib.latest_frame
+latest_frame.argtypes = [c_void_p, IMAGE]
+latest_frame.restype = c_longlong
+
+flush_frame_pipeline = lib.flush_frame_pipeline
+flush_frame_pipeline.argtypes = [c_void_p]
+flush_frame_pipeline.restype = None
+
+frame_pipeline_stats_lib = lib.frame_pipeline_stats
+frame_pipeline_stats_lib.argtypes = [c_void_p, c_int, POINTER(FRAME_STATS)]
+frame_pipeline_stats_lib.restype = c_int
+
+def frame_pipeline_stats(p, stage=-1):
+    # The FRAME_STATS of a stage, or of the whole pipeline for -1
+    s = FRAME_STATS()
+    if not frame_pipeline_stats_lib(p, stage, byref(s)):
+        raise IndexError("no such stage")
+    return s
+
+free_frame_pipeline = lib.free_frame_pipeline
+free_frame_pipeline.argtypes = [c_void_p]
+free_frame_pipeline.restype = None
+
+class HWC_IMAGE(Structure):
+    # Interleaved pixels: channel k of (x, y) is data[(y*w + x)*c + k]
+    _fields_ = [('w', c_int),
+                ('h', c_int),
+                ('c', c_int),
+                ('data', POINTER(c_float))]
+
+make_hwc_image = lib.make_hwc_image
+make_hwc_image.argtypes = [c_int, c_int, c_int]
+make_hwc_image.restype = HWC_IMAGE
+
+free_hwc_image = lib.free_hwc_image
+free_hwc_image.argtypes = [HWC_IMAGE]
+free_hwc_image.restype = None
+
+image_to_hwc = lib.image_to_hwc
+image_to_hwc.argtypes = [IMAGE]
+image_to_hwc.restype = HWC_IMAGE
+
+hwc_to_image = lib.hwc_to_image
+hwc_to_image.argtypes = [HWC_IMAGE]
+hwc_to_image.restype = IMAGE
+
+load_hwc_image_lib = lib.load_hwc_image
+load_hwc_image_lib.argtypes = [c_char_p]
+load_hwc_image_lib.restype = HWC_IMAGE
+
+def load_hwc_image(f):
+    return load_hwc_image_lib(f.encode('ascii'))
+
+save_hwc_image_lib = lib.save_hwc_image
+save_hwc_image_lib.argtypes = [HWC_IMAGE, c_char_p, SAVE_OPTIONS]
+save_hwc_image_lib.restype = c_int
+
+def save_hwc_image(im, f, opts):
+    return save_hwc_image_lib(im, f.encode('ascii'), opts)
+
+hwc_rgb_to_grayscale = lib.hwc_rgb_to_grayscale
+hwc_rgb_to_grayscale.argtypes = [HWC_IMAGE]
+hwc_rgb_to_grayscale.restype = HWC_IMAGE
+
+hwc_rgb_to_hsv = lib.hwc_rgb_to_hsv
+hwc_rgb_to_hsv.argtypes = [HWC_IMAGE]
+hwc_rgb_to_hsv.restype = None
+
+hwc_hsv_to_rgb = lib.hwc_hsv_to_rgb
+hwc_hsv_to_rgb.argtypes = [HWC_IMAGE]
+hwc_hsv_to_rgb.restype = None
+
+hwc_nn_resize = lib.hwc_nn_resize
+hwc_nn_resize.argtypes = [HWC_IMAGE, c_int, c_int]
+hwc_nn_resize.restype = HWC_IMAGE
+
+hwc_bilinear_resize = lib.hwc_bilinear_resize
+hwc_bilinear_resize.argtypes = [HWC_IMAGE, c_int, c_int]
+hwc_bilinear_resize.restype = HWC_IMAGE
+
+hwc_resize_with_plan = lib.hwc_resize_with_plan
+hwc_resize_with_plan.argtypes = [HWC_IMAGE, c_void_p]
+hwc_resize_with_plan.restype = HWC_IMAGE
+
+hwc_convolve_image = lib.hwc_convolve_image
+hwc_convolve_image.argtypes = [HWC_IMAGE, IMAGE, c_int]
+hwc_convolve_image.restype = HWC_IMAGE
+
+class GPU_IMAGE(Structure):
+    # mem is a device buffer; it is 0 without make OPENCL=1 or a device
+    _fields_ = [('w', c_int),
+                ('h', c_int),
+                ('c', c_int),
+                ('mem', c_void_p)]
+
+gpu_available = lib.gpu_available
+gpu_available.argtypes = []
+gpu_available.restype = c_int
+
+make_gpu_image = lib.make_gpu_image
+make_gpu_image.argtypes = [c_int, c_int, c_int]
+make_gpu_image.restype = GPU_IMAGE
+
+free_gpu_image = lib.free_gpu_image
+free_gpu_image.argtypes = [GPU_IMAGE]
+free_gpu_image.restype = None
+
+gpu_upload = lib.gpu_upload
+gpu_upload.argtypes = [IMAGE]
+gpu_upload.restype = GPU_IMAGE
+
+gpu_upload_into = lib.gpu_upload_into
+gpu_upload_into.argtypes = [GPU_IMAGE, IMAGE]
+gpu_upload_into.restype = None
+
+gpu_download = lib.gpu_download
+gpu_download.argtypes = [GPU_IMAGE]
+gpu_download.restype = IMAGE
+
+gpu_download_into = lib.gpu_download_into
+gpu_download_into.argtypes = [IMAGE, GPU_IMAGE]
+gpu_download_into.restype = None
+
+gpu_finish = lib.gpu_finish
+gpu_finish.argtypes = []
+gpu_finish.restype = None
+
+gpu_convolve_image = lib.gpu_convolve_image
+gpu_convolve_image.argtypes = [GPU_IMAGE, IMAGE, c_int]
+gpu_convolve_image.restype = GPU_IMAGE
+
+gpu_nn_resize = lib.gpu_nn_resize
+gpu_nn_resize.argtypes = [GPU_IMAGE, c_int, c_int]
+gpu_nn_resize.restype = GPU_IMAGE
+
+gpu_bilinear_resize = lib.gpu_bilinear_resize
+gpu_bilinear_resize.argtypes = [GPU_IMAGE, c_int, c_int]
+gpu_bilinear_resize.restype = GPU_IMAGE
+
+gpu_rgb_to_grayscale = lib.gpu_rgb_to_grayscale
+gpu_rgb_to_grayscale.argtypes = [GPU_IMAGE]
+gpu_rgb_to_grayscale.restype = GPU_IMAGE
+
+gpu_rgb_to_hsv = lib.gpu_rgb_to_hsv
+gpu_rgb_to_hsv.argtypes = [GPU_IMAGE]
+gpu_rgb_to_hsv.restype = None
+
+gpu_hsv_to_rgb = lib.gpu_hsv_to_rgb
+gpu_hsv_to_rgb.argtypes = [GPU_IMAGE]
+gpu_hsv_to_rgb.restype = None
+
+gpu_sobel_image_into = lib.gpu_sobel_image_into
+gpu_sobel_image_into.argtypes = [GPU_IMAGE, GPU_IMAGE, GPU_IMAGE, c_int]
+gpu_sobel_image_into.restype = None
+
+instrument_enabled = lib.instrument_enabled
+instrument_enabled.argtypes = []
+instrument_enabled.restype = c_int
+
+instrument_reset = lib.instrument_reset
+instrument_reset.argtypes = []
+instrument_reset.restype = None
+
+instrument_report_lib = lib.instrument_report
+instrument_report_lib.argtypes = [c_char_p]
+instrument_report_lib.restype = None
+
+def instrument_report(f=None):
+    instrument_report_lib(f.encode('ascii') if f else None)
+
+instrument_trace_start_lib = lib.instrument_trace_start
+instrument_trace_start_lib.argtypes = [c_char_p]
+instrument_trace_start_lib.restype = c_int
+
+def instrument_trace_start(f):
+    return instrument_trace_start_lib(f.encode('ascii'))
+
+instrument_trace_stop = lib.instrument_trace_stop
+instrument_trace_stop.argtypes = []
+instrument_trace_stop.restype = c_int
+
+set_num_threads = lib.set_num_threads
+set_num_threads.argtypes = [c_int]
+set_num_threads.restype = None
+
+get_num_threads = lib.get_num_threads
+get_num_threads.argtypes = []
+get_num_threads.restype = c_int
+
+bytes_to_image = lib.bytes_to_image
+bytes_to_image.argtypes = [c_void_p, c_int, c_int, c_int]
+bytes_to_image.restype = IMAGE
+
+bytes_to_image_into = lib.bytes_to_image_into
+bytes_to_image_into.argtypes = [IMAGE, c_void_p, c_int]
+bytes_to_image_into.restype = None
+
+image_to_bytes = lib.image_to_bytes
+image_to_bytes.argtypes = [IMAGE, c_void_p]
+image_to_bytes.restype = None
+
+# Sharing pixels with NumPy. numpy is only imported by the functions that
+# need it.
+
+def image_buffer(im):
+    # The pixels of im as a ctypes array, which supports the buffer
+    # protocol (memoryview, numpy.frombuffer) without copying. It is only
+    # valid until im is freed.
+    n = im.w * im.h * im.c
+    return (c_float * n).from_address(cast(im.data, c_void_p).value)
+
+def image_to_numpy(im):
+    # A (c, h, w) float32 view of the pixels, no copy; writes go to im
+    import numpy as np
+    return np.frombuffer(image_buffer(im), dtype=np.float32).reshape(im.c, im.h, im.w)
+
+def image_from_numpy(arr):
+    # Wraps a C contiguous float32 array of shape (c, h, w) or (h, w) as an
+    # image without copying. The image keeps arr alive, and must never be
+    # passed to free_image since numpy owns the memory.
+    import numpy as np
+    if arr.dtype != np.float32 or not arr.flags['C_CONTIGUOUS'] or arr.ndim not in (2, 3):
+        raise ValueError("expected a C contiguous float32 array of shape (c, h, w) or (h, w)")
+    c, h, w = (1,) + arr.shape if arr.ndim == 2 else arr.shape
+    im = IMAGE(w, h, c, arr.ctypes.data_as(POINTER(c_float)))
+    im._array = arr
+    return im
+
+def image_from_numpy_bytes(arr):
+    # Converts a uint8 array of shape (h, w, c) or (h, w), as most image
+    # libraries use, into a new planar image in one pass; free it with
+    # free_image. A fourth (alpha) channel is dropped.
+    import numpy as np
+    arr = np.ascontiguousarray(arr, dtype=np.uint8)
+    if arr.ndim not in (2, 3):
+        raise ValueError("expected a uint8 array of shape (h, w, c) or (h, w)")
+    h, w = arr.shape[:2]
+    c = arr.shape[2] if arr.ndim == 3 else 1
+    return bytes_to_image(arr.ctypes.data, w, h, c)
+
+def image_to_numpy_bytes(im):
+    # The image clamped and rounded to a new (h, w, c) uint8 array
+    import numpy as np
+    arr = np.empty((im.h, im.w, im.c), dtype=np.uint8)
+    image_to_bytes(im, arr.ctypes.data)
+    return arr
+
 
 if __name__ == "__main__":
     im = load_image("data/dog.jpg")